@@ -0,0 +1,131 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fs.h>
+
+/*
+ * Count the heap allocations made by libfs.
+ *
+ * This program is linked with -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc,
+ * --wrap=free so that every allocation made by the library (and by this
+ * program) goes through the counters below.
+ */
+
+#define DISKNAME "bench_alloc.fs"
+#define DATA_BLOCK_COUNT 4096
+#define ITERATIONS 10000
+
+#define ASSERT(cond, func)                               \
+do {                                                     \
+	if (!(cond)) {                                       \
+		fprintf(stderr, "Function '%s' failed\n", func); \
+		exit(EXIT_FAILURE);                              \
+	}                                                    \
+} while (0)
+
+static size_t num_allocs;
+static size_t num_frees;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void __real_free(void *ptr);
+
+void *__wrap_malloc(size_t size)
+{
+	num_allocs++;
+	return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+	num_allocs++;
+	return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+	num_allocs++;
+	return __real_realloc(ptr, size);
+}
+
+void __wrap_free(void *ptr)
+{
+	if (ptr)
+		num_frees++;
+	__real_free(ptr);
+}
+
+/* Run @op ITERATIONS times and report the allocations it made */
+#define MEASURE(name, op)                                              \
+do {                                                                   \
+	size_t allocs_before = num_allocs;                                 \
+	for (int i = 0; i < ITERATIONS; i++)                               \
+		op;                                                            \
+	printf("%-24s %8d ops %8zu allocs %6.3f allocs/op\n", name,        \
+		   ITERATIONS, num_allocs - allocs_before,                     \
+		   (double) (num_allocs - allocs_before) / ITERATIONS);        \
+} while (0)
+
+int main(int argc, char *argv[])
+{
+	static char buf[4096];
+	static char stdout_buf[BUFSIZ];
+	char cmd[128];
+	int ret;
+	int fd, fd_nobuf, fd_append;
+
+	/* Keep stdio from allocating behind our back */
+	setvbuf(stdout, stdout_buf, _IOLBF, sizeof(stdout_buf));
+
+	/* Create a fresh disk */
+	sprintf(cmd, "./fs_make.x %s %d > /dev/null", DISKNAME, DATA_BLOCK_COUNT);
+	ret = system(cmd);
+	ASSERT(ret == 0, "fs_make.x");
+
+	/* The disk layer keeps its access counters from one open to the next */
+	ret = fs_mount(DISKNAME) || fs_umount();
+	ASSERT(!ret, "warm-up mount");
+
+	size_t allocs_at_start = num_allocs;
+	size_t frees_at_start = num_frees;
+
+	ret = fs_mount(DISKNAME);
+	ASSERT(!ret, "fs_mount");
+	printf("%-24s %8zu allocs\n", "fs_mount", num_allocs - allocs_at_start);
+
+	fs_create("buffered");
+	fs_create("direct");
+	fs_create("log");
+	fd = fs_open("buffered");
+	fd_nobuf = fs_open_flags("direct", FS_O_NOBUF);
+	fd_append = fs_open_flags("log", FS_O_APPEND);
+
+	/* Warm up: first use of a descriptor takes a buffer from the pool */
+	fs_write(fd, buf, 100);
+	fs_write(fd_append, buf, 100);
+	fs_write(fd_nobuf, buf, sizeof(buf));
+
+	/* Steady state */
+	MEASURE("fs_write 100B buffered", fs_write(fd, buf, 100));
+	MEASURE("fs_write 100B append", fs_write(fd_append, buf, 100));
+	MEASURE("fs_write 4KiB direct", (fs_lseek(fd_nobuf, (i % 64) * sizeof(buf)), fs_write(fd_nobuf, buf, sizeof(buf))));
+	MEASURE("fs_read 4KiB", (fs_lseek(fd, (i % 64) * sizeof(buf)), fs_read(fd, buf, sizeof(buf))));
+	MEASURE("fs_open/fs_close", fs_close(fs_open("direct")));
+	MEASURE("fs_stat", fs_stat(fd));
+
+	fs_close(fd);
+	fs_close(fd_nobuf);
+	fs_close(fd_append);
+
+	ret = fs_umount();
+	ASSERT(!ret, "fs_umount");
+
+	/* Everything the mount allocated must be gone */
+	printf("%-24s %8zu allocs %8zu frees\n", "mount lifetime",
+		   num_allocs - allocs_at_start, num_frees - frees_at_start);
+
+	remove(DISKNAME);
+	return 0;
+}
@@ -0,0 +1,731 @@
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <disk.h>
+#include <fs.h>
+
+/*
+ * Benchmark suite for libfs.
+ *
+ * Every workload runs on a freshly formatted image (made with fs_format()) and
+ * records the latency of each operation it times. Results are reported as
+ * throughput and p50/p99/p999 latency, either as a table for humans or as
+ * CSV/JSON for tracking regressions.
+ *
+ * With the RAM backend, the image is loaded in memory at each mount so that
+ * the workloads measure the CPU time of libfs without any system call.
+ *
+ * Write workloads also report the disk space their file ends up taking, to
+ * compare the formats and compression (see fs_compress()).
+ *
+ * With -K, every block is checksummed (see fs_checksums()), to measure what
+ * verifying reads and updating checksums on writes costs. The scrub workload
+ * always has checksums, and measures how fast fs_scrub() verifies a disk.
+ */
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+
+#define bench_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	bench_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+#define KiB 1024
+#define MiB (1024 * KiB)
+
+/** Default image size, the largest fs_make.x can format */
+#define DEFAULT_DATA_BLOCKS 8192
+
+/** Size of the text and noise patterns written by the compression workloads */
+#define PATTERN_SIZE (1 * MiB)
+
+enum format {
+	FORMAT_HUMAN,
+	FORMAT_CSV,
+	FORMAT_JSON,
+};
+
+struct config {
+	const char *diskname;
+	int data_blocks;
+	int fat32;
+	int extents;
+	int log;
+	int dedup;
+	int compress;
+	int checksums;
+	size_t file_size;
+	int iterations;
+	uint64_t seed;
+	enum format format;
+	const char *only;
+	const char *latency;
+	const char *backend;
+};
+
+struct result {
+	char name[32];
+	size_t io_size;
+	size_t ops;
+	size_t bytes;
+	double seconds;
+	double p50_us;
+	double p99_us;
+	double p999_us;
+	size_t disk_bytes;
+};
+
+/* Latency samples of the workload being run */
+struct samples {
+	uint64_t *ns;
+	size_t count;
+	size_t capacity;
+};
+
+static struct config config = {
+	.diskname = "bench.fs",
+	.data_blocks = DEFAULT_DATA_BLOCKS,
+	.file_size = 16 * MiB,
+	.iterations = 2000,
+	.seed = 150,
+	.format = FORMAT_HUMAN,
+	.only = NULL,
+	.backend = "file",
+};
+
+/* Name given to fs_mount(), which selects the disk backend */
+static char mountname[256];
+
+/* Log-like text, which compresses well, and random bytes, which do not */
+static char text[PATTERN_SIZE];
+static char noise[PATTERN_SIZE];
+
+static uint64_t rng_state;
+
+/* xorshift64*, so runs are repeatable for a given seed */
+static uint64_t rng_next(void)
+{
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 2685821657736338717ULL;
+}
+
+/* Wall clock, plus the device time of a virtual latency model */
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec + block_disk_sim_time();
+}
+
+static void samples_add(struct samples *s, uint64_t ns)
+{
+	if (s->count == s->capacity) {
+		s->capacity = s->capacity ? 2 * s->capacity : 4096;
+		s->ns = realloc(s->ns, s->capacity * sizeof(*s->ns));
+		if (!s->ns)
+			die("Cannot malloc");
+	}
+	s->ns[s->count++] = ns;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static double percentile_us(struct samples *s, double p)
+{
+	if (!s->count)
+		return 0;
+
+	size_t idx = (size_t)(p * (s->count - 1) + 0.5);
+	return s->ns[idx] / 1000.0;
+}
+
+/* Time one call of @op, record its latency and return its value */
+#define TIMED(s, op) ({							\
+	uint64_t __start = now_ns();				\
+	int __ret = (op);							\
+	samples_add((s), now_ns() - __start);		\
+	__ret;										\
+})
+
+static void format_disk(void)
+{
+	unsigned int flags = (config.fat32 ? FS_FORMAT_FAT32 : 0) | (config.extents ? FS_FORMAT_EXTENTS : 0)
+		| (config.log ? FS_FORMAT_LOG : 0);
+
+	if (fs_format(config.diskname, config.data_blocks, flags))
+		die("Cannot format '%s' with %d data blocks", config.diskname, config.data_blocks);
+}
+
+static void mount_fresh(void)
+{
+	format_disk();
+	if (fs_mount(mountname))
+		die("Cannot mount '%s'", config.diskname);
+	if (config.dedup && fs_dedup(1))
+		die("Cannot enable deduplication on '%s'", config.diskname);
+	if (config.checksums && fs_checksums(1))
+		die("Cannot enable checksums on '%s'", config.diskname);
+}
+
+static void umount_clean(void)
+{
+	if (fs_umount())
+		die("Cannot unmount '%s'", config.diskname);
+}
+
+/* Create and open a file, optionally filled with @size bytes */
+static int prepare_file(const char *filename, size_t size, char *buf)
+{
+	int fd;
+
+	if (fs_create(filename))
+		die("Cannot create '%s'", filename);
+	if (config.compress && fs_compress(filename, 1))
+		die("Cannot compress '%s'", filename);
+
+	fd = fs_open(filename);
+	if (fd < 0)
+		die("Cannot open '%s'", filename);
+
+	for (size_t done = 0; done < size; done += 64 * KiB) {
+		if (fs_write(fd, buf, 64 * KiB) != 64 * KiB)
+			die("Disk too small for a %zu byte file", size);
+	}
+	fs_lseek(fd, 0);
+
+	return fd;
+}
+
+/* Data blocks left free on the mounted disk */
+static uint32_t free_blocks(void)
+{
+	struct fs_frag frag;
+
+	if (fs_fragmentation(&frag))
+		die("Cannot measure '%s'", config.diskname);
+	return frag.free_blocks;
+}
+
+/* Fill @text with log lines and @noise with random bytes, before anything is timed */
+static void make_patterns(void)
+{
+	size_t len = 0;
+
+	for (int line = 0; len + 128 < sizeof(text); line++)
+		len += sprintf(text + len, "2026-10-18 12:%02d:%02d.%03d INFO [worker-%d] GET /api/items/%lu 200 %d ms\n",
+					   line / 60 % 60, line % 60, line * 37 % 1000, line % 8,
+					   (unsigned long)(rng_next() % 100000), (int)(rng_next() % 500));
+	memset(text + len, '\n', sizeof(text) - len);
+
+	for (size_t i = 0; i < sizeof(noise); i += sizeof(uint64_t))
+		memcpy(noise + i, &(uint64_t){rng_next()}, sizeof(uint64_t));
+}
+
+static void finish(struct result *r, struct samples *s, uint64_t start)
+{
+	r->seconds = (now_ns() - start) / 1e9;
+	r->ops = s->count;
+
+	qsort(s->ns, s->count, sizeof(*s->ns), cmp_u64);
+	r->p50_us = percentile_us(s, 0.50);
+	r->p99_us = percentile_us(s, 0.99);
+	r->p999_us = percentile_us(s, 0.999);
+
+	s->count = 0;
+}
+
+/* WORKLOADS */
+
+static void bench_seq_write(struct result *r, struct samples *s, size_t io_size, char *buf)
+{
+	mount_fresh();
+	int fd = prepare_file("seq", 0, buf);
+	uint32_t free_before = free_blocks();
+
+	uint64_t start = now_ns();
+	for (size_t done = 0; done < config.file_size; done += io_size) {
+		if (TIMED(s, fs_write(fd, buf, io_size)) != (int)io_size)
+			die("Short write");
+		r->bytes += io_size;
+	}
+	fs_close(fd);
+	finish(r, s, start);
+	r->disk_bytes = (size_t)(free_before - free_blocks()) * BLOCK_SIZE;
+
+	umount_clean();
+}
+
+/* Sequential writes of blocks that are all different, so that deduplication finds nothing */
+static void bench_uniq_write(struct result *r, struct samples *s, size_t io_size, char *buf)
+{
+	mount_fresh();
+	int fd = prepare_file("uniq", 0, buf);
+	uint32_t free_before = free_blocks();
+
+	uint64_t start = now_ns();
+	for (size_t done = 0; done < config.file_size; done += io_size) {
+		for (size_t i = 0; i < io_size; i += BLOCK_SIZE)
+			memcpy(buf + i, &(uint64_t){done + i}, sizeof(uint64_t));
+		if (TIMED(s, fs_write(fd, buf, io_size)) != (int)io_size)
+			die("Short write");
+		r->bytes += io_size;
+	}
+	fs_close(fd);
+	finish(r, s, start);
+	r->disk_bytes = (size_t)(free_before - free_blocks()) * BLOCK_SIZE;
+
+	memset(buf, 'x', 64 * KiB);
+	umount_clean();
+}
+
+static void bench_seq_read(struct result *r, struct samples *s, size_t io_size, char *buf)
+{
+	mount_fresh();
+	int fd = prepare_file("seq", config.file_size, buf);
+
+	uint64_t start = now_ns();
+	for (size_t done = 0; done < config.file_size; done += io_size)
+		r->bytes += TIMED(s, fs_read(fd, buf, io_size));
+	finish(r, s, start);
+
+	fs_close(fd);
+	umount_clean();
+}
+
+/* Sequential writes of @pattern, repeated up to the file size */
+static void pattern_write(struct result *r, struct samples *s, size_t io_size, const char *pattern)
+{
+	mount_fresh();
+	int fd = prepare_file("pattern", 0, NULL);
+	uint32_t free_before = free_blocks();
+
+	uint64_t start = now_ns();
+	for (size_t done = 0; done < config.file_size; done += io_size) {
+		if (TIMED(s, fs_write(fd, (void *)(pattern + done % PATTERN_SIZE), io_size)) != (int)io_size)
+			die("Short write");
+		r->bytes += io_size;
+	}
+	fs_close(fd);
+	finish(r, s, start);
+	r->disk_bytes = (size_t)(free_before - free_blocks()) * BLOCK_SIZE;
+
+	umount_clean();
+}
+
+/* Sequential reads of a file made of @pattern, checked against it */
+static void pattern_read(struct result *r, struct samples *s, size_t io_size, char *buf, const char *pattern)
+{
+	mount_fresh();
+	int fd = prepare_file("pattern", 0, NULL);
+
+	for (size_t done = 0; done < config.file_size; done += PATTERN_SIZE) {
+		if (fs_write(fd, (void *)pattern, PATTERN_SIZE) != PATTERN_SIZE)
+			die("Disk too small for a %zu byte file", config.file_size);
+	}
+	fs_close(fd);
+	fd = fs_open("pattern");
+
+	uint64_t start = now_ns();
+	for (size_t done = 0; done < config.file_size; done += io_size) {
+		if (TIMED(s, fs_read(fd, buf, io_size)) != (int)io_size)
+			die("Short read");
+		if (memcmp(buf, pattern + done % PATTERN_SIZE, io_size))
+			die("Read back different data");
+		r->bytes += io_size;
+	}
+	finish(r, s, start);
+
+	fs_close(fd);
+	memset(buf, 'x', 64 * KiB);
+	umount_clean();
+}
+
+static void bench_text_write(struct result *r, struct samples *s, size_t io_size, char *buf)
+{
+	pattern_write(r, s, io_size, text);
+}
+
+static void bench_text_read(struct result *r, struct samples *s, size_t io_size, char *buf)
+{
+	pattern_read(r, s, io_size, buf, text);
+}
+
+static void bench_noise_write(struct result *r, struct samples *s, size_t io_size, char *buf)
+{
+	pattern_write(r, s, io_size, noise);
+}
+
+static void bench_noise_read(struct result *r, struct samples *s, size_t io_size, char *buf)
+{
+	pattern_read(r, s, io_size, buf, noise);
+}
+
+static void bench_rand_write(struct result *r, struct samples *s, size_t io_size, char *buf)
+{
+	mount_fresh();
+	int fd = prepare_file("rand", config.file_size, buf);
+	size_t slots = config.file_size / io_size;
+
+	uint64_t start = now_ns();
+	for (int i = 0; i < config.iterations; i++) {
+		fs_lseek(fd, (rng_next() % slots) * io_size);
+		r->bytes += TIMED(s, fs_write(fd, buf, io_size));
+	}
+	fs_close(fd);
+	finish(r, s, start);
+
+	umount_clean();
+}
+
+static void bench_rand_read(struct result *r, struct samples *s, size_t io_size, char *buf)
+{
+	mount_fresh();
+	int fd = prepare_file("rand", config.file_size, buf);
+	size_t slots = config.file_size / io_size;
+
+	uint64_t start = now_ns();
+	for (int i = 0; i < config.iterations; i++) {
+		fs_lseek(fd, (rng_next() % slots) * io_size);
+		r->bytes += TIMED(s, fs_read(fd, buf, io_size));
+	}
+	finish(r, s, start);
+
+	fs_close(fd);
+	umount_clean();
+}
+
+/* Verify a file against its checksums, @io_size worth of blocks per fs_scrub() call, over one pass */
+static void bench_scrub(struct result *r, struct samples *s, size_t io_size, char *buf)
+{
+	struct fs_scrub_report report;
+
+	mount_fresh();
+	if (!config.checksums && fs_checksums(1))
+		die("Cannot enable checksums on '%s'", config.diskname);
+	fs_close(prepare_file("scrub", config.file_size, buf));
+
+	uint64_t start = now_ns();
+	while (r->bytes < config.file_size) {
+		if (TIMED(s, fs_scrub(io_size / BLOCK_SIZE, &report)) != 0)
+			die("Scrub failed");
+		r->bytes += report.blocks_scrubbed * BLOCK_SIZE;
+	}
+	finish(r, s, start);
+
+	umount_clean();
+}
+
+/* Create, write, close and delete small files, timing the whole cycle */
+static void bench_small_files(struct result *r, struct samples *s, size_t io_size, char *buf)
+{
+	char filename[FS_FILENAME_LEN];
+
+	mount_fresh();
+
+	uint64_t start = now_ns();
+	for (int i = 0; i < config.iterations; i++) {
+		int slot = i % 64;
+		uint64_t op_start = now_ns();
+
+		snprintf(filename, sizeof(filename), "small%d", slot);
+		if (i >= 64 && fs_delete(filename))
+			die("Cannot delete '%s'", filename);
+		if (fs_create(filename))
+			die("Cannot create '%s'", filename);
+
+		int fd = fs_open(filename);
+		r->bytes += fs_write(fd, buf, io_size);
+		fs_close(fd);
+
+		samples_add(s, now_ns() - op_start);
+	}
+	finish(r, s, start);
+
+	umount_clean();
+}
+
+static void bench_open_close(struct result *r, struct samples *s, size_t io_size, char *buf)
+{
+	mount_fresh();
+	fs_close(prepare_file("churn", io_size, buf));
+
+	uint64_t start = now_ns();
+	for (int i = 0; i < config.iterations; i++) {
+		uint64_t op_start = now_ns();
+		int fd = fs_open("churn");
+		fs_close(fd);
+		samples_add(s, now_ns() - op_start);
+	}
+	finish(r, s, start);
+
+	umount_clean();
+}
+
+static void bench_mount(struct result *r, struct samples *s, size_t io_size, char *buf)
+{
+	format_disk();
+
+	uint64_t start = now_ns();
+	for (int i = 0; i < config.iterations / 10; i++) {
+		uint64_t op_start = now_ns();
+		if (fs_mount(mountname))
+			die("Cannot mount '%s'", config.diskname);
+		umount_clean();
+		samples_add(s, now_ns() - op_start);
+	}
+	finish(r, s, start);
+}
+
+/* Fill the whole disk with one file, until fs_write() comes up short */
+static void bench_full_disk(struct result *r, struct samples *s, size_t io_size, char *buf)
+{
+	mount_fresh();
+	int fd = prepare_file("fill", 0, buf);
+
+	uint64_t start = now_ns();
+	for (;;) {
+		int written = TIMED(s, fs_write(fd, buf, io_size));
+		r->bytes += written;
+		if (written < (int)io_size)
+			break;
+	}
+	fs_close(fd);
+	finish(r, s, start);
+
+	umount_clean();
+}
+
+static struct workload {
+	const char *name;
+	void (*func)(struct result *, struct samples *, size_t, char *);
+	size_t io_sizes[4];
+} workloads[] = {
+	{ "seq_write",	bench_seq_write,	{ 512, 4 * KiB, 64 * KiB } },
+	{ "uniq_write",	bench_uniq_write,	{ 4 * KiB, 64 * KiB } },
+	{ "seq_read",	bench_seq_read,		{ 512, 4 * KiB, 64 * KiB } },
+	{ "text_write",	bench_text_write,	{ 4 * KiB, 64 * KiB } },
+	{ "text_read",	bench_text_read,	{ 4 * KiB, 64 * KiB } },
+	{ "noise_write",	bench_noise_write,	{ 4 * KiB, 64 * KiB } },
+	{ "noise_read",	bench_noise_read,	{ 4 * KiB, 64 * KiB } },
+	{ "rand_write",	bench_rand_write,	{ 512, 4 * KiB, 64 * KiB } },
+	{ "rand_read",	bench_rand_read,	{ 512, 4 * KiB, 64 * KiB } },
+	{ "scrub",		bench_scrub,		{ 64 * KiB, 1 * MiB } },
+	{ "small_files",	bench_small_files,	{ 100, 1 * KiB } },
+	{ "open_close",	bench_open_close,	{ 4 * KiB } },
+	{ "mount",		bench_mount,		{ 0 } },
+	{ "full_disk",	bench_full_disk,	{ 64 * KiB } },
+};
+
+/* REPORTING */
+
+static void report_header(void)
+{
+	switch (config.format) {
+	case FORMAT_HUMAN:
+		printf("%-12s %8s %8s %10s %10s %10s %10s %10s %10s\n", "workload", "io_size",
+			   "ops", "MB/s", "ops/s", "p50(us)", "p99(us)", "p999(us)", "disk(MB)");
+		break;
+	case FORMAT_CSV:
+		printf("workload,io_size,ops,bytes,seconds,mb_per_s,ops_per_s,p50_us,p99_us,p999_us,disk_bytes\n");
+		break;
+	case FORMAT_JSON:
+		printf("[");
+		break;
+	}
+}
+
+static void report(struct result *r, int idx)
+{
+	double mb_s = r->seconds > 0 ? r->bytes / r->seconds / 1e6 : 0;
+	double ops_s = r->seconds > 0 ? r->ops / r->seconds : 0;
+
+	switch (config.format) {
+	case FORMAT_HUMAN:
+		printf("%-12s %8zu %8zu %10.1f %10.0f %10.1f %10.1f %10.1f", r->name,
+			   r->io_size, r->ops, mb_s, ops_s, r->p50_us, r->p99_us, r->p999_us);
+		if (r->disk_bytes)
+			printf(" %10.1f", r->disk_bytes / 1e6);
+		printf("\n");
+		break;
+	case FORMAT_CSV:
+		printf("%s,%zu,%zu,%zu,%.6f,%.3f,%.1f,%.3f,%.3f,%.3f,%zu\n", r->name,
+			   r->io_size, r->ops, r->bytes, r->seconds, mb_s, ops_s,
+			   r->p50_us, r->p99_us, r->p999_us, r->disk_bytes);
+		break;
+	case FORMAT_JSON:
+		printf("%s\n  {\"workload\": \"%s\", \"io_size\": %zu, \"ops\": %zu, "
+			   "\"bytes\": %zu, \"seconds\": %.6f, \"mb_per_s\": %.3f, "
+			   "\"ops_per_s\": %.1f, \"p50_us\": %.3f, \"p99_us\": %.3f, "
+			   "\"p999_us\": %.3f, \"disk_bytes\": %zu}", idx ? "," : "", r->name,
+			   r->io_size, r->ops, r->bytes, r->seconds, mb_s, ops_s, r->p50_us,
+			   r->p99_us, r->p999_us, r->disk_bytes);
+		break;
+	}
+	fflush(stdout);
+}
+
+static void report_footer(void)
+{
+	if (config.format == FORMAT_JSON)
+		printf("\n]\n");
+}
+
+static void usage(char *program)
+{
+	size_t i;
+
+	fprintf(stderr, "Usage: %s [options]\n", program);
+	fprintf(stderr, "\t-d <disk>\timage to format and use (default %s)\n", config.diskname);
+	fprintf(stderr, "\t-b <blocks>\tdata blocks in the image (default %d)\n", config.data_blocks);
+	fprintf(stderr, "\t-W\t\tformat the image with a 32-bit FAT\n");
+	fprintf(stderr, "\t-E\t\tformat the image with extents instead of FAT chains\n");
+	fprintf(stderr, "\t-L\t\tformat the image log-structured (implies -E)\n");
+	fprintf(stderr, "\t-D\t\tdeduplicate full blocks as they are written (implies -E)\n");
+	fprintf(stderr, "\t-C\t\tcompress the files of the workloads (implies -E)\n");
+	fprintf(stderr, "\t-K\t\tchecksum every block, verified on read\n");
+	fprintf(stderr, "\t-s <MiB>\tfile size of the sequential/random workloads (default %zu)\n", config.file_size / MiB);
+	fprintf(stderr, "\t-n <ops>\toperations per random/churn workload (default %d)\n", config.iterations);
+	fprintf(stderr, "\t-r <seed>\tseed of the random offsets (default %lu)\n", (unsigned long)config.seed);
+	fprintf(stderr, "\t-f <format>\thuman, csv or json (default human)\n");
+	fprintf(stderr, "\t-w <workload>\tonly run this workload\n");
+	fprintf(stderr, "\t-l <model>\tsimulate device latency, e.g. ssd or hdd,seed=1,virtual\n");
+	fprintf(stderr, "\t-m <backend>\tdisk backend, file or ram (default %s)\n", config.backend);
+	fprintf(stderr, "Workloads are:\n");
+	for (i = 0; i < ARRAY_SIZE(workloads); i++)
+		fprintf(stderr, "\t%s\n", workloads[i].name);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	static char buf[64 * KiB];
+	struct samples samples = { 0 };
+	int opt, idx = 0;
+
+	while ((opt = getopt(argc, argv, "d:b:WELDCKs:n:r:f:w:l:m:h")) != -1) {
+		switch (opt) {
+		case 'd':
+			config.diskname = optarg;
+			break;
+		case 'b':
+			config.data_blocks = atoi(optarg);
+			break;
+		case 'W':
+			config.fat32 = 1;
+			break;
+		case 'E':
+			config.extents = 1;
+			break;
+		case 'L':
+			config.log = 1;
+			break;
+		case 'D':
+			config.dedup = 1;
+			config.extents = 1;
+			break;
+		case 'C':
+			config.compress = 1;
+			config.extents = 1;
+			break;
+		case 'K':
+			config.checksums = 1;
+			break;
+		case 's':
+			config.file_size = (size_t)atoi(optarg) * MiB;
+			break;
+		case 'n':
+			config.iterations = atoi(optarg);
+			break;
+		case 'r':
+			config.seed = strtoull(optarg, NULL, 0);
+			break;
+		case 'f':
+			if (!strcmp(optarg, "human"))
+				config.format = FORMAT_HUMAN;
+			else if (!strcmp(optarg, "csv"))
+				config.format = FORMAT_CSV;
+			else if (!strcmp(optarg, "json"))
+				config.format = FORMAT_JSON;
+			else
+				usage(argv[0]);
+			break;
+		case 'w':
+			config.only = optarg;
+			break;
+		case 'l':
+			config.latency = optarg;
+			break;
+		case 'm':
+			config.backend = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (config.data_blocks < 1 || config.iterations < 10)
+		usage(argv[0]);
+
+	if (!strcmp(config.backend, "file"))
+		snprintf(mountname, sizeof(mountname), "%s", config.diskname);
+	else if (!strcmp(config.backend, "ram"))
+		snprintf(mountname, sizeof(mountname), "ram:%s", config.diskname);
+	else
+		usage(argv[0]);
+
+	if (config.latency) {
+		struct block_latency_model model;
+
+		if (block_disk_parse_latency(config.latency, &model))
+			usage(argv[0]);
+		block_disk_set_latency(&model);
+	}
+
+	memset(buf, 'x', sizeof(buf));
+	rng_state = config.seed ? config.seed : 1;
+	make_patterns();
+	report_header();
+
+	for (size_t i = 0; i < ARRAY_SIZE(workloads); i++) {
+		struct workload *w = &workloads[i];
+
+		if (config.only && strcmp(config.only, w->name))
+			continue;
+
+		for (size_t j = 0; j < ARRAY_SIZE(w->io_sizes); j++) {
+			struct result r = { 0 };
+
+			if (j > 0 && !w->io_sizes[j])
+				break;
+
+			rng_state = config.seed ? config.seed : 1;
+			snprintf(r.name, sizeof(r.name), "%s", w->name);
+			r.io_size = w->io_sizes[j];
+
+			w->func(&r, &samples, r.io_size, buf);
+			report(&r, idx++);
+		}
+	}
+
+	report_footer();
+	remove(config.diskname);
+	free(samples.ns);
+
+	return 0;
+}
@@ -0,0 +1,143 @@
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <disk.h>
+
+/*
+ * Block I/O counter, loaded with LD_PRELOAD.
+ *
+ * Both fs_ref.x and the programs built against libfs go through libc's
+ * open()/read()/write() (or their positional pread()/pwrite() variants) to
+ * access the virtual disk, so interposing these counts the blocks each implementation transfers without touching either of
+ * them. Only the image named by $DISK_COUNT_IMAGE is tracked. At exit, the
+ * totals are appended to $DISK_COUNT_OUT (or printed on stderr) as:
+ *
+ *	<block reads> <block writes>
+ */
+
+/* Invalid file descriptor */
+#define INVALID_FD -1
+
+static int disk_fd = INVALID_FD;
+static unsigned long block_reads;
+static unsigned long block_writes;
+
+static int (*real_open)(const char *, int, ...);
+static int (*real_close)(int);
+static ssize_t (*real_read)(int, void *, size_t);
+static ssize_t (*real_write)(int, const void *, size_t);
+static ssize_t (*real_pread)(int, void *, size_t, off_t);
+static ssize_t (*real_pwrite)(int, const void *, size_t, off_t);
+static ssize_t (*real_pread64)(int, void *, size_t, off64_t);
+static ssize_t (*real_pwrite64)(int, const void *, size_t, off64_t);
+
+__attribute__((constructor))
+static void disk_count_init(void)
+{
+	real_open = dlsym(RTLD_NEXT, "open");
+	real_close = dlsym(RTLD_NEXT, "close");
+	real_read = dlsym(RTLD_NEXT, "read");
+	real_write = dlsym(RTLD_NEXT, "write");
+	real_pread = dlsym(RTLD_NEXT, "pread");
+	real_pwrite = dlsym(RTLD_NEXT, "pwrite");
+	real_pread64 = dlsym(RTLD_NEXT, "pread64");
+	real_pwrite64 = dlsym(RTLD_NEXT, "pwrite64");
+}
+
+__attribute__((destructor))
+static void disk_count_fini(void)
+{
+	const char *out = getenv("DISK_COUNT_OUT");
+	FILE *f = out ? fopen(out, "a") : stderr;
+
+	if (!f)
+		return;
+
+	fprintf(f, "%lu %lu\n", block_reads, block_writes);
+	if (f != stderr)
+		fclose(f);
+}
+
+int open(const char *pathname, int flags, ...)
+{
+	const char *image = getenv("DISK_COUNT_IMAGE");
+	mode_t mode = 0;
+	int fd;
+
+	if (flags & (O_CREAT | O_TMPFILE)) {
+		va_list ap;
+
+		va_start(ap, flags);
+		mode = va_arg(ap, mode_t);
+		va_end(ap);
+	}
+
+	fd = real_open(pathname, flags, mode);
+	if (fd >= 0 && image && !strcmp(pathname, image))
+		disk_fd = fd;
+
+	return fd;
+}
+
+int close(int fd)
+{
+	if (fd == disk_fd)
+		disk_fd = INVALID_FD;
+
+	return real_close(fd);
+}
+
+static void count_read(int fd, size_t count)
+{
+	if (fd == disk_fd && count % BLOCK_SIZE == 0)
+		block_reads += count / BLOCK_SIZE;
+}
+
+static void count_write(int fd, size_t count)
+{
+	if (fd == disk_fd && count % BLOCK_SIZE == 0)
+		block_writes += count / BLOCK_SIZE;
+}
+
+ssize_t read(int fd, void *buf, size_t count)
+{
+	count_read(fd, count);
+	return real_read(fd, buf, count);
+}
+
+ssize_t write(int fd, const void *buf, size_t count)
+{
+	count_write(fd, count);
+	return real_write(fd, buf, count);
+}
+
+ssize_t pread(int fd, void *buf, size_t count, off_t offset)
+{
+	count_read(fd, count);
+	return real_pread(fd, buf, count, offset);
+}
+
+ssize_t pwrite(int fd, const void *buf, size_t count, off_t offset)
+{
+	count_write(fd, count);
+	return real_pwrite(fd, buf, count, offset);
+}
+
+ssize_t pread64(int fd, void *buf, size_t count, off64_t offset)
+{
+	count_read(fd, count);
+	return real_pread64(fd, buf, count, offset);
+}
+
+ssize_t pwrite64(int fd, const void *buf, size_t count, off64_t offset)
+{
+	count_write(fd, count);
+	return real_pwrite64(fd, buf, count, offset);
+}
@@ -0,0 +1,89 @@
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <fs.h>
+
+/*
+ * Check the consistency of an image without mounting it (see fs_check()).
+ *
+ * Exit status follows fsck: 0 if the image is consistent, 1 if every problem
+ * was repaired, 4 if problems are left, 8 if the image could not be checked.
+ */
+
+#define EXIT_CLEAN 0
+#define EXIT_REPAIRED 1
+#define EXIT_PROBLEMS 4
+#define EXIT_FAILED 8
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void usage(char *program)
+{
+	fprintf(stderr, "Usage: %s [-r] [-q] [-j <threads>] <diskname>\n", program);
+	fprintf(stderr, "\t-r\t\tfree leaked blocks\n");
+	fprintf(stderr, "\t-q\t\tonly print the summary, not each problem\n");
+	fprintf(stderr, "\t-j <threads>\tworker threads (default: one per CPU)\n");
+	exit(EXIT_FAILED);
+}
+
+int main(int argc, char **argv)
+{
+	struct fs_check_report report;
+	unsigned int flags = FS_CHECK_VERBOSE;
+	int num_threads = 0, opt;
+
+	while ((opt = getopt(argc, argv, "rqj:h")) != -1) {
+		switch (opt) {
+		case 'r':
+			flags |= FS_CHECK_REPAIR;
+			break;
+		case 'q':
+			flags &= ~FS_CHECK_VERBOSE;
+			break;
+		case 'j':
+			num_threads = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind != 1)
+		usage(argv[0]);
+
+	const char *diskname = argv[optind];
+
+	uint64_t start = now_ns();
+	int left = fs_check(diskname, flags, num_threads, &report);
+	uint64_t elapsed = now_ns() - start;
+
+	if (left == -1) {
+		fprintf(stderr, "Cannot check '%s'\n", diskname);
+		return EXIT_FAILED;
+	}
+
+	printf("%s: %u files, %u blocks used, checked in %.3f ms\n", diskname,
+		   report.files, report.blocks_used, elapsed / 1e6);
+	printf("bad_superblock=%u\n", report.bad_superblock);
+	printf("bad_entries=%u\n", report.bad_entries);
+	printf("bad_links=%u\n", report.bad_links);
+	printf("cycles=%u\n", report.cycles);
+	printf("cross_linked=%u\n", report.cross_linked);
+	printf("leaked=%u\n", report.leaked);
+	printf("size_mismatches=%u\n", report.size_mismatches);
+	printf("repaired=%u\n", report.repaired);
+	printf("%u problem(s), %d left\n", report.errors, left);
+
+	if (left)
+		return EXIT_PROBLEMS;
+
+	return report.repaired ? EXIT_REPAIRED : EXIT_CLEAN;
+}
@@ -0,0 +1,28 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <fs.h>
+
+/*
+ * Convert a disk made with FAT chains to the extent format (see fs_convert()).
+ *
+ * Data blocks are not moved, only the metadata describing them is rewritten.
+ */
+
+int main(int argc, char **argv)
+{
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s <diskname>\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	const char *diskname = argv[1];
+
+	if (fs_convert(diskname)) {
+		fprintf(stderr, "Cannot convert '%s'\n", diskname);
+		return EXIT_FAILURE;
+	}
+
+	printf("Converted virtual disk '%s' to extents\n", diskname);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,87 @@
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <disk.h>
+#include <fs.h>
+
+/*
+ * Deduplicate the data blocks of an extent disk (see fs_dedup_scan()), and
+ * optionally turn inline deduplication on or off (see fs_dedup()).
+ */
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void usage(char *program)
+{
+	fprintf(stderr, "Usage: %s [-i] [-n] <diskname>\n", program);
+	fprintf(stderr, "\t-i\tdeduplicate full blocks as they are written from now on\n");
+	fprintf(stderr, "\t-n\tstop deduplicating blocks as they are written\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+	struct fs_dedup_report report;
+	int inline_mode = -1, opt;
+
+	while ((opt = getopt(argc, argv, "inh")) != -1) {
+		switch (opt) {
+		case 'i':
+			inline_mode = 1;
+			break;
+		case 'n':
+			inline_mode = 0;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind != 1)
+		usage(argv[0]);
+
+	const char *diskname = argv[optind];
+
+	if (fs_mount(diskname)) {
+		fprintf(stderr, "Cannot mount '%s'\n", diskname);
+		return EXIT_FAILURE;
+	}
+
+	uint64_t start = now_ns();
+	if (fs_dedup_scan(&report)) {
+		fprintf(stderr, "Cannot deduplicate '%s' (not an extent disk?)\n", diskname);
+		fs_umount();
+		return EXIT_FAILURE;
+	}
+	uint64_t elapsed = now_ns() - start;
+
+	if (inline_mode != -1 && fs_dedup(inline_mode)) {
+		fprintf(stderr, "Cannot change inline deduplication of '%s'\n", diskname);
+		fs_umount();
+		return EXIT_FAILURE;
+	}
+
+	if (fs_umount()) {
+		fprintf(stderr, "Cannot unmount '%s'\n", diskname);
+		return EXIT_FAILURE;
+	}
+
+	printf("%s: %lu blocks scanned in %.3f ms (%.1f MB/s)\n", diskname, (unsigned long)report.blocks_scanned,
+		   elapsed / 1e6, elapsed ? report.blocks_scanned * (double)BLOCK_SIZE / (elapsed / 1e3) : 0);
+	printf("blocks_deduplicated=%lu\n", (unsigned long)report.blocks_deduplicated);
+	printf("mismatches=%lu\n", (unsigned long)report.mismatches);
+	printf("logical_blocks=%lu\n", (unsigned long)report.logical_blocks);
+	printf("physical_blocks=%lu\n", (unsigned long)report.physical_blocks);
+	printf("dedup_ratio=%.2f\n", report.physical_blocks ? (double)report.logical_blocks / report.physical_blocks : 1.0);
+	if (inline_mode != -1)
+		printf("inline deduplication %s\n", inline_mode ? "enabled" : "disabled");
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,61 @@
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <fs.h>
+
+/*
+ * Create a disk with an empty file system (see fs_format()).
+ *
+ * Without -w, -e and -l, the disk is the same as the one fs_make.x would create,
+ * but it is not limited to 8192 data blocks.
+ */
+
+static void usage(char *program)
+{
+	fprintf(stderr, "Usage: %s [-w] [-e] [-l] <diskname> <data block count>\n", program);
+	fprintf(stderr, "\t-w\t32-bit FAT, for disks beyond 65,535 blocks\n");
+	fprintf(stderr, "\t-e\tdescribe files by extents instead of FAT chains\n");
+	fprintf(stderr, "\t-l\twrite data to a log of segments (implies -e)\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int flags = 0;
+	char *end;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "welh")) != -1) {
+		switch (opt) {
+		case 'w':
+			flags |= FS_FORMAT_FAT32;
+			break;
+		case 'e':
+			flags |= FS_FORMAT_EXTENTS;
+			break;
+		case 'l':
+			flags |= FS_FORMAT_LOG;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind != 2)
+		usage(argv[0]);
+
+	const char *diskname = argv[optind];
+	size_t data_blocks = strtoul(argv[optind + 1], &end, 0);
+	if (*end != '\0' || data_blocks == 0)
+		usage(argv[0]);
+
+	if (fs_format(diskname, data_blocks, flags)) {
+		fprintf(stderr, "Cannot create '%s' with %zu data blocks\n", diskname, data_blocks);
+		return EXIT_FAILURE;
+	}
+
+	printf("Created virtual disk '%s' with '%zu' data blocks%s%s\n", diskname, data_blocks,
+		   flags & FS_FORMAT_FAT32 ? " (32-bit FAT)" : "",
+		   flags & FS_FORMAT_LOG ? " (log-structured)" : flags & FS_FORMAT_EXTENTS ? " (extents)" : "");
+	return EXIT_SUCCESS;
+}
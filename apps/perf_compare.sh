@@ -0,0 +1,241 @@
+#!/bin/bash
+
+#
+# Differential performance comparison between fs_ref.x and test_fs.x
+#
+# Every phase runs the same command (usually a script) through both programs,
+# on identical copies of the same disk image. Each phase is timed (best of
+# RUNS) and the blocks read/written are counted by preloading disk_count.so.
+# Phases where libfs is slower, or transfers more blocks, than the reference
+# are flagged.
+#
+# Usage: ./perf_compare.sh [-r runs] [-t tolerance_percent] [-k]
+#
+
+set -o pipefail
+
+RUNS=5
+TOLERANCE=10
+KEEP=0
+
+#
+# Logging helpers
+#
+log() {
+    echo -e "${*}"
+}
+
+warning() {
+    log "Warning: ${*}"
+}
+error() {
+    log "Error: ${*}"
+}
+die() {
+    error "${*}"
+    exit 1
+}
+
+while getopts "r:t:kh" opt; do
+    case ${opt} in
+        r) RUNS=${OPTARG} ;;
+        t) TOLERANCE=${OPTARG} ;;
+        k) KEEP=1 ;;
+        *) die "Usage: ${0} [-r runs] [-t tolerance_percent] [-k]" ;;
+    esac
+done
+
+APPS=$(cd "$(dirname "${0}")" && pwd)
+WORKDIR=$(mktemp -d)
+
+# Phases run from WORKDIR, so that filenames fit in FS_FILENAME_LEN
+BASE_IMG="base.fs"
+DISK_IMG="disk.fs"
+DATA_FILE="data_1M"
+SMALL_FILE="data_4K"
+
+FLAGGED=0
+
+cleanup() {
+    [[ ${KEEP} -eq 1 ]] && log "Work files kept in ${WORKDIR}" && return
+    rm -rf "${WORKDIR}"
+}
+trap cleanup EXIT
+
+#
+# Run helpers
+#
+
+# Run one program on a fresh copy of the base image, and count its block I/O
+# 1: program, 2...: arguments (DISK stands for the image)
+run_counted() {
+    local prog=${1}; shift
+    local args=("${@/#DISK/${DISK_IMG}}")
+
+    cp "${BASE_IMG}" "${DISK_IMG}"
+    rm -f count
+
+    local start=$(date +%s%N)
+    DISK_COUNT_IMAGE="${DISK_IMG}" DISK_COUNT_OUT=count \
+        LD_PRELOAD="${APPS}/disk_count.so" "${APPS}/${prog}" "${args[@]}" \
+        >stdout 2>stderr
+    local end=$(date +%s%N)
+
+    ELAPSED_US=$(( (end - start) / 1000 ))
+    read READS WRITES < count || die "No block counts from ${prog}"
+
+    # Every phase mounts the image, so no I/O means the counter missed it
+    (( READS + WRITES > 0 )) ||
+        die "${prog} did no counted I/O on ${DISK_IMG}, check disk_count.so"
+}
+
+# Best-of-RUNS time, block counts and output of a program on a phase
+# 1: program, 2...: arguments
+measure() {
+    local prog=${1}; shift
+    local best=
+
+    for ((i = 0; i < RUNS; i++)); do
+        run_counted "${prog}" "${@}"
+        [[ -z ${best} || ${ELAPSED_US} -lt ${best} ]] && best=${ELAPSED_US}
+    done
+
+    BEST_US=${best}
+    OUTPUT=$(cat stdout)
+}
+
+# Compare both implementations on a phase
+# 1: phase name, 2...: test_fs command line
+phase() {
+    local name=${1}; shift
+    local flags=()
+
+    measure fs_ref.x "${@}"
+    local ref_us=${BEST_US} ref_r=${READS} ref_w=${WRITES} ref_out=${OUTPUT}
+
+    measure test_fs.x "${@}"
+    local lib_us=${BEST_US} lib_r=${READS} lib_w=${WRITES} lib_out=${OUTPUT}
+
+    (( lib_us * 100 > ref_us * (100 + TOLERANCE) )) && flags+=("SLOWER")
+    (( lib_w > ref_w )) && flags+=("MORE_WRITES")
+    (( lib_r > ref_r )) && flags+=("MORE_READS")
+    [[ "${ref_out}" != "${lib_out}" ]] && flags+=("OUTPUT_DIFFERS")
+    [[ ${#flags[@]} -gt 0 ]] && FLAGGED=$((FLAGGED + 1))
+
+    printf "%-16s %9d %9d %6.2fx %7d/%-7d %7d/%-7d %s\n" "${name}" \
+        "${ref_us}" "${lib_us}" "$(awk "BEGIN { print ${lib_us} / (${ref_us} + 1) }")" \
+        "${ref_r}" "${ref_w}" "${lib_r}" "${lib_w}" "${flags[*]}"
+}
+
+# Write a script into the work directory, read from stdin
+# 1: script name
+script() {
+    cat > "${1}.script"
+}
+
+# Build the base image that every phase starts from
+# 1: data blocks, 2...: files to add with the reference implementation
+base_image() {
+    local blocks=${1}; shift
+
+    "${APPS}/fs_make.x" "${BASE_IMG}" "${blocks}" > /dev/null || die "fs_make.x failed"
+    for f in "${@}"; do
+        "${APPS}/fs_ref.x" add "${BASE_IMG}" "${f}" > /dev/null || die "Cannot add ${f}"
+    done
+}
+
+#
+# Workloads
+#
+make_workloads() {
+    python3 -c "print('a' * 1048576, end='')" > "${DATA_FILE}"
+    python3 -c "print('b' * 4096, end='')" > "${SMALL_FILE}"
+    local a100=$(python3 -c "print('a' * 100, end='')")
+
+    { echo MOUNT; echo UMOUNT; } | script mount
+
+    {
+        echo MOUNT
+        for i in $(seq 100); do printf "CREATE\tf%d\n" ${i}; done
+        for i in $(seq 100); do printf "DELETE\tf%d\n" ${i}; done
+        echo UMOUNT
+    } | script create_delete
+
+    {
+        printf "MOUNT\nCREATE\tsmall\nOPEN\tsmall\n"
+        for i in $(seq 1000); do printf "WRITE\tDATA\t%s\n" "${a100}"; done
+        printf "CLOSE\nUMOUNT\n"
+    } | script small_writes
+
+    printf "MOUNT\nCREATE\tbig\nOPEN\tbig\nWRITE\tFILE\t%s\nCLOSE\nUMOUNT\n" \
+        "${DATA_FILE}" | script seq_write
+
+    # The phases below expect data_1M on the base image
+    printf "MOUNT\nOPEN\t%s\nREAD\t1048576\tFILE\t%s\nCLOSE\nUMOUNT\n" \
+        "${DATA_FILE}" "${DATA_FILE}" | script seq_read
+
+    {
+        printf "MOUNT\nOPEN\t%s\n" "${DATA_FILE}"
+        for i in $(seq 0 499); do
+            printf "SEEK\t%d\nREAD\t100\tDATA\t%s\n" $(( (i * 7919 * 100) % 1048000 )) "${a100}"
+        done
+        printf "CLOSE\nUMOUNT\n"
+    } | script random_read
+
+    {
+        printf "MOUNT\nOPEN\t%s\n" "${DATA_FILE}"
+        for i in $(seq 0 499); do
+            printf "SEEK\t%d\nWRITE\tDATA\t%s\n" $(( (i * 7919 * 100) % 1048000 )) "${a100}"
+        done
+        printf "CLOSE\nUMOUNT\n"
+    } | script random_write
+
+    {
+        printf "MOUNT\nOPEN\t%s\n" "${DATA_FILE}"
+        for i in $(seq 1 255); do
+            printf "SEEK\t%d\nWRITE\tFILE\t%s\n" $(( i * 4096 - 2048 )) "${SMALL_FILE}"
+        done
+        printf "CLOSE\nUMOUNT\n"
+    } | script cross_block
+}
+
+run_phases() {
+    printf "%-16s %9s %9s %7s %15s %15s %s\n" "phase" "ref(us)" "lib(us)" \
+        "ratio" "ref r/w" "lib r/w" "flags"
+
+    base_image 4096
+    phase mount           script DISK "mount.script"
+    phase create_delete   script DISK "create_delete.script"
+    phase small_writes    script DISK "small_writes.script"
+    phase seq_write       script DISK "seq_write.script"
+    phase info_empty      info DISK
+    phase add_1M          add DISK "${DATA_FILE}"
+
+    base_image 4096 "${DATA_FILE}" "${SMALL_FILE}"
+    phase seq_read        script DISK "seq_read.script"
+    phase random_read     script DISK "random_read.script"
+    phase random_write    script DISK "random_write.script"
+    phase cross_block     script DISK "cross_block.script"
+    phase info_full       info DISK
+    phase ls              ls DISK
+    phase stat            stat DISK "${DATA_FILE}"
+    phase cat_1M          cat DISK "${DATA_FILE}"
+    phase rm_1M           rm DISK "${DATA_FILE}"
+}
+
+make_prereqs() {
+    make -C "${APPS}" test_fs.x disk_count.so > /dev/null 2>&1 ||
+        die "Compilation failed"
+
+    local x
+    for x in test_fs.x fs_make.x fs_ref.x disk_count.so; do
+        [[ -e "${APPS}/${x}" ]] || die "Can't find ${x}"
+    done
+}
+
+make_prereqs
+cd "${WORKDIR}" || die "Cannot enter ${WORKDIR}"
+make_workloads
+run_phases
+
+log "\n${FLAGGED} phase(s) flagged (time tolerance ${TOLERANCE}%, best of ${RUNS} runs)"
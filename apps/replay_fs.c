@@ -0,0 +1,321 @@
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <fs.h>
+
+/*
+ * Replay a trace recorded with fs_trace_start() (or FS_TRACE=<file>).
+ *
+ * The calls of the trace are executed again, in order, on a freshly formatted
+ * image: either back to back to find the maximum speed, or paced to match the
+ * recorded timestamps. The latency distribution of each operation is reported
+ * next to the recorded one.
+ */
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+
+#define replay_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	replay_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+/** Data blocks of the image when the trace does not record a mount */
+#define DEFAULT_DATA_BLOCKS 8192
+
+/* Latencies of one operation, recorded and replayed */
+struct op_stats {
+	uint32_t *recorded;
+	uint32_t *replayed;
+	size_t count;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static struct fs_trace_record *load_trace(const char *filename, size_t *count)
+{
+	struct fs_trace_header header;
+	struct fs_trace_record *records;
+	FILE *f;
+	long size;
+
+	f = fopen(filename, "rb");
+	if (!f)
+		die("Cannot open trace '%s'", filename);
+
+	if (fread(&header, sizeof(header), 1, f) != 1
+		|| memcmp(header.magic, FS_TRACE_MAGIC, sizeof(header.magic))
+		|| header.record_size != sizeof(struct fs_trace_record))
+		die("'%s' is not a trace file", filename);
+
+	fseek(f, 0, SEEK_END);
+	size = ftell(f) - sizeof(header);
+	fseek(f, sizeof(header), SEEK_SET);
+
+	*count = size / sizeof(*records);
+	records = malloc(size + 1);
+	if (!records || fread(records, sizeof(*records), *count, f) != *count)
+		die("Cannot read trace '%s'", filename);
+
+	fclose(f);
+	return records;
+}
+
+static void format_disk(const char *diskname, uint64_t data_blocks)
+{
+	/* Disks too large for a 16-bit FAT were recorded on a 32-bit one */
+	if (fs_format(diskname, data_blocks, 0) && fs_format(diskname, data_blocks, FS_FORMAT_FAT32))
+		die("Cannot format '%s' with %lu data blocks", diskname, (unsigned long)data_blocks);
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static double percentile_us(uint32_t *ns, size_t count, double p)
+{
+	return ns[(size_t)(p * (count - 1) + 0.5)] / 1000.0;
+}
+
+/* Map a recorded descriptor to the one returned by the replay */
+static int fd_map[FS_OPEN_MAX_COUNT];
+
+static int replay_fd(int fd)
+{
+	return fd >= 0 && fd < FS_OPEN_MAX_COUNT ? fd_map[fd] : fd;
+}
+
+/* Execute one recorded call, return its result */
+static int replay(struct fs_trace_record *rec, const char *diskname, char *buf)
+{
+	int fd = replay_fd(rec->fd);
+	int ret;
+
+	switch (rec->op) {
+	case FS_TRACE_MOUNT:
+		return fs_mount(diskname);
+	case FS_TRACE_UMOUNT:
+		return fs_umount();
+	case FS_TRACE_INFO:
+		return fs_info();
+	case FS_TRACE_CREATE:
+		return fs_create(rec->filename);
+	case FS_TRACE_DELETE:
+		return fs_delete(rec->filename);
+	case FS_TRACE_TRUNCATE:
+		return fs_truncate(rec->filename, rec->arg);
+	case FS_TRACE_FTRUNCATE:
+		return fs_ftruncate(fd, rec->arg);
+	case FS_TRACE_LS:
+		return fs_ls();
+	case FS_TRACE_OPEN:
+		ret = fs_open_flags(rec->filename, rec->arg);
+		if (rec->result >= 0 && rec->result < FS_OPEN_MAX_COUNT)
+			fd_map[rec->result] = ret;
+		return ret;
+	case FS_TRACE_CLOSE:
+		return fs_close(fd);
+	case FS_TRACE_STAT:
+		return fs_stat(fd);
+	case FS_TRACE_LSEEK:
+		return fs_lseek(fd, rec->arg);
+	case FS_TRACE_SEEK_DATA:
+		return fs_seek_data(fd, rec->arg);
+	case FS_TRACE_SEEK_HOLE:
+		return fs_seek_hole(fd, rec->arg);
+	case FS_TRACE_WRITE:
+		return fs_write(fd, buf, rec->arg);
+	case FS_TRACE_READ:
+		return fs_read(fd, buf, rec->arg);
+	case FS_TRACE_SYNC:
+		return fs_sync();
+	case FS_TRACE_TAILPACK:
+		return fs_tailpack(rec->arg);
+	case FS_TRACE_DEFRAG:
+		return fs_defrag(rec->arg, 0);
+	case FS_TRACE_CLEAN:
+		return fs_clean(rec->arg);
+	case FS_TRACE_CLONE:
+		/* The source of a clone is not recorded, the copy starts out empty */
+		return fs_create(rec->filename);
+	case FS_TRACE_SNAPSHOT_CREATE:
+		return fs_snapshot_create(rec->filename);
+	case FS_TRACE_SNAPSHOT_DELETE:
+		return fs_snapshot_delete(rec->filename);
+	case FS_TRACE_DEDUP:
+		return fs_dedup(rec->arg);
+	case FS_TRACE_DEDUP_SCAN: {
+		struct fs_dedup_report report;
+
+		return fs_dedup_scan(&report);
+	}
+	case FS_TRACE_COMPRESS:
+		return fs_compress(rec->filename, rec->arg);
+	case FS_TRACE_CHECKSUMS:
+		return fs_checksums(rec->arg);
+	case FS_TRACE_SCRUB: {
+		struct fs_scrub_report report;
+
+		return fs_scrub(rec->arg, &report);
+	}
+	case FS_TRACE_SCRUB_RATE:
+		return fs_scrub_rate(rec->arg);
+	case FS_TRACE_SNAPSHOT_OPEN:
+		/* The snapshot is not recorded, the live file is read instead */
+		ret = fs_open(rec->filename);
+		if (rec->result >= 0 && rec->result < FS_OPEN_MAX_COUNT)
+			fd_map[rec->result] = ret;
+		return ret;
+	}
+
+	return -1;
+}
+
+static void usage(char *program)
+{
+	fprintf(stderr, "Usage: %s [-p] [-b <blocks>] <trace> <diskname>\n", program);
+	fprintf(stderr, "\t-p\t\treplay at the recorded pace instead of full speed\n");
+	fprintf(stderr, "\t-b <blocks>\tdata blocks of the image (default: as recorded)\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct op_stats stats[FS_TRACE_OP_COUNT] = { 0 };
+	struct fs_trace_record *records;
+	size_t count, max_io = 0, mismatches = 0;
+	uint64_t data_blocks = 0;
+	int paced = 0, opt;
+	char *buf;
+
+	while ((opt = getopt(argc, argv, "pb:h")) != -1) {
+		switch (opt) {
+		case 'p':
+			paced = 1;
+			break;
+		case 'b':
+			data_blocks = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind != 2)
+		usage(argv[0]);
+
+	const char *tracename = argv[optind];
+	const char *diskname = argv[optind + 1];
+
+	records = load_trace(tracename, &count);
+
+	/* Size the image and the I/O buffer from the trace */
+	for (size_t i = 0; i < count; i++) {
+		struct fs_trace_record *rec = &records[i];
+
+		if (rec->op >= FS_TRACE_OP_COUNT)
+			die("Unknown operation %d in record %zu", rec->op, i);
+		if (!data_blocks && rec->op == FS_TRACE_MOUNT && rec->result == 0)
+			data_blocks = rec->arg;
+		if ((rec->op == FS_TRACE_READ || rec->op == FS_TRACE_WRITE) && rec->arg > max_io)
+			max_io = rec->arg;
+		stats[rec->op].count++;
+	}
+	if (!data_blocks)
+		data_blocks = DEFAULT_DATA_BLOCKS;
+
+	for (int op = 0; op < FS_TRACE_OP_COUNT; op++) {
+		stats[op].recorded = malloc((stats[op].count + 1) * sizeof(uint32_t));
+		stats[op].replayed = malloc((stats[op].count + 1) * sizeof(uint32_t));
+		stats[op].count = 0;
+	}
+
+	buf = malloc(max_io + 1);
+	if (!buf)
+		die("Cannot malloc");
+	memset(buf, 'r', max_io + 1);
+
+	for (int i = 0; i < FS_OPEN_MAX_COUNT; i++)
+		fd_map[i] = -1;
+
+	format_disk(diskname, data_blocks);
+
+	uint64_t start = now_ns();
+	for (size_t i = 0; i < count; i++) {
+		struct fs_trace_record *rec = &records[i];
+		struct op_stats *st = &stats[rec->op];
+
+		/* Wait for the time the call was made at */
+		if (paced) {
+			uint64_t target = start + rec->timestamp_ns;
+			uint64_t now = now_ns();
+
+			if (target > now) {
+				struct timespec ts = {
+					.tv_sec = (target - now) / 1000000000ULL,
+					.tv_nsec = (target - now) % 1000000000ULL,
+				};
+				nanosleep(&ts, NULL);
+			}
+		}
+
+		uint64_t op_start = now_ns();
+		int ret = replay(rec, diskname, buf);
+		uint64_t latency = now_ns() - op_start;
+
+		/* Descriptors are compared through the mapping, not by value */
+		if (rec->op == FS_TRACE_OPEN ? (ret < 0) != (rec->result < 0) : ret != rec->result)
+			mismatches++;
+
+		st->recorded[st->count] = rec->latency_ns;
+		st->replayed[st->count] = latency > UINT32_MAX ? UINT32_MAX : latency;
+		st->count++;
+	}
+	double seconds = (now_ns() - start) / 1e9;
+
+	printf("Replayed %zu calls in %.3f s (%s), %zu result(s) differ from the trace\n",
+		   count, seconds, paced ? "paced" : "full speed", mismatches);
+	printf("%-10s %8s %27s %27s\n", "", "", "recorded (us)", "replayed (us)");
+	printf("%-10s %8s %8s %8s %9s %8s %8s %9s\n", "op", "count",
+		   "p50", "p99", "p999", "p50", "p99", "p999");
+
+	for (int op = 0; op < FS_TRACE_OP_COUNT; op++) {
+		struct op_stats *st = &stats[op];
+
+		if (!st->count)
+			continue;
+
+		qsort(st->recorded, st->count, sizeof(uint32_t), cmp_u32);
+		qsort(st->replayed, st->count, sizeof(uint32_t), cmp_u32);
+		printf("%-10s %8zu %8.1f %8.1f %9.1f %8.1f %8.1f %9.1f\n", fs_trace_op_name(op),
+			   st->count,
+			   percentile_us(st->recorded, st->count, 0.50),
+			   percentile_us(st->recorded, st->count, 0.99),
+			   percentile_us(st->recorded, st->count, 0.999),
+			   percentile_us(st->replayed, st->count, 0.50),
+			   percentile_us(st->replayed, st->count, 0.99),
+			   percentile_us(st->replayed, st->count, 0.999));
+
+		free(st->recorded);
+		free(st->replayed);
+	}
+
+	free(records);
+	free(buf);
+	return mismatches ? 1 : 0;
+}
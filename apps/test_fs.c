@@ -1,14 +1,18 @@
 #include <assert.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <disk.h>
 #include <fs.h>
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
@@ -34,239 +38,613 @@ struct thread_arg {
 	char **argv;
 };
 
-void thread_fs_script(void *arg)
-{
-	struct thread_arg *t_arg = arg;
-	struct stat st;
-	char *diskname, *script;
-	FILE *fd_script;
-	char *command, *data_source, *data_description, *data, *fs_filename;
-	const int total_command_parts = 4;
-	char *command_args[total_command_parts];
-	int offset;
-	char mounted = 0;
+/* Longest script line, and deepest LOOP nesting */
+#define SCRIPT_LINE_MAX 1024
+#define SCRIPT_LOOP_MAX 16
 
-	char line_buffer[1024];
-	int command_index = 1;
+/* Descriptors opened by a script, with the name given to OPEN */
+struct script_fd {
+	char name[FS_FILENAME_LEN];
+	int fd;
+};
 
-	if (t_arg->argc < 2)
-		die("Usage: <diskname> <script filename>");
+struct script_loop {
+	size_t start;
+	long remaining;
+};
 
-	diskname = t_arg->argv[0];
-	script = t_arg->argv[1];
+/* State of a running script */
+struct script {
+	char **lines;
+	size_t num_lines;
+
+	struct script_fd fds[FS_OPEN_MAX_COUNT];
+	int cur_fd;
+
+	struct script_loop loops[SCRIPT_LOOP_MAX];
+	int num_loops;
+
+	/* Generated payloads */
+	char *payload;
+	size_t payload_size;
+	uint64_t seed;
+
+	/* Current TIME section */
+	char section[SCRIPT_LINE_MAX];
+	struct timespec section_start;
+	size_t bytes_read;
+	size_t bytes_written;
+
+	char verify;
+	char quiet;
+	char mounted;
+};
+
+/* Print the outcome of a command, unless the script asked for quiet */
+#define script_print(s, ...)		\
+do {								\
+	if (!(s)->quiet)				\
+		printf(__VA_ARGS__);		\
+} while (0)
+
+/* Unmount and exit on a failing command */
+#define script_die(...)				\
+do {								\
+	fs_umount();					\
+	die(__VA_ARGS__);				\
+} while (0)
+
+static void script_load(struct script *s, const char *filename)
+{
+	char line_buffer[SCRIPT_LINE_MAX];
+	size_t capacity = 0;
+	FILE *fd_script;
 
 	/* Open script on host computer */
-	fd_script = fopen(script, "r");
+	fd_script = fopen(filename, "r");
 	if (!fd_script)
 		die_perror("fopen");
 
-	int fs_fd = -1;
-
-	/* Loop through the script and execute the specified commands */
-	while (fgets(line_buffer, 1024, fd_script) != NULL) {
+	/* Keep the whole script in memory so that loops can jump back */
+	while (fgets(line_buffer, SCRIPT_LINE_MAX, fd_script) != NULL) {
 		/* Remove trailing newline from command line */
 		char *nl = strchr(line_buffer, '\n');
 		if (nl)
 			*nl = '\0';
 
-		/* Tokenize line */
-		command_args[0] = strtok(line_buffer, "\t");
-		command_index = 1;
-		do {
-			command_args[command_index] = strtok(NULL, "\t");
-		} while (command_index < total_command_parts && command_args[command_index++] != NULL);
-		command = command_args[0];
+		if (s->num_lines == capacity) {
+			capacity = capacity ? 2 * capacity : 64;
+			s->lines = realloc(s->lines, capacity * sizeof(char *));
+			if (!s->lines)
+				die_perror("realloc");
+		}
+		s->lines[s->num_lines++] = strdup(line_buffer);
+	}
 
-		int data_fd;
-		int count, data_size;
+	fclose(fd_script);
+}
 
-		char *read_buf;
+/* Return a payload buffer of at least @len bytes */
+static char *script_payload(struct script *s, size_t len)
+{
+	if (len + 1 > s->payload_size) {
+		s->payload_size = len + 1;
+		s->payload = realloc(s->payload, s->payload_size);
+		if (!s->payload)
+			script_die("Cannot allocate %zu byte payload", len);
+	}
+	return s->payload;
+}
 
-		/* End when no command present */
-		if (!command)
-			break;
+/* Fill @buf with @pattern repeated over @len bytes */
+static void fill_pattern(char *buf, size_t len, const char *pattern)
+{
+	size_t pattern_len = strlen(pattern);
 
-		if (strcmp(command, "MOUNT") == 0) {
-			if (fs_mount(diskname))
-				die("Cannot mount disk");
-			else {
-				printf("MOUNT successful.\n");
-				mounted = 1;
-			}
+	for (size_t i = 0; i < len; i++)
+		buf[i] = pattern[i % pattern_len];
+}
 
-		} else if (strcmp(command, "UMOUNT") == 0) {
-			if (mounted && fs_umount())
-				die("Cannot unmount");
-			else {
-				printf("UMOUNT successful.\n");
-				mounted = 0;
-			}
+/* Fill @buf with bytes from a xorshift generator, repeatable from SEED */
+static void fill_random(struct script *s, char *buf, size_t len)
+{
+	for (size_t i = 0; i < len; i += sizeof(uint64_t)) {
+		s->seed ^= s->seed << 13;
+		s->seed ^= s->seed >> 7;
+		s->seed ^= s->seed << 17;
 
-		} else if (strcmp(command, "CREATE") == 0) {
-			fs_filename = command_args[1];
+		size_t n = len - i < sizeof(uint64_t) ? len - i : sizeof(uint64_t);
+		memcpy(buf + i, &s->seed, n);
+	}
+}
 
-			if(fs_create(fs_filename)) {
-				fs_umount();
-				die("Cannot create file");
-			}
+static double elapsed_ms(struct timespec *start)
+{
+	struct timespec now;
 
-			printf("CREATE successful.\n");
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
 
-		} else if (strcmp(command, "DELETE") == 0) {
-			fs_filename = command_args[1];
+/* Find the descriptor opened under @name, or a free slot if @name is NULL */
+static struct script_fd *script_fd_find(struct script *s, const char *name)
+{
+	for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+		if (!name && s->fds[i].fd < 0)
+			return &s->fds[i];
+		if (name && s->fds[i].fd >= 0 && !strcmp(s->fds[i].name, name))
+			return &s->fds[i];
+	}
+	return NULL;
+}
 
-			if(fs_delete(fs_filename)) {
-				fs_umount();
-				die("Cannot delete file");
-			}
+/*
+ * Build the payload of a WRITE or READ command, in @data/@data_size.
+ * @args points to "<source> <description>", where generated payloads of a
+ * WRITE take their length first, and those of a READ use @read_len.
+ */
+static void script_data(struct script *s, char **args, const char *read_len,
+						char **data, int *data_size, char *file_loaded)
+{
+	struct stat st;
+	char *data_source = args[0];
+	int data_fd;
+	const char *len = read_len ? read_len : args[1];
+	char *pattern = read_len ? args[1] : args[2];
+
+	*file_loaded = 0;
+
+	if (!data_source)
+		script_die("Missing data source");
+
+	if (strcmp(data_source, "DATA") == 0) {
+		*data = args[1] ? args[1] : "";
+		*data_size = strlen(*data);
+	} else if (strcmp(data_source, "FILE") == 0) {
+		data_fd = open(args[1], O_RDONLY);
+		if (data_fd < 0) {
+			fs_umount();
+			die_perror("open");
+		}
+		if (fstat(data_fd, &st)) {
+			fs_umount();
+			die_perror("fstat");
+		}
+		if (!S_ISREG(st.st_mode))
+			script_die("Not a regular file: %s\n", args[1]);
+
+		FILE *data_file = fdopen(data_fd, "r");
+		*data_size = st.st_size;
+		*data = calloc(*data_size + 1, sizeof(char));
+		size_t n = fread(*data, sizeof(char), *data_size, data_file);
+		assert(n == sizeof(char) * *data_size);
+		fclose(data_file);
+		*file_loaded = 1;
+	} else if (strcmp(data_source, "PATTERN") == 0) {
+		if (!len || !pattern || !pattern[0])
+			script_die("Usage: PATTERN [<len>] <pattern>");
+		*data_size = atoi(len);
+		*data = script_payload(s, *data_size);
+		fill_pattern(*data, *data_size, pattern);
+		(*data)[*data_size] = '\0';
+	} else if (strcmp(data_source, "RANDOM") == 0) {
+		if (!len)
+			script_die("Usage: RANDOM [<len>]");
+		*data_size = atoi(len);
+		*data = script_payload(s, *data_size);
+		fill_random(s, *data, *data_size);
+		(*data)[*data_size] = '\0';
+	} else {
+		script_die("Invalid data description");
+	}
 
-			printf("DELETE successful.\n");
+	if (!*data || *data_size < 0)
+		script_die("Could not find data");
+}
 
-		} else if (strcmp(command, "OPEN") == 0) {
-			fs_filename = command_args[1];
+/* Dump the runtime statistics of libfs, one key=value per line */
+static void print_stats(void)
+{
+	struct fs_stats st;
 
-			fs_fd = fs_open(fs_filename);
+	if (fs_get_stats(&st))
+		die("Cannot get stats");
 
-			if (fs_fd < 0) {
-				fs_umount();
-				die("Cannot open file");
-			}
+	printf("FS Stats:\n");
+	for (int op = 0; op < FS_TRACE_OP_COUNT; op++) {
+		const char *name = fs_trace_op_name(op);
 
-			printf("OPEN successful.\n");
+		printf("op_%s_calls=%lu\n", name, (unsigned long)st.ops[op].calls);
+		printf("op_%s_errors=%lu\n", name, (unsigned long)st.ops[op].errors);
+		printf("op_%s_total_ns=%lu\n", name, (unsigned long)st.ops[op].total_ns);
+		printf("op_%s_max_ns=%lu\n", name, (unsigned long)st.ops[op].max_ns);
+	}
 
-		} else if (strcmp(command, "CLOSE") == 0) {
-			if (fs_close(fs_fd)) {
-				fs_umount();
-				die("Cannot close file");
-			}
+#define PRINT_STAT(field) printf(#field "=%lu\n", (unsigned long)st.field)
+	PRINT_STAT(bytes_read_requested);
+	PRINT_STAT(bytes_read);
+	PRINT_STAT(bytes_write_requested);
+	PRINT_STAT(bytes_written);
+	PRINT_STAT(blocks_read);
+	PRINT_STAT(blocks_written);
+	PRINT_STAT(superblock_flushes);
+	PRINT_STAT(rootdir_flushes);
+	PRINT_STAT(fat_flushes);
+	PRINT_STAT(fat_blocks_flushed);
+	PRINT_STAT(meta_table_flushes);
+	PRINT_STAT(alloc_searches);
+	PRINT_STAT(alloc_scan_steps);
+	PRINT_STAT(chain_walk_steps);
+	PRINT_STAT(extent_search_steps);
+	PRINT_STAT(defrag_files_moved);
+	PRINT_STAT(defrag_blocks_moved);
+	PRINT_STAT(log_blocks_redirected);
+	PRINT_STAT(log_checkpoints);
+	PRINT_STAT(log_segments_cleaned);
+	PRINT_STAT(log_blocks_moved);
+	PRINT_STAT(shared_blocks_copied);
+	PRINT_STAT(blocks_deduplicated);
+	PRINT_STAT(dedup_mismatches);
+	PRINT_STAT(chunks_compressed);
+	PRINT_STAT(chunks_uncompressed);
+	PRINT_STAT(chunk_cache_hits);
+	PRINT_STAT(chunk_cache_misses);
+	PRINT_STAT(fat_pages_loaded);
+	PRINT_STAT(fat_pages_evicted);
+	PRINT_STAT(checksum_failures);
+	PRINT_STAT(blocks_scrubbed);
+#undef PRINT_STAT
+
+	printf("write_amplification=%.3f\n", st.bytes_written ?
+		   (double)st.blocks_written * BLOCK_SIZE / st.bytes_written : 0);
+}
 
-			printf("CLOSE successful.\n");
+/* Execute one script line, return the index of the next line to run */
+static size_t script_exec(struct script *s, char *diskname, size_t pc)
+{
+	char line_buffer[SCRIPT_LINE_MAX];
+	const int total_command_parts = 4;
+	char *command_args[total_command_parts + 1];
+	char *command, *fs_filename, *data;
+	int count, data_size;
+	char file_loaded;
+	char *read_buf;
+	struct script_fd *sfd;
+
+	/* Tokenize a copy of the line, since loops run it again */
+	strcpy(line_buffer, s->lines[pc]);
+	memset(command_args, 0, sizeof(command_args));
+	command_args[0] = strtok(line_buffer, "\t");
+	for (int i = 1; i < total_command_parts && command_args[i - 1]; i++)
+		command_args[i] = strtok(NULL, "\t");
+	command = command_args[0];
+
+	/* Skip blank lines and comments */
+	if (!command || command[0] == '#')
+		return pc + 1;
+
+	if (strcmp(command, "MOUNT") == 0) {
+		if (fs_mount(diskname))
+			die("Cannot mount disk");
+		else {
+			script_print(s, "MOUNT successful.\n");
+			s->mounted = 1;
+		}
 
-		} else if (strcmp(command, "SEEK") == 0) {
-			offset = atoi(command_args[1]);
+	} else if (strcmp(command, "UMOUNT") == 0) {
+		if (s->mounted && fs_umount())
+			die("Cannot unmount");
+		else {
+			script_print(s, "UMOUNT successful.\n");
+			s->mounted = 0;
+		}
 
-			if (fs_lseek(fs_fd, offset)) {
-				fs_umount();
-				die("Cannot seek to position");
-			} else {
-				printf("SEEK successful.\n");
-			}
+	} else if (strcmp(command, "CREATE") == 0) {
+		fs_filename = command_args[1];
 
-		} else if (strcmp(command, "WRITE") == 0) {
-			data_source = command_args[1];
-			data_description = command_args[2];
-
-			if (strcmp(data_source, "DATA") == 0) {
-				data = data_description;
-				data_size = strlen(data);
-			} else if (strcmp(data_source, "FILE") == 0) {
-				data_fd = open(data_description, O_RDONLY);
-				if (data_fd < 0) {
-					fs_umount();
-					die_perror("open");
-				}
-				if (fstat(data_fd, &st)) {
-					fs_umount();
-					die_perror("fstat");
-				}
-				if (!S_ISREG(st.st_mode)) {
-					fs_umount();
-					die("Not a regular file: %s\n", data_description);
-				}
-				data_size = st.st_size;
-				data = mmap(NULL, data_size, PROT_READ, MAP_PRIVATE, data_fd, 0);
-			} else {
-				data = NULL;
-				data_size = 0;
-			}
+		if (fs_create(fs_filename))
+			script_die("Cannot create file");
 
-			if (!data) {
-				fs_umount();
-				die_perror("Could not find data to write");
-			}
+		script_print(s, "CREATE successful.\n");
 
-			count = fs_write(fs_fd, data, data_size);
-			if (count < 0) {
-				fs_umount();
-				die("write error");
-			}
-			printf("Wrote %d bytes to file.\n", count);
-
-		} else if (strcmp(command, "READ") == 0) {
-			int read_req_length = atoi(command_args[1]);
-			data_source = command_args[2];
-			data_description = command_args[3];
-
-			char file_loaded = 0;
-
-			if (strcmp(data_source, "DATA") == 0) {
-				data = data_description;
-				data_size = strlen(data);
-			} else if (strcmp(data_source, "FILE") == 0) {
-				data_fd = open(data_description, O_RDONLY);
-				if (data_fd < 0) {
-					fs_umount();
-					die_perror("open");
-				}
-				if (fstat(data_fd, &st)) {
-					fs_umount();
-					die_perror("fstat");
-				}
-				if (!S_ISREG(st.st_mode)) {
-					fs_umount();
-					die("Not a regular file: %s\n", data_description);
-				}
-
-				FILE *data_file = fopen(data_description, "r");
-				data_size = st.st_size;
-				data = calloc(data_size+1, sizeof(char));
-				size_t n = fread (data, sizeof(char), data_size, data_file);
-				assert(n == sizeof(char) * data_size);
-				fclose(data_file);
-				file_loaded = 1;
-			} else {
-				fs_umount();
-				die("Invalid data description");
-			}
+	} else if (strcmp(command, "DELETE") == 0) {
+		fs_filename = command_args[1];
 
-			if (!data) {
-				fs_umount();
-				die_perror("Could not find data to write");
-			}
+		if (fs_delete(fs_filename))
+			script_die("Cannot delete file");
 
-			if (read_req_length < 0) {
-				fs_umount();
-				die("invalid data read length");
-			}
+		script_print(s, "DELETE successful.\n");
 
-			read_buf = calloc(read_req_length+1, sizeof(char));
-			count = fs_read(fs_fd, read_buf, read_req_length);
+	} else if (strcmp(command, "OPEN") == 0) {
+		fs_filename = command_args[1];
+		const char *name = command_args[2] ? command_args[2] : "";
 
-			if (count < 0) {
-				fs_umount();
-				die("read error");
-			}
+		if (script_fd_find(s, name))
+			script_die("Descriptor '%s' already open", name);
+
+		sfd = script_fd_find(s, NULL);
+		if (!sfd)
+			script_die("Too many open descriptors");
+
+		sfd->fd = fs_open(fs_filename);
+		if (sfd->fd < 0)
+			script_die("Cannot open file");
+		snprintf(sfd->name, sizeof(sfd->name), "%s", name);
+		s->cur_fd = sfd->fd;
+
+		script_print(s, "OPEN successful.\n");
+
+	} else if (strcmp(command, "USE") == 0) {
+		sfd = script_fd_find(s, command_args[1] ? command_args[1] : "");
+		if (!sfd)
+			script_die("No descriptor named '%s'", command_args[1]);
+		s->cur_fd = sfd->fd;
+
+	} else if (strcmp(command, "CLOSE") == 0) {
+		/* Without a name, close the current descriptor */
+		if (command_args[1]) {
+			sfd = script_fd_find(s, command_args[1]);
+		} else {
+			sfd = NULL;
+			for (int i = 0; i < FS_OPEN_MAX_COUNT && !sfd; i++)
+				if (s->fds[i].fd >= 0 && s->fds[i].fd == s->cur_fd)
+					sfd = &s->fds[i];
+		}
+
+		if (fs_close(sfd ? sfd->fd : s->cur_fd))
+			script_die("Cannot close file");
+		if (sfd) {
+			if (sfd->fd == s->cur_fd)
+				s->cur_fd = -1;
+			sfd->fd = -1;
+		}
+
+		script_print(s, "CLOSE successful.\n");
+
+	} else if (strcmp(command, "SEEK") == 0) {
+		int offset = atoi(command_args[1]);
 
-			// both data and read_buf were allocated with an extra zero byte
-			// +1 here to check for the canaries
-			if (memcmp(data, read_buf, data_size+1) == 0)
-				printf("Read %d bytes from file. Compared %d correct.\n", count, data_size);
-			else
-				printf("Read unexpected data! %s read vs given %s\n", read_buf, data);
+		if (fs_lseek(s->cur_fd, offset))
+			script_die("Cannot seek to position");
+		else
+			script_print(s, "SEEK successful.\n");
 
-			free(read_buf);
-			if(file_loaded){
-				free(data);
+	} else if (strcmp(command, "WRITE") == 0) {
+		script_data(s, &command_args[1], NULL, &data, &data_size, &file_loaded);
+
+		count = fs_write(s->cur_fd, data, data_size);
+		if (count < 0)
+			script_die("write error");
+		s->bytes_written += count;
+		script_print(s, "Wrote %d bytes to file.\n", count);
+
+		if (file_loaded)
+			free(data);
+
+	} else if (strcmp(command, "READ") == 0) {
+		int read_req_length = atoi(command_args[1]);
+
+		if (read_req_length < 0)
+			script_die("invalid data read length");
+
+		/* Without verification the expected data can be omitted */
+		if (s->verify || command_args[2])
+			script_data(s, &command_args[2], command_args[1], &data, &data_size, &file_loaded);
+
+		read_buf = calloc(read_req_length+1, sizeof(char));
+		count = fs_read(s->cur_fd, read_buf, read_req_length);
+
+		if (count < 0)
+			script_die("read error");
+		s->bytes_read += count;
+
+		// both data and read_buf were allocated with an extra zero byte
+		// +1 here to check for the canaries
+		if (!s->verify)
+			script_print(s, "Read %d bytes from file.\n", count);
+		else if (memcmp(data, read_buf, data_size+1) == 0)
+			script_print(s, "Read %d bytes from file. Compared %d correct.\n", count, data_size);
+		else
+			printf("Read unexpected data! %s read vs given %s\n", read_buf, data);
+
+		free(read_buf);
+		if (file_loaded)
+			free(data);
+
+	} else if (strcmp(command, "LOOP") == 0) {
+		long times = command_args[1] ? atol(command_args[1]) : 0;
+
+		if (s->num_loops == SCRIPT_LOOP_MAX)
+			script_die("LOOP nested too deep");
+
+		/* Skip the body of a loop that runs zero times */
+		if (times <= 0) {
+			int depth = 0;
+			for (pc++; pc < s->num_lines; pc++) {
+				if (!strncmp(s->lines[pc], "LOOP", 4))
+					depth++;
+				else if (!strcmp(s->lines[pc], "END") && depth-- == 0)
+					break;
 			}
+			return pc + 1;
 		}
+
+		s->loops[s->num_loops++] = (struct script_loop){ .start = pc + 1, .remaining = times };
+
+	} else if (strcmp(command, "END") == 0) {
+		if (!s->num_loops)
+			script_die("END without LOOP");
+
+		struct script_loop *loop = &s->loops[s->num_loops - 1];
+		if (--loop->remaining > 0)
+			return loop->start;
+		s->num_loops--;
+
+	} else if (strcmp(command, "SEED") == 0) {
+		s->seed = command_args[1] ? strtoull(command_args[1], NULL, 0) : 0;
+		if (!s->seed)
+			s->seed = 1;
+
+	} else if (strcmp(command, "VERIFY") == 0) {
+		s->verify = !command_args[1] || strcmp(command_args[1], "OFF");
+
+	} else if (strcmp(command, "QUIET") == 0) {
+		s->quiet = !command_args[1] || strcmp(command_args[1], "OFF");
+
+	} else if (strcmp(command, "TIME") == 0) {
+		snprintf(s->section, sizeof(s->section), "%s", command_args[1] ? command_args[1] : "");
+		s->bytes_read = 0;
+		s->bytes_written = 0;
+		clock_gettime(CLOCK_MONOTONIC, &s->section_start);
+
+	} else if (strcmp(command, "REPORT") == 0) {
+		double ms = elapsed_ms(&s->section_start);
+		size_t bytes = s->bytes_read + s->bytes_written;
+
+		printf("REPORT %s: %.3f ms, %zu bytes read, %zu bytes written, %.2f MB/s\n",
+			   s->section, ms, s->bytes_read, s->bytes_written,
+			   ms > 0 ? bytes / ms / 1e3 : 0);
+
+	} else if (strcmp(command, "STATS") == 0) {
+		if (command_args[1] && !strcmp(command_args[1], "RESET"))
+			fs_reset_stats();
+		else
+			print_stats();
+
+	} else {
+		script_die("Unknown command '%s'", command);
 	}
 
+	return pc + 1;
+}
+
+void thread_fs_script(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct script s = {
+		.cur_fd = -1,
+		.seed = 150,
+		.verify = 1,
+	};
+	char *diskname, *script;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <script filename>");
+
+	diskname = t_arg->argv[0];
+	script = t_arg->argv[1];
+
+	for (int i = 0; i < FS_OPEN_MAX_COUNT; i++)
+		s.fds[i].fd = -1;
+
+	script_load(&s, script);
+
+	/* The whole run is the default TIME section */
+	clock_gettime(CLOCK_MONOTONIC, &s.section_start);
+
+	/* Execute the commands, loops jump back to their start */
+	for (size_t pc = 0; pc < s.num_lines; )
+		pc = script_exec(&s, diskname, pc);
+
 	/* unmount at the end just to be safe in case there is
 	   no UMOUNT command in script */
-	if (mounted && fs_umount())
+	if (s.mounted && fs_umount())
 		die("Cannot unmount diskname");
 
-	fclose(fd_script);
+	for (size_t i = 0; i < s.num_lines; i++)
+		free(s.lines[i]);
+	free(s.lines);
+	free(s.payload);
+}
+
+void thread_fs_stats(void *arg)
+{
+	/* Run the script, then dump what it cost */
+	thread_fs_script(arg);
+	print_stats();
+}
+
+/* Dump the block I/O latency histograms and access heatmap of the disk */
+static void print_disk_stats(void)
+{
+	static const char *regions[BLOCK_REGION_COUNT] = {
+		[BLOCK_REGION_SUPERBLOCK] = "superblock",
+		[BLOCK_REGION_FAT] = "fat",
+		[BLOCK_REGION_ROOT] = "root",
+		[BLOCK_REGION_DATA] = "data",
+	};
+	const int heatmap_rows = 32;
+	struct block_disk_stats st;
+	uint64_t *counts, max_row = 0;
+	int bcount;
+
+	block_disk_get_stats(&st);
+
+	/* Histograms, one line per non-empty bucket */
+	printf("Disk Stats:\n");
+	for (int r = 0; r < BLOCK_REGION_COUNT; r++) {
+		for (int b = 0; b < BLOCK_LATENCY_BUCKETS; b++) {
+			if (st.read[r][b])
+				printf("read_%s_%luns=%lu\n", regions[r], 1UL << b, (unsigned long)st.read[r][b]);
+		}
+		for (int b = 0; b < BLOCK_LATENCY_BUCKETS; b++) {
+			if (st.write[r][b])
+				printf("write_%s_%luns=%lu\n", regions[r], 1UL << b, (unsigned long)st.write[r][b]);
+		}
+	}
+
+	bcount = block_disk_heatmap(NULL, 0);
+	if (bcount <= 0)
+		die("No disk statistics");
+	counts = malloc(bcount * sizeof(uint64_t));
+	if (!counts)
+		die_perror("malloc");
+	block_disk_heatmap(counts, bcount);
+
+	/* Heatmap, accesses summed over ranges of blocks */
+	int per_row = (bcount + heatmap_rows - 1) / heatmap_rows;
+	uint64_t rows[heatmap_rows];
+
+	memset(rows, 0, sizeof(rows));
+	for (int i = 0; i < bcount; i++)
+		rows[i / per_row] += counts[i];
+	for (int i = 0; i < heatmap_rows; i++)
+		if (rows[i] > max_row)
+			max_row = rows[i];
+
+	printf("Heatmap (%d blocks per row):\n", per_row);
+	for (int i = 0; i < heatmap_rows && i * per_row < bcount; i++) {
+		int first = i * per_row;
+		int last = first + per_row - 1 < bcount - 1 ? first + per_row - 1 : bcount - 1;
+		int bar = max_row ? (int)(rows[i] * 50 / max_row) : 0;
+
+		printf("%6d-%-6d %10lu |%.*s\n", first, last, (unsigned long)rows[i], bar,
+			   "##################################################");
+	}
+
+	/* Hottest single blocks */
+	printf("Hottest blocks:\n");
+	for (int n = 0; n < 8; n++) {
+		int hottest = 0;
+
+		for (int i = 1; i < bcount; i++)
+			if (counts[i] > counts[hottest])
+				hottest = i;
+		if (!counts[hottest])
+			break;
+
+		printf("block %d: %lu accesses\n", hottest, (unsigned long)counts[hottest]);
+		counts[hottest] = 0;
+	}
+
+	free(counts);
+}
+
+void thread_fs_iostats(void *arg)
+{
+	/* Run the script, then dump the disk accesses it made */
+	thread_fs_script(arg);
+	print_disk_stats();
 }
 
 void thread_fs_stat(void *arg)
@@ -274,7 +652,7 @@ void thread_fs_stat(void *arg)
 	struct thread_arg *t_arg = arg;
 	char *diskname, *filename;
 	int fs_fd;
-	int stat;
+	int64_t stat;
 
 	if (t_arg->argc < 2)
 		die("need <diskname> <filename>");
@@ -291,7 +669,7 @@ void thread_fs_stat(void *arg)
 		die("Cannot open file");
 	}
 
-	stat = fs_stat(fs_fd);
+	stat = fs_stat64(fs_fd);
 	if (stat < 0) {
 		fs_close(fs_fd);
 		fs_umount();
@@ -313,7 +691,7 @@ void thread_fs_stat(void *arg)
 	if (fs_umount())
 		die("cannot unmount diskname");
 
-	printf("Size of file '%s' is %d bytes\n", filename, stat);
+	printf("Size of file '%s' is %" PRId64 " bytes\n", filename, stat);
 }
 
 void thread_fs_cat(void *arg)
@@ -321,7 +699,8 @@ void thread_fs_cat(void *arg)
 	struct thread_arg *t_arg = arg;
 	char *diskname, *filename, *buf;
 	int fs_fd;
-	int stat, read;
+	int64_t stat;
+	ssize_t read;
 
 	if (t_arg->argc < 2)
 		die("need <diskname> <filename>");
@@ -338,7 +717,7 @@ void thread_fs_cat(void *arg)
 		die("Cannot open file");
 	}
 
-	stat = fs_stat(fs_fd);
+	stat = fs_stat64(fs_fd);
 	if (stat < 0) {
 		fs_umount();
 		die("Cannot stat file");
@@ -365,7 +744,7 @@ void thread_fs_cat(void *arg)
 	if (fs_umount())
 		die("cannot unmount diskname");
 
-	printf("Read file '%s' (%d/%d bytes)\n", filename, read, stat);
+	printf("Read file '%s' (%zd/%" PRId64 " bytes)\n", filename, read, stat);
 	printf("Content of the file:\n");
 	fwrite(buf, 1, stat, stdout);
 	fflush(stdout);
@@ -398,13 +777,64 @@ void thread_fs_rm(void *arg)
 	printf("Removed file '%s'\n", filename);
 }
 
+void thread_fs_clone(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *src_filename, *dst_filename;
+
+	if (t_arg->argc < 3)
+		die("need <diskname> <source filename> <new filename>");
+
+	diskname = t_arg->argv[0];
+	src_filename = t_arg->argv[1];
+	dst_filename = t_arg->argv[2];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_clone(src_filename, dst_filename)) {
+		fs_umount();
+		die("Cannot clone file (not an extent disk?)");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Cloned file '%s' to '%s'\n", src_filename, dst_filename);
+}
+
+void thread_fs_snapshot(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *name;
+
+	if (t_arg->argc < 2)
+		die("need <diskname> <snapshot name>");
+
+	diskname = t_arg->argv[0];
+	name = t_arg->argv[1];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_snapshot_create(name)) {
+		fs_umount();
+		die("Cannot create snapshot (not an extent disk?)");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Created snapshot '%s'\n", name);
+}
+
 void thread_fs_add(void *arg)
 {
 	struct thread_arg *t_arg = arg;
 	char *diskname, *filename, *buf;
 	int fd, fs_fd;
 	struct stat st;
-	int written;
+	ssize_t written;
 
 	if (t_arg->argc < 2)
 		die("Usage: <diskname> <host filename>");
@@ -454,7 +884,7 @@ void thread_fs_add(void *arg)
 	if (fs_umount())
 		die("Cannot unmount diskname");
 
-	printf("Wrote file '%s' (%d/%zu bytes)\n", filename, written,
+	printf("Wrote file '%s' (%zd/%zu bytes)\n", filename, written,
 		   st.st_size);
 
 	munmap(buf, st.st_size);
@@ -507,6 +937,83 @@ size_t get_argv(char *argv)
 	return (size_t)ret;
 }
 
+static void print_frag(const char *when)
+{
+	struct fs_frag frag;
+
+	if (fs_fragmentation(&frag))
+		die("Cannot measure fragmentation");
+
+	printf("%s: %u/%u files fragmented, %u blocks in %u extents (%.2f per file), "
+		   "%u free blocks in %u extents (largest %u)\n", when,
+		   frag.fragmented_files, frag.files, frag.blocks, frag.extents,
+		   frag.files ? (double)frag.extents / frag.files : 0,
+		   frag.free_blocks, frag.free_extents, frag.largest_free_extent);
+}
+
+void thread_fs_defrag(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+	size_t max_blocks = 0;
+	unsigned int max_us = 0;
+	int passes = 0, ret;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [<max blocks per step> [<max us per step>]]");
+
+	diskname = t_arg->argv[0];
+	if (t_arg->argc > 1)
+		max_blocks = get_argv(t_arg->argv[1]);
+	if (t_arg->argc > 2)
+		max_us = get_argv(t_arg->argv[2]);
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	print_frag("Before");
+
+	/* Run in budgeted steps, as a background task on a live FS would */
+	do {
+		ret = fs_defrag(max_blocks, max_us);
+		if (ret == -1)
+			die("Cannot defragment diskname");
+		passes++;
+	} while (ret == 1);
+
+	print_frag("After");
+	printf("Defragmented in %d step(s)\n", passes);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+void thread_fs_clean(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+	size_t max_segments = 0;
+	int ret;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [<max segments>]");
+
+	diskname = t_arg->argv[0];
+	if (t_arg->argc > 1)
+		max_segments = get_argv(t_arg->argv[1]);
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	ret = fs_clean(max_segments);
+	if (ret == -1)
+		die("Cannot clean diskname (not log-structured?)");
+	printf("Cleaned %d segment(s)\n", ret);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
 static struct {
 	const char *name;
 	void(*func)(void *);
@@ -515,9 +1022,15 @@ static struct {
 	{ "ls",		thread_fs_ls },
 	{ "add",	thread_fs_add },
 	{ "rm",		thread_fs_rm },
+	{ "clone",	thread_fs_clone },
+	{ "snapshot",	thread_fs_snapshot },
 	{ "cat",	thread_fs_cat },
 	{ "stat",	thread_fs_stat },
-	{ "script",	thread_fs_script }
+	{ "script",	thread_fs_script },
+	{ "stats",	thread_fs_stats },
+	{ "iostats",	thread_fs_iostats },
+	{ "defrag",	thread_fs_defrag },
+	{ "clean",	thread_fs_clean }
 };
 
 void usage(char *program)
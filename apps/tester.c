@@ -1,8 +1,11 @@
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
+#include <disk.h>
 #include <fs.h>
 
 #define DISKNAME "test_disk.fs"
@@ -93,6 +96,7 @@ void simple_test_everythig()
 	ASSERT(ret == strlen(data), "fs_stat 2");
 
 	/* Read some data */
+	fs_lseek(fd, 0);
 	ret = fs_read(fd, read_buf, 10);
 	ASSERT(ret == 10, "fs_read ret");
 	ASSERT(!strncmp(read_buf, data, 10), "fs_read data");
@@ -370,7 +374,8 @@ void write_and_read_big_files()
 	ASSERT(ret == sizeof(data), "write all 6000 integers");
 	ASSERT(fs_stat(fd) == 24000, "fs_stat is 24000 bytes");
 
-	/* read from empty file */
+	/* read back from the start */
+	fs_lseek(fd, 0);
 	ret = fs_read(fd, read_buf, fs_stat(fd));
 	ASSERT(ret == fs_stat(fd), "read all bytes");
 	// for (int i = 0; i < 6000; i++) {
@@ -418,7 +423,8 @@ void read_write_basic(){
 	ret = fs_write(fd, buf, sizeof(buf));
 	ASSERT(ret == 6000, "wrote 6000 bytes");
 
-    /* read file 17 bytes at a time */
+    /* read file 170 bytes at a time */
+	fs_lseek(fd, 0);
 	count = 0;
 	while(count < 6500){
 		ret = fs_read(fd, read_buf + count, 170);
@@ -430,6 +436,1967 @@ void read_write_basic(){
 		if (buf[i] != read_buf[i])
 			printf("(%d, %d)\n", buf[i], read_buf[i]);
 	}
+
+	fs_umount();
+}
+
+void tail_packing()
+{
+	char data[3100];
+	char read_buf[3100];
+	char filename[FS_FILENAME_LEN];
+	int fd;
+	int ret;
+	for (int i = 0; i < 3100; i++) data[i] = 'a' + i % 26;
+    fprintf(stderr, "%s", color("\n------TESTING tail_packing------\n", 33));
+
+    /* Reset disk file */
+	reset_disk(DISKNAME, DATA_BLOCK_COUNT);
+
+	ret = fs_mount(DISKNAME);
+	ASSERT(!ret, "fs_mount");
+
+	ret = fs_tailpack(1);
+	ASSERT(ret == 0, "fs_tailpack enable");
+
+    /* more small files than there are data blocks */
+	for (int i = 0; i < 60; i++) {
+		sprintf(filename, "small%d", i);
+		fs_create(filename);
+		fd = fs_open(filename);
+		ret = fs_write(fd, data + i, 100 + i);
+		ASSERT(ret == 100 + i, NULL);
+		fs_close(fd);
+	}
+	ASSERT(1, "wrote 60 small files on a 50 block disk");
+
+	fs_umount();
+	ret = fs_mount(DISKNAME);
+	ASSERT(!ret, "fs_mount (persistant)");
+
+	for (int i = 0; i < 60; i++) {
+		sprintf(filename, "small%d", i);
+		fd = fs_open(filename);
+		ret = fs_read(fd, read_buf, sizeof(read_buf));
+		ASSERT(ret == 100 + i && !memcmp(read_buf, data + i, ret), NULL);
+		fs_close(fd);
+	}
+	ASSERT(1, "read back 60 small files");
+
+    /* grow a packed file in place, then past the packing limit */
+	fd = fs_open("small7");
+	fs_lseek(fd, fs_stat(fd));
+	ret = fs_write(fd, data + 7 + 107, 500);
+	ASSERT(ret == 500, "fs_write grow packed file");
+	ret = fs_write(fd, data + 7 + 607, 2393);
+	ASSERT(ret == 2393, "fs_write promote packed file");
+	ASSERT(fs_stat(fd) == 3000, "fs_stat promoted file");
+
+	fs_lseek(fd, 0);
+	ret = fs_read(fd, read_buf, sizeof(read_buf));
+	ASSERT(ret == 3000 && !memcmp(read_buf, data + 7, ret), "fs_read promoted file");
+	fs_close(fd);
+
+	ret = fs_delete("small8");
+	ASSERT(ret == 0, "fs_delete packed file");
+
+	fs_umount();
+    fprintf(stderr, "%s", green("...PASSED THE WHOLE TEST!\n"));
+}
+
+void sparse_files()
+{
+	const char *filename = "sparse";
+	char data[10] = "0123456789";
+	char read_buf[6 * 4096];
+	char zeros[4096] = {0};
+	int fd;
+	int ret;
+    fprintf(stderr, "%s", color("\n------TESTING sparse_files------\n", 33));
+
+    /* Reset disk file */
+	reset_disk(DISKNAME, DATA_BLOCK_COUNT);
+
+	ret = fs_mount(DISKNAME);
+	ASSERT(!ret, "fs_mount");
+	fs_create(filename);
+	fd = fs_open(filename);
+
+    /* seek past the end of the file and write there */
+	ret = fs_lseek(fd, 5 * 4096 + 100);
+	ASSERT(ret == 0, "fs_lseek past EOF");
+	ret = fs_write(fd, data, 10);
+	ASSERT(ret == 10, "fs_write past EOF");
+	ASSERT(fs_stat(fd) == 5 * 4096 + 110, "fs_stat sparse file");
+
+	ASSERT(fs_seek_data(fd, 0) == 5 * 4096, "fs_seek_data skips hole");
+	ASSERT(fs_seek_hole(fd, 0) == 0, "fs_seek_hole at hole");
+	ASSERT(fs_seek_hole(fd, 5 * 4096) == 5 * 4096 + 110, "fs_seek_hole at EOF");
+	ASSERT(fs_seek_data(fd, 5 * 4096 + 110) == -1, "fs_seek_data past EOF");
+
+    /* fill part of the hole */
+	fs_lseek(fd, 2 * 4096 + 5);
+	ret = fs_write(fd, data, 10);
+	ASSERT(ret == 10, "fs_write inside hole");
+	ASSERT(fs_seek_hole(fd, 2 * 4096) == 3 * 4096, "fs_seek_hole after filled block");
+
+	fs_close(fd);
+	fs_umount();
+	ret = fs_mount(DISKNAME);
+	ASSERT(!ret, "fs_mount (persistant)");
+	fd = fs_open(filename);
+
+	ret = fs_read(fd, read_buf, sizeof(read_buf));
+	ASSERT(ret == 5 * 4096 + 110, "fs_read sparse file");
+	ASSERT(!memcmp(read_buf, zeros, 4096), "hole reads back as zeros");
+	ASSERT(!memcmp(read_buf + 2 * 4096 + 5, data, 10), "data inside filled hole");
+	ASSERT(!memcmp(read_buf + 5 * 4096 + 100, data, 10), "data after hole");
+	ASSERT(!memcmp(read_buf + 4 * 4096, zeros, 4096), "second hole reads back as zeros");
+	ASSERT(fs_seek_data(fd, 3 * 4096) == 5 * 4096, "fs_seek_data (persistant)");
+
+	fs_close(fd);
+	ret = fs_delete(filename);
+	ASSERT(ret == 0, "fs_delete sparse file");
+
+	fs_umount();
+    fprintf(stderr, "%s", green("...PASSED THE WHOLE TEST!\n"));
+}
+
+void truncate_files()
+{
+	static char data[47 * 4096];
+	static char read_buf[47 * 4096];
+	char zeros[4096] = {0};
+	int fd;
+	int ret;
+	for (int i = 0; i < sizeof(data); i++) data[i] = i % 251;
+    fprintf(stderr, "%s", color("\n------TESTING truncate_files------\n", 33));
+
+    /* Reset disk file */
+	reset_disk(DISKNAME, DATA_BLOCK_COUNT);
+
+    /* Truncate before mounting */
+	ret = fs_truncate("myfile", 0);
+	ASSERT(ret == -1, "fs_truncate before mounting");
+
+	ret = fs_mount(DISKNAME);
+	ASSERT(!ret, "fs_mount");
+
+	ret = fs_truncate("myfile", 0);
+	ASSERT(ret == -1, "fs_truncate non existant");
+
+	fs_create("myfile");
+	fd = fs_open("myfile");
+	ret = fs_write(fd, data, 10 * 4096);
+	ASSERT(ret == 10 * 4096, "fs_write 10 blocks");
+
+    /* shrink to a bit more than one block */
+	ret = fs_ftruncate(fd, 5000);
+	ASSERT(ret == 0, "fs_ftruncate shrink");
+	ASSERT(fs_stat(fd) == 5000, "fs_stat after shrink");
+
+    /* grow again, the new range must read back as zeros */
+	ret = fs_truncate("myfile", 8192);
+	ASSERT(ret == 0, "fs_truncate grow");
+	fs_lseek(fd, 0);
+	ret = fs_read(fd, read_buf, sizeof(read_buf));
+	ASSERT(ret == 8192, "fs_read after grow");
+	ASSERT(!memcmp(read_buf, data, 5000), "fs_read kept data");
+	ASSERT(!memcmp(read_buf + 5000, zeros, 8192 - 5000), "fs_read zeros after old end");
+	fs_close(fd);
+
+    /* released blocks can be used by another file */
+	fs_create("other");
+	fd = fs_open("other");
+	ret = fs_write(fd, data, 47 * 4096);
+	ASSERT(ret == 47 * 4096, "fs_write into released blocks");
+	fs_close(fd);
+
+	fs_umount();
+	ret = fs_mount(DISKNAME);
+	ASSERT(!ret, "fs_mount (persistant)");
+
+	fd = fs_open("other");
+	ret = fs_read(fd, read_buf, sizeof(read_buf));
+	ASSERT(ret == 47 * 4096 && !memcmp(read_buf, data, ret), "fs_read other file (persistant)");
+	fs_close(fd);
+
+	ret = fs_truncate("other", 0);
+	ASSERT(ret == 0, "fs_truncate to zero");
+	fd = fs_open("other");
+	ASSERT(fs_stat(fd) == 0, "fs_stat after truncate to zero");
+	fs_close(fd);
+
+    /* growing a packed file moves it to a regular block, it must not take the slots of the next one */
+	fs_tailpack(1);
+	fs_create("packed");
+	fs_create("next");
+	fd = fs_open("packed");
+	fs_write(fd, data, 100);
+	fs_close(fd);
+	fd = fs_open("next");
+	fs_write(fd, data + 1000, 100);
+	fs_close(fd);
+	fd = fs_open("packed");
+	ret = fs_ftruncate(fd, 2000);
+	ASSERT(ret == 0 && fs_stat(fd) == 2000, "fs_ftruncate grow packed file");
+	ret = fs_read(fd, read_buf, sizeof(read_buf));
+	ASSERT(ret == 2000 && !memcmp(read_buf, data, 100) && !memcmp(read_buf + 100, zeros, 2000 - 100),
+		   "fs_read grown packed file");
+	fs_close(fd);
+	fd = fs_open("next");
+	ret = fs_read(fd, read_buf, sizeof(read_buf));
+	ASSERT(ret == 100 && !memcmp(read_buf, data + 1000, 100), "fs_read packed file after its neighbour grew");
+	fs_close(fd);
+	fs_tailpack(0);
+
+	fs_umount();
+    fprintf(stderr, "%s", green("...PASSED THE WHOLE TEST!\n"));
+}
+
+#define APPEND_RECORD 100
+#define APPEND_COUNT 500
+
+void *append_records(void *arg)
+{
+	char record[APPEND_RECORD];
+	int fd = fs_open_flags("log", FS_O_APPEND);
+
+	memset(record, *(char *) arg, APPEND_RECORD);
+	for (int i = 0; i < APPEND_COUNT; i++) {
+		if (fs_write(fd, record, APPEND_RECORD) != APPEND_RECORD)
+			break;
+	}
+
+	fs_close(fd);
+	return NULL;
+}
+
+void append_mode()
+{
+	static char read_buf[3 * APPEND_RECORD * APPEND_COUNT];
+	char ids[2] = {'a', 'b'};
+	pthread_t threads[2];
+	int fd;
+	int ret;
+	int counts[3] = {0};
+    fprintf(stderr, "%s", color("\n------TESTING append_mode------\n", 33));
+
+    /* Reset disk file */
+	reset_disk(DISKNAME, DATA_BLOCK_COUNT);
+
+	ret = fs_mount(DISKNAME);
+	ASSERT(!ret, "fs_mount");
+	fs_create("log");
+
+    /* two threads appending to the same file */
+	for (int i = 0; i < 2; i++)
+		pthread_create(&threads[i], NULL, append_records, &ids[i]);
+	for (int i = 0; i < 2; i++)
+		pthread_join(threads[i], NULL);
+
+	fs_umount();
+	ret = fs_mount(DISKNAME);
+	ASSERT(!ret, "fs_mount (persistant)");
+
+    /* append after remount, offset of a plain lseek is ignored */
+	fd = fs_open_flags("log", FS_O_APPEND);
+	fs_lseek(fd, 0);
+	memset(read_buf, 'c', APPEND_RECORD);
+	ret = fs_write(fd, read_buf, APPEND_RECORD);
+	ASSERT(ret == APPEND_RECORD, "fs_write append after remount");
+	ASSERT(fs_stat(fd) == (2 * APPEND_COUNT + 1) * APPEND_RECORD, "fs_stat all records appended");
+
+    /* records never overlap */
+	fs_lseek(fd, 0);
+	ret = fs_read(fd, read_buf, sizeof(read_buf));
+	ASSERT(ret == (2 * APPEND_COUNT + 1) * APPEND_RECORD, "fs_read all records");
+	for (int i = 0; i < ret; i += APPEND_RECORD) {
+		ASSERT(!memcmp(read_buf + i, read_buf + i + 1, APPEND_RECORD - 1), NULL);
+		counts[read_buf[i] - 'a']++;
+	}
+	ASSERT(counts[0] == APPEND_COUNT && counts[1] == APPEND_COUNT && counts[2] == 1, "records are intact");
+
+	fs_close(fd);
+	fs_umount();
+    fprintf(stderr, "%s", green("...PASSED THE WHOLE TEST!\n"));
+}
+
+void write_buffering()
+{
+	static char data[3 * 4096 + 50];
+	static char read_buf[3 * 4096 + 50];
+	int fd, fd_reader, fd_nobuf;
+	int ret;
+	for (int i = 0; i < sizeof(data); i++) data[i] = 'A' + i % 50;
+    fprintf(stderr, "%s", color("\n------TESTING write_buffering------\n", 33));
+
+    /* Reset disk file */
+	reset_disk(DISKNAME, DATA_BLOCK_COUNT);
+
+	ret = fs_mount(DISKNAME);
+	ASSERT(!ret, "fs_mount");
+	fs_create("buffered");
+	fs_create("unbuffered");
+
+    /* small sequential writes, visible through another descriptor */
+	fd = fs_open("buffered");
+	fd_reader = fs_open("buffered");
+	for (int i = 0; i < 6000; i += 100) {
+		ret = fs_write(fd, data + i, 100);
+		ASSERT(ret == 100, NULL);
+	}
+	ASSERT(fs_stat(fd) == 6000, "fs_stat with buffered data");
+	ret = fs_read(fd_reader, read_buf, sizeof(read_buf));
+	ASSERT(ret == 6000 && !memcmp(read_buf, data, 6000), "fs_read sees buffered data");
+
+    /* keep writing after the flush, then overwrite in the middle */
+	for (int i = 6000; i < sizeof(data); i += 50) {
+		ret = fs_write(fd, data + i, 50);
+		ASSERT(ret == 50, NULL);
+	}
+	fs_lseek(fd, 10);
+	ret = fs_write(fd, "0123456789", 10);
+	ASSERT(ret == 10, "fs_write overwrite after lseek");
+	fs_close(fd);
+
+    /* same workload with buffering disabled */
+	fd_nobuf = fs_open_flags("unbuffered", FS_O_NOBUF);
+	for (int i = 0; i < sizeof(data); i += 50)
+		fs_write(fd_nobuf, data + i, 50);
+	ret = fs_sync();
+	ASSERT(ret == 0, "fs_sync");
+
+	fs_umount();
+	ret = fs_mount(DISKNAME);
+	ASSERT(!ret, "fs_mount (persistant)");
+
+	memcpy(data + 10, "0123456789", 10);
+	fd = fs_open("buffered");
+	ret = fs_read(fd, read_buf, sizeof(read_buf));
+	ASSERT(ret == sizeof(data) && !memcmp(read_buf, data, ret), "fs_read buffered file (persistant)");
+	fs_close(fd);
+
+	memcpy(data + 10, "KLMNOPQRST", 10);
+	fd = fs_open("unbuffered");
+	ret = fs_read(fd, read_buf, sizeof(read_buf));
+	ASSERT(ret == sizeof(data) && !memcmp(read_buf, data, ret), "fs_read unbuffered file (persistant)");
+	fs_close(fd);
+
+	fs_umount();
+    fprintf(stderr, "%s", green("...PASSED THE WHOLE TEST!\n"));
+}
+
+#define TRACENAME "test_trace.bin"
+
+void tracing()
+{
+	struct fs_trace_header header;
+	struct fs_trace_record records[16];
+	char buf[100] = "trace me";
+	int fd, ret;
+	size_t count;
+	FILE *f;
+    fprintf(stderr, "%s", color("\n------TESTING tracing------\n", 33));
+
+    /* Reset disk file */
+	reset_disk(DISKNAME, DATA_BLOCK_COUNT);
+
+	ret = fs_trace_stop();
+	ASSERT(ret == -1, "fs_trace_stop without a trace");
+	ret = fs_trace_start(TRACENAME);
+	ASSERT(!ret, "fs_trace_start");
+	ret = fs_trace_start(TRACENAME);
+	ASSERT(ret == -1, "fs_trace_start twice");
+
+    /* record a short session */
+	fs_mount(DISKNAME);
+	fs_create("traced");
+	fd = fs_open("traced");
+	fs_write(fd, buf, sizeof(buf));
+	fs_lseek(fd, 10);
+	fs_read(fd, buf, sizeof(buf));
+	fs_close(fd);
+	fs_umount();
+
+	ret = fs_trace_stop();
+	ASSERT(!ret, "fs_trace_stop");
+
+    /* read the trace file back */
+	f = fopen(TRACENAME, "rb");
+	ASSERT(f != NULL, NULL);
+	ret = fread(&header, sizeof(header), 1, f);
+	ASSERT(ret == 1 && !memcmp(header.magic, FS_TRACE_MAGIC, 8)
+		   && header.record_size == sizeof(struct fs_trace_record), "trace header");
+	count = fread(records, sizeof(struct fs_trace_record), 16, f);
+	fclose(f);
+	remove(TRACENAME);
+	ASSERT(count == 8, "trace record count");
+
+	ASSERT(records[0].op == FS_TRACE_MOUNT && records[0].result == 0
+		   && records[0].arg == DATA_BLOCK_COUNT, "trace fs_mount");
+	ASSERT(records[1].op == FS_TRACE_CREATE && !strcmp(records[1].filename, "traced"), "trace fs_create");
+	ASSERT(records[2].op == FS_TRACE_OPEN && records[2].result == fd, "trace fs_open");
+	ASSERT(records[3].op == FS_TRACE_WRITE && records[3].fd == fd && records[3].offset == 0
+		   && records[3].arg == sizeof(buf) && records[3].result == sizeof(buf), "trace fs_write");
+	ASSERT(records[4].op == FS_TRACE_LSEEK && records[4].offset == sizeof(buf)
+		   && records[4].arg == 10, "trace fs_lseek");
+	ASSERT(records[5].op == FS_TRACE_READ && records[5].offset == 10
+		   && records[5].result == sizeof(buf) - 10, "trace fs_read");
+	ASSERT(records[6].op == FS_TRACE_CLOSE && records[7].op == FS_TRACE_UMOUNT, "trace fs_close/fs_umount");
+	for (int i = 1; i < 8; i++)
+		ASSERT(records[i].timestamp_ns >= records[i - 1].timestamp_ns, NULL);
+
+    fprintf(stderr, "%s", green("...PASSED THE WHOLE TEST!\n"));
+}
+
+void runtime_stats()
+{
+	static char data[3 * 4096];
+	struct fs_stats st;
+	int fd, ret;
+    fprintf(stderr, "%s", color("\n------TESTING runtime_stats------\n", 33));
+
+    /* Reset disk file */
+	reset_disk(DISKNAME, DATA_BLOCK_COUNT);
+
+	ret = fs_get_stats(NULL);
+	ASSERT(ret == -1, "fs_get_stats(NULL)");
+	ret = fs_reset_stats();
+	ASSERT(!ret, "fs_reset_stats");
+	fs_get_stats(&st);
+	ASSERT(st.ops[FS_TRACE_MOUNT].calls == 0 && st.blocks_written == 0, "stats are reset");
+
+	fs_mount(DISKNAME);
+	fs_create("stats");
+	fs_create("stats");
+	fd = fs_open_flags("stats", FS_O_NOBUF);
+	fs_write(fd, data, sizeof(data));
+	fs_lseek(fd, 0);
+	fs_read(fd, data, 100);
+	fs_close(fd);
+	fs_umount();
+
+	fs_get_stats(&st);
+	ASSERT(st.ops[FS_TRACE_MOUNT].calls == 1 && st.ops[FS_TRACE_UMOUNT].calls == 1, "stats mount/umount calls");
+	ASSERT(st.ops[FS_TRACE_CREATE].calls == 2 && st.ops[FS_TRACE_CREATE].errors == 1, "stats create errors");
+	ASSERT(st.ops[FS_TRACE_WRITE].calls == 1 && st.ops[FS_TRACE_WRITE].total_ns > 0
+		   && st.ops[FS_TRACE_WRITE].max_ns <= st.ops[FS_TRACE_WRITE].total_ns, "stats write latency");
+	ASSERT(st.bytes_write_requested == sizeof(data) && st.bytes_written == sizeof(data), "stats bytes written");
+	ASSERT(st.bytes_read_requested == 100 && st.bytes_read == 100, "stats bytes read");
+	ASSERT(st.blocks_written >= 3 && st.blocks_read >= 1, "stats block I/O");
+	ASSERT(st.alloc_searches >= 3 && st.alloc_scan_steps >= st.alloc_searches, "stats allocation scans");
+	ASSERT(st.rootdir_flushes >= 1 && st.fat_flushes >= 1 && st.fat_blocks_flushed >= 1, "stats metadata flushes");
+
+	fs_reset_stats();
+	fs_get_stats(&st);
+	ASSERT(st.ops[FS_TRACE_WRITE].calls == 0 && st.bytes_written == 0, "stats reset after use");
+
+    fprintf(stderr, "%s", green("...PASSED THE WHOLE TEST!\n"));
+}
+
+uint64_t histogram_total(uint64_t *hist)
+{
+	uint64_t total = 0;
+	for (int i = 0; i < BLOCK_LATENCY_BUCKETS; i++)
+		total += hist[i];
+	return total;
+}
+
+void disk_stats()
+{
+	static char data[2 * 4096];
+	struct block_disk_stats st;
+	uint64_t counts[DATA_BLOCK_COUNT + 3];
+	int fd, ret;
+    fprintf(stderr, "%s", color("\n------TESTING disk_stats------\n", 33));
+
+    /* Reset disk file */
+	reset_disk(DISKNAME, DATA_BLOCK_COUNT);
+
+	ret = block_disk_get_stats(NULL);
+	ASSERT(ret == -1, "block_disk_get_stats(NULL)");
+
+	fs_mount(DISKNAME);
+	fs_create("hot");
+	fd = fs_open_flags("hot", FS_O_NOBUF);
+	for (int i = 0; i < 10; i++) {
+		fs_lseek(fd, 0);
+		fs_write(fd, data, sizeof(data));
+	}
+	fs_close(fd);
+	fs_umount();
+
+    /* histograms outlive the disk being closed */
+	ret = block_disk_get_stats(&st);
+	ASSERT(!ret, "block_disk_get_stats");
+	ASSERT(histogram_total(st.read[BLOCK_REGION_SUPERBLOCK]) == 1, "superblock read once");
+	ASSERT(histogram_total(st.read[BLOCK_REGION_FAT]) == 1, "FAT read at mount");
+	ASSERT(histogram_total(st.write[BLOCK_REGION_ROOT]) >= 1, "root directory written");
+	ASSERT(histogram_total(st.write[BLOCK_REGION_DATA]) == 20, "data blocks written");
+
+	ret = block_disk_heatmap(NULL, 0);
+	ASSERT(ret == DATA_BLOCK_COUNT + 3, "block_disk_heatmap size");
+	block_disk_heatmap(counts, ret);
+	ASSERT(counts[0] == 1 && counts[4] == 10 && counts[5] == 10, "block_disk_heatmap counts");
+
+	block_disk_reset_stats();
+	block_disk_get_stats(&st);
+	block_disk_heatmap(counts, DATA_BLOCK_COUNT + 3);
+	ASSERT(histogram_total(st.write[BLOCK_REGION_DATA]) == 0 && counts[4] == 0, "block_disk_reset_stats");
+
+    fprintf(stderr, "%s", green("...PASSED THE WHOLE TEST!\n"));
+}
+
+/* Mount, write and read back a few blocks, return the latency injected */
+uint64_t simulated_workload()
+{
+	static char data[4 * 4096];
+	struct block_disk_stats st;
+	int fd;
+
+	reset_disk(DISKNAME, DATA_BLOCK_COUNT);
+	fs_mount(DISKNAME);
+	fs_create("sim");
+	fd = fs_open_flags("sim", FS_O_NOBUF);
+	fs_write(fd, data, sizeof(data));
+	fs_lseek(fd, 0);
+	fs_read(fd, data, sizeof(data));
+	fs_close(fd);
+	fs_umount();
+
+	block_disk_get_stats(&st);
+	return st.injected_ns;
+}
+
+void latency_model()
+{
+	static char blocks[4 * 4096];
+	struct block_latency_model model;
+	struct block_disk_stats st;
+	uint64_t accesses = 0, injected;
+	int ret;
+    fprintf(stderr, "%s", color("\n------TESTING latency_model------\n", 33));
+
+	ret = block_disk_parse_latency("hdd,bogus=1", &model);
+	ASSERT(ret == -1, "block_disk_parse_latency invalid setting");
+	ret = block_disk_parse_latency("ssd,fixed_us=7,bw_mbps=0,virtual", &model);
+	ASSERT(!ret && model.fixed_ns == 7000 && model.bandwidth == 0 && model.virtual, "block_disk_parse_latency");
+
+    /* a fixed cost is paid once per request, however many blocks it transfers */
+	block_disk_set_latency(&model);
+	reset_disk(DISKNAME, DATA_BLOCK_COUNT);
+	block_disk_open(DISKNAME);
+	block_disk_reset_stats();
+	block_readv(4, 4, blocks);
+	block_read(4, blocks);
+	block_disk_get_stats(&st);
+	block_disk_close();
+	ASSERT(st.injected_ns == 2 * 7000, "fixed latency per request");
+
+	injected = simulated_workload();
+	block_disk_get_stats(&st);
+	for (int r = 0; r < BLOCK_REGION_COUNT; r++)
+		accesses += histogram_total(st.read[r]) + histogram_total(st.write[r]);
+	ASSERT(injected > 0 && injected < accesses * 7000, "fixed latency");
+
+    /* the HDD model is repeatable for a given seed */
+	block_disk_parse_latency("hdd,outlier_ppm=100000,outlier_us=50,seed=42,virtual", &model);
+	block_disk_set_latency(&model);
+	injected = simulated_workload();
+	block_disk_get_stats(&st);
+	ASSERT(st.seeks > 0 && injected > st.seeks * 500000, "hdd seeks");
+	block_disk_set_latency(&model);
+	ret = simulated_workload() == injected;
+	ASSERT(ret, "hdd latency is deterministic");
+
+	block_disk_set_latency(NULL);
+	ret = simulated_workload() == 0;
+	ASSERT(ret, "latency model disabled");
+
+    fprintf(stderr, "%s", green("...PASSED THE WHOLE TEST!\n"));
+}
+
+void ram_backend()
+{
+	char mountname[64], buf[16];
+	int fd, ret;
+    fprintf(stderr, "%s", color("\n------TESTING ram_backend------\n", 33));
+
+    /* Reset disk file */
+	reset_disk(DISKNAME, DATA_BLOCK_COUNT);
+
+	ret = fs_mount("ram:no_such_disk.fs");
+	ASSERT(ret == -1, "fs_mount missing RAM image");
+
+    /* changes to a RAM disk are discarded */
+	sprintf(mountname, "ram:%s", DISKNAME);
+	ret = fs_mount(mountname);
+	ASSERT(!ret, "fs_mount RAM disk");
+	ret = block_disk_count();
+	ASSERT(ret == DATA_BLOCK_COUNT + 3, "block_disk_count RAM disk");
+	fs_create("scratch");
+	fd = fs_open("scratch");
+	ret = fs_write(fd, "volatile", 8);
+	ASSERT(ret == 8, "fs_write RAM disk");
+	fs_close(fd);
+	fs_umount();
+
+	fs_mount(DISKNAME);
+	ret = fs_open("scratch");
+	ASSERT(ret == -1, "RAM disk discarded");
+	fs_umount();
+
+    /* or written back to the image */
+	sprintf(mountname, "ram+save:%s", DISKNAME);
+	fs_mount(mountname);
+	fs_create("kept");
+	fd = fs_open("kept");
+	fs_write(fd, "persistent", 10);
+	fs_close(fd);
+	ret = fs_umount();
+	ASSERT(!ret, "fs_umount RAM disk");
+
+	fs_mount(DISKNAME);
+	fd = fs_open("kept");
+	ret = fs_read(fd, buf, sizeof(buf));
+	ASSERT(ret == 10 && !memcmp(buf, "persistent", 10), "RAM disk saved");
+	fs_close(fd);
+	fs_umount();
+
+    fprintf(stderr, "%s", green("...PASSED THE WHOLE TEST!\n"));
+}
+
+void defrag()
+{
+	static char block_a[4096], block_b[4096], buf[4096];
+	struct fs_frag frag;
+	int fd_a, fd_b, ret;
+    fprintf(stderr, "%s", color("\n------TESTING defrag------\n", 33));
+
+    /* Reset disk file */
+	reset_disk(DISKNAME, DATA_BLOCK_COUNT);
+
+	ret = fs_defrag(0, 0);
+	ASSERT(ret == -1, "fs_defrag not mounted");
+
+	memset(block_a, 'a', sizeof(block_a));
+	memset(block_b, 'b', sizeof(block_b));
+
+    /* interleave the blocks of two files */
+	fs_mount(DISKNAME);
+	fs_create("a");
+	fs_create("b");
+	fd_a = fs_open_flags("a", FS_O_NOBUF);
+	fd_b = fs_open("b");
+	for (int i = 0; i < 8; i++) {
+		block_a[0] = block_b[0] = '0' + i;
+		fs_write(fd_a, block_a, sizeof(block_a));
+		fs_write(fd_b, block_b, sizeof(block_b));
+	}
+	/* leave a partial block in b's write buffer */
+	fs_write(fd_b, "tail", 4);
+
+	ret = fs_fragmentation(&frag);
+	ASSERT(!ret && frag.files == 2 && frag.fragmented_files == 2, "fs_fragmentation before");
+
+    /* a budget of one block still moves one whole file per call */
+	ret = fs_defrag(1, 0);
+	ASSERT(ret == 1, "fs_defrag budget");
+	ret = fs_defrag(1, 0);
+	ASSERT(ret == 0, "fs_defrag pass complete");
+
+	fs_fragmentation(&frag);
+	ASSERT(frag.fragmented_files == 0 && frag.extents == 2 && frag.blocks == 17, "fs_fragmentation after");
+
+    /* both files are intact, open descriptors keep working */
+	fs_write(fd_b, "more", 4);
+	fs_close(fd_a);
+	fs_close(fd_b);
+	fs_umount();
+
+	fs_mount(DISKNAME);
+	fd_a = fs_open("a");
+	fd_b = fs_open("b");
+	ret = 0;
+	for (int i = 0; i < 8; i++) {
+		block_a[0] = block_b[0] = '0' + i;
+		ret |= fs_read(fd_a, buf, sizeof(buf)) != sizeof(buf) || memcmp(buf, block_a, sizeof(buf));
+		ret |= fs_read(fd_b, buf, sizeof(buf)) != sizeof(buf) || memcmp(buf, block_b, sizeof(buf));
+	}
+	ret |= fs_read(fd_b, buf, sizeof(buf)) != 8 || memcmp(buf, "tailmore", 8);
+	ASSERT(!ret, "data intact after defrag");
+	fs_close(fd_a);
+	fs_close(fd_b);
+	fs_umount();
+
+    fprintf(stderr, "%s", green("...PASSED THE WHOLE TEST!\n"));
+}
+
+void image_check()
+{
+	static char data[3 * 4096];
+	uint16_t FAT[4096 / sizeof(uint16_t)];
+	struct fs_check_report report;
+	int fd, ret;
+    fprintf(stderr, "%s", color("\n------TESTING image_check------\n", 33));
+
+    /* Reset disk file */
+	reset_disk(DISKNAME, DATA_BLOCK_COUNT);
+
+    /* a: blocks 1-3, b: blocks 4-5, c: block 6 */
+	fs_mount(DISKNAME);
+	fs_create("a");
+	fs_create("b");
+	fs_create("c");
+	fd = fs_open("a");
+	fs_write(fd, data, 3 * 4096);
+	fs_close(fd);
+	fd = fs_open("b");
+	fs_write(fd, data, 2 * 4096);
+	fs_close(fd);
+	fd = fs_open("c");
+	fs_write(fd, data, 100);
+	fs_close(fd);
+
+	ret = fs_check(DISKNAME, 0, 0, &report);
+	ASSERT(ret == -1, "fs_check while mounted");
+	fs_umount();
+
+	ret = fs_check(DISKNAME, 0, 0, &report);
+	ASSERT(ret == 0 && report.errors == 0 && report.files == 3 && report.blocks_used == 6, "fs_check clean image");
+
+    /* leak block 10, cross-link b into a, and loop c onto itself */
+	block_disk_open(DISKNAME);
+	block_read(1, FAT);
+	FAT[10] = 0xFFFF;
+	FAT[5] = 3;
+	FAT[6] = 6;
+	block_write(1, FAT);
+	block_disk_close();
+
+    /* a single worker walks the files in order, so a owns block 3 */
+	ret = fs_check(DISKNAME, 0, 1, &report);
+	ASSERT(ret == 3 && report.leaked == 1 && report.cross_linked == 1 && report.cycles == 1, "fs_check corrupted image");
+
+	ret = fs_check(DISKNAME, FS_CHECK_REPAIR, 2, &report);
+	ASSERT(ret == 2 && report.repaired == 1, "fs_check repair");
+
+	ret = fs_check(DISKNAME, 0, 4, &report);
+	ASSERT(ret == 2 && report.leaked == 0, "leak repaired");
+
+    fprintf(stderr, "%s", green("...PASSED THE WHOLE TEST!\n"));
+}
+
+void fat32()
+{
+	static char data[3 * 4096], buf[3 * 4096];
+	static uint32_t FAT[4096 / sizeof(uint32_t)];
+	struct fs_check_report report;
+	struct fs_stats stats;
+	int fd, ret;
+    fprintf(stderr, "%s", color("\n------TESTING fat32------\n", 33));
+
+    /* 70000 data blocks do not fit in 16-bit block numbers */
+	ret = fs_format(DISKNAME, 70000, 0);
+	ASSERT(ret == -1, "fs_format too large for a 16-bit FAT");
+	ret = fs_format(DISKNAME, 70000, FS_FORMAT_FAT32);
+	ASSERT(ret == 0, "fs_format 32-bit FAT");
+
+	ret = fs_check(DISKNAME, 0, 0, &report);
+	ASSERT(ret == 0 && report.errors == 0, "fs_check blank image");
+
+    /* mark the first 65 FAT blocks taken, so files land past block 65535 */
+	for (size_t i = 0; i < sizeof(FAT) / sizeof(FAT[0]); i++)
+		FAT[i] = 0xFFFFFFFF;
+	block_disk_open(DISKNAME);
+	for (int i = 1; i <= 65; i++)
+		block_write(i, FAT);
+	block_disk_close();
+
+	for (size_t i = 0; i < sizeof(data); i++)
+		data[i] = 'a' + i % 26;
+
+	fs_reset_stats();
+	fs_mount(DISKNAME);
+	fs_create("big");
+	fd = fs_open("big");
+	ret = fs_write(fd, data, sizeof(data));
+	ASSERT(ret == sizeof(data), "fs_write past block 65535");
+
+    /* a hole in front of the last block needs the 32-bit hole map */
+	fs_lseek(fd, 100 * 4096);
+	ret = fs_write(fd, data, 4096);
+	ASSERT(ret == 4096 && fs_stat(fd) == 101 * 4096, "sparse write");
+	fs_close(fd);
+
+    /* the allocator paged through more FAT blocks than it may keep */
+	fs_get_stats(&stats);
+	ASSERT(stats.fat_pages_loaded > 64 && stats.fat_pages_evicted > 0, "FAT loaded in pages");
+	fs_umount();
+
+	fs_mount(DISKNAME);
+	fd = fs_open("big");
+	ret = fs_read(fd, buf, sizeof(buf));
+	ASSERT(ret == sizeof(buf) && !memcmp(buf, data, sizeof(buf)), "fs_read after remount");
+	fs_lseek(fd, 100 * 4096 - 4096);
+	ret = fs_read(fd, buf, 2 * 4096);
+	ASSERT(ret == 2 * 4096 && buf[0] == 0 && buf[4095] == 0 && !memcmp(buf + 4096, data, 4096), "fs_read hole and data");
+	fs_close(fd);
+	fs_umount();
+
+    /* only the blocks marked by hand are unaccounted for */
+	ret = fs_check(DISKNAME, FS_CHECK_REPAIR, 0, &report);
+	ASSERT(ret == 0 && report.leaked == 65 * 1024 - 1 && report.repaired == report.leaked, "fs_check 32-bit FAT");
+
+	ret = fs_check(DISKNAME, 0, 0, &report);
+	ASSERT(ret == 0 && report.errors == 0 && report.files == 1, "fs_check repaired image");
+
+    fprintf(stderr, "%s", green("...PASSED THE WHOLE TEST!\n"));
+}
+
+void large_files()
+{
+	static char data[4096], buf[2 * 4096];
+	const int64_t GiB = 1024 * 1024 * 1024;
+	struct fs_check_report report;
+	struct fs_stats stats;
+	int64_t size;
+	ssize_t ret;
+	int fd;
+    fprintf(stderr, "%s", color("\n------TESTING large_files------\n", 33));
+
+	for (size_t i = 0; i < sizeof(data); i++)
+		data[i] = 'a' + i % 26;
+
+	fs_format(DISKNAME, 100, FS_FORMAT_FAT32);
+	fs_mount(DISKNAME);
+	fs_create("huge");
+	fd = fs_open("huge");
+
+    /* a single block 5 GiB into the file */
+	fs_lseek(fd, 5 * GiB);
+	ret = fs_write(fd, data, sizeof(data));
+	size = fs_stat64(fd);
+	ASSERT(ret == sizeof(data) && size == 5 * GiB + 4096, "fs_write past 4 GiB");
+	ASSERT(fs_stat(fd) == -1, "fs_stat too large for an int");
+
+	fs_lseek(fd, 5 * GiB - 4096);
+	ret = fs_read(fd, buf, sizeof(buf));
+	ASSERT(ret == sizeof(buf) && buf[0] == 0 && !memcmp(buf + 4096, data, 4096), "fs_read past 4 GiB");
+	ASSERT(fs_seek_data(fd, 0) == 5 * GiB, "fs_seek_data past 4 GiB");
+
+	fs_ftruncate(fd, 6 * GiB);
+	fs_close(fd);
+	fs_umount();
+
+	fs_mount(DISKNAME);
+	fd = fs_open("huge");
+	size = fs_stat64(fd);
+	ASSERT(size == 6 * GiB, "size after remount");
+	fs_close(fd);
+	fs_umount();
+
+	ret = fs_check(DISKNAME, 0, 0, &report);
+	ASSERT(ret == 0 && report.errors == 0, "fs_check large file");
+
+    /* reading a file in order follows each link once */
+	fs_format(DISKNAME, 2048, 0);
+	fs_mount(DISKNAME);
+	fs_create("long");
+	fd = fs_open("long");
+	for (int i = 0; i < 1000; i++)
+		fs_write(fd, data, sizeof(data));
+	fs_close(fd);
+
+	fd = fs_open("long");
+	fs_reset_stats();
+	for (int i = 0; i < 1000; i++)
+		fs_read(fd, buf, sizeof(data));
+	fs_get_stats(&stats);
+	ASSERT(stats.chain_walk_steps < 2 * 1000 && !memcmp(buf, data, sizeof(data)), "sequential read");
+
+    /* a 16-bit hole map cannot describe a hole of 65,536 blocks */
+	fs_lseek(fd, (1000 + 65536) * 4096LL);
+	ret = fs_write(fd, data, sizeof(data));
+	ASSERT(ret == 0 && fs_stat64(fd) == 1000 * 4096, "hole too long for a 16-bit FAT");
+	fs_close(fd);
+	fs_umount();
+
+    fprintf(stderr, "%s", green("...PASSED THE WHOLE TEST!\n"));
+}
+
+void extents()
+{
+	static char data[64 * 4096], buf[64 * 4096];
+	struct fs_check_report report;
+	struct fs_stats stats;
+	struct fs_frag frag;
+	bool same = true;
+	int fd, fd2, ret;
+    fprintf(stderr, "%s", color("\n------TESTING extents------\n", 33));
+
+	for (size_t i = 0; i < sizeof(data); i++)
+		data[i] = 'a' + i / 4096 % 26;
+
+	ret = fs_format(DISKNAME, 4, FS_FORMAT_EXTENTS);
+	ASSERT(ret == -1, "fs_format too small for the extent table");
+
+	fs_format(DISKNAME, 2048, FS_FORMAT_EXTENTS);
+	fs_mount(DISKNAME);
+	fs_create("seq");
+	fd = fs_open("seq");
+	for (int i = 0; i < 8; i++)
+		fs_write(fd, data, sizeof(data));
+	fs_close(fd);
+
+    /* a file written in order is a single extent, read without any FAT link */
+	fs_fragmentation(&frag);
+	ASSERT(frag.files == 1 && frag.extents == 1 && frag.blocks == 8 * 64, "sequential file is one extent");
+
+	fd = fs_open("seq");
+	fs_reset_stats();
+	for (int i = 0; i < 8; i++) {
+		fs_read(fd, buf, sizeof(buf));
+		same = same && !memcmp(buf, data, sizeof(data));
+	}
+	fs_get_stats(&stats);
+	ASSERT(same && stats.chain_walk_steps == 0 && stats.extent_search_steps < 8 * 4, "sequential read");
+
+	fs_lseek(fd, 300 * 4096 + 100);
+	fs_read(fd, buf, 4096);
+	ASSERT(!memcmp(buf, data + 300 % 64 * 4096 + 100, 4096), "random read");
+	fs_close(fd);
+
+    /* holes are extents of their own */
+	fs_create("sparse");
+	fd = fs_open("sparse");
+	fs_write(fd, data, 4096);
+	fs_lseek(fd, 100 * 4096);
+	fs_write(fd, data, 4096);
+	ASSERT(fs_seek_data(fd, 4096) == 100 * 4096 && fs_seek_hole(fd, 0) == 4096, "sparse file");
+	fs_close(fd);
+
+    /* interleaved writes need more extents than a record holds */
+	fs_create("a");
+	fs_create("b");
+	fd = fs_open("a");
+	fd2 = fs_open("b");
+	for (int i = 0; i < 40; i++) {
+		fs_write(fd, data + i % 64 * 4096, 4096);
+		fs_write(fd2, data, 4096);
+	}
+	fs_close(fd);
+	fs_close(fd2);
+	fs_fragmentation(&frag);
+	ASSERT(frag.extents >= 2 * 40, "interleaved files");
+	fs_umount();
+
+	ret = fs_check(DISKNAME, 0, 0, &report);
+	ASSERT(ret == 0 && report.errors == 0, "fs_check extents");
+
+	fs_mount(DISKNAME);
+	fd = fs_open("a");
+	ret = fs_read(fd, buf, 40 * 4096);
+	ASSERT(ret == 40 * 4096 && !memcmp(buf, data, 40 * 4096), "overflow extents after remount");
+	fs_ftruncate(fd, 10 * 4096);
+	fs_close(fd);
+	fs_delete("b");
+	fs_umount();
+
+	ret = fs_check(DISKNAME, 0, 0, &report);
+	ASSERT(ret == 0 && report.errors == 0, "fs_check after truncate and delete");
+
+    /* the overflow block of a file is taken with the data that needs it, a full disk stops the write */
+	fs_format(DISKNAME, 256, FS_FORMAT_EXTENTS);
+	fs_mount(DISKNAME);
+	fs_create("a");
+	fs_create("b");
+	fd = fs_open("a");
+	fd2 = fs_open("b");
+	for (int i = 0; i < 15; i++) {
+		fs_write(fd, data + i * 4096, 4096);
+		fs_write(fd2, data, 4096);
+	}
+	fs_close(fd2);
+	fs_create("fill");
+	fd2 = fs_open("fill");
+	while (fs_write(fd2, data, 4096) == 4096)
+		;
+	fs_ftruncate(fd2, fs_stat(fd2) - 4096);
+	fs_close(fd2);
+	ret = fs_write(fd, data + 15 * 4096, 4096);
+	ASSERT(ret == 0, "write that needs an overflow block on a full disk");
+	ret = fs_close(fd);
+	ASSERT(ret == 0, "close after a write short of an overflow block");
+	fs_umount();
+
+	ret = fs_check(DISKNAME, 0, 0, &report);
+	ASSERT(ret == 0 && report.errors == 0, "fs_check after filling a disk with extents");
+
+	fs_mount(DISKNAME);
+	fd = fs_open("a");
+	ret = fs_read(fd, buf, sizeof(buf));
+	ASSERT(ret == 15 * 4096 && !memcmp(buf, data, 15 * 4096), "file short of an overflow block after remount");
+	fs_close(fd);
+	fs_umount();
+
+    /* a FAT disk keeps its data blocks when converted */
+	fs_format(DISKNAME, 2048, 0);
+	fs_mount(DISKNAME);
+	fs_create("a");
+	fs_create("b");
+	fd = fs_open("a");
+	fd2 = fs_open("b");
+	for (int i = 0; i < 40; i++) {
+		fs_write(fd, data + i % 64 * 4096, 4096);
+		fs_write(fd2, data, 4096);
+	}
+	fs_lseek(fd2, 1000 * 4096);
+	fs_write(fd2, data, 4096);
+	fs_close(fd);
+	fs_close(fd2);
+	fs_create("c");
+	fd = fs_open("c");
+	fs_write(fd, data, sizeof(data));
+	fs_write(fd, data, sizeof(data));
+	fs_close(fd);
+	fs_umount();
+
+	ret = fs_check(DISKNAME, 0, 0, &report);
+	ASSERT(ret == 0 && report.errors == 0, "fs_check before conversion");
+	ret = fs_convert(DISKNAME);
+	ASSERT(ret == 0, "fs_convert");
+	ret = fs_check(DISKNAME, 0, 0, &report);
+	ASSERT(ret == 0 && report.errors == 0, "fs_check converted disk");
+
+	fs_mount(DISKNAME);
+	fd = fs_open("a");
+	ret = fs_read(fd, buf, 40 * 4096);
+	ASSERT(ret == 40 * 4096 && !memcmp(buf, data, 40 * 4096), "converted file");
+	fs_close(fd);
+	fd = fs_open("b");
+	ASSERT(fs_seek_data(fd, 40 * 4096) == 1000 * 4096, "converted hole");
+	fs_close(fd);
+	fd = fs_open("c");
+	fs_lseek(fd, sizeof(data));
+	ret = fs_read(fd, buf, sizeof(buf));
+	ASSERT(ret == sizeof(buf) && !memcmp(buf, data, sizeof(data)), "converted contiguous file");
+	fs_close(fd);
+	fs_umount();
+
+    fprintf(stderr, "%s", green("...PASSED THE WHOLE TEST!\n"));
+}
+
+void log_structured()
+{
+	static char data[64 * 4096], buf[64 * 4096];
+	struct fs_check_report report;
+	struct fs_stats stats;
+	struct fs_frag frag;
+	int fd, ret;
+	unsigned int seed = 1;
+    fprintf(stderr, "%s", color("\n------TESTING log_structured------\n", 33));
+
+	for (size_t i = 0; i < sizeof(data); i++)
+		data[i] = 'a' + i / 4096 % 26;
+
+	fs_format(DISKNAME, 4096, FS_FORMAT_LOG);
+	fs_mount(DISKNAME);
+	ASSERT(fs_clean(0) == 0, "fs_clean with nothing to reclaim");
+	fs_create("log");
+	fd = fs_open("log");
+	fs_write(fd, data, sizeof(data));
+
+    /* blocks written since the last checkpoint are overwritten in place */
+	fs_reset_stats();
+	fs_lseek(fd, 0);
+	fs_write(fd, data, 4096);
+	fs_get_stats(&stats);
+	ASSERT(stats.log_blocks_redirected == 0, "overwrite before a checkpoint");
+	fs_close(fd);
+	fd = fs_open("log");
+
+    /* once closed, an overwrite goes to the head of the log, the file reads the new data */
+	fs_reset_stats();
+	memset(data + 10 * 4096, 'X', 4096);
+	fs_lseek(fd, 10 * 4096);
+	fs_write(fd, data + 10 * 4096, 4096);
+	fs_get_stats(&stats);
+	ASSERT(stats.log_blocks_redirected == 1, "overwrite is redirected");
+
+	memset(data + 20 * 4096 + 50, 'Y', 100);
+	fs_lseek(fd, 20 * 4096 + 50);
+	fs_write(fd, data + 20 * 4096 + 50, 100);
+	fs_close(fd);
+
+	fs_fragmentation(&frag);
+	ASSERT(frag.extents > 1, "overwritten blocks left their extent");
+	fd = fs_open("log");
+	ret = fs_read(fd, buf, sizeof(buf));
+	ASSERT(ret == sizeof(buf) && !memcmp(buf, data, sizeof(data)), "read after overwrites");
+	fs_close(fd);
+	fs_umount();
+
+	ret = fs_check(DISKNAME, 0, 0, &report);
+	ASSERT(ret == 0 && report.errors == 0, "fs_check log disk");
+
+    /* random overwrites across checkpoints leave segments partly dead, fs_clean() gathers their live blocks */
+	fs_mount(DISKNAME);
+	for (int i = 0; i < 320; i++) {
+		int block = rand_r(&seed) % 64;
+
+		if (i % 32 == 0)
+			fd = fs_open("log");
+		data[block * 4096] = 'a' + i % 26;
+		fs_lseek(fd, block * 4096);
+		fs_write(fd, data + block * 4096, 4096);
+		if (i % 32 == 31)
+			fs_close(fd);
+	}
+
+	fs_reset_stats();
+	ret = fs_clean(0);
+	fs_get_stats(&stats);
+	ASSERT(ret > 0 && stats.log_segments_cleaned == (uint64_t) ret && stats.log_blocks_moved < (uint64_t) ret * 64
+		   && stats.log_checkpoints == 1, "fs_clean");
+
+	fd = fs_open("log");
+	ret = fs_read(fd, buf, sizeof(buf));
+	ASSERT(ret == sizeof(buf) && !memcmp(buf, data, sizeof(data)), "read after cleaning");
+	fs_close(fd);
+	fs_umount();
+
+	ret = fs_check(DISKNAME, 0, 0, &report);
+	ASSERT(ret == 0 && report.errors == 0, "fs_check after cleaning");
+
+    /* defrag stores a buffered overwrite before it looks at the extents, the overwrite moves its block */
+	fs_mount(DISKNAME);
+	fd = fs_open("log");
+	memset(data + 6 * 4096 + 100, 'Z', 50);
+	fs_lseek(fd, 6 * 4096 + 100);
+	fs_write(fd, data + 6 * 4096 + 100, 50);
+	ret = fs_defrag(0, 0);
+	fs_fragmentation(&frag);
+	ASSERT(ret == 0 && frag.fragmented_files == 0, "fs_defrag log disk");
+	fs_lseek(fd, 0);
+	ret = fs_read(fd, buf, sizeof(buf));
+	ASSERT(ret == sizeof(buf) && !memcmp(buf, data, sizeof(data)), "read after defrag");
+	fs_close(fd);
+	fs_umount();
+
+	ret = fs_check(DISKNAME, 0, 0, &report);
+	ASSERT(ret == 0 && report.errors == 0, "fs_check after defrag");
+
+	fs_mount(DISKNAME);
+	fd = fs_open("log");
+	ret = fs_read(fd, buf, sizeof(buf));
+	ASSERT(ret == sizeof(buf) && !memcmp(buf, data, sizeof(data)), "log file after remount");
+	fs_ftruncate(fd, 30 * 4096 + 10);
+	fs_close(fd);
+	fs_delete("log");
+	fs_umount();
+
+	ret = fs_check(DISKNAME, 0, 0, &report);
+	ASSERT(ret == 0 && report.errors == 0, "fs_check after truncate and delete");
+
+    /* overwriting a small disk many times over relies on the background cleaner */
+	fs_format(DISKNAME, 256, FS_FORMAT_LOG);
+	fs_mount(DISKNAME);
+	fs_create("log");
+	fd = fs_open("log");
+	fs_write(fd, data, sizeof(data));
+	for (int i = 0; i < 5000; i++) {
+		int block = rand_r(&seed) % 64;
+
+		data[block * 4096 + 1] = 'a' + i % 26;
+		fs_lseek(fd, block * 4096);
+		ret = fs_write(fd, data + block * 4096, 4096);
+		if (ret != 4096)
+			break;
+	}
+	ASSERT(ret == 4096, "overwrites of a small log disk");
+	fs_lseek(fd, 0);
+	ret = fs_read(fd, buf, sizeof(buf));
+	ASSERT(ret == sizeof(buf) && !memcmp(buf, data, sizeof(data)), "read back from a small log disk");
+	fs_close(fd);
+	fs_umount();
+
+	ret = fs_check(DISKNAME, 0, 0, &report);
+	ASSERT(ret == 0 && report.errors == 0, "fs_check small log disk");
+
+	fs_format(DISKNAME, 1024, FS_FORMAT_EXTENTS);
+	fs_mount(DISKNAME);
+	ASSERT(fs_clean(0) == -1, "fs_clean on a disk without a log");
+	fs_umount();
+
+    fprintf(stderr, "%s", green("...PASSED THE WHOLE TEST!\n"));
+}
+
+void clones()
+{
+	static char data[64 * 4096], copy[64 * 4096], buf[64 * 4096];
+	struct fs_check_report report;
+	struct fs_stats stats;
+	struct fs_frag frag;
+	uint32_t free_blocks;
+	int fd, ret;
+    fprintf(stderr, "%s", color("\n------TESTING clones------\n", 33));
+
+	for (size_t i = 0; i < sizeof(data); i++)
+		data[i] = 'a' + i / 4096 % 26;
+
+    /* clones need extents */
+	fs_format(DISKNAME, 4096, 0);
+	fs_mount(DISKNAME);
+	fs_create("src");
+	ASSERT(fs_clone("src", "copy") == -1, "fs_clone on a FAT disk");
+	fs_umount();
+
+	fs_format(DISKNAME, 4096, FS_FORMAT_EXTENTS);
+	fs_mount(DISKNAME);
+	fs_fragmentation(&frag);
+	free_blocks = frag.free_blocks;
+	fs_create("src");
+	fd = fs_open("src");
+	fs_write(fd, data, sizeof(data));
+	fs_close(fd);
+
+    /* cloning only writes metadata */
+	fs_reset_stats();
+	ASSERT(fs_clone("src", "copy") == 0, "fs_clone");
+	fs_get_stats(&stats);
+	ASSERT(stats.blocks_written < 16, "clone writes no data blocks");
+	ASSERT(fs_clone("src", "copy") == -1, "fs_clone to an existing file");
+	ASSERT(fs_clone("none", "copy2") == -1, "fs_clone of a missing file");
+	fs_fragmentation(&frag);
+	ASSERT(frag.free_blocks > free_blocks - 64 - 8, "clone takes no data blocks");
+
+	fd = fs_open("copy");
+	ASSERT(fs_stat(fd) == sizeof(data), "clone size");
+	ret = fs_read(fd, buf, sizeof(buf));
+	ASSERT(ret == sizeof(buf) && !memcmp(buf, data, sizeof(data)), "read clone");
+
+    /* writes to the clone copy the blocks they touch, the source keeps its data */
+	memcpy(copy, data, sizeof(data));
+	memset(copy + 10 * 4096, 'X', 4096);
+	memset(copy + 20 * 4096 + 50, 'Y', 100);
+	memset(copy + 30 * 4096, 'Z', 10 * 4096);
+	fs_reset_stats();
+	fs_lseek(fd, 10 * 4096);
+	fs_write(fd, copy + 10 * 4096, 4096);
+	fs_lseek(fd, 20 * 4096 + 50);
+	fs_write(fd, copy + 20 * 4096 + 50, 100);
+	fs_lseek(fd, 30 * 4096);
+	fs_write(fd, copy + 30 * 4096, 10 * 4096);
+	fs_close(fd);
+	fs_get_stats(&stats);
+	ASSERT(stats.shared_blocks_copied == 12, "copy-on-write of the modified blocks only");
+
+	fd = fs_open("copy");
+	ret = fs_read(fd, buf, sizeof(buf));
+	ASSERT(ret == sizeof(buf) && !memcmp(buf, copy, sizeof(copy)), "read modified clone");
+	fs_close(fd);
+	fd = fs_open("src");
+	ret = fs_read(fd, buf, sizeof(buf));
+	ASSERT(ret == sizeof(buf) && !memcmp(buf, data, sizeof(data)), "source is unchanged");
+	fs_close(fd);
+	fs_umount();
+
+	ret = fs_check(DISKNAME, 0, 0, &report);
+	ASSERT(ret == 0 && report.errors == 0, "fs_check with clones");
+
+    /* deleting the source leaves the blocks the clone still uses */
+	fs_mount(DISKNAME);
+	fs_delete("src");
+	fd = fs_open("copy");
+	ret = fs_read(fd, buf, sizeof(buf));
+	ASSERT(ret == sizeof(buf) && !memcmp(buf, copy, sizeof(copy)), "read clone after deleting the source");
+	fs_close(fd);
+	fs_umount();
+
+	ret = fs_check(DISKNAME, 0, 0, &report);
+	ASSERT(ret == 0 && report.errors == 0, "fs_check after deleting the source");
+
+	fs_mount(DISKNAME);
+	fd = fs_open("copy");
+	ret = fs_read(fd, buf, sizeof(buf));
+	ASSERT(ret == sizeof(buf) && !memcmp(buf, copy, sizeof(copy)), "clone after remount");
+	fs_close(fd);
+	fs_delete("copy");
+	fs_fragmentation(&frag);
+	ASSERT(frag.free_blocks + 2 == free_blocks, "every data block is freed");
+	fs_umount();
+
+    /* on a full disk, a write to a shared block fails right away instead of when it is flushed */
+	fs_format(DISKNAME, 256, FS_FORMAT_EXTENTS);
+	fs_mount(DISKNAME);
+	fs_create("src");
+	fd = fs_open("src");
+	fs_write(fd, data, sizeof(data));
+	fs_close(fd);
+	fs_clone("src", "copy");
+	fs_create("fill");
+	fd = fs_open("fill");
+	while (fs_write(fd, data, sizeof(data)) == sizeof(data))
+		;
+	fs_close(fd);
+	fd = fs_open("copy");
+	fs_lseek(fd, 20 * 4096 + 50);
+	ret = fs_write(fd, copy + 20 * 4096 + 50, 100);
+	ASSERT(ret == 0, "write to a shared block of a full disk");
+	ret = fs_close(fd);
+	ASSERT(ret == 0, "close after a failed write to a shared block");
+	fd = fs_open("copy");
+	ret = fs_read(fd, buf, sizeof(buf));
+	ASSERT(ret == sizeof(buf) && !memcmp(buf, data, sizeof(data)), "clone unchanged by the failed write");
+	fs_close(fd);
+	fs_umount();
+
+	ret = fs_check(DISKNAME, 0, 0, &report);
+	ASSERT(ret == 0 && report.errors == 0, "fs_check after filling a disk with clones");
+
+    /* clones of a log disk */
+	fs_format(DISKNAME, 4096, FS_FORMAT_LOG);
+	fs_mount(DISKNAME);
+	fs_create("src");
+	fd = fs_open("src");
+	fs_write(fd, data, sizeof(data));
+	fs_close(fd);
+	fs_clone("src", "copy");
+	fd = fs_open("copy");
+	fs_lseek(fd, 10 * 4096);
+	fs_write(fd, copy + 10 * 4096, 4096);
+	fs_close(fd);
+	fs_clean(0);
+	fd = fs_open("src");
+	ret = fs_read(fd, buf, sizeof(buf));
+	ASSERT(ret == sizeof(buf) && !memcmp(buf, data, sizeof(data)), "source of a clone on a log disk");
+	fs_close(fd);
+	fs_umount();
+
+	ret = fs_check(DISKNAME, 0, 0, &report);
+	ASSERT(ret == 0 && report.errors == 0, "fs_check log disk with clones");
+
+    fprintf(stderr, "%s", green("...PASSED THE WHOLE TEST!\n"));
+}
+
+void snapshots()
+{
+	static char data[64 * 4096], buf[64 * 4096];
+	struct fs_snapshot_info info[4];
+	struct fs_check_report report;
+	struct fs_stats stats;
+	struct fs_frag frag;
+	uint32_t free_blocks;
+	int fd, snap_fd, ret;
+    fprintf(stderr, "%s", color("\n------TESTING snapshots------\n", 33));
+
+	for (size_t i = 0; i < sizeof(data); i++)
+		data[i] = 'a' + i / 4096 % 26;
+
+	fs_format(DISKNAME, 4096, 0);
+	fs_mount(DISKNAME);
+	ASSERT(fs_snapshot_create("snap") == -1, "fs_snapshot_create on a FAT disk");
+	ASSERT(fs_snapshot_list(NULL, 0) == 0, "no snapshots on a FAT disk");
+	fs_umount();
+
+	fs_format(DISKNAME, 4096, FS_FORMAT_EXTENTS);
+	fs_mount(DISKNAME);
+	fs_tailpack(1);
+	fs_create("big");
+	fd = fs_open("big");
+	fs_write(fd, data, sizeof(data));
+	fs_close(fd);
+	fs_create("small");
+	fd = fs_open("small");
+	fs_write(fd, "before", 6);
+	fs_close(fd);
+	fs_fragmentation(&frag);
+	free_blocks = frag.free_blocks;
+
+    /* taking a snapshot only writes metadata */
+	fs_reset_stats();
+	ASSERT(fs_snapshot_create("snap") == 0, "fs_snapshot_create");
+	fs_get_stats(&stats);
+	ASSERT(stats.blocks_written < 24, "snapshot writes no data blocks");
+	ASSERT(fs_snapshot_create("snap") == -1, "fs_snapshot_create with an existing name");
+	ret = fs_snapshot_list(info, 4);
+	ASSERT(ret == 1 && !strcmp(info[0].name, "snap") && info[0].files == 2 && info[0].created > 0, "fs_snapshot_list");
+
+    /* the live file system keeps changing, the snapshot does not */
+	fd = fs_open("big");
+	fs_lseek(fd, 5 * 4096);
+	fs_write(fd, "XXXX", 4);
+	fs_lseek(fd, 40 * 4096);
+	fs_write(fd, data, 8 * 4096);
+	fs_ftruncate(fd, 50 * 4096);
+	fs_close(fd);
+	fd = fs_open("small");
+	fs_write(fd, "after!", 6);
+	fs_close(fd);
+	fs_create("new");
+
+	snap_fd = fs_snapshot_open("snap", "big");
+	ASSERT(snap_fd >= 0 && fs_stat(snap_fd) == sizeof(data), "fs_snapshot_open");
+	ret = fs_read(snap_fd, buf, sizeof(buf));
+	ASSERT(ret == sizeof(buf) && !memcmp(buf, data, sizeof(data)), "read a file of the snapshot");
+	ASSERT(fs_write(snap_fd, data, 10) == -1 && fs_ftruncate(snap_fd, 0) == -1, "files of snapshots are read-only");
+	ASSERT(fs_snapshot_delete("snap") == -1, "fs_snapshot_delete of an open snapshot");
+	fs_close(snap_fd);
+
+	snap_fd = fs_snapshot_open("snap", "small");
+	ret = fs_read(snap_fd, buf, sizeof(buf));
+	ASSERT(ret == 6 && !memcmp(buf, "before", 6), "packed file of the snapshot");
+	fs_close(snap_fd);
+	ASSERT(fs_snapshot_open("snap", "new") == -1, "file created after the snapshot");
+
+	fd = fs_open("small");
+	ret = fs_read(fd, buf, sizeof(buf));
+	ASSERT(ret == 6 && !memcmp(buf, "after!", 6), "live file after the snapshot");
+	fs_close(fd);
+
+    /* the snapshot outlives the files it was taken from, and remounts */
+	fs_delete("big");
+	fs_umount();
+
+	ret = fs_check(DISKNAME, 0, 0, &report);
+	ASSERT(ret == 0 && report.errors == 0, "fs_check with a snapshot");
+
+	fs_mount(DISKNAME);
+	snap_fd = fs_snapshot_open("snap", "big");
+	ret = fs_read(snap_fd, buf, sizeof(buf));
+	ASSERT(ret == sizeof(buf) && !memcmp(buf, data, sizeof(data)), "snapshot after remount");
+	fs_close(snap_fd);
+
+	ASSERT(fs_snapshot_create("snap2") == 0, "second snapshot");
+	ASSERT(fs_snapshot_delete("snap") == 0, "fs_snapshot_delete");
+	ASSERT(fs_snapshot_list(NULL, 0) == 1, "snapshot deleted");
+	ASSERT(fs_snapshot_open("snap", "big") == -1, "deleted snapshot");
+	ASSERT(fs_snapshot_delete("snap2") == 0, "delete the last snapshot");
+	fs_delete("small");
+	fs_delete("new");
+	fs_fragmentation(&frag);
+    /* the reference count table (2 blocks) and the snapshot table stay */
+	ASSERT(frag.free_blocks + 3 == free_blocks + 65, "every data block is freed");
+	fs_umount();
+
+	ret = fs_check(DISKNAME, 0, 0, &report);
+	ASSERT(ret == 0 && report.errors == 0, "fs_check after deleting the snapshots");
+
+    /* on a full disk, a write to a block kept by a snapshot fails right away */
+	fs_format(DISKNAME, 256, FS_FORMAT_EXTENTS);
+	fs_mount(DISKNAME);
+	fs_create("big");
+	fd = fs_open("big");
+	fs_write(fd, data, sizeof(data));
+	fs_close(fd);
+	fs_snapshot_create("snap");
+	fs_create("fill");
+	fd = fs_open("fill");
+	while (fs_write(fd, data, sizeof(data)) == sizeof(data))
+		;
+	fs_close(fd);
+	fd = fs_open("big");
+	ret = fs_write(fd, "XXXX", 4);
+	ASSERT(ret == 0, "write to a snapshot block of a full disk");
+	ret = fs_close(fd);
+	ASSERT(ret == 0, "close after a failed write to a snapshot block");
+	fs_umount();
+
+	ret = fs_check(DISKNAME, 0, 0, &report);
+	ASSERT(ret == 0 && report.errors == 0, "fs_check after filling a disk with a snapshot");
+
+    fprintf(stderr, "%s", green("...PASSED THE WHOLE TEST!\n"));
+}
+
+void dedup()
+{
+	static char data[64 * 4096], buf[64 * 4096];
+	struct fs_dedup_report dedup_report;
+	struct fs_check_report report;
+	struct fs_stats stats;
+	int fd, ret;
+    fprintf(stderr, "%s", color("\n------TESTING dedup------\n", 33));
+
+	// 26 distinct blocks, repeated
+	for (size_t i = 0; i < sizeof(data); i++)
+		data[i] = 'a' + i / 4096 % 26;
+
+    /* deduplication needs extents */
+	fs_format(DISKNAME, 4096, 0);
+	fs_mount(DISKNAME);
+	ASSERT(fs_dedup(1) == -1, "fs_dedup on a FAT disk");
+	ASSERT(fs_dedup_scan(&dedup_report) == -1, "fs_dedup_scan on a FAT disk");
+	fs_umount();
+
+    /* the offline scan keeps one copy of each distinct block */
+	fs_format(DISKNAME, 4096, FS_FORMAT_EXTENTS);
+	fs_mount(DISKNAME);
+	fs_create("a");
+	fs_create("b");
+	fd = fs_open("a");
+	fs_write(fd, data, sizeof(data));
+	fs_close(fd);
+	fd = fs_open("b");
+	fs_write(fd, data, sizeof(data));
+	fs_close(fd);
+	ASSERT(fs_dedup_scan(NULL) == -1, "fs_dedup_scan without a report");
+	ret = fs_dedup_scan(&dedup_report);
+	ASSERT(ret == 0, "fs_dedup_scan");
+	ASSERT(dedup_report.blocks_scanned == 128, "every block is scanned");
+	ASSERT(dedup_report.blocks_deduplicated == 102, "duplicates are released");
+	ASSERT(dedup_report.logical_blocks == 128 && dedup_report.physical_blocks == 26, "dedup ratio");
+	ASSERT(dedup_report.mismatches == 0, "no fingerprint mismatch");
+
+	fd = fs_open("b");
+	ret = fs_read(fd, buf, sizeof(buf));
+	ASSERT(ret == sizeof(buf) && !memcmp(buf, data, sizeof(data)), "read deduplicated file");
+
+    /* writes to a deduplicated block copy it */
+	memset(data + 3 * 4096, 'X', 4096);
+	fs_lseek(fd, 3 * 4096);
+	fs_write(fd, data + 3 * 4096, 4096);
+	fs_lseek(fd, 0);
+	ret = fs_read(fd, buf, sizeof(buf));
+	ASSERT(ret == sizeof(buf) && !memcmp(buf, data, sizeof(data)), "read modified file");
+	fs_close(fd);
+	memset(data + 3 * 4096, 'd', 4096);
+	fd = fs_open("a");
+	ret = fs_read(fd, buf, sizeof(buf));
+	ASSERT(ret == sizeof(buf) && !memcmp(buf, data, sizeof(data)), "other file is unchanged");
+	fs_close(fd);
+	fs_umount();
+
+	ret = fs_check(DISKNAME, 0, 0, &report);
+	ASSERT(ret == 0 && report.errors == 0, "fs_check after fs_dedup_scan");
+
+    /* inline deduplication maps full blocks to the indexed ones, across mounts */
+	fs_mount(DISKNAME);
+	ASSERT(fs_dedup(1) == 0, "fs_dedup");
+	fs_create("c");
+	fd = fs_open("c");
+	fs_reset_stats();
+	ret = fs_write(fd, data, sizeof(data));
+	ASSERT(ret == sizeof(data), "write duplicate data");
+	fs_get_stats(&stats);
+	ASSERT(stats.blocks_deduplicated == 64, "every block is deduplicated");
+	ASSERT(stats.blocks_written < 8, "no data block is written");
+	fs_close(fd);
+	fs_umount();
+
+	fs_mount(DISKNAME);
+	fs_create("d");
+	fd = fs_open("d");
+	fs_reset_stats();
+	for (int i = 0; i < 16; i++)
+		fs_write(fd, data + i * 512, 512);
+	memset(buf, 'Q', 4096);
+	fs_write(fd, buf, 4096);
+	fs_get_stats(&stats);
+	ASSERT(stats.blocks_deduplicated == 2, "blocks of small writes are deduplicated");
+	fs_lseek(fd, 0);
+	ret = fs_read(fd, buf, sizeof(buf));
+	ASSERT(ret == 3 * 4096 && !memcmp(buf, data, 2 * 4096), "read small writes");
+	fs_close(fd);
+	fd = fs_open("c");
+	ret = fs_read(fd, buf, sizeof(buf));
+	ASSERT(ret == sizeof(buf) && !memcmp(buf, data, sizeof(data)), "read file written after remount");
+	fs_close(fd);
+	fs_delete("a");
+	fs_delete("b");
+	fs_umount();
+
+	ret = fs_check(DISKNAME, 0, 0, &report);
+	ASSERT(ret == 0 && report.errors == 0, "fs_check after inline deduplication");
+
+    /* deduplication of a log disk */
+	fs_format(DISKNAME, 4096, FS_FORMAT_LOG);
+	fs_mount(DISKNAME);
+	fs_dedup(1);
+	fs_create("a");
+	fd = fs_open("a");
+	fs_reset_stats();
+	fs_write(fd, data, sizeof(data));
+	fs_get_stats(&stats);
+	ASSERT(stats.blocks_deduplicated == 38, "log disk deduplicates repeated blocks");
+	fs_lseek(fd, 0);
+	ret = fs_read(fd, buf, sizeof(buf));
+	ASSERT(ret == sizeof(buf) && !memcmp(buf, data, sizeof(data)), "read deduplicated file on a log disk");
+	fs_close(fd);
+	fs_clean(0);
+	fs_umount();
+
+	ret = fs_check(DISKNAME, 0, 0, &report);
+	ASSERT(ret == 0 && report.errors == 0, "fs_check log disk with deduplication");
+
+    fprintf(stderr, "%s", green("...PASSED THE WHOLE TEST!\n"));
+}
+
+void compress()
+{
+	static char data[256 * 1024], noise[64 * 1024], buf[256 * 1024];
+	struct fs_check_report report;
+	struct fs_stats stats;
+	struct fs_frag frag;
+	uint32_t free_blocks;
+	uint32_t seed = 1;
+	size_t len = 0;
+	int fd, snap_fd, ret;
+    fprintf(stderr, "%s", color("\n------TESTING compress------\n", 33));
+
+	// log-like text compresses, random bytes do not
+	for (int line = 0; len + 80 < sizeof(data); line++)
+		len += sprintf(data + len, "2026-10-18 12:%02d:%02d INFO request %d served in %d ms\n",
+					   line / 60 % 60, line % 60, line, line * 7 % 1000);
+	memset(data + len, '\n', sizeof(data) - len);
+	for (size_t i = 0; i < sizeof(noise); i++) {
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+		noise[i] = seed;
+	}
+
+    /* compression needs extents and an empty file */
+	fs_format(DISKNAME, 4096, 0);
+	fs_mount(DISKNAME);
+	fs_create("a");
+	ASSERT(fs_compress("a", 1) == -1, "fs_compress on a FAT disk");
+	fs_umount();
+
+	fs_format(DISKNAME, 4096, FS_FORMAT_EXTENTS);
+	fs_mount(DISKNAME);
+	fs_create("a");
+	fd = fs_open("a");
+	fs_write(fd, "x", 1);
+	fs_close(fd);
+	ASSERT(fs_compress("a", 1) == -1, "fs_compress of a non-empty file");
+	ASSERT(fs_compress("none", 1) == -1, "fs_compress of a missing file");
+	fs_delete("a");
+
+    /* compressible data takes fewer blocks */
+	fs_create("a");
+	ASSERT(fs_compress("a", 1) == 0, "fs_compress");
+	fs_fragmentation(&frag);
+	free_blocks = frag.free_blocks;
+	fd = fs_open("a");
+	fs_reset_stats();
+	ret = fs_write(fd, data, sizeof(data));
+	ASSERT(ret == sizeof(data), "write compressible data");
+	fs_close(fd);
+	fs_get_stats(&stats);
+	ASSERT(stats.chunks_compressed == 4, "every chunk is compressed");
+	fs_fragmentation(&frag);
+	ASSERT(free_blocks - frag.free_blocks < 64 / 2, "compressed file takes fewer blocks");
+
+	fd = fs_open("a");
+	ASSERT(fs_stat(fd) == sizeof(data), "size of compressed file");
+	ret = fs_read(fd, buf, sizeof(buf));
+	ASSERT(ret == sizeof(buf) && !memcmp(buf, data, sizeof(data)), "read compressed file");
+	fs_lseek(fd, 100000);
+	ret = fs_read(fd, buf, 5000);
+	ASSERT(ret == 5000 && !memcmp(buf, data + 100000, 5000), "read across chunks");
+
+    /* overwrites modify the chunk in place */
+	memset(data + 70000, 'X', 3000);
+	fs_lseek(fd, 70000);
+	fs_write(fd, data + 70000, 3000);
+	fs_lseek(fd, 0);
+	ret = fs_read(fd, buf, sizeof(buf));
+	ASSERT(ret == sizeof(buf) && !memcmp(buf, data, sizeof(data)), "read overwritten compressed file");
+	fs_close(fd);
+
+    /* incompressible data is stored as is */
+	fs_create("b");
+	fs_compress("b", 1);
+	fd = fs_open("b");
+	fs_reset_stats();
+	fs_write(fd, noise, sizeof(noise));
+	fs_close(fd);
+	fs_get_stats(&stats);
+	ASSERT(stats.chunks_uncompressed == 1 && stats.chunks_compressed == 0, "incompressible chunk");
+	fd = fs_open("b");
+	ret = fs_read(fd, buf, sizeof(noise));
+	ASSERT(ret == sizeof(noise) && !memcmp(buf, noise, sizeof(noise)), "read incompressible file");
+	fs_close(fd);
+
+    /* small appends are stored when the file is closed */
+	fs_create("c");
+	fs_compress("c", 1);
+	fd = fs_open("c");
+	for (int i = 0; i < 200; i++)
+		fs_write(fd, data + i * 100, 100);
+	fs_close(fd);
+	fs_umount();
+
+	fs_mount(DISKNAME);
+	fd = fs_open("c");
+	ret = fs_read(fd, buf, sizeof(buf));
+	ASSERT(ret == 20000 && !memcmp(buf, data, 20000), "read small appends after remount");
+	fs_close(fd);
+	fd = fs_open("a");
+	ret = fs_read(fd, buf, sizeof(buf));
+	ASSERT(ret == sizeof(buf) && !memcmp(buf, data, sizeof(data)), "read compressed file after remount");
+
+    /* truncation cuts a chunk, growing reads zeros */
+	ret = fs_ftruncate(fd, 100000);
+	ASSERT(ret == 0, "fs_ftruncate compressed file");
+	ret = fs_ftruncate(fd, 200000);
+	ASSERT(ret == 0, "grow compressed file");
+	fs_lseek(fd, 0);
+	ret = fs_read(fd, buf, sizeof(buf));
+	ASSERT(ret == 200000 && !memcmp(buf, data, 100000), "read truncated compressed file");
+	ASSERT(buf[100000] == 0 && !memcmp(buf + 100000, buf + 100001, 99999), "grown part reads zeros");
+
+    /* chunks of zeros are holes */
+	ASSERT(fs_seek_data(fd, 0) == 0, "fs_seek_data at data");
+	ASSERT(fs_seek_hole(fd, 0) == 2 * 64 * 1024, "fs_seek_hole after the last chunk with data");
+	fs_close(fd);
+
+    /* clones and snapshots share the stored chunks */
+	ASSERT(fs_clone("a", "copy") == 0, "fs_clone compressed file");
+	ASSERT(fs_snapshot_create("snap") == 0, "fs_snapshot_create with compressed files");
+	fd = fs_open("a");
+	fs_write(fd, noise, 4096);
+	fs_close(fd);
+	fd = fs_open("copy");
+	ret = fs_read(fd, buf, sizeof(buf));
+	ASSERT(ret == 200000 && !memcmp(buf, data, 100000), "read clone of compressed file");
+	fs_close(fd);
+	snap_fd = fs_snapshot_open("snap", "a");
+	ret = fs_read(snap_fd, buf, sizeof(buf));
+	ASSERT(ret == 200000 && !memcmp(buf, data, 100000), "read compressed file in a snapshot");
+	fs_close(snap_fd);
+	fd = fs_open("a");
+	ret = fs_read(fd, buf, 4096);
+	ASSERT(ret == 4096 && !memcmp(buf, noise, 4096), "read modified compressed file");
+	fs_close(fd);
+	fs_umount();
+
+	ret = fs_check(DISKNAME, 0, 0, &report);
+	ASSERT(ret == 0 && report.errors == 0, "fs_check with compressed files");
+
+    /* compression of a log disk */
+	fs_format(DISKNAME, 4096, FS_FORMAT_LOG);
+	fs_mount(DISKNAME);
+	fs_create("a");
+	fs_compress("a", 1);
+	fd = fs_open("a");
+	fs_write(fd, data, sizeof(data));
+	fs_lseek(fd, 0);
+	ret = fs_read(fd, buf, sizeof(buf));
+	ASSERT(ret == sizeof(buf) && !memcmp(buf, data, sizeof(data)), "read compressed file on a log disk");
+	fs_close(fd);
+	fs_clean(0);
+	fd = fs_open("a");
+	ret = fs_read(fd, buf, sizeof(buf));
+	ASSERT(ret == sizeof(buf) && !memcmp(buf, data, sizeof(data)), "read compressed file after cleaning");
+	fs_close(fd);
+	fs_umount();
+
+	ret = fs_check(DISKNAME, 0, 0, &report);
+	ASSERT(ret == 0 && report.errors == 0, "fs_check log disk with compressed files");
+
+    /* defrag stores cached chunks before it looks at the extents, a chunk that grows takes more blocks */
+	fs_format(DISKNAME, 4096, FS_FORMAT_EXTENTS);
+	fs_mount(DISKNAME);
+	fs_create("a");
+	fs_compress("a", 1);
+	fs_create("b");
+	fd = fs_open("a");
+	fs_write(fd, data, 64 * 1024);
+	fs_close(fd);
+	fd = fs_open("b");
+	fs_write(fd, noise, 4096);
+	fs_close(fd);
+	fd = fs_open("a");
+	fs_lseek(fd, 64 * 1024);
+	fs_write(fd, data + 64 * 1024, 64 * 1024);
+	fs_close(fd);
+
+	fd = fs_open("a");
+	memcpy(data, noise, 32 * 1024);
+	fs_write(fd, noise, 32 * 1024);
+	ret = fs_defrag(0, 0);
+	ASSERT(ret == 0, "fs_defrag with a modified chunk in the cache");
+	fs_close(fd);
+	fs_umount();
+
+	ret = fs_check(DISKNAME, 0, 0, &report);
+	ASSERT(ret == 0 && report.errors == 0, "fs_check after defrag of a compressed file");
+	fs_mount(DISKNAME);
+	fd = fs_open("a");
+	ret = fs_read(fd, buf, sizeof(buf));
+	ASSERT(ret == 128 * 1024 && !memcmp(buf, data, 128 * 1024), "read compressed file after defrag");
+	fs_close(fd);
+	fs_umount();
+
+    fprintf(stderr, "%s", green("...PASSED THE WHOLE TEST!\n"));
+}
+
+void checksums()
+{
+	static char data[64 * 4096], buf[64 * 4096], block[4096];
+	static uint16_t FAT[4096 / sizeof(uint16_t)];
+	struct fs_scrub_report scrub;
+	struct fs_check_report report;
+	struct fs_stats stats;
+	struct fs_frag frag;
+	uint32_t free_blocks;
+	int fd, ret, bad_block = -1;
+    fprintf(stderr, "%s", color("\n------TESTING checksums------\n", 33));
+
+	// every block of the file is different, so it can be found on the disk
+	for (size_t i = 0; i < sizeof(data); i++)
+		data[i] = 'a' + (i / 4096 + i) % 26;
+	for (int i = 0; i < 64; i++)
+		sprintf(data + i * 4096, "block %d", i);
+
+    /* scrubbing needs checksums */
+	fs_format(DISKNAME, 4096, 0);
+	fs_mount(DISKNAME);
+	ASSERT(fs_scrub(0, &scrub) == -1, "fs_scrub without checksums");
+	ASSERT(fs_scrub_rate(1000) == -1, "fs_scrub_rate without checksums");
+
+	fs_fragmentation(&frag);
+	free_blocks = frag.free_blocks;
+	ret = fs_checksums(1);
+	ASSERT(ret == 0, "fs_checksums");
+	fs_fragmentation(&frag);
+	ASSERT(frag.free_blocks < free_blocks, "checksum region takes data blocks");
+
+	fs_create("a");
+	fd = fs_open("a");
+	ret = fs_write(fd, data, sizeof(data));
+	ASSERT(ret == sizeof(data), "write with checksums");
+	fs_close(fd);
+	ret = fs_scrub(0, &scrub);
+	ASSERT(ret == 0 && scrub.bad_blocks == 0 && scrub.blocks_scrubbed >= 64, "fs_scrub clean disk");
+	ret = fs_scrub(10, &scrub);
+	ASSERT(ret == 0 && scrub.blocks_scrubbed == 10, "fs_scrub budget");
+	fs_umount();
+
+	ret = fs_check(DISKNAME, 0, 0, &report);
+	ASSERT(ret == 0 && report.errors == 0, "fs_check with checksums");
+
+    /* flip a bit of the sixth block of the file behind the library's back */
+	block_disk_open(DISKNAME);
+	for (int i = 0; i < block_disk_count() && bad_block == -1; i++) {
+		block_read(i, block);
+		if (!memcmp(block, data + 5 * 4096, sizeof(block)))
+			bad_block = i;
+	}
+	block[100] ^= 1;
+	block_write(bad_block, block);
+	block_disk_close();
+	ASSERT(bad_block != -1, "find the block on disk");
+
+	fs_mount(DISKNAME);
+	fs_reset_stats();
+	fd = fs_open("a");
+	ret = fs_read(fd, buf, sizeof(buf));
+	ASSERT(ret == 5 * 4096 && !memcmp(buf, data, 5 * 4096), "read stops before corrupted block");
+	ret = fs_read(fd, buf, 4096);
+	ASSERT(ret == -1, "read corrupted block");
+	fs_lseek(fd, 6 * 4096);
+	ret = fs_read(fd, buf, 4096);
+	ASSERT(ret == 4096 && !memcmp(buf, data + 6 * 4096, 4096), "read past corrupted block");
+	fs_close(fd);
+	fs_get_stats(&stats);
+	ASSERT(stats.checksum_failures > 0, "checksum failures counted");
+
+	ret = fs_scrub(0, &scrub);
+	ASSERT(ret == 1 && scrub.bad_blocks == 1 && scrub.first_bad_block == (uint32_t) bad_block, "fs_scrub finds corrupted block");
+	fs_umount();
+
+	ret = fs_check(DISKNAME, 0, 0, &report);
+	ASSERT(ret == 1 && report.bad_checksums == 1, "fs_check corrupted block");
+
+    /* a leak written to the FAT also breaks the checksum of the FAT block */
+	block_disk_open(DISKNAME);
+	block[100] ^= 1;
+	block_write(bad_block, block);
+	block_read(1, FAT);
+	FAT[1000] = 0xFFFF;
+	block_write(1, FAT);
+	block_disk_close();
+
+	ret = fs_check(DISKNAME, 0, 0, &report);
+	ASSERT(ret == 2 && report.leaked == 1 && report.bad_checksums == 1, "fs_check leak in FAT");
+	ret = fs_check(DISKNAME, FS_CHECK_REPAIR, 0, &report);
+	ASSERT(ret == 1 && report.repaired == 1, "fs_check repair");
+	ret = fs_check(DISKNAME, 0, 0, &report);
+	ASSERT(ret == 0 && report.errors == 0, "repair updates the checksum of the FAT");
+
+    /* the root directory is verified at mount (block 3 with 2 FAT blocks) */
+	block_disk_open(DISKNAME);
+	block_read(3, block);
+	block[0] ^= 1;
+	block_write(3, block);
+	block_disk_close();
+	ASSERT(fs_mount(DISKNAME) == -1, "fs_mount with corrupted root directory");
+
+	block_disk_open(DISKNAME);
+	block[0] ^= 1;
+	block_write(3, block);
+	block_disk_close();
+	ASSERT(fs_mount(DISKNAME) == 0, "fs_mount with restored root directory");
+
+    /* the background scrubber verifies the disk at its own pace */
+	fs_reset_stats();
+	ret = fs_scrub_rate(100000);
+	ASSERT(ret == 0, "fs_scrub_rate");
+	fs_get_stats(&stats);
+	for (int i = 0; i < 2000 && stats.blocks_scrubbed < 64; i++) {
+		usleep(1000);
+		fs_get_stats(&stats);
+	}
+	ASSERT(stats.blocks_scrubbed >= 64 && stats.checksum_failures == 0, "background scrub");
+	fd = fs_open("a");
+	ret = fs_read(fd, buf, sizeof(buf));
+	ASSERT(ret == sizeof(buf) && !memcmp(buf, data, sizeof(data)), "read while scrubbing");
+	fs_close(fd);
+	ASSERT(fs_scrub_rate(0) == 0, "stop the scrubber");
+
+    /* disabling releases the region */
+	fs_fragmentation(&frag);
+	free_blocks = frag.free_blocks;
+	ret = fs_checksums(0);
+	ASSERT(ret == 0, "disable checksums");
+	fs_fragmentation(&frag);
+	ASSERT(frag.free_blocks > free_blocks, "checksum region released");
+	ASSERT(fs_scrub(0, NULL) == -1, "fs_scrub after disabling");
+	fs_umount();
+
+	ret = fs_check(DISKNAME, 0, 0, &report);
+	ASSERT(ret == 0 && report.errors == 0, "fs_check after disabling");
+
+    /* blocks moved by the log cleaner keep their checksums */
+	fs_format(DISKNAME, 4096, FS_FORMAT_LOG);
+	fs_mount(DISKNAME);
+	fs_checksums(1);
+	fs_create("a");
+	fd = fs_open("a");
+	fs_write(fd, data, sizeof(data));
+	fs_lseek(fd, 4096);
+	fs_write(fd, data + 4096, 16 * 4096);
+	fs_close(fd);
+	fs_clean(0);
+	fs_umount();
+
+	ret = fs_check(DISKNAME, 0, 0, &report);
+	ASSERT(ret == 0 && report.errors == 0, "fs_check log disk with checksums");
+
+	fs_mount(DISKNAME);
+	fd = fs_open("a");
+	ret = fs_read(fd, buf, sizeof(buf));
+	ASSERT(ret == sizeof(buf) && !memcmp(buf, data, sizeof(data)), "read log disk with checksums");
+	fs_close(fd);
+	ret = fs_scrub(0, &scrub);
+	ASSERT(ret == 0 && scrub.blocks_scrubbed >= 64, "fs_scrub log disk");
+	fs_umount();
+
+    fprintf(stderr, "%s", green("...PASSED THE WHOLE TEST!\n"));
 }
 
 int main(int argc, char *argv[]) {
@@ -443,4 +2410,25 @@ int main(int argc, char *argv[]) {
 	write_and_read();
 	write_and_read_big_files();
 	read_write_basic();
+	tail_packing();
+	sparse_files();
+	truncate_files();
+	append_mode();
+	write_buffering();
+	tracing();
+	runtime_stats();
+	disk_stats();
+	latency_model();
+	ram_backend();
+	defrag();
+	image_check();
+	fat32();
+	large_files();
+	extents();
+	log_structured();
+	clones();
+	snapshots();
+	dedup();
+	compress();
+	checksums();
 }
@@ -1,8 +1,11 @@
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "disk.h"
@@ -15,130 +18,797 @@
 
 /* Disk instance description */
 struct disk {
-	/* File descriptor */
-	int fd;
+	/* Backend serving the blocks, and its state (NULL when closed) */
+	const struct block_backend *backend;
+	void *priv;
 	/* Block count */
 	size_t bcount;
+	/* First block of the root directory and data regions */
+	size_t root_block;
+	size_t data_start;
 };
 
 /* Currently open virtual disk (invalid by default) */
-static struct disk disk = { .fd = INVALID_FD };
+static struct disk disk;
 
-int block_disk_open(const char *diskname)
+/* I/O statistics of the most recently opened disk */
+static struct block_disk_stats stats;
+static uint64_t *access_counts;
+static size_t access_bcount;
+
+/* Serializes the accounting of accesses made from several threads (e.g. by fs_check()) */
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t now_ns(void)
 {
-	int fd;
-	struct stat st;
+	struct timespec ts;
 
-	if (!diskname) {
-		block_error("invalid file diskname");
-		return -1;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static enum block_region block_region(size_t block)
+{
+	if (block == 0)
+		return BLOCK_REGION_SUPERBLOCK;
+	if (block < disk.root_block)
+		return BLOCK_REGION_FAT;
+	if (block < disk.data_start)
+		return BLOCK_REGION_ROOT;
+	return BLOCK_REGION_DATA;
+}
+
+/* Simulated device latency (disabled by default) */
+static struct {
+	int enabled;
+	int env_checked;
+	struct block_latency_model model;
+	/* Random state, and block a sequential access would hit next */
+	uint64_t rng;
+	size_t next_block;
+	/* Latency injected since the program started */
+	uint64_t total_ns;
+} sim;
+
+/* xorshift64, so that a seed always gives the same latencies */
+static uint64_t sim_random(void)
+{
+	sim.rng ^= sim.rng << 13;
+	sim.rng ^= sim.rng >> 7;
+	sim.rng ^= sim.rng << 17;
+	return sim.rng;
+}
+
+static uint64_t isqrt(uint64_t x)
+{
+	uint64_t r = 0;
+
+	for (uint64_t bit = 1ULL << 62; bit; bit >>= 2) {
+		if (x >= r + bit) {
+			x -= r + bit;
+			r = (r >> 1) + bit;
+		} else {
+			r >>= 1;
+		}
 	}
+	return r;
+}
 
-	if (disk.fd != INVALID_FD) {
-		block_error("disk already open");
-		return -1;
+/* Latency the simulated device adds to a request for @count blocks from @block */
+static uint64_t sim_latency(size_t block, size_t count)
+{
+	const struct block_latency_model *m = &sim.model;
+	uint64_t ns = m->fixed_ns;
+
+	if (m->bandwidth)
+		ns += count * BLOCK_SIZE * 1000000000ULL / m->bandwidth;
+
+	/* Re-reading the previous block is served by the drive's cache */
+	if (block != sim.next_block && block + 1 != sim.next_block) {
+		size_t distance = block > sim.next_block ?
+			block - sim.next_block : sim.next_block - block;
+
+		/* Seek time grows with the square root of the distance */
+		if (m->seek_max_ns > m->seek_min_ns) {
+			uint64_t fraction = (distance << 32) / disk.bcount;
+			ns += (m->seek_max_ns - m->seek_min_ns) * isqrt(fraction) >> 16;
+		}
+		ns += m->seek_min_ns;
+		if (m->rotation_ns)
+			ns += sim_random() % m->rotation_ns;
+		stats.seeks++;
+	}
+	sim.next_block = block + count;
+
+	if (m->outlier_ppm && sim_random() % 1000000 < m->outlier_ppm) {
+		ns += m->outlier_ns;
+		stats.outliers++;
 	}
 
-	if ((fd = open(diskname, O_RDWR, 0644)) < 0) {
+	stats.injected_ns += ns;
+	sim.total_ns += ns;
+	return ns;
+}
+
+/* Wait until @ns after @from, sleeping for long waits and spinning for short ones */
+static void sim_wait(uint64_t from, uint64_t ns)
+{
+	uint64_t deadline = from + ns;
+	uint64_t now;
+
+	while ((now = now_ns()) < deadline) {
+		if (deadline - now > 100000) {
+			uint64_t sleep_ns = deadline - now - 50000;
+			struct timespec ts = {
+				.tv_sec = sleep_ns / 1000000000ULL,
+				.tv_nsec = sleep_ns % 1000000000ULL,
+			};
+			nanosleep(&ts, NULL);
+		}
+	}
+}
+
+/* Account for one block access that took @latency (stats_lock held) */
+static void block_account_locked(uint64_t hist[BLOCK_REGION_COUNT][BLOCK_LATENCY_BUCKETS],
+				 size_t block, uint64_t latency)
+{
+	int bucket = latency ? 63 - __builtin_clzll(latency) : 0;
+
+	if (bucket >= BLOCK_LATENCY_BUCKETS)
+		bucket = BLOCK_LATENCY_BUCKETS - 1;
+
+	hist[block_region(block)][bucket]++;
+	access_counts[block]++;
+}
+
+/*
+ * Account for @count blocks transferred at once in @latency, and simulate the
+ * device latency of the request. The wait happens once the lock is released, so
+ * that requests from several threads overlap like on a real device.
+ */
+static void block_account_range(uint64_t hist[BLOCK_REGION_COUNT][BLOCK_LATENCY_BUCKETS],
+				size_t block, size_t count, uint64_t latency)
+{
+	uint64_t injected = 0;
+	int wait = 0;
+
+	pthread_mutex_lock(&stats_lock);
+	if (sim.enabled) {
+		injected = sim_latency(block, count);
+		wait = !sim.model.virtual;
+	}
+	for (size_t i = 0; i < count; i++)
+		block_account_locked(hist, block + i, (latency + injected) / count);
+	pthread_mutex_unlock(&stats_lock);
+
+	if (wait)
+		sim_wait(now_ns(), injected);
+}
+
+/* Account for one block access that took @latency */
+static void block_account(uint64_t hist[BLOCK_REGION_COUNT][BLOCK_LATENCY_BUCKETS],
+			  size_t block, uint64_t latency)
+{
+	block_account_range(hist, block, 1, latency);
+}
+
+
+/* FILE BACKEND */
+
+/* Image file of the file backend */
+static struct file_disk {
+	int fd;
+	size_t bcount;
+} file_disk = { .fd = INVALID_FD };
+
+static void *file_open(const char *path, size_t *bcount)
+{
+	int fd;
+	struct stat st;
+
+	if ((fd = open(path, O_RDWR, 0644)) < 0) {
 		perror("open");
-		return -1;
+		return NULL;
 	}
 
 	if (fstat(fd, &st)) {
 		perror("fstat");
-		return -1;
+		close(fd);
+		return NULL;
 	}
 
 	/* The disk image's size should be a multiple of the block size */
 	if (st.st_size % BLOCK_SIZE != 0) {
 		block_error("size '%zu' is not multiple of '%d'",
 			    st.st_size, BLOCK_SIZE);
+		close(fd);
+		return NULL;
+	}
+
+	file_disk.fd = fd;
+	file_disk.bcount = st.st_size / BLOCK_SIZE;
+	*bcount = file_disk.bcount;
+
+	return &file_disk;
+}
+
+static int file_close(void *priv)
+{
+	struct file_disk *f = priv;
+
+	close(f->fd);
+	f->fd = INVALID_FD;
+
+	return 0;
+}
+
+static size_t file_count(void *priv)
+{
+	struct file_disk *f = priv;
+
+	return f->bcount;
+}
+
+static int file_readv(void *priv, size_t block, size_t count, void *buf)
+{
+	struct file_disk *f = priv;
+	size_t len = count * BLOCK_SIZE;
+
+	/* Read at the block's offset, the descriptor is shared by the threads of fs_check() */
+	for (size_t done = 0; done < len; ) {
+		ssize_t ret = pread(f->fd, (char *)buf + done, len - done, block * BLOCK_SIZE + done);
+
+		if (ret <= 0) {
+			perror("pread");
+			return -1;
+		}
+		done += ret;
+	}
+
+	return 0;
+}
+
+static int file_writev(void *priv, size_t block, size_t count, const void *buf)
+{
+	struct file_disk *f = priv;
+	size_t len = count * BLOCK_SIZE;
+
+	/* Write at the block's offset, without moving a file position shared between threads */
+	for (size_t done = 0; done < len; ) {
+		ssize_t ret = pwrite(f->fd, (const char *)buf + done, len - done, block * BLOCK_SIZE + done);
+
+		if (ret <= 0) {
+			perror("pwrite");
+			return -1;
+		}
+		done += ret;
+	}
+
+	return 0;
+}
+
+static int file_read(void *priv, size_t block, void *buf)
+{
+	return file_readv(priv, block, 1, buf);
+}
+
+static int file_write(void *priv, size_t block, const void *buf)
+{
+	return file_writev(priv, block, 1, buf);
+}
+
+static int file_sync(void *priv)
+{
+	struct file_disk *f = priv;
+
+	if (fdatasync(f->fd)) {
+		perror("fdatasync");
+		return -1;
+	}
+
+	return 0;
+}
+
+const struct block_backend block_backend_file = {
+	.name = "file",
+	.open = file_open,
+	.close = file_close,
+	.count = file_count,
+	.read = file_read,
+	.write = file_write,
+	.readv = file_readv,
+	.writev = file_writev,
+	.sync = file_sync,
+};
+
+
+/* RAM BACKEND */
+
+/* In-memory copy of an image */
+struct ram_disk {
+	char *blocks;
+	size_t bcount;
+	/* Image to write the blocks back to, NULL to discard them */
+	char *save_path;
+};
+
+static void *ram_load(const char *path, size_t *bcount, int save)
+{
+	struct ram_disk *r;
+	size_t count;
+
+	/* Borrow the file backend to read the whole image in one go */
+	if (!file_open(path, &count))
+		return NULL;
+
+	r = calloc(1, sizeof(*r));
+	if (r) {
+		r->bcount = count;
+		r->blocks = malloc(count ? count * BLOCK_SIZE : 1);
+		r->save_path = save ? strdup(path) : NULL;
+	}
+	if (!r || !r->blocks || (save && !r->save_path)
+	    || file_readv(&file_disk, 0, count, r->blocks)) {
+		if (r) {
+			free(r->blocks);
+			free(r->save_path);
+		}
+		free(r);
+		file_close(&file_disk);
+		return NULL;
+	}
+	file_close(&file_disk);
+
+	*bcount = count;
+	return r;
+}
+
+static void *ram_open(const char *path, size_t *bcount)
+{
+	return ram_load(path, bcount, 0);
+}
+
+static void *ram_save_open(const char *path, size_t *bcount)
+{
+	return ram_load(path, bcount, 1);
+}
+
+static int ram_sync(void *priv)
+{
+	struct ram_disk *r = priv;
+	size_t count;
+	int ret;
+
+	if (!r->save_path)
+		return 0;
+
+	if (!file_open(r->save_path, &count))
+		return -1;
+
+	ret = count == r->bcount ? file_writev(&file_disk, 0, count, r->blocks) : -1;
+	if (ret == 0)
+		ret = file_sync(&file_disk);
+	file_close(&file_disk);
+
+	return ret;
+}
+
+static int ram_close(void *priv)
+{
+	struct ram_disk *r = priv;
+	int ret = ram_sync(r);
+
+	free(r->blocks);
+	free(r->save_path);
+	free(r);
+
+	return ret;
+}
+
+static size_t ram_count(void *priv)
+{
+	struct ram_disk *r = priv;
+
+	return r->bcount;
+}
+
+static int ram_readv(void *priv, size_t block, size_t count, void *buf)
+{
+	struct ram_disk *r = priv;
+
+	memcpy(buf, r->blocks + block * BLOCK_SIZE, count * BLOCK_SIZE);
+	return 0;
+}
+
+static int ram_writev(void *priv, size_t block, size_t count, const void *buf)
+{
+	struct ram_disk *r = priv;
+
+	memcpy(r->blocks + block * BLOCK_SIZE, buf, count * BLOCK_SIZE);
+	return 0;
+}
+
+static int ram_read(void *priv, size_t block, void *buf)
+{
+	return ram_readv(priv, block, 1, buf);
+}
+
+static int ram_write(void *priv, size_t block, const void *buf)
+{
+	return ram_writev(priv, block, 1, buf);
+}
+
+const struct block_backend block_backend_ram = {
+	.name = "ram",
+	.open = ram_open,
+	.close = ram_close,
+	.count = ram_count,
+	.read = ram_read,
+	.write = ram_write,
+	.readv = ram_readv,
+	.writev = ram_writev,
+	.sync = ram_sync,
+};
+
+const struct block_backend block_backend_ram_save = {
+	.name = "ram+save",
+	.open = ram_save_open,
+	.close = ram_close,
+	.count = ram_count,
+	.read = ram_read,
+	.write = ram_write,
+	.readv = ram_readv,
+	.writev = ram_writev,
+	.sync = ram_sync,
+};
+
+/* Backends that can be picked with a "<name>:" prefix on the disk name */
+static const struct block_backend *backends[] = {
+	&block_backend_ram,
+	&block_backend_ram_save,
+};
+
+
+/* BLOCK DISK API */
+
+int block_disk_open_backend(const char *path, const struct block_backend *backend)
+{
+	size_t bcount;
+	void *priv;
+
+	if (!path || !backend) {
+		block_error("invalid file diskname");
+		return -1;
+	}
+
+	if (disk.backend) {
+		block_error("disk already open");
+		return -1;
+	}
+
+	if (!(priv = backend->open(path, &bcount)))
 		return -1;
+
+	/* Pick up a latency model from the environment the first time */
+	if (!sim.env_checked) {
+		struct block_latency_model model;
+		const char *spec = getenv("DISK_LATENCY");
+
+		sim.env_checked = 1;
+		if (spec && block_disk_parse_latency(spec, &model) == 0)
+			block_disk_set_latency(&model);
+	}
+	sim.next_block = 0;
+
+	/* Start the statistics of this disk from scratch */
+	if (!access_counts || access_bcount != bcount) {
+		free(access_counts);
+		access_bcount = bcount;
+		access_counts = malloc((access_bcount ? access_bcount : 1) * sizeof(*access_counts));
+		if (!access_counts) {
+			perror("malloc");
+			backend->close(priv);
+			return -1;
+		}
 	}
+	block_disk_reset_stats();
 
-	disk.fd = fd;
-	disk.bcount = st.st_size / BLOCK_SIZE;
+	disk.backend = backend;
+	disk.priv = priv;
+	disk.bcount = bcount;
+	disk.root_block = 1;
+	disk.data_start = 1;
 
 	return 0;
 }
 
+int block_disk_open(const char *diskname)
+{
+	if (!diskname) {
+		block_error("invalid file diskname");
+		return -1;
+	}
+
+	for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+		size_t len = strlen(backends[i]->name);
+
+		if (!strncmp(diskname, backends[i]->name, len) && diskname[len] == ':')
+			return block_disk_open_backend(diskname + len + 1, backends[i]);
+	}
+
+	return block_disk_open_backend(diskname, &block_backend_file);
+}
+
+int block_disk_create(const char *diskname, size_t bcount)
+{
+	int fd;
+
+	if (!diskname || !bcount) {
+		block_error("invalid disk description");
+		return -1;
+	}
+
+	if ((fd = open(diskname, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+		perror("open");
+		return -1;
+	}
+
+	/* Blocks never written read back as zeros and take no room on the host */
+	if (ftruncate(fd, (off_t)bcount * BLOCK_SIZE)) {
+		perror("ftruncate");
+		close(fd);
+		return -1;
+	}
+
+	return close(fd);
+}
+
 int block_disk_close(void)
 {
-	if (disk.fd == INVALID_FD) {
+	int ret;
+
+	if (!disk.backend) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	close(disk.fd);
+	ret = disk.backend->close(disk.priv);
 
-	disk.fd = INVALID_FD;
+	disk.backend = NULL;
+	disk.priv = NULL;
 
-	return 0;
+	return ret;
 }
 
 int block_disk_count(void)
 {
-	if (disk.fd == INVALID_FD) {
+	if (!disk.backend) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	return disk.bcount;
+	return disk.backend->count(disk.priv);
 }
 
-int block_write(size_t block, const void *buf)
+int block_disk_sync(void)
 {
-	if (disk.fd == INVALID_FD) {
+	if (!disk.backend) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	if (block >= disk.bcount) {
-		block_error("block index out of bounds (%zu/%zu)",
-			    block, disk.bcount);
+	return disk.backend->sync ? disk.backend->sync(disk.priv) : 0;
+}
+
+int block_disk_set_layout(size_t root_block, size_t data_start)
+{
+	if (!disk.backend) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	if (root_block < 1 || data_start < root_block || data_start > disk.bcount) {
+		block_error("invalid layout (%zu/%zu/%zu)",
+			    root_block, data_start, disk.bcount);
 		return -1;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
+	disk.root_block = root_block;
+	disk.data_start = data_start;
+
+	return 0;
+}
+
+int block_disk_get_stats(struct block_disk_stats *out)
+{
+	if (!out)
 		return -1;
+
+	*out = stats;
+	return 0;
+}
+
+int block_disk_heatmap(uint64_t *counts, size_t count)
+{
+	if ((!counts && count) || !access_counts)
+		return -1;
+
+	memcpy(counts, access_counts,
+	       (count < access_bcount ? count : access_bcount) * sizeof(*counts));
+
+	return access_bcount;
+}
+
+void block_disk_reset_stats(void)
+{
+	memset(&stats, 0, sizeof(stats));
+	if (access_counts)
+		memset(access_counts, 0, access_bcount * sizeof(*access_counts));
+}
+
+int block_disk_set_latency(const struct block_latency_model *model)
+{
+	sim.env_checked = 1;
+	sim.enabled = model != NULL;
+	if (model) {
+		sim.model = *model;
+		sim.rng = model->seed ? model->seed : 1;
 	}
 
-	/* Perform the actual write into the disk image */
-	if (write(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("write");
+	return 0;
+}
+
+uint64_t block_disk_sim_time(void)
+{
+	return sim.total_ns;
+}
+
+int block_disk_parse_latency(const char *spec, struct block_latency_model *model)
+{
+	char buf[256], *saveptr, *tok;
+
+	if (!spec || !model || strlen(spec) >= sizeof(buf))
 		return -1;
+
+	memset(model, 0, sizeof(*model));
+	strcpy(buf, spec);
+
+	for (tok = strtok_r(buf, ",", &saveptr); tok; tok = strtok_r(NULL, ",", &saveptr)) {
+		char *value = strchr(tok, '=');
+		unsigned long long n = 0;
+
+		if (value) {
+			*value++ = '\0';
+			n = strtoull(value, NULL, 0);
+		}
+
+		if (!strcmp(tok, "none")) {
+			memset(model, 0, sizeof(*model));
+		} else if (!strcmp(tok, "ssd")) {
+			model->fixed_ns = 50000;
+			model->bandwidth = 500000000;
+		} else if (!strcmp(tok, "hdd")) {
+			model->seek_min_ns = 500000;
+			model->seek_max_ns = 15000000;
+			model->rotation_ns = 8333333;
+			model->bandwidth = 150000000;
+		} else if (!strcmp(tok, "virtual")) {
+			model->virtual = 1;
+		} else if (!value) {
+			block_error("invalid latency setting '%s'", tok);
+			return -1;
+		} else if (!strcmp(tok, "fixed_us")) {
+			model->fixed_ns = n * 1000;
+		} else if (!strcmp(tok, "seek_min_us")) {
+			model->seek_min_ns = n * 1000;
+		} else if (!strcmp(tok, "seek_max_us")) {
+			model->seek_max_ns = n * 1000;
+		} else if (!strcmp(tok, "rotation_us")) {
+			model->rotation_ns = n * 1000;
+		} else if (!strcmp(tok, "bw_mbps")) {
+			model->bandwidth = n * 1000000;
+		} else if (!strcmp(tok, "outlier_ppm")) {
+			model->outlier_ppm = n;
+		} else if (!strcmp(tok, "outlier_us")) {
+			model->outlier_ns = n * 1000;
+		} else if (!strcmp(tok, "seed")) {
+			model->seed = n;
+		} else {
+			block_error("invalid latency setting '%s'", tok);
+			return -1;
+		}
 	}
 
 	return 0;
 }
 
-int block_read(size_t block, void *buf)
+/* Check that @count blocks from @block can be accessed */
+static int block_check(size_t block, size_t count)
 {
-	if (disk.fd == INVALID_FD) {
+	if (!disk.backend) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	if (block >= disk.bcount) {
+	if (block >= disk.bcount || count > disk.bcount - block) {
 		block_error("block index out of bounds (%zu/%zu)",
-			    block, disk.bcount);
+			    block + count - 1, disk.bcount);
 		return -1;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
+	return 0;
+}
+
+int block_write(size_t block, const void *buf)
+{
+	uint64_t start = now_ns();
+
+	if (block_check(block, 1) || disk.backend->write(disk.priv, block, buf))
 		return -1;
-	}
 
-	/* Perform the actual read from the disk image */
-	if (read(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("read");
+	block_account(stats.write, block, now_ns() - start);
+
+	return 0;
+}
+
+int block_read(size_t block, void *buf)
+{
+	uint64_t start = now_ns();
+
+	if (block_check(block, 1) || disk.backend->read(disk.priv, block, buf))
+		return -1;
+
+	block_account(stats.read, block, now_ns() - start);
+
+	return 0;
+}
+
+int block_writev(size_t block, size_t count, const void *buf)
+{
+	uint64_t start = now_ns();
+
+	if (!count)
+		return 0;
+
+	if (block_check(block, count))
 		return -1;
+
+	if (!disk.backend->writev) {
+		for (size_t i = 0; i < count; i++)
+			if (block_write(block + i, (const char *)buf + i * BLOCK_SIZE))
+				return -1;
+		return 0;
 	}
 
+	if (disk.backend->writev(disk.priv, block, count, buf))
+		return -1;
+
+	block_account_range(stats.write, block, count, now_ns() - start);
+
 	return 0;
 }
 
+int block_readv(size_t block, size_t count, void *buf)
+{
+	uint64_t start = now_ns();
+
+	if (!count)
+		return 0;
+
+	if (block_check(block, count))
+		return -1;
+
+	if (!disk.backend->readv) {
+		for (size_t i = 0; i < count; i++)
+			if (block_read(block + i, (char *)buf + i * BLOCK_SIZE))
+				return -1;
+		return 0;
+	}
+
+	if (disk.backend->readv(disk.priv, block, count, buf))
+		return -1;
+
+	block_account_range(stats.read, block, count, now_ns() - start);
+
+	return 0;
+}
@@ -2,10 +2,54 @@
 #define _DISK_H
 
 #include <stddef.h> /* for size_t definition */
+#include <stdint.h>
 
 /** Size of a disk block in bytes */
 #define BLOCK_SIZE 4096
 
+/**
+ * struct block_backend - Storage behind the virtual disk
+ * @name: Name of the backend, also the prefix that selects it in
+ *        block_disk_open()
+ * @open: Open the disk described by @path, store its block count in @bcount
+ *        and return the backend's state for it (NULL on failure)
+ * @close: Release the disk
+ * @count: Return the block count of the disk
+ * @read: Read block @block into @buf
+ * @write: Write @buf into block @block
+ * @readv: Read @count consecutive blocks from @block into @buf (optional)
+ * @writev: Write @count consecutive blocks from @buf, starting at @block
+ *          (optional)
+ * @sync: Make the writes so far durable (optional)
+ *
+ * The block layer checks the bounds of every access before handing it to the
+ * backend, and accounts for it (statistics, simulated latency) around the
+ * backend's call. Missing vectored operations fall back to one call per block.
+ */
+struct block_backend {
+	const char *name;
+	void *(*open)(const char *path, size_t *bcount);
+	int (*close)(void *priv);
+	size_t (*count)(void *priv);
+	int (*read)(void *priv, size_t block, void *buf);
+	int (*write)(void *priv, size_t block, const void *buf);
+	int (*readv)(void *priv, size_t block, size_t count, void *buf);
+	int (*writev)(void *priv, size_t block, size_t count, const void *buf);
+	int (*sync)(void *priv);
+};
+
+/** Disk image file, accessed with system calls (the default backend) */
+extern const struct block_backend block_backend_file;
+
+/** Copy of a disk image held in memory, discarded when closed ("ram:") */
+extern const struct block_backend block_backend_ram;
+
+/**
+ * Copy of a disk image held in memory, written back to the image by
+ * block_disk_sync() and when closed ("ram+save:")
+ */
+extern const struct block_backend block_backend_ram_save;
+
 /**
  * block_disk_open - Open virtual disk file
  * @diskname: Name of the virtual disk file
@@ -14,11 +58,39 @@
  * blocks can be read from it with block_read() or written to it with
  * block_write().
  *
+ * A "ram:" or "ram+save:" prefix on @diskname loads the image that follows it
+ * in memory instead, so that block accesses make no system calls (see
+ * block_disk_open_backend()).
+ *
  * Return: -1 if @diskname is invalid, if the virtual disk file cannot be opened
  * or is already open. 0 otherwise.
  */
 int block_disk_open(const char *diskname);
 
+/**
+ * block_disk_open_backend - Open a virtual disk served by a given backend
+ * @path: Image the backend opens
+ * @backend: Backend to use
+ *
+ * Return: -1 if @path or @backend is NULL, if a disk is already open or if
+ * the backend cannot open @path. 0 otherwise.
+ */
+int block_disk_open_backend(const char *path, const struct block_backend *backend);
+
+/**
+ * block_disk_create - Create a blank virtual disk file
+ * @diskname: Name of the virtual disk file
+ * @bcount: Number of blocks of the disk
+ *
+ * Create virtual disk file @diskname, or truncate it if it exists, with
+ * @bcount blocks of zeros. The file is sparse, so blocks take room on the host
+ * only once they are written. The disk is not opened.
+ *
+ * Return: -1 if @diskname is NULL, if @bcount is 0 or if the file cannot be
+ * created. 0 otherwise.
+ */
+int block_disk_create(const char *diskname, size_t bcount);
+
 /**
  * block_disk_close - Close virtual disk file
  *
@@ -60,5 +132,188 @@ int block_write(size_t block, const void *buf);
  */
 int block_read(size_t block, void *buf);
 
+/**
+ * block_writev - Write consecutive blocks to disk
+ * @block: Index of the first block to write to
+ * @count: Number of blocks to write
+ * @buf: Data buffer of @count * %BLOCK_SIZE bytes
+ *
+ * Same as @count calls to block_write(), made in a single backend access when
+ * the backend supports it.
+ *
+ * Return: -1 if one of the blocks is out of bounds or inaccessible, or if the
+ * writing operation fails. 0 otherwise.
+ */
+int block_writev(size_t block, size_t count, const void *buf);
+
+/**
+ * block_readv - Read consecutive blocks from disk
+ * @block: Index of the first block to read from
+ * @count: Number of blocks to read
+ * @buf: Data buffer of @count * %BLOCK_SIZE bytes
+ *
+ * Same as @count calls to block_read(), made in a single backend access when
+ * the backend supports it.
+ *
+ * Return: -1 if one of the blocks is out of bounds or inaccessible, or if the
+ * reading operation fails. 0 otherwise.
+ */
+int block_readv(size_t block, size_t count, void *buf);
+
+/**
+ * block_disk_sync - Make the writes to the disk durable
+ *
+ * Flush the image file to stable storage, or write a "ram+save:" disk back to
+ * its image.
+ *
+ * Return: -1 if there was no virtual disk file opened or if the backend fails
+ * to sync. 0 otherwise.
+ */
+int block_disk_sync(void);
+
+/** Regions of the disk, as laid out by block_disk_set_layout() */
+enum block_region {
+	BLOCK_REGION_SUPERBLOCK,
+	BLOCK_REGION_FAT,
+	BLOCK_REGION_ROOT,
+	BLOCK_REGION_DATA,
+	BLOCK_REGION_COUNT,
+};
+
+/** Latency histogram buckets: bucket i counts latencies in [2^i, 2^(i+1)) ns */
+#define BLOCK_LATENCY_BUCKETS 32
+
+/**
+ * struct block_disk_stats - Block I/O latency of the disk
+ * @read: Histogram of block_read() latencies, per region
+ * @write: Histogram of block_write() latencies, per region
+ * @injected_ns: Latency added by the simulated device (see
+ *               block_disk_set_latency())
+ * @seeks: Accesses that were not sequential, for the simulated device
+ * @outliers: Accesses that were made slow on purpose by the simulated device
+ */
+struct block_disk_stats {
+	uint64_t read[BLOCK_REGION_COUNT][BLOCK_LATENCY_BUCKETS];
+	uint64_t write[BLOCK_REGION_COUNT][BLOCK_LATENCY_BUCKETS];
+	uint64_t injected_ns;
+	uint64_t seeks;
+	uint64_t outliers;
+};
+
+/**
+ * block_disk_set_layout - Describe the regions of the open disk
+ * @root_block: Index of the root directory block
+ * @data_start: Index of the first data block
+ *
+ * Block 0 is the superblock, and the FAT spans the blocks between the
+ * superblock and @root_block. Until this is called, every block but the
+ * superblock is accounted as data.
+ *
+ * Return: -1 if there was no virtual disk file opened, or if the layout does
+ * not fit in it. 0 otherwise.
+ */
+int block_disk_set_layout(size_t root_block, size_t data_start);
+
+/**
+ * block_disk_get_stats - Get the latency histograms of the disk
+ * @stats: Structure to fill
+ *
+ * Histograms cover the most recently opened disk, and remain available after
+ * it is closed.
+ *
+ * Return: -1 if @stats is NULL. 0 otherwise.
+ */
+int block_disk_get_stats(struct block_disk_stats *stats);
+
+/**
+ * block_disk_heatmap - Get the number of accesses to each block
+ * @counts: Array to fill, one entry per block
+ * @count: Number of entries of @counts
+ *
+ * Fill @counts with the number of block_read() and block_write() calls made on
+ * each block of the most recently opened disk, starting from block 0. Call it
+ * with a NULL @counts and a zero @count to size the array.
+ *
+ * Return: -1 if @counts is NULL while @count is not zero, or if no disk was
+ * ever opened. Otherwise the number of blocks of that disk (which may exceed
+ * @count).
+ */
+int block_disk_heatmap(uint64_t *counts, size_t count);
+
+/**
+ * block_disk_reset_stats - Reset the latency histograms and access counters
+ */
+void block_disk_reset_stats(void);
+
+/**
+ * struct block_latency_model - Simulated device latency
+ * @fixed_ns: Cost of every request, whatever the number of blocks it transfers
+ * @seek_min_ns: Seek cost to a nearby block (HDD model, 0 to disable)
+ * @seek_max_ns: Seek cost across the whole disk; seeks in between cost
+ *               @seek_min_ns plus the square root of the fraction of the disk
+ *               crossed times the difference
+ * @rotation_ns: Time of a full rotation; each seek waits for a random part of
+ *               it (HDD model)
+ * @bandwidth: Transfer rate in bytes per second, 0 for unlimited
+ * @outlier_ppm: Accesses per million that are made slow
+ * @outlier_ns: Latency added to slow accesses
+ * @seed: Seed of the random choices, so that runs are repeatable
+ * @virtual: Only account the latency in &struct block_disk_stats (and the
+ *           histograms) instead of waiting for it
+ *
+ * An access to the block right after the previous one, or to the previous
+ * block again, is sequential and does not seek.
+ */
+struct block_latency_model {
+	uint64_t fixed_ns;
+	uint64_t seek_min_ns;
+	uint64_t seek_max_ns;
+	uint64_t rotation_ns;
+	uint64_t bandwidth;
+	uint32_t outlier_ppm;
+	uint64_t outlier_ns;
+	uint64_t seed;
+	int virtual;
+};
+
+/**
+ * block_disk_set_latency - Simulate the latency of a real device
+ * @model: Latency model, or NULL to go back to the raw image speed
+ *
+ * Inject the latency of @model in every subsequent block_read() and
+ * block_write(), on top of the time taken by the image file. The model stays in
+ * place across disks until it is changed. If no model was set, the first
+ * block_disk_open() uses the one described by the DISK_LATENCY environment
+ * variable, if any (see block_disk_parse_latency()).
+ *
+ * Return: 0.
+ */
+int block_disk_set_latency(const struct block_latency_model *model);
+
+/**
+ * block_disk_parse_latency - Build a latency model from a description
+ * @spec: Comma-separated list of presets and settings
+ * @model: Model to fill
+ *
+ * Presets are "ssd", "hdd" and "none". Settings override them, and are
+ * "fixed_us", "seek_min_us", "seek_max_us", "rotation_us", "bw_mbps",
+ * "outlier_ppm", "outlier_us", "seed" (each followed by "=<value>") and
+ * "virtual". For example "hdd,seed=7,virtual".
+ *
+ * Return: -1 if @spec or @model is NULL, or if @spec cannot be parsed. 0
+ * otherwise.
+ */
+int block_disk_parse_latency(const char *spec, struct block_latency_model *model);
+
+/**
+ * block_disk_sim_time - Total latency injected by the simulated device
+ *
+ * Unlike &struct block_disk_stats, this never resets. With a virtual model,
+ * adding it to a clock gives the time an operation would take on the device.
+ *
+ * Return: Nanoseconds of latency injected since the program started.
+ */
+uint64_t block_disk_sim_time(void);
+
 #endif /* _DISK_H */
 
@@ -1,9 +1,15 @@
 #include <assert.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "disk.h"
 #include "fs.h"
@@ -11,13 +17,109 @@
 // superblock macros
 #define SIGNATURE_LENGTH 8
 
-// FAT macros
+// FAT macros, block indices are 32-bit in memory whatever the FAT width on disk
 #define FAT_START_IDX 1
-#define FAT_EOC 0xFFFF
+#define FAT_EOC 0xFFFFFFFF
+#define FAT16_EOC 0xFFFF
+#define FAT16_ENTRIES_PER_BLOCK (BLOCK_SIZE / sizeof(uint16_t))
+#define FAT32_ENTRIES_PER_BLOCK (BLOCK_SIZE / sizeof(uint32_t))
+
+// FAT32 blocks kept in memory at once
+#define FAT32_MAX_RESIDENT 64
+
+// tail locations keep 26 bits for the block index
+#define FAT32_MAX_DATA_BLOCKS ((1U << 26) - 1)
+
+// Arena macros
+#define ARENA_CHUNK_SIZE (64 * 1024)
+#define ARENA_ALIGN 16
 
 // Root Directory macros
 #define ROOT_ENTRY_SIZE 32
 
+// superblock feature flags
+#define FS_FEATURE_TAILPACK 0x0001
+#define FS_FEATURE_FAT32 0x0002
+// set once a file grows past 4 GiB, whose entry then holds the high half of its size
+#define FS_FEATURE_LARGE_FILES 0x0004
+// regular files are described by extents, the FAT only marks their blocks used
+#define FS_FEATURE_EXTENTS 0x0008
+// data is written out of place to a log of segments (extent disks only)
+#define FS_FEATURE_LOG 0x0010
+// some data blocks are shared by clones, the reference count table says by how many files
+#define FS_FEATURE_SHARED 0x0020
+// snapshots are listed in a table of one block (extent disks only)
+#define FS_FEATURE_SNAPSHOTS 0x0040
+// full blocks are deduplicated as they are written (extent disks only)
+#define FS_FEATURE_DEDUP 0x0080
+// the fingerprint table holds the fingerprint of the data blocks that can be deduplicated against
+#define FS_FEATURE_FINGERPRINTS 0x0100
+// every block but the superblock has a checksum in the checksum region, verified as it is read
+#define FS_FEATURE_CHECKSUMS 0x0200
+
+// file flags
+#define FILE_TAIL 0x01
+// data is stored in chunks that are compressed when it saves blocks (extent disks only)
+#define FILE_COMPRESSED 0x02
+
+// last_block_idx of entries written before it was tracked (block 0 is never a data block)
+#define LAST_BLOCK_UNKNOWN 0
+
+// Extent macros
+#define EXTENT_INLINE 15
+#define EXTENTS_PER_BLOCK (BLOCK_SIZE / sizeof(diskExtent))
+#define EXTENT_TABLE_BLOCKS (FS_FILE_MAX_COUNT * sizeof(extentRecord) / BLOCK_SIZE)
+
+// Snapshot macros: a snapshot is a copy of the root directory, the number of
+// extents of each file, then the extents of all files one after the other
+#define SNAPSHOT_HEADER_BLOCKS 2
+// open files of snapshots take the root directory entries past the live ones
+#define SNAPSHOT_FILE(fd) (FS_FILE_MAX_COUNT + (fd))
+
+// Deduplication macros: largest index, and blocks fingerprinted ahead of a run written at once
+#define DEDUP_MAX_SLOTS (1U << 20)
+#define DEDUP_BATCH_BLOCKS 16
+#define DEDUP_PRIME 0x9E3779B97F4A7C15ULL
+#define FINGERPRINTS_PER_BLOCK (BLOCK_SIZE / sizeof(uint32_t))
+
+// Checksum macros: CRC32C polynomial (reflected), bytes of each of the 3 streams the crc32
+// instruction checksums at once (4 KiB in a single round), and blocks the scrubber reads in one access
+#define CRC32C_POLY 0x82F63B78
+#define CRC32C_LANE 1360
+#define CHECKSUMS_PER_BLOCK (BLOCK_SIZE / sizeof(uint32_t))
+#define SCRUB_BATCH_BLOCKS 256
+
+// Compression macros: blocks spanned by a chunk of a compressed file, chunks kept decompressed,
+// and how a chunk stored in fewer blocks than it spans is recognized and encoded
+#define CHUNK_BLOCKS 16
+#define CHUNK_SIZE (CHUNK_BLOCKS * BLOCK_SIZE)
+#define CHUNK_CACHE_SIZE 8
+#define CHUNK_MAGIC 0x4B4E4843
+#define CHUNK_RAW 0
+#define CHUNK_LZ 1
+
+// LZ macros: shortest match, size of the match finder's table, farthest match, longest fixed-size copy
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+#define LZ_MAX_OFFSET 0xFFFF
+#define LZ_WILD_COPY 16
+
+// Log macros
+#define LOG_SEGMENT_BLOCKS 64
+// blocks written to the log between two checkpoints of the metadata
+#define LOG_CHECKPOINT_BLOCKS 1024
+// the cleaner starts below an eighth of the segments empty, and stops at a quarter
+#define LOG_CLEAN_LOW(num_segments) ((num_segments) / 8 + 1)
+#define LOG_CLEAN_HIGH(num_segments) ((num_segments) / 4 + 1)
+
+// Tail packing macros
+#define TAIL_SLOT_SIZE 64
+#define TAIL_SLOTS_PER_BLOCK (BLOCK_SIZE / TAIL_SLOT_SIZE)
+#define TAIL_MAX_SIZE (BLOCK_SIZE / 2)
+#define TAIL_LOC(block, slot) (((uint32_t) (block) << 6) | (slot))
+#define TAIL_LOC_BLOCK(loc) ((loc) >> 6)
+#define TAIL_LOC_SLOT(loc) ((loc) & 0x3F)
+
 
 int ceil_but_better(double input) {
 	int rounded_down = (int) input;
@@ -42,6 +144,20 @@ int max(int num1, int num2) {
 	return num1 > num2 ? num1 : num2;
 }
 
+/** Takes the minimum of 2 sizes, for byte counts and offsets that may not fit in an int
+ * 
+*/
+uint64_t min_size(uint64_t num1, uint64_t num2) {
+	return num1 < num2 ? num1 : num2;
+}
+
+/** Takes the maximum of 2 sizes
+ * 
+*/
+uint64_t max_size(uint64_t num1, uint64_t num2) {
+	return num1 > num2 ? num1 : num2;
+}
+
 typedef struct superblock {
 	char signature[SIGNATURE_LENGTH];
 	uint16_t block_count;
@@ -49,68 +165,635 @@ typedef struct superblock {
 	uint16_t data_block_start_idx;
 	uint16_t amt_data_blocks;
 	uint8_t num_blocks_for_FAT;
+	uint16_t features;
+	uint16_t holemap_block_idx;
+	// geometry of FS_FEATURE_FAT32 disks, whose 16-bit fields above are 0
+	uint32_t block_count32;
+	uint32_t root_block_idx32;
+	uint32_t data_block_start_idx32;
+	uint32_t amt_data_blocks32;
+	uint32_t num_blocks_for_FAT32;
+	uint32_t holemap_block_idx32;
+	// first block of the extent table of FS_FEATURE_EXTENTS disks
+	uint32_t extent_table_idx;
+	// first block of the reference count table of FS_FEATURE_SHARED disks
+	uint32_t refcount_idx;
+	// block of the snapshot table of FS_FEATURE_SNAPSHOTS disks
+	uint32_t snapshot_idx;
+	// first block of the fingerprint table of FS_FEATURE_FINGERPRINTS disks
+	uint32_t fingerprint_idx;
+	// first block of the checksum region of FS_FEATURE_CHECKSUMS disks
+	uint32_t checksum_idx;
 } * superblock_t;
 
+// layout of a disk, read from the 16-bit or the 32-bit superblock fields
+typedef struct geometry {
+	bool fat32;
+	uint32_t block_count;
+	uint32_t root_block_idx;
+	uint32_t data_block_start_idx;
+	uint32_t amt_data_blocks;
+	uint32_t num_blocks_for_FAT;
+	uint32_t holemap_block_idx;
+	bool extents;
+	uint32_t extent_table_idx;
+	bool log;
+	uint32_t refcount_idx;
+	uint32_t snapshot_idx;
+	uint32_t fingerprint_idx;
+	uint32_t checksum_idx;
+} geometry;
+
+// FAT32 block held in memory
+typedef struct fatPage {
+	uint32_t FAT_block;
+	uint32_t *entries;
+	bool dirty;
+	bool referenced;
+} fatPage;
+
 typedef struct FAT {
 	int curr_pos;
 	size_t num_blocks_taken;
+	bool dirty;
+	bool failed;
+	// FAT16: the whole table, and the blocks of it to flush
+	uint64_t dirty_blocks[4];
 	uint16_t *blocks;
+	// FAT32: blocks loaded on demand, and the page holding each (0 if none, page + 1 otherwise)
+	fatPage pages[FAT32_MAX_RESIDENT];
+	size_t num_pages;
+	size_t clock_hand;
+	uint8_t *page_of;
 } * FAT_t;
 
 typedef struct file {
 	char filename[FS_FILENAME_LEN];
 	uint32_t file_size;
 	uint16_t first_block_idx;
-	char padding[10];
+	uint8_t flags;
+	uint8_t reserved;
+	// packed files: location of their slots, other files: high half of their size
+	union {
+		uint32_t tail_loc;
+		uint32_t file_size_hi;
+	};
+	uint16_t last_block_idx;
+	// FAT32: high half of first_block_idx
+	uint16_t first_block_hi;
 } file;
 
+_Static_assert(sizeof(file) == ROOT_ENTRY_SIZE, "root directory entry must be 32 bytes");
+
+// extent as stored on disk: consecutive data blocks, or a hole if start is 0
+typedef struct diskExtent {
+	uint32_t start;
+	uint32_t length;
+} diskExtent;
+
+// extents of a file, the ones past EXTENT_INLINE in a chain of overflow blocks
+typedef struct extentRecord {
+	uint32_t num_extents;
+	uint32_t overflow_idx;
+	diskExtent extents[EXTENT_INLINE];
+} extentRecord;
+
+_Static_assert(sizeof(extentRecord) == 128, "extent records must be 128 bytes");
+
+// run of consecutive data blocks holding consecutive blocks of a file
+typedef struct extent {
+	uint64_t block_num;
+	uint32_t start;
+	uint32_t length;
+} extent;
+
+// extents of a file in logical order, the gaps between them are holes
+typedef struct extentList {
+	extent *extents;
+	size_t count;
+	size_t capacity;
+	bool dirty;
+} extentList;
+
+// block of a file found in a segment by the log cleaner
+typedef struct logBlock {
+	int file_num;
+	uint64_t block_num;
+	uint32_t block_idx;
+} logBlock;
+
+// snapshot as listed in the snapshot table
+typedef struct snapshotEntry {
+	char name[FS_FILENAME_LEN];
+	uint32_t meta_idx;
+	uint32_t num_blocks;
+	uint64_t created;
+} snapshotEntry;
+
+_Static_assert(FS_SNAPSHOT_MAX_COUNT * sizeof(snapshotEntry) <= BLOCK_SIZE, "snapshot table must fit in a block");
+
+// start of a chunk of a compressed file stored in fewer blocks than it spans
+typedef struct chunkHeader {
+	uint32_t magic;
+	uint32_t method;
+	// bytes stored after the header, and bytes of the chunk they hold (the rest are zeros)
+	uint32_t stored;
+	uint32_t length;
+} chunkHeader;
+
 typedef struct rootDir {
 	size_t num_files;
-	file files[FS_FILE_MAX_COUNT];
+	// entries past FS_FILE_MAX_COUNT are files of snapshots open through a descriptor, never saved
+	file files[FS_FILE_MAX_COUNT + FS_OPEN_MAX_COUNT];
 } * rootDir_t;
 
+typedef struct writeBuffer {
+	char *data;
+	int block_idx;
+	size_t block_num;
+	size_t start;
+	size_t end;
+	bool fresh;
+} writeBuffer;
+
+// last block a descriptor reached in its file's chain, valid while chain_gen is unchanged
+typedef struct chainCursor {
+	uint32_t block_idx;
+	size_t block_num;
+	uint64_t gen;
+} chainCursor;
+
 typedef struct openFile {
 	int fd;
 	int file_num;
+	int flags;
 	size_t file_offset;
+	writeBuffer wbuf;
+	chainCursor cursor;
 } openFile;
 
+typedef struct tailBlock {
+	uint32_t block_idx;
+	uint64_t used;
+} tailBlock;
+
+// decompressed chunk of a compressed file, file_num is -1 if the entry is free
+typedef struct chunkCache {
+	char *data;
+	int file_num;
+	uint64_t chunk_num;
+	uint64_t last_used;
+	bool dirty;
+} chunkCache;
+
+// checksums of the mounted disk, and the blocks of the region to save (all zero without checksums)
+typedef struct checksumState {
+	uint32_t *table;
+	uint64_t *dirty;
+	// disk blocks of the region, blocks covered, and the first block whose checksum is not written through
+	uint32_t first;
+	uint32_t num_blocks;
+	uint32_t num_entries;
+	uint32_t data_start;
+} checksumState;
+
+typedef struct arenaChunk {
+	struct arenaChunk *next;
+	size_t size;
+	size_t used;
+	_Alignas(ARENA_ALIGN) char data[];
+} arenaChunk;
+
 typedef struct FS {
+	arenaChunk *arena;
+	void *free_buffers;
 	superblock_t superblock;
+	geometry geo;
 	FAT_t FAT;
 	rootDir_t rootDir;
+	uint32_t last_block[FS_FILE_MAX_COUNT];
+	void *disk_superblock;
+	void *disk_rootDir;
+	tailBlock tails[FS_FILE_MAX_COUNT];
+	size_t num_tails;
+	void *holes;
+	bool holes_dirty;
+	extentRecord *extent_table;
+	extentList extents[FS_FILE_MAX_COUNT + FS_OPEN_MAX_COUNT];
+	bool extents_dirty;
+	// references to each data block beyond the first, once a file has been cloned
+	uint16_t *refs;
+	bool refs_dirty;
+	// snapshot table once a snapshot has been taken, and the snapshot each descriptor has a file of
+	snapshotEntry *snapshots;
+	uint8_t snapshot_of[FS_OPEN_MAX_COUNT];
+	// fingerprint of each data block (0 if none) and the blocks of the table to save, once
+	// deduplication is used, and the index of the fingerprints (data block + 1 per slot, 0 if none)
+	uint32_t *fingerprints;
+	uint64_t *fingerprints_dirty;
+	uint32_t *dedup_index;
+	size_t dedup_mask;
+	// chunks of compressed files, the least recently used one makes room for others, and where
+	// a chunk is compressed before it is stored (NULL until a compressed file is used)
+	chunkCache chunks[CHUNK_CACHE_SIZE];
+	uint64_t chunk_clock;
+	char *chunk_stored;
+	// scrubber: next block to verify, where blocks are read, and its rate in blocks per second (0 if stopped)
+	uint32_t scrub_cursor;
+	char *scrub_buf;
+	size_t scrub_rate;
+	bool scrub_running;
+	// checksums the blocks are verified against, once the disk has a checksum region
+	checksumState checksums;
+	// log disks: used and overwritten blocks of each segment, and where the log is written
+	uint8_t *log_used;
+	uint8_t *log_dead;
+	uint8_t *log_pinned;
+	size_t num_segments;
+	size_t log_free_segments;
+	size_t log_next_segment;
+	uint32_t log_head;
+	uint32_t log_end;
+	// blocks taken and blocks replaced since the last checkpoint, and how many
+	uint64_t *log_new;
+	uint64_t *log_dead_map;
+	size_t log_pending;
+	bool log_cleaning;
+	uint64_t mount_id;
 	openFile open_files[FS_OPEN_MAX_COUNT];
 	size_t num_open_files;
+	int defrag_cursor;
+	// bumped whenever a chain or the hole map changes
+	uint64_t chain_gen;
 	bool is_mounted;
 } FS;
 
 
-/** Creates and allocates memory for a FS instance
+/* STATISTICS */
+
+// runtime statistics, reported by fs_get_stats()
+static struct fs_stats stats;
+
+
+/* CHECKSUMS
+ *
+ * Once checksums are enabled (see fs_checksums()), every block of the disk but
+ * the superblock has a CRC32C in the checksum region, a run of data blocks
+ * chained like the other metadata tables. The block accessors below verify the
+ * blocks they read and update the checksums of the blocks they write. The
+ * checksums of the FAT and the root directory are written along with them,
+ * those of data blocks are saved with the FAT (see fs_checksum_save()).
+ */
+
+// CRC32C tables of the portable version, and the version the CPU supports best
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+static uint32_t crc32c_table[8][256];
+static uint32_t crc32c_lane_shift[4][256];
+static uint32_t (*crc32c_update)(uint32_t crc, const unsigned char *p, size_t len);
+
+/** Update a CRC32C without special instructions
+ * 
+ * Each step folds 8 bytes at once through 8 tables (slicing-by-8).
+*/
+uint32_t fs_crc32c_portable(uint32_t crc, const unsigned char *p, size_t len) {
+	for (; len >= 8; p += 8, len -= 8) {
+		uint32_t lo = crc ^ (p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24);
+		uint32_t hi = p[4] | p[5] << 8 | p[6] << 16 | (uint32_t) p[7] << 24;
+
+		crc = crc32c_table[7][lo & 0xFF] ^ crc32c_table[6][(lo >> 8) & 0xFF]
+			^ crc32c_table[5][(lo >> 16) & 0xFF] ^ crc32c_table[4][lo >> 24]
+			^ crc32c_table[3][hi & 0xFF] ^ crc32c_table[2][(hi >> 8) & 0xFF]
+			^ crc32c_table[1][(hi >> 16) & 0xFF] ^ crc32c_table[0][hi >> 24];
+	}
+
+	for (; len; p++, len--)
+		crc = crc32c_table[0][(crc ^ *p) & 0xFF] ^ (crc >> 8);
+
+	return crc;
+}
+
+/** CRC32C state after CRC32C_LANE more zero bytes, to join the streams checksummed at once
+ * 
+*/
+uint32_t fs_crc32c_shift(uint32_t crc) {
+	return crc32c_lane_shift[0][crc & 0xFF] ^ crc32c_lane_shift[1][(crc >> 8) & 0xFF]
+		^ crc32c_lane_shift[2][(crc >> 16) & 0xFF] ^ crc32c_lane_shift[3][crc >> 24];
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+/** Update a CRC32C with the crc32 instruction of SSE4.2
+ * 
+ * The instruction takes 3 cycles but can start every cycle, so 3 consecutive
+ * streams of CRC32C_LANE bytes are checksummed at once, and joined afterwards.
+*/
+__attribute__((target("sse4.2")))
+uint32_t fs_crc32c_sse42(uint32_t crc, const unsigned char *p, size_t len) {
+	uint64_t crc64 = crc;
+
+	for (; len >= 3 * CRC32C_LANE; p += 3 * CRC32C_LANE, len -= 3 * CRC32C_LANE) {
+		uint64_t crc1 = 0, crc2 = 0;
+
+		for (size_t i = 0; i < CRC32C_LANE; i += 8) {
+			uint64_t word0, word1, word2;
+
+			memcpy(&word0, p + i, sizeof(word0));
+			memcpy(&word1, p + CRC32C_LANE + i, sizeof(word1));
+			memcpy(&word2, p + 2 * CRC32C_LANE + i, sizeof(word2));
+			crc64 = __builtin_ia32_crc32di(crc64, word0);
+			crc1 = __builtin_ia32_crc32di(crc1, word1);
+			crc2 = __builtin_ia32_crc32di(crc2, word2);
+		}
+
+		crc64 = fs_crc32c_shift(fs_crc32c_shift(crc64) ^ crc1) ^ crc2;
+	}
+
+	for (; len >= 8; p += 8, len -= 8) {
+		uint64_t word;
+
+		memcpy(&word, p, sizeof(word));
+		crc64 = __builtin_ia32_crc32di(crc64, word);
+	}
+
+	crc = crc64;
+	for (; len; p++, len--)
+		crc = __builtin_ia32_crc32qi(crc, *p);
+
+	return crc;
+}
+#endif
+
+/** Build the tables of the portable CRC32C, and pick the version to use
+ * 
+ * The shift of the state over CRC32C_LANE zero bytes is linear, so it is
+ * tabulated for each byte of the state.
+*/
+void fs_crc32c_init(void) {
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t crc = i;
+
+		for (int bit = 0; bit < 8; bit++)
+			crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+		crc32c_table[0][i] = crc;
+	}
+	for (uint32_t i = 0; i < 256; i++) {
+		for (int k = 1; k < 8; k++)
+			crc32c_table[k][i] = (crc32c_table[k - 1][i] >> 8) ^ crc32c_table[0][crc32c_table[k - 1][i] & 0xFF];
+	}
+
+	static const unsigned char zeros[CRC32C_LANE];
+	for (uint32_t i = 0; i < 256; i++) {
+		for (int k = 0; k < 4; k++)
+			crc32c_lane_shift[k][i] = fs_crc32c_portable(i << (8 * k), zeros, CRC32C_LANE);
+	}
+
+	crc32c_update = fs_crc32c_portable;
+#if defined(__x86_64__) && defined(__GNUC__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.2"))
+		crc32c_update = fs_crc32c_sse42;
+#endif
+}
+
+/** CRC32C (Castagnoli) of a buffer
+ * 
+*/
+uint32_t fs_crc32c(const void *data, size_t len) {
+	pthread_once(&crc32c_once, fs_crc32c_init);
+	return ~crc32c_update(~0U, data, len);
+}
+
+/** Check whether a block of the disk has a checksum
+ * 
+ * The superblock locates the region, and the region does not cover itself.
+*/
+bool fs_checksum_covered(FS *fs, size_t block) {
+	return fs->checksums.table && block != 0 && block < fs->checksums.num_entries
+		&& (block < fs->checksums.first || block >= fs->checksums.first + fs->checksums.num_blocks);
+}
+
+/** Count the blocks read at @block whose checksum does not match
+ * 
+*/
+size_t fs_checksum_mismatches(FS *fs, size_t block, size_t count, const void *buf) {
+	size_t bad = 0;
+
+	for (size_t i = 0; fs->checksums.table && i < count; i++) {
+		if (fs_checksum_covered(fs, block + i)
+			&& fs_crc32c((const char *) buf + i * BLOCK_SIZE, BLOCK_SIZE) != fs->checksums.table[block + i])
+			bad++;
+	}
+
+	return bad;
+}
+
+/** Record the checksums of the blocks written at @block
+ * 
+ * The checksums of blocks before the data region are written right away,
+ * those of data blocks are left for fs_checksum_save().
+ * 
+ * returns: 0 on success, -1 if a block of the region cannot be written
+*/
+int fs_checksum_update(FS *fs, size_t block, size_t count, const void *buf) {
+	size_t first_meta = SIZE_MAX, last_meta = 0;
+
+	for (size_t i = 0; i < count; i++) {
+		size_t entry = block + i;
+
+		if (!fs_checksum_covered(fs, entry))
+			continue;
+
+		fs->checksums.table[entry] = fs_crc32c((const char *) buf + i * BLOCK_SIZE, BLOCK_SIZE);
+		if (entry >= fs->checksums.data_start) {
+			fs->checksums.dirty[entry / CHECKSUMS_PER_BLOCK / 64] |= 1ULL << (entry / CHECKSUMS_PER_BLOCK % 64);
+			continue;
+		}
+
+		first_meta = min_size(first_meta, entry / CHECKSUMS_PER_BLOCK);
+		last_meta = entry / CHECKSUMS_PER_BLOCK;
+	}
+
+	for (size_t i = first_meta; i <= last_meta; i++) {
+		stats.blocks_written++;
+		if (block_write(fs->checksums.first + i, fs->checksums.table + i * CHECKSUMS_PER_BLOCK) == -1)
+			return -1;
+	}
+
+	return 0;
+}
+
+/** Write the blocks of the checksum region holding modified checksums
+ * 
+ * returns: 0 on success, -1 if a block cannot be written
+*/
+int fs_checksum_save(FS *fs) {
+	bool saved = false;
+
+	for (size_t i = 0, run; i < fs->checksums.num_blocks; i += run) {
+		run = 0;
+		while (i + run < fs->checksums.num_blocks && (fs->checksums.dirty[(i + run) / 64] & (1ULL << ((i + run) % 64))))
+			run++;
+		if (run == 0) {
+			run = 1;
+			continue;
+		}
+
+		stats.blocks_written += run;
+		if (block_writev(fs->checksums.first + i, run, fs->checksums.table + i * CHECKSUMS_PER_BLOCK) == -1)
+			return -1;
+		for (size_t j = i; j < i + run; j++)
+			fs->checksums.dirty[j / 64] &= ~(1ULL << (j % 64));
+		saved = true;
+	}
+
+	if (saved)
+		stats.meta_table_flushes++;
+	return 0;
+}
+
+
+/* BLOCK ACCESS */
+
+// Fail a read of blocks that do not match their checksums, counting them
+static int fs_block_verify(FS *fs, int ret, size_t block, size_t count, const void *buf) {
+	size_t bad = ret == 0 ? fs_checksum_mismatches(fs, block, count, buf) : 0;
+
+	stats.checksum_failures += bad;
+	return bad ? -1 : ret;
+}
+
+// Read a block from disk, counting it
+static int fs_block_read(FS *fs, size_t block, void *buf) {
+	stats.blocks_read++;
+	return fs_block_verify(fs, block_read(block, buf), block, 1, buf);
+}
+
+// Write a block to disk, counting it
+static int fs_block_write(FS *fs, size_t block, const void *buf) {
+	stats.blocks_written++;
+	if (block_write(block, buf) == -1)
+		return -1;
+	return fs_checksum_update(fs, block, 1, buf);
+}
+
+// Read consecutive blocks from disk at once, counting them
+static int fs_block_readv(FS *fs, size_t block, size_t count, void *buf) {
+	stats.blocks_read += count;
+	return fs_block_verify(fs, block_readv(block, count, buf), block, count, buf);
+}
+
+// Write consecutive blocks to disk at once, counting them
+static int fs_block_writev(FS *fs, size_t block, size_t count, const void *buf) {
+	stats.blocks_written += count;
+	if (block_writev(block, count, buf) == -1)
+		return -1;
+	return fs_checksum_update(fs, block, count, buf);
+}
+
+
+/* ARENA HELPERS */
+
+/** Carve zeroed memory out of a mount's arena
+ * @arena: head of the arena's chunk list
+ * @size: number of bytes needed
+ * 
+ * Memory is never given back individually, the whole arena is released at
+ * once by fs_arena_release() when the file system is unmounted.
+ * 
+ * returns: pointer to the memory, NULL if a new chunk could not be allocated
+*/
+void * fs_arena_alloc(arenaChunk **arena, size_t size) {
+	size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+
+	// start a new chunk when the current one is full
+	if (!*arena || (*arena)->used + size > (*arena)->size) {
+		size_t chunk_size = max(size, ARENA_CHUNK_SIZE);
+		arenaChunk *chunk = malloc(sizeof(*chunk) + chunk_size);
+		if (!chunk)
+			return NULL;
+
+		*chunk = (arenaChunk){.next = *arena, .size = chunk_size, .used = 0};
+		*arena = chunk;
+	}
+
+	void *ptr = (*arena)->data + (*arena)->used;
+	(*arena)->used += size;
+
+	memset(ptr, 0, size);
+	return ptr;
+}
+
+/** Release every chunk of an arena
+ * 
+*/
+void fs_arena_release(arenaChunk *arena) {
+	while (arena) {
+		arenaChunk *next = arena->next;
+		free(arena);
+		arena = next;
+	}
+}
+
+/** Get a block-sized buffer from the mount's buffer pool
+ * @fs: pointer to filesystem
+ * 
+ * returns: pointer to the buffer, NULL if the arena could not grow
+*/
+void * fs_buffer_get(FS *fs) {
+	void *buf = fs->free_buffers;
+
+	if (!buf)
+		return fs_arena_alloc(&fs->arena, BLOCK_SIZE);
+
+	fs->free_buffers = *(void **) buf;
+	return buf;
+}
+
+/** Give a block-sized buffer back to the mount's buffer pool
+ * 
+*/
+void fs_buffer_put(FS *fs, void *buf) {
+	if (!buf)
+		return;
+
+	*(void **) buf = fs->free_buffers;
+	fs->free_buffers = buf;
+}
+
+/** Creates a FS instance in its own arena
  * 
  * returns: pointer of FS struct
 */
 FS * fs_init(void) {
-	FS *fs = malloc(sizeof(*fs));
-	fs->is_mounted = false;
-	fs->num_open_files = 0;
+	// the FS struct is the first thing carved from its own arena
+	arenaChunk *arena = NULL;
+	FS *fs = fs_arena_alloc(&arena, sizeof(*fs));
 
 	// malloc error handling
 	if (!fs)
 		return NULL;
 
+	fs->arena = arena;
+	fs->is_mounted = false;
+
 	// init sub structs for filesystem var
-	fs->superblock = malloc(BLOCK_SIZE);
-	fs->FAT = malloc(sizeof(*fs->FAT));
-	fs->rootDir = malloc(sizeof(*fs->rootDir));
+	fs->superblock = fs_arena_alloc(&fs->arena, BLOCK_SIZE);
+	fs->FAT = fs_arena_alloc(&fs->arena, sizeof(*fs->FAT));
+	fs->rootDir = fs_arena_alloc(&fs->arena, sizeof(*fs->rootDir));
+
+	// copies of what is on disk, so unchanged blocks are not written back
+	fs->disk_superblock = fs_arena_alloc(&fs->arena, BLOCK_SIZE);
+	fs->disk_rootDir = fs_arena_alloc(&fs->arena, BLOCK_SIZE);
 
 	// malloc error handling
-	if (!fs->superblock || !fs->FAT || !fs->rootDir)
+	if (!fs->superblock || !fs->FAT || !fs->rootDir || !fs->disk_superblock || !fs->disk_rootDir) {
+		fs_arena_release(fs->arena);
 		return NULL;
+	}
 
 	// fill openFiles array
 	fs->num_open_files = 0;
 	for (int i = 0; i < FS_OPEN_MAX_COUNT; i++)
-		fs->open_files[i] = (openFile){.file_num = -1};
+		fs->open_files[i] = (openFile){.file_num = -1, .wbuf = {.block_idx = -1}};
 
 	return fs;
 }
@@ -139,7 +822,7 @@ bool fs_validate_filename(const char *filename) {
 */
 bool fs_validate_fd(FS *fs, int fd) {
 	// invalid file descriptor
-	if (fd < 0 || fd > FS_OPEN_MAX_COUNT)
+	if (fd < 0 || fd >= FS_OPEN_MAX_COUNT)
 		return false;
 
 	// file descriptor is not currently open
@@ -157,8 +840,8 @@ bool fs_validate_fd(FS *fs, int fd) {
  * 			0 otherwise
 */
 bool fs_validate_file_num(FS *fs, int file_num) {
-	// invalid file descriptor
-	if (file_num < 0 || file_num > FS_FILE_MAX_COUNT)
+	// invalid file number, files of snapshots included
+	if (file_num < 0 || file_num >= FS_FILE_MAX_COUNT + FS_OPEN_MAX_COUNT)
 		return false;
 
 	// get file
@@ -213,359 +896,465 @@ int fs_file_num_from_fd(FS *fs, int fd) {
 	return file_num;
 }
 
-// Save superblock to disk
+// Save superblock to disk, unless the disk already holds it
 int fs_save_superblock(FS *fs) {
+	if (!memcmp(fs->disk_superblock, fs->superblock, BLOCK_SIZE))
+		return 0;
+
+	stats.superblock_flushes++;
+
 	// write superblock values
-	if (block_write(0, fs->superblock) == -1)
+	if (fs_block_write(fs, 0, fs->superblock) == -1)
 		return -1;
 
+	memcpy(fs->disk_superblock, fs->superblock, BLOCK_SIZE);
 	return 0;
 }
 
-// Save rootDir to disk
+// Save rootDir to disk, unless the disk already holds it
 int fs_save_rootDir(FS *fs) {
-	if (block_write(fs->superblock->root_block_idx, fs->rootDir->files) == -1)
+	if (!memcmp(fs->disk_rootDir, fs->rootDir->files, BLOCK_SIZE))
+		return 0;
+
+	stats.rootdir_flushes++;
+
+	if (fs_block_write(fs, fs->geo.root_block_idx, fs->rootDir->files) == -1)
 		return -1;
 
+	memcpy(fs->disk_rootDir, fs->rootDir->files, BLOCK_SIZE);
 	return 0;
 }
 
-// Save FAT to disk
-int fs_save_FAT(FS *fs) {
-	// write array to disk
-	for (int i = 0; i < fs->superblock->num_blocks_for_FAT; i++) {
-		size_t FAT_ptr_offset = BLOCK_SIZE * i / sizeof(uint16_t);
-		block_write(FAT_START_IDX + i, fs->FAT->blocks + FAT_ptr_offset);
+/** Read the layout of a disk from the fields of its superblock
+ * 
+*/
+void fs_geometry_read(superblock_t sb, geometry *geo) {
+	if (sb->features & FS_FEATURE_FAT32) {
+		*geo = (geometry){.fat32 = true, .block_count = sb->block_count32, .root_block_idx = sb->root_block_idx32,
+			.data_block_start_idx = sb->data_block_start_idx32, .amt_data_blocks = sb->amt_data_blocks32,
+			.num_blocks_for_FAT = sb->num_blocks_for_FAT32, .holemap_block_idx = sb->holemap_block_idx32};
+	} else {
+		*geo = (geometry){.fat32 = false, .block_count = sb->block_count, .root_block_idx = sb->root_block_idx,
+			.data_block_start_idx = sb->data_block_start_idx, .amt_data_blocks = sb->amt_data_blocks,
+			.num_blocks_for_FAT = sb->num_blocks_for_FAT, .holemap_block_idx = sb->holemap_block_idx};
 	}
 
-	return 0;
-}
+	if (sb->features & FS_FEATURE_EXTENTS) {
+		geo->extents = true;
+		geo->extent_table_idx = sb->extent_table_idx;
+		geo->log = sb->features & FS_FEATURE_LOG;
+		geo->refcount_idx = sb->features & FS_FEATURE_SHARED ? sb->refcount_idx : 0;
+		geo->snapshot_idx = sb->features & FS_FEATURE_SNAPSHOTS ? sb->snapshot_idx : 0;
+		geo->fingerprint_idx = sb->features & FS_FEATURE_FINGERPRINTS ? sb->fingerprint_idx : 0;
+	}
 
-// returns true if fs is open
-// returns false if fs has not been opened
-bool is_mounted(FS *fs) {
-	return block_disk_count() != -1 && fs->is_mounted;
+	geo->checksum_idx = sb->features & FS_FEATURE_CHECKSUMS ? sb->checksum_idx : 0;
 }
 
+/** First data block of a file, FAT_EOC if it has none
+ * 
+*/
+uint32_t fs_file_first(const geometry *geo, const file *target_file) {
+	uint32_t block_idx = target_file->first_block_idx;
 
-// global filesystem var
-FS *fs;
-
-int fs_mount(const char *diskname)
-{
-	// init global filesystem var
-	fs = fs_init();
-
-	// open virtual disk
-	if (block_disk_open(diskname) == -1)
-		return -1;
+	// a FAT32 entry without blocks has both halves set to FAT16_EOC
+	if (geo->fat32)
+		block_idx |= (uint32_t) target_file->first_block_hi << 16;
+	else if (block_idx == FAT16_EOC)
+		block_idx = FAT_EOC;
 
-	// assign superblock values
-	block_read(0, fs->superblock);
+	return block_idx;
+}
 
-	// init FAT array
-	fs->FAT->curr_pos = 0;
-	fs->FAT->blocks = malloc(fs->superblock->num_blocks_for_FAT * BLOCK_SIZE);
+/** Point a file's entry to its first data block (FAT_EOC for none)
+ * 
+*/
+void fs_file_set_first(const geometry *geo, file *target_file, uint32_t block_idx) {
+	target_file->first_block_idx = block_idx;
+	if (geo->fat32)
+		target_file->first_block_hi = block_idx >> 16;
+}
 
-	// malloc error handling
-	if (!fs->FAT->blocks)
-		return -1;
+/** Last data block of a file, FAT_EOC if it has none, LAST_BLOCK_UNKNOWN if not tracked
+ * 
+ * The whole index is kept in memory, the entry on disk only holds it while it
+ * fits in 16 bits.
+*/
+uint32_t fs_file_last(FS *fs, const file *target_file) {
+	return fs->last_block[target_file - fs->rootDir->files];
+}
 
-	// read and assign values to array
-	for (int i = 0; i < fs->superblock->num_blocks_for_FAT; i++) {
-		size_t FAT_ptr_offset = BLOCK_SIZE * i / sizeof(uint16_t);
-		block_read(FAT_START_IDX + i, fs->FAT->blocks + FAT_ptr_offset);
-	}
+/** Record the last data block of a file
+ * 
+*/
+void fs_file_set_last(FS *fs, file *target_file, uint32_t block_idx) {
+	fs->last_block[target_file - fs->rootDir->files] = block_idx;
+
+	if (block_idx == FAT_EOC)
+		target_file->last_block_idx = FAT16_EOC;
+	else if (block_idx < FAT16_EOC)
+		target_file->last_block_idx = block_idx;
+	else
+		target_file->last_block_idx = LAST_BLOCK_UNKNOWN;
+}
 
-	// read into block buffer
-	block_read(fs->superblock->root_block_idx, fs->rootDir->files);
+/** Size of a file in bytes
+ * 
+ * Packed files are smaller than a block, their tail_loc is not part of the size.
+*/
+uint64_t fs_file_size(const file *target_file) {
+	if (target_file->flags & FILE_TAIL)
+		return target_file->file_size;
 
-	// calculate number of blocks taken
-	fs->rootDir->num_files = 0;
-	for (int i = 0; i < FS_FILE_MAX_COUNT; i++){
-		// calculate blocks taken and increment counter
-		int file_num_blocks = ceil_but_better(fs->rootDir->files[i].file_size / (double) BLOCK_SIZE);
-		fs->FAT->num_blocks_taken += file_num_blocks;
+	return (uint64_t) target_file->file_size_hi << 32 | target_file->file_size;
+}
 
-		// increment number of files counter if filename is not null
-		if (fs->rootDir->files[i].filename[0] != '\0')
-			fs->rootDir->num_files++;
+/** Set the size of a file
+ * @fs: pointer to filesystem
+ * @target_file: file to resize, with its FILE_TAIL flag already up to date
+ * @size: new file size in bytes
+ * 
+ * The first file to grow past 4 GiB marks the disk with FS_FEATURE_LARGE_FILES,
+ * since readers unaware of it would only see the low half of the size.
+ * 
+ * returns: 0 on success, -1 if the superblock cannot be written
+*/
+int fs_file_set_size(FS *fs, file *target_file, uint64_t size) {
+	target_file->file_size = size;
+	if (!(target_file->flags & FILE_TAIL))
+		target_file->file_size_hi = size >> 32;
+
+	if (size > UINT32_MAX && !(fs->superblock->features & FS_FEATURE_LARGE_FILES)) {
+		fs->superblock->features |= FS_FEATURE_LARGE_FILES;
+		return fs_save_superblock(fs);
 	}
 
-	fs->is_mounted = true;
 	return 0;
 }
 
-int fs_umount(void)
-{
-	// make sure fs is properly mounted
-	if (!is_mounted(fs))
-		return -1;
-
-	// save superblock
-	if (!fs_save_superblock(fs) == -1)
-		return -1;
-
-	// save rootDir
-	if (!fs_save_rootDir(fs) == -1)
-		return -1;
 
-	// save FAT
-	if (!fs_save_FAT(fs) == -1)
-		return -1;
+/* FAT ACCESS
+ *
+ * A FAT16 is small enough to be read whole at mount time. A FAT32 can span
+ * thousands of blocks, so its blocks are read as their entries are used and at
+ * most FAT32_MAX_RESIDENT of them are kept in memory, in pages that are
+ * reused in clock order.
+ */
 
-	// free pointer memory
-	free(fs);
+/** Write a FAT32 page back to its FAT block if it was modified
+ * 
+ * returns: 0 on success, -1 if the block cannot be written
+*/
+int fs_fat_page_flush(FS *fs, fatPage *page) {
+	if (!page->dirty)
+		return 0;
 
-	// close block disk
-	if (block_disk_close() == -1)
+	stats.fat_blocks_flushed++;
+	if (fs_block_write(fs, FAT_START_IDX + page->FAT_block, page->entries) == -1)
 		return -1;
 
+	page->dirty = false;
 	return 0;
 }
 
-int fs_info(void)
-{
-	// make sure fs is properly mounted
-	if (!is_mounted(fs))
-		return -1;
+/** Find a page to load another FAT32 block into
+ * @fs: pointer to filesystem
+ * 
+ * Once every page is in use, the clock hand skips (and clears) the pages
+ * referenced since it last passed them and reuses the first other one, after
+ * writing it back if needed.
+ * 
+ * returns: the page, NULL if no buffer is left or a dirty page cannot be written back
+*/
+fatPage * fs_fat_page_alloc(FS *fs) {
+	FAT_t FAT = fs->FAT;
 
-	printf("FS Info:\n");
-	printf("total_blk_count=%d\n", fs->superblock->block_count);
-	printf("fat_blk_count=%d\n", fs->superblock->num_blocks_for_FAT);
-	printf("rdir_blk=%d\n", fs->superblock->root_block_idx);
-	printf("data_blk=%d\n", fs->superblock->data_block_start_idx);
-	printf("data_blk_count=%d\n", fs->superblock->amt_data_blocks);
-	printf("fat_free_ratio=%ld/%d\n", fs->superblock->amt_data_blocks - fs->FAT->num_blocks_taken - 1, fs->superblock->amt_data_blocks);
-	printf("rdir_free_ratio=%ld/%d\n", FS_FILE_MAX_COUNT - fs->rootDir->num_files, FS_FILE_MAX_COUNT);
-}
+	if (FAT->num_pages < FAT32_MAX_RESIDENT) {
+		uint32_t *entries = fs_buffer_get(fs);
+		if (!entries)
+			return NULL;
 
-int fs_create(const char *filename)
-{
-	// make sure fs is properly mounted
-	if (!is_mounted(fs))
-		return -1;
+		FAT->pages[FAT->num_pages] = (fatPage){.entries = entries};
+		return &FAT->pages[FAT->num_pages++];
+	}
 
-	// validate filename
-	if (!fs_validate_filename(filename))
-		return -1;
+	for (;;) {
+		fatPage *page = &FAT->pages[FAT->clock_hand];
+		uint8_t page_num = FAT->clock_hand + 1;
 
-	// makesure filename does not exist already
-	if (fs_file_num_from_filename(fs, filename) != -2)
-		return -1;
-	
-	// make sure there is space for another file
-	if (fs->rootDir->num_files >= FS_FILE_MAX_COUNT)
-		return -1;
+		FAT->clock_hand = (FAT->clock_hand + 1) % FAT32_MAX_RESIDENT;
+		if (page->referenced) {
+			page->referenced = false;
+			continue;
+		}
 
-	// get file list pointer
-	file *files_list = fs->rootDir->files;
+		if (fs_fat_page_flush(fs, page) == -1)
+			return NULL;
 
-	// initalize new file instance
-	file new_file = {.file_size = 0, .first_block_idx = FAT_EOC};
-	strcpy(new_file.filename, filename);
+		// a page whose block could not be read holds nothing
+		if (FAT->page_of[page->FAT_block] == page_num) {
+			FAT->page_of[page->FAT_block] = 0;
+			stats.fat_pages_evicted++;
+		}
+		return page;
+	}
+}
 
-	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		// if cell is empty in directory...
-		if (files_list[i].filename[0] == '\0') {
-			// fill cell with new file and return successful
-			files_list[i] = new_file;
-			fs->rootDir->num_files++;
-			
-			// save updated rootDir
-			if (!fs_save_rootDir(fs) == -1)
-				return -1;
+/** Get the page holding the FAT32 entry of a block, reading it on first use
+ * @fs: pointer to filesystem
+ * @block_idx: data block whose entry is wanted
+ * 
+ * returns: the page, NULL if the FAT block cannot be read
+*/
+fatPage * fs_fat_page(FS *fs, uint32_t block_idx) {
+	FAT_t FAT = fs->FAT;
+	uint32_t FAT_block = block_idx / FAT32_ENTRIES_PER_BLOCK;
+
+	if (FAT->page_of[FAT_block]) {
+		fatPage *page = &FAT->pages[FAT->page_of[FAT_block] - 1];
+		page->referenced = true;
+		return page;
+	}
 
-			return 0;
-		}
+	fatPage *page = fs_fat_page_alloc(fs);
+	if (!page || fs_block_read(fs, FAT_START_IDX + FAT_block, page->entries) == -1) {
+		FAT->failed = true;
+		return NULL;
 	}
 
-	return -1;
+	stats.fat_pages_loaded++;
+	page->FAT_block = FAT_block;
+	page->dirty = false;
+	page->referenced = true;
+	FAT->page_of[FAT_block] = page - FAT->pages + 1;
+	return page;
 }
 
-int fs_delete(const char *filename)
-{
-	// make sure fs is properly mounted
-	if (!is_mounted(fs))
-		return -1;
+/** Read a FAT entry
+ * @fs: pointer to filesystem
+ * @block_idx: FAT entry to read
+ * 
+ * returns: next block index, FAT_EOC, or 0 if the block is free
+*/
+uint32_t fs_fat_get(FS *fs, uint32_t block_idx) {
+	if (!fs->geo.fat32) {
+		uint16_t value = fs->FAT->blocks[block_idx];
+		return value == FAT16_EOC ? FAT_EOC : value;
+	}
 
-	file *files_list = fs->rootDir->files;
-	file EMPTY_FILE_CELL = {.filename = '\0', .file_size = 0, .first_block_idx = FAT_EOC};
+	// an unreadable FAT block ends chains and has no free block to give
+	fatPage *page = fs_fat_page(fs, block_idx);
+	return page ? page->entries[block_idx % FAT32_ENTRIES_PER_BLOCK] : FAT_EOC;
+}
 
-	// get file_num
-	int file_num = fs_file_num_from_filename(fs, filename);
+/** Count the blocks taken in a FAT32, reading it in runs of blocks
+ * @fs: pointer to filesystem
+ * 
+ * The blocks are only scanned, not kept: a mount loads the FAT blocks it uses
+ * when it uses them.
+ * 
+ * returns: 0 on success, -1 if the FAT cannot be read
+*/
+int fs_fat32_count_taken(FS *fs) {
+	size_t run_blocks = min(fs->geo.num_blocks_for_FAT, FAT32_MAX_RESIDENT);
+	uint32_t *entries = malloc(run_blocks * BLOCK_SIZE);
 
-	// invalid filename or couldnt find
-	if (file_num < 0) 
+	if (!entries)
 		return -1;
 
-	// TODO: first, free blocks in FAT associated with file
-	uint16_t block_idx = files_list[file_num].first_block_idx;
-	while (block_idx != FAT_EOC) {
-		// save next block idx and set value to FAT_EOC
-		uint16_t next_block_idx = fs->FAT->blocks[block_idx];
-		fs->FAT->blocks[block_idx] = FAT_EOC;
-
-		// update current block idx and continue
-		block_idx = next_block_idx;
-	}
+	fs->FAT->num_blocks_taken = 0;
+	for (size_t i = 0; i < fs->geo.num_blocks_for_FAT; i += run_blocks) {
+		size_t count = min(fs->geo.num_blocks_for_FAT - i, run_blocks);
+		size_t first_entry = i * FAT32_ENTRIES_PER_BLOCK;
+		size_t num_entries = min(count * FAT32_ENTRIES_PER_BLOCK, fs->geo.amt_data_blocks - first_entry);
 
-	// delete entry in 
-	files_list[file_num] = EMPTY_FILE_CELL;
-	fs->rootDir->num_files--;
+		if (fs_block_readv(fs, FAT_START_IDX + i, count, entries) == -1) {
+			free(entries);
+			return -1;
+		}
 
-	// save updated rootDir
-	if (!fs_save_rootDir(fs) == -1)
-		return -1;
-	
-	// save updated FAT
-	if (!fs_save_FAT(fs) == -1)
-		return -1;
+		for (size_t j = 0; j < num_entries; j++) {
+			if (entries[j] != 0)
+				fs->FAT->num_blocks_taken++;
+		}
+	}
 
+	free(entries);
 	return 0;
 }
 
-int fs_ls(void)
-{
-	// make sure fs is properly mounted
-	if (!is_mounted(fs))
-		return -1;
+/** Size of a hole map entry, wide enough for a hole as long as the data region
+ * 
+*/
+size_t fs_hole_entry_size(FS *fs) {
+	return fs->geo.fat32 ? sizeof(uint32_t) : sizeof(uint16_t);
+}
 
-	file *files_list = fs->rootDir->files;
+/** Longest hole a hole map entry can describe, in blocks
+ * 
+*/
+size_t fs_hole_max(FS *fs) {
+	return fs->geo.fat32 ? UINT32_MAX : UINT16_MAX;
+}
 
-	// print header
-	printf("FS Ls:\n");
+/** Number of unallocated blocks in front of a block of a sparse file
+ * 
+*/
+size_t fs_hole_skip(FS *fs, uint32_t block_idx) {
+	if (!fs->holes)
+		return 0;
 
-	// print each file information
-	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		// file is not empty...
-		if (files_list[i].filename[0] != '\0')
-			printf("file: %s, size: %d, data_blk: %d\n", files_list[i].filename, files_list[i].file_size, files_list[i].first_block_idx);
-	}
+	return fs->geo.fat32 ? ((uint32_t *) fs->holes)[block_idx] : ((uint16_t *) fs->holes)[block_idx];
 }
 
-int fs_open(const char *filename)
-{
-	// make sure fs is properly mounted
-	if (!is_mounted(fs))
-		return -1;
+/** Store an entry of the hole map, which must exist
+ * 
+*/
+void fs_hole_store(FS *fs, uint32_t block_idx, size_t skip) {
+	if (fs->geo.fat32)
+		((uint32_t *) fs->holes)[block_idx] = skip;
+	else
+		((uint16_t *) fs->holes)[block_idx] = skip;
+
+	fs->chain_gen++;
+	fs->holes_dirty = true;
+}
 
-	// check if max amount of open files has been reached
-	if (fs->num_open_files >= FS_OPEN_MAX_COUNT)
-		return -1;
-	
-	// find open file descriptor
-	int fd = -1;
-	for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
-		// file_num of -1 means fd is available to use
-		if (fs->open_files[i].file_num == -1) {
-			fd = i;
-			break;
-		}
+/** Read a metadata table stored in a chain of data blocks
+ * @fs: pointer to filesystem
+ * @block_idx: first data block of the chain
+ * @table: buffer to fill, one block per chain link
+ * 
+ * returns: 0 on success, -1 if a block cannot be read
+*/
+int fs_meta_load(FS *fs, uint32_t block_idx, void *table) {
+	for (char *p = table; block_idx != FAT_EOC; p += BLOCK_SIZE) {
+		if (fs_block_read(fs, fs->geo.data_block_start_idx + block_idx, p) == -1)
+			return -1;
+		block_idx = fs_fat_get(fs, block_idx);
 	}
 
-	// ERROR: no file descriptor available
-	if (fd == -1)
-		return -1;
-
-	// get file number
-	int file_num = fs_file_num_from_filename(fs, filename);
-	if (file_num < 0)
-		return -1;
-
-	// set open file
-	fs->open_files[fd] = (openFile){.fd = fd, .file_num = file_num, .file_offset = 0};
-	fs->num_open_files++;
-
-	return fd;
+	return 0;
 }
 
-int fs_close(int fd)
-{
-	// make sure fs is properly mounted
-	if (!is_mounted(fs))
-		return -1;
-
-	// make sure file descriptor is valid
-	if (!fs_validate_fd(fs, fd))
-		return -1;
-
-	// close file descriptor
-	fs->open_files[fd] = (openFile){.file_num = -1};
-	fs->num_open_files--;
+/** Write a metadata table back to its chain of data blocks
+ * @fs: pointer to filesystem
+ * @block_idx: first data block of the chain
+ * @table: buffer holding one block per chain link
+ * 
+ * returns: 0 on success, -1 if a block cannot be written
+*/
+int fs_meta_save(FS *fs, uint32_t block_idx, const void *table) {
+	stats.meta_table_flushes++;
+	for (const char *p = table; block_idx != FAT_EOC; p += BLOCK_SIZE) {
+		if (fs_block_write(fs, fs->geo.data_block_start_idx + block_idx, p) == -1)
+			return -1;
+		block_idx = fs_fat_get(fs, block_idx);
+	}
 
 	return 0;
 }
 
-int fs_stat(int fd)
-{
-	// make sure fs is properly mounted
-	if (!is_mounted(fs))
-		return -1;
-
-	// get file number from fd
-	int file_num = fs_file_num_from_fd(fs, fd);
-	if (file_num == -1)
-		return -1;
-
-	// return file size
-	return fs->rootDir->files[file_num].file_size;
+/** Number of blocks needed by a table with one entry per data block
+ * 
+*/
+int fs_meta_num_blocks(FS *fs, size_t entry_size) {
+	return ceil_but_better(fs->geo.amt_data_blocks * entry_size / (double) BLOCK_SIZE);
 }
 
-int fs_lseek(int fd, size_t offset)
-{
-	// make sure fs is properly mounted
-	if (!is_mounted(fs))
-		return -1;
-
-	// offset is too large
-	if (offset > fs_stat(fd))
-		return -1;
+// returns true if fs is open
+// returns false if fs has not been opened
+bool is_mounted(FS *fs) {
+	return fs && block_disk_count() != -1 && fs->is_mounted;
+}
 
-	// invalid fd
-	if (!fs_validate_fd(fs, fd))
-		return -1;
+// bit of a data block in a bitmap of the data region
+bool fs_bit_test(const uint64_t *map, uint32_t block_idx) {
+	return map[block_idx / 64] & (1ULL << (block_idx % 64));
+}
 
-	// set offset
-	fs->open_files[fd].file_offset = offset;
+void fs_bit_set(uint64_t *map, uint32_t block_idx) {
+	map[block_idx / 64] |= 1ULL << (block_idx % 64);
+}
 
-	return 0;
+void fs_bit_clear(uint64_t *map, uint32_t block_idx) {
+	map[block_idx / 64] &= ~(1ULL << (block_idx % 64));
 }
 
-/** Find the block and block offset of the file in question 
- * @fs: pointer to filesystem
- * @fd: file descriptor of open file in question
- * @block_idx: block index where the overall offset lays
- * @block_offset: offset of the block where the overall offset lays
+/** Forget the fingerprint of a data block, which no longer holds the data it was taken of
  * 
- * returns: 0 on successful, -1 otherwise
 */
-int fs_get_block_offset(FS *fs, int fd, size_t *block_idx, size_t *block_offset) {
-	// get file number
-	int file_num = fs_file_num_from_fd(fs, fd);
-	if (file_num == -1) 
-		return -1;
+void fs_fingerprint_clear(FS *fs, uint32_t block_idx) {
+	if (!fs->fingerprints || !fs->fingerprints[block_idx])
+		return;
 
-	// get open file descriptor
-	openFile open_file = fs->open_files[fd];
-	// get target file
-	file target_file = fs->rootDir->files[file_num];
+	fs->fingerprints[block_idx] = 0;
+	fs_bit_set(fs->fingerprints_dirty, block_idx / FINGERPRINTS_PER_BLOCK);
+}
 
-	// get start values before looping to update them
-	*block_idx = target_file.first_block_idx;
-	*block_offset = open_file.file_offset;
+/** Update a FAT entry and keep the block accounting in sync
+ * @fs: pointer to filesystem
+ * @block_idx: FAT entry to update
+ * @value: next block index, FAT_EOC, or 0 to free the block
+*/
+void fs_fat_set(FS *fs, uint32_t block_idx, uint32_t value) {
+	fatPage *page = NULL;
+
+	// the update is lost if the FAT block cannot be read, fs_save_FAT() reports it
+	if (fs->geo.fat32 && !(page = fs_fat_page(fs, block_idx)))
+		return;
+
+	uint32_t old_value = fs_fat_get(fs, block_idx);
+
+	if (old_value == 0 && value != 0)
+		fs->FAT->num_blocks_taken++;
+	else if (old_value != 0 && value == 0)
+		fs->FAT->num_blocks_taken--;
+
+	// freed blocks no longer have a gap in front of them, nor data to share
+	if (value == 0 && fs_hole_skip(fs, block_idx))
+		fs_hole_store(fs, block_idx, 0);
+	if (value == 0)
+		fs_fingerprint_clear(fs, block_idx);
+
+	// log disks count the used blocks of each segment, to find empty ones
+	if (fs->log_used && (old_value == 0) != (value == 0)) {
+		size_t segment = block_idx / LOG_SEGMENT_BLOCKS;
+
+		if (value != 0 && fs->log_used[segment]++ == 0) {
+			fs->log_free_segments--;
+		} else if (value == 0) {
+			fs_bit_clear(fs->log_new, block_idx);
+			if (--fs->log_used[segment] == 0) {
+				fs->log_free_segments++;
+				fs->log_pinned[segment] = 0;
+			}
+		}
+	}
 
-	// loop until block_offset is inside a the current block
-	// or until we hit FAT_EOC
-	while (*block_offset >= BLOCK_SIZE && fs->FAT->blocks[*block_idx] != FAT_EOC) {
-		// decrement block_offset by entire block size
-		*block_offset -= BLOCK_SIZE;
+	fs->chain_gen++;
+	if (page) {
+		page->entries[block_idx % FAT32_ENTRIES_PER_BLOCK] = value;
+		page->dirty = true;
+	} else {
+		fs->FAT->blocks[block_idx] = value == FAT_EOC ? FAT16_EOC : value;
 
-		// go to next block in file
-		*block_idx = fs->FAT->blocks[*block_idx];
+		// remember which FAT block needs to be flushed
+		size_t FAT_block = block_idx / FAT16_ENTRIES_PER_BLOCK;
+		fs->FAT->dirty_blocks[FAT_block / 64] |= 1ULL << (FAT_block % 64);
 	}
 
-	return 0;
+	fs->FAT->dirty = true;
+}
+
+/** Point the link after @prev_block_idx (or the file's first block) to @block_idx
+ * 
+*/
+void fs_chain_link(FS *fs, file *target_file, uint32_t prev_block_idx, uint32_t block_idx) {
+	if (prev_block_idx == FAT_EOC)
+		fs_file_set_first(&fs->geo, target_file, block_idx);
+	else
+		fs_fat_set(fs, prev_block_idx, block_idx);
 }
 
 /** Find the next open data block index in the FAT 
@@ -576,157 +1365,6493 @@ int fs_get_block_offset(FS *fs, int fd, size_t *block_idx, size_t *block_offset)
 */
 int fs_find_open_data_block(FS *fs) {
 	// errors
-	if (fs->FAT->num_blocks_taken >= fs->superblock->amt_data_blocks)
+	if (fs->FAT->num_blocks_taken >= fs->geo.amt_data_blocks)
 		return -1;
 
-	for (int i = 0; i < fs->superblock->amt_data_blocks; i++) {
-		if (fs->FAT->blocks[i] == 0)
+	// a FAT32 search resumes after the block it last handed out (next fit),
+	// so that it does not page in the whole FAT
+	uint32_t start = fs->geo.fat32 ? fs->FAT->curr_pos : 0;
+
+	stats.alloc_searches++;
+	for (uint32_t n = 0; n < fs->geo.amt_data_blocks; n++) {
+		uint32_t i = (start + n) % fs->geo.amt_data_blocks;
+
+		stats.alloc_scan_steps++;
+		if (fs_fat_get(fs, i) == 0) {
+			fs->FAT->curr_pos = i + 1;
 			return i;
+		}
 	}
 
 	// if no block is available
 	return -1;
 }
 
-int fs_write(int fd, void *buf, size_t count)
-{
-	// make sure fs is properly mounted
-	if (!is_mounted(fs))
-		return -1;
+/** Allocate a zeroed chain of data blocks for a metadata table
+ * @fs: pointer to filesystem
+ * @num_blocks: length of the chain
+ * 
+ * returns: first block of the chain,
+ * 			-1 if the disk does not have enough free blocks, or a block
+ * 			cannot be zeroed (the chain is then released)
+*/
+int fs_meta_create(FS *fs, int num_blocks) {
+	char zero[BLOCK_SIZE] = {0};
+	uint32_t first_block_idx = FAT_EOC;
 
-	// number of bytes already written from @buf
-	size_t bytes_written = 0;
+	if (fs->FAT->num_blocks_taken + num_blocks > fs->geo.amt_data_blocks)
+		return -1;
 
-	// pointer to block sized buffer
-	void *block_p = malloc(BLOCK_SIZE);
+	// build the chain back to front
+	for (int i = 0; i < num_blocks; i++) {
+		int open_block = fs_find_open_data_block(fs);
+		fs_fat_set(fs, open_block, first_block_idx);
+		first_block_idx = open_block;
+		if (fs_block_write(fs, fs->geo.data_block_start_idx + open_block, zero) == -1)
+			goto fail;
+	}
 
-	// get target file
-	int file_num = fs_file_num_from_fd(fs, fd);
-	if (file_num == -1)
-		return -1;
-	
-	// get open file descriptor
-	openFile *open_file = &fs->open_files[fd];
-	// get target file
-	file *target_file = &fs->rootDir->files[file_num];
+	return first_block_idx;
 
-	// Pointer to block index we are currently on
-	// This is a pointer so that we can change the value if we need
-	// to change it to connect it to the end of a chain in the FAT
-	uint16_t *block_idx_p = &target_file->first_block_idx;
+fail:
+	while (first_block_idx != FAT_EOC) {
+		uint32_t next_block_idx = fs_fat_get(fs, first_block_idx);
+		fs_fat_set(fs, first_block_idx, 0);
+		first_block_idx = next_block_idx;
+	}
+	return -1;
+}
 
-	// loop until bytes are written
-	while (bytes_written < count) {
+/* HOLE MAP HELPERS */
 
-		// allocate another block if necessary
-		if (*block_idx_p == FAT_EOC) {
+/** Create the hole map the first time a sparse file needs it
+ * @fs: pointer to filesystem
+ * 
+ * returns: 0 on success, -1 if there is no room for the hole map
+*/
+int fs_hole_map_create(FS *fs) {
+	if (fs->holes)
+		return 0;
 
-			// find open block
-			size_t open_block = fs_find_open_data_block(fs);
-			if (open_block == -1)
-				return bytes_written;
+	int num_blocks = fs_meta_num_blocks(fs, fs_hole_entry_size(fs));
+	if (fs->FAT->num_blocks_taken + num_blocks > fs->geo.amt_data_blocks)
+		return -1;
 
-			// connect new open block to chain
-			*block_idx_p = open_block;
-			fs->FAT->blocks[open_block] = FAT_EOC;
-			fs->FAT->num_blocks_taken++;
+	void *holes = fs_arena_alloc(&fs->arena, num_blocks * BLOCK_SIZE);
+	if (!holes)
+		return -1;
 
-			// save updated rootDir
-			if (!fs_save_FAT(fs) == -1)
-				return -1;
-		}
+	int first_block_idx = fs_meta_create(fs, num_blocks);
+	if (first_block_idx == -1)
+		return -1;
 
-		// calculate number of bytes to be written in this block
-		size_t num_bytes_to_write = min(count - bytes_written, BLOCK_SIZE);
+	fs->holes = holes;
+	fs->geo.holemap_block_idx = first_block_idx;
+	if (fs->geo.fat32)
+		fs->superblock->holemap_block_idx32 = first_block_idx;
+	else
+		fs->superblock->holemap_block_idx = first_block_idx;
+	return fs_save_superblock(fs);
+}
 
-		// first read block we are about to overwrite
-		if (num_bytes_to_write < BLOCK_SIZE)
-			block_read(fs->superblock->data_block_start_idx + *block_idx_p, block_p);
+/** Record the number of unallocated blocks in front of a block
+ * @fs: pointer to filesystem
+ * @block_idx: data block index
+ * @skip: number of hole blocks between the previous block of the file and @block_idx
+ * 
+ * returns: 0 on success, -1 if the hole map could not be created
+*/
+int fs_hole_set(FS *fs, uint32_t block_idx, size_t skip) {
+	if (!fs->holes && skip == 0)
+		return 0;
 
-		// bytes to block sized pointer
-		memcpy(block_p, buf + bytes_written, num_bytes_to_write);
+	if (fs_hole_map_create(fs) == -1)
+		return -1;
 
-		// write to block
-		block_write(fs->superblock->data_block_start_idx + *block_idx_p, block_p);
+	fs_hole_store(fs, block_idx, skip);
+	return 0;
+}
 
-		// update bytes written and file size if necessary
-		bytes_written += num_bytes_to_write;
+/* LOG HELPERS
+ *
+ * Disks formatted with FS_FORMAT_LOG write the blocks of files at the head of
+ * a log, which fills one empty segment of LOG_SEGMENT_BLOCKS blocks after the
+ * other. An overwrite goes to the log too, and the block it replaces stays
+ * allocated until a checkpoint (fs_save_FAT()) has saved the extents that no
+ * longer point to it, so that the metadata on disk only ever points to blocks
+ * holding the data it describes. The cleaner keeps a supply of empty segments
+ * by copying the live blocks of the emptiest ones to the log.
+ */
+
+// wakes the background cleaner up when empty segments run low
+static pthread_cond_t log_cond = PTHREAD_COND_INITIALIZER;
+
+/** Move the head of the log to the next empty segment
+ * 
+ * returns: 0 on success, -1 if no segment is empty
+*/
+int fs_log_open_segment(FS *fs) {
+	if (fs->log_free_segments < LOG_CLEAN_LOW(fs->num_segments))
+		pthread_cond_signal(&log_cond);
 
-		// update file size if necessary
-		if (bytes_written > target_file->file_size) {
-			target_file->file_size = bytes_written;
+	for (size_t n = 0; n < fs->num_segments; n++) {
+		size_t segment = (fs->log_next_segment + n) % fs->num_segments;
 
-			// save updated rootDir to disk
-			if (!fs_save_rootDir(fs) == -1)
-				return -1;
+		if (fs->log_used[segment] == 0) {
+			fs->log_next_segment = segment + 1;
+			fs->log_head = segment * LOG_SEGMENT_BLOCKS;
+			fs->log_end = min_size(fs->log_head + LOG_SEGMENT_BLOCKS, fs->geo.amt_data_blocks);
+			return 0;
 		}
-
-		// get next block
-		block_idx_p = &fs->FAT->blocks[*block_idx_p];
 	}
 
-	return bytes_written;
+	return -1;
 }
 
-int fs_read(int fd, void *buf, size_t count)
-{
-	// make sure fs is properly mounted
-	if (!is_mounted(fs))
-		return -1;
+/** Take the block at the head of the log
+ * 
+ * Once no segment is empty, blocks are taken wherever they are free.
+ * 
+ * returns: index of the block, marked used in the FAT, -1 if the disk is full
+*/
+int fs_log_alloc(FS *fs) {
+	int block_idx;
 
-	// number of bytes already read into @buf
-	size_t bytes_read = 0;
+	while (fs->log_head < fs->log_end && fs_fat_get(fs, fs->log_head) != 0)
+		fs->log_head++;
 
-	// pointer to block sized buffer
-	void *block_p = malloc(BLOCK_SIZE);
+	if (fs->log_head < fs->log_end || fs_log_open_segment(fs) == 0)
+		block_idx = fs->log_head++;
+	else
+		block_idx = fs_find_open_data_block(fs);
 
-	// get target file
-	int file_num = fs_file_num_from_fd(fs, fd);
-	if (file_num == -1)
+	if (block_idx == -1)
 		return -1;
 
-	// get open file descriptor
-	openFile *open_file = &fs->open_files[fd];
-
-	// get target file
-	file *target_file = &fs->rootDir->files[file_num];
-
-	// vars to keep track of current block index and block offset
-	size_t block_idx;
-	size_t block_offset;
+	fs_fat_set(fs, block_idx, FAT_EOC);
+	fs_bit_set(fs->log_new, block_idx);
+	fs->log_pending++;
+	return block_idx;
+}
 
-	int c = 0;
-	while (bytes_read < count && open_file->file_offset < target_file->file_size) {
+/** Give up a block of a file that was replaced in the log
+ * 
+ * The metadata on disk cannot point to a block taken since the last
+ * checkpoint, so such a block is released at once. Others wait for the next
+ * checkpoint.
+*/
+void fs_log_kill(FS *fs, uint32_t block_idx) {
+	if (fs_bit_test(fs->log_new, block_idx)) {
+		fs_fat_set(fs, block_idx, 0);
+		return;
+	}
+
+	// the block is freed at the checkpoint, nothing may start sharing it
+	fs_fingerprint_clear(fs, block_idx);
+
+	fs_bit_set(fs->log_dead_map, block_idx);
+	fs->log_dead[block_idx / LOG_SEGMENT_BLOCKS]++;
+	fs->log_pending++;
+}
+
+/** Release the blocks replaced since the last checkpoint, once the metadata is saved
+ * 
+ * returns: number of blocks released
+*/
+size_t fs_log_release(FS *fs) {
+	size_t num_words = (fs->geo.amt_data_blocks + 63) / 64;
+	size_t released = 0;
+
+	for (size_t i = 0; i < num_words; i++) {
+		for (uint32_t bit = 0; fs->log_dead_map[i] && bit < 64; bit++) {
+			if (!(fs->log_dead_map[i] & (1ULL << bit)))
+				continue;
+
+			fs->log_dead_map[i] &= ~(1ULL << bit);
+			fs_fat_set(fs, i * 64 + bit, 0);
+			released++;
+		}
+	}
+
+	memset(fs->log_new, 0, num_words * sizeof(uint64_t));
+	memset(fs->log_dead, 0, fs->num_segments);
+	fs->log_pending = 0;
+	stats.log_checkpoints++;
+	return released;
+}
+
+/** Count the used blocks of each segment of a log disk when it is mounted
+ * 
+ * returns: 0 on success, -1 if the FAT cannot be read or the maps allocated
+*/
+int fs_log_setup(FS *fs) {
+	size_t num_words = (fs->geo.amt_data_blocks + 63) / 64;
+	size_t num_segments = (fs->geo.amt_data_blocks + LOG_SEGMENT_BLOCKS - 1) / LOG_SEGMENT_BLOCKS;
+
+	// used, dead and pinned counts of each segment, then the new and dead bitmaps
+	uint8_t *counts = fs_arena_alloc(&fs->arena, 3 * num_segments);
+	uint64_t *maps = fs_arena_alloc(&fs->arena, 2 * num_words * sizeof(uint64_t));
+	if (!counts || !maps)
+		return -1;
+
+	fs->num_segments = num_segments;
+	fs->log_free_segments = 0;
+	for (uint32_t i = 0; i < fs->geo.amt_data_blocks; i++) {
+		if (fs_fat_get(fs, i) != 0)
+			counts[i / LOG_SEGMENT_BLOCKS]++;
+	}
+	for (size_t i = 0; i < num_segments; i++) {
+		if (counts[i] == 0)
+			fs->log_free_segments++;
+	}
+	if (fs->FAT->failed)
+		return -1;
+
+	// the first block taken opens a segment
+	fs->log_used = counts;
+	fs->log_dead = counts + num_segments;
+	fs->log_pinned = counts + 2 * num_segments;
+	fs->log_new = maps;
+	fs->log_dead_map = maps + num_words;
+	fs->log_head = fs->log_end = 0;
+	fs->log_next_segment = 0;
+	fs->log_pending = 0;
+	return 0;
+}
+
+/* SHARED BLOCK HELPERS
+ *
+ * fs_clone() gives a new file the extents of an existing one instead of a
+ * copy of its data, and counts the extra references each block then has in a
+ * table of 16-bit entries created the first time a file is cloned. A write to
+ * a shared block goes to a new block of the writer's own (copy-on-write), and
+ * a shared block is only freed once its last reference is dropped.
+ */
+
+/** Number of references to a data block beyond the first
+ * 
+*/
+uint16_t fs_block_refs(FS *fs, uint32_t block_idx) {
+	return fs->refs ? fs->refs[block_idx] : 0;
+}
+
+/** Create the reference count table the first time a file is cloned
+ * @fs: pointer to filesystem
+ * 
+ * returns: 0 on success, -1 if there is no room for the table
+*/
+int fs_refs_create(FS *fs) {
+	if (fs->refs)
+		return 0;
+
+	int num_blocks = fs_meta_num_blocks(fs, sizeof(uint16_t));
+	if (fs->FAT->num_blocks_taken + num_blocks > fs->geo.amt_data_blocks)
+		return -1;
+
+	uint16_t *refs = fs_arena_alloc(&fs->arena, num_blocks * BLOCK_SIZE);
+	if (!refs)
+		return -1;
+
+	int first_block_idx = fs_meta_create(fs, num_blocks);
+	if (first_block_idx == -1)
+		return -1;
+
+	fs->refs = refs;
+	fs->geo.refcount_idx = first_block_idx;
+	fs->superblock->refcount_idx = first_block_idx;
+	fs->superblock->features |= FS_FEATURE_SHARED;
+	return fs_save_superblock(fs);
+}
+
+/** Drop a file's reference to one of its data blocks
+ * 
+ * A block shared with other files only loses a reference. The last one frees
+ * it, at the next checkpoint on a log disk (see fs_log_kill()).
+*/
+void fs_block_release(FS *fs, uint32_t block_idx) {
+	if (fs_block_refs(fs, block_idx)) {
+		fs->refs[block_idx]--;
+		fs->refs_dirty = true;
+	} else if (fs->geo.log) {
+		fs_log_kill(fs, block_idx);
+	} else {
+		fs_fat_set(fs, block_idx, 0);
+	}
+}
+
+/** Check whether a block of a file must be copied elsewhere before it is overwritten
+ * 
+ * That is the case of shared blocks, and of the blocks of a log disk that the
+ * metadata on disk may still point to.
+*/
+bool fs_block_needs_copy(FS *fs, uint32_t block_idx) {
+	return fs_block_refs(fs, block_idx) || (fs->geo.log && !fs_bit_test(fs->log_new, block_idx));
+}
+
+/** Check whether a file shares any of its blocks with another file
+ * 
+*/
+bool fs_extent_shared(FS *fs, int file_num) {
+	extentList *list = &fs->extents[file_num];
+
+	for (size_t i = 0; fs->refs && i < list->count; i++) {
+		for (uint32_t j = 0; j < list->extents[i].length; j++) {
+			if (fs->refs[list->extents[i].start + j])
+				return true;
+		}
+	}
+
+	return false;
+}
+
+/* EXTENT HELPERS
+ *
+ * Disks formatted with FS_FORMAT_EXTENTS describe each regular file by the
+ * runs of consecutive blocks it is made of, so that a block is found by a
+ * binary search instead of a walk along the FAT, and a run is read or written
+ * in one go. The FAT only marks the blocks of files as used, and still links
+ * the chains of metadata blocks. The extent table holds one record per root
+ * directory entry, and is loaded whole at mount time.
+ */
+
+/** Make room for @count extents in a file's list
+ * 
+ * Lists live in the mount's arena, a list that grows leaves its old array behind.
+ * 
+ * returns: 0 on success, -1 if the arena could not grow
+*/
+int fs_extent_reserve(FS *fs, extentList *list, size_t count) {
+	if (count <= list->capacity)
+		return 0;
+
+	size_t capacity = max_size(count, max_size(2 * list->capacity, 4));
+	extent *extents = fs_arena_alloc(&fs->arena, capacity * sizeof(extent));
+	if (!extents)
+		return -1;
 
-		// get block specific offset
-		if (fs_get_block_offset(fs, fd, &block_idx, &block_offset) == -1)
+	if (list->count)
+		memcpy(extents, list->extents, list->count * sizeof(extent));
+	list->extents = extents;
+	list->capacity = capacity;
+	return 0;
+}
+
+/** Add a run at the end of a file's list, merging it with the last extent if it continues it
+ * 
+ * returns: 0 on success, -1 if the arena could not grow
+*/
+int fs_extent_append(FS *fs, extentList *list, uint64_t block_num, uint32_t start, uint32_t length) {
+	extent *last = list->count ? &list->extents[list->count - 1] : NULL;
+
+	if (last && last->block_num + last->length == block_num && last->start + last->length == start
+		&& (uint64_t) last->length + length <= UINT32_MAX) {
+		last->length += length;
+		return 0;
+	}
+
+	if (fs_extent_reserve(fs, list, list->count + 1) == -1)
+		return -1;
+
+	list->extents[list->count++] = (extent){.block_num = block_num, .start = start, .length = length};
+	return 0;
+}
+
+/** Find the last extent starting at or before a logical block
+ * 
+ * returns: index of the extent, -1 if every extent starts after @block_num
+*/
+ssize_t fs_extent_find(const extentList *list, uint64_t block_num) {
+	size_t low = 0, high = list->count;
+
+	while (low < high) {
+		size_t mid = low + (high - low) / 2;
+
+		stats.extent_search_steps++;
+		if (list->extents[mid].block_num <= block_num)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	return (ssize_t) low - 1;
+}
+
+/** Take a data block for a file, @goal if it is free (the head of the log on log disks)
+ * 
+ * returns: index of the block, marked used in the FAT, -1 if the disk is full
+*/
+int fs_extent_alloc_block(FS *fs, uint32_t goal) {
+	int block_idx;
+
+	if (fs->geo.log)
+		return fs_log_alloc(fs);
+
+	if (goal != 0 && goal < fs->geo.amt_data_blocks && fs->FAT->num_blocks_taken < fs->geo.amt_data_blocks
+		&& fs_fat_get(fs, goal) == 0)
+		block_idx = goal;
+	else
+		block_idx = fs_find_open_data_block(fs);
+
+	if (block_idx != -1)
+		fs_fat_set(fs, block_idx, FAT_EOC);
+
+	return block_idx;
+}
+
+/** Number of extents a file's list takes on disk, counting the holes
+ * 
+*/
+size_t fs_extent_disk_count(const extentList *list) {
+	uint64_t next_block_num = 0;
+	size_t count = list->count;
+
+	for (size_t i = 0; i < list->count; i++) {
+		uint64_t gap = list->extents[i].block_num - next_block_num;
+
+		count += (gap + UINT32_MAX - 1) / UINT32_MAX;
+		next_block_num = list->extents[i].block_num + list->extents[i].length;
+	}
+
+	return count;
+}
+
+/** Make sure the chain of overflow blocks of a file can hold @count extents as stored on disk
+ * @fs: pointer to filesystem
+ * @file_num: file number of the file
+ * @count: number of extents, see fs_extent_disk_count()
+ * 
+ * Blocks are taken when a file gains extents rather than when they are saved,
+ * so that a full disk is reported by the call that fills it. Saving the
+ * extents releases the blocks they no longer need.
+ * 
+ * returns: 0 on success, -1 if the disk is full
+*/
+int fs_extent_room(FS *fs, int file_num, size_t count) {
+	extentRecord *record = &fs->extent_table[file_num];
+	uint32_t prev_block_idx = 0;
+	uint32_t block_idx = record->overflow_idx ? record->overflow_idx : FAT_EOC;
+
+	for (size_t n = EXTENT_INLINE; n < count; n += EXTENTS_PER_BLOCK) {
+		if (block_idx == FAT_EOC) {
+			int open_block = fs_extent_alloc_block(fs, prev_block_idx ? prev_block_idx + 1 : 0);
+			if (open_block == -1)
+				return -1;
+
+			if (prev_block_idx)
+				fs_fat_set(fs, prev_block_idx, open_block);
+			else
+				record->overflow_idx = open_block;
+			block_idx = open_block;
+
+			// the next save gives the block back if the extents end up not needing it
+			fs->extents[file_num].dirty = true;
+			fs->extents_dirty = true;
+		}
+
+		prev_block_idx = block_idx;
+		block_idx = fs_fat_get(fs, block_idx);
+	}
+
+	return 0;
+}
+
+/** Map an unmapped logical block of a file to a data block
+ * @fs: pointer to filesystem
+ * @list: extents of the file
+ * @i: index of the last extent before @block_num, -1 if there is none
+ * @block_num: logical block number inside the file
+ * @block_idx: data block to map it to
+ * 
+ * The block extends the extents around it when it continues them on disk.
+ * 
+ * returns: 0 on success, -1 if the arena could not grow
+*/
+int fs_extent_insert(FS *fs, extentList *list, ssize_t i, uint64_t block_num, uint32_t block_idx) {
+	extent *prev = i >= 0 ? &list->extents[i] : NULL;
+	extent *next = (size_t) (i + 1) < list->count ? &list->extents[i + 1] : NULL;
+	bool follows = prev && prev->block_num + prev->length == block_num && prev->start + prev->length == block_idx
+		&& prev->length < UINT32_MAX;
+	bool precedes = next && next->block_num == block_num + 1 && next->start == block_idx + 1
+		&& next->length < UINT32_MAX;
+
+	if (follows) {
+		prev->length++;
+
+		// the block may close the gap up to the next extent
+		if (precedes && (uint64_t) prev->length + next->length <= UINT32_MAX) {
+			prev->length += next->length;
+			memmove(next, next + 1, (list->count - i - 2) * sizeof(extent));
+			list->count--;
+		}
+	} else if (precedes) {
+		*next = (extent){.block_num = block_num, .start = block_idx, .length = next->length + 1};
+	} else {
+		if (fs_extent_reserve(fs, list, list->count + 1) == -1)
 			return -1;
 
-		// failsafe
-		if (block_idx == FAT_EOC)
+		memmove(&list->extents[i + 2], &list->extents[i + 1], (list->count - i - 1) * sizeof(extent));
+		list->extents[i + 1] = (extent){.block_num = block_num, .start = block_idx, .length = 1};
+		list->count++;
+	}
+
+	list->dirty = true;
+	fs->extents_dirty = true;
+	return 0;
+}
+
+/** Unmap a logical block of a file, leaving a hole
+ * @fs: pointer to filesystem
+ * @list: extents of the file, with room for one more
+ * @i: index of the extent holding @block_num
+ * @block_num: logical block number inside the file
+ * 
+ * The data block is left to the caller.
+ * 
+ * returns: index of the last extent before the hole, -1 if there is none
+*/
+ssize_t fs_extent_punch(FS *fs, extentList *list, ssize_t i, uint64_t block_num) {
+	extent *ext = &list->extents[i];
+	uint32_t offset = block_num - ext->block_num;
+
+	// punch the block out of its extent
+	if (ext->length == 1) {
+		memmove(ext, ext + 1, (list->count - i - 1) * sizeof(extent));
+		list->count--;
+		i--;
+	} else if (offset == 0) {
+		ext->block_num++;
+		ext->start++;
+		ext->length--;
+		i--;
+	} else if (offset == ext->length - 1) {
+		ext->length--;
+	} else {
+		memmove(ext + 2, ext + 1, (list->count - i - 1) * sizeof(extent));
+		ext[1] = (extent){.block_num = block_num + 1, .start = ext->start + offset + 1,
+			.length = ext->length - offset - 1};
+		ext->length = offset;
+		list->count++;
+	}
+
+	list->dirty = true;
+	fs->extents_dirty = true;
+	return i;
+}
+
+/** Map a logical block of a file to another data block
+ * @fs: pointer to filesystem
+ * @file_num: file number of the file
+ * @block_num: logical block number inside the file, which must be mapped
+ * @block_idx: data block to map it to, the old one is left to the caller
+ * 
+ * returns: 0 on success, -1 if the arena could not grow or the disk is full
+*/
+int fs_extent_remap(FS *fs, int file_num, uint64_t block_num, uint32_t block_idx) {
+	extentList *list = &fs->extents[file_num];
+
+	// splitting an extent and inserting the block take up to two more
+	if (fs_extent_reserve(fs, list, list->count + 2) == -1
+		|| fs_extent_room(fs, file_num, fs_extent_disk_count(list) + 2) == -1)
+		return -1;
+
+	ssize_t i = fs_extent_punch(fs, list, fs_extent_find(list, block_num), block_num);
+	return fs_extent_insert(fs, list, i, block_num, block_idx);
+}
+
+/** Map a logical block of a file described by extents, see fs_file_block()
+ * @fs: pointer to filesystem
+ * @file_num: file number of the file
+ * @block_num: logical block number inside the file
+ * @allocate: allocate a block if @block_num is a hole or past the end
+ * @fresh: set to true if the returned block was just allocated (may be NULL)
+ * 
+ * A block added right after an extent is taken next to it on disk when
+ * possible, so that the extent grows instead of a new one being started.
+ * 
+ * returns: data block index of logical block @block_num,
+ * 			-1 if the block is not allocated or the disk is full
+*/
+int fs_extent_block(FS *fs, int file_num, uint64_t block_num, bool allocate, bool *fresh) {
+	extentList *list = &fs->extents[file_num];
+	ssize_t i = fs_extent_find(list, block_num);
+	extent *prev = i >= 0 ? &list->extents[i] : NULL;
+
+	if (fresh)
+		*fresh = false;
+
+	if (prev && block_num < prev->block_num + prev->length)
+		return prev->start + (block_num - prev->block_num);
+
+	if (!allocate)
+		return -1;
+
+	// the block may start an extent, and split a hole in two
+	if (fs_extent_room(fs, file_num, fs_extent_disk_count(list) + 2) == -1)
+		return -1;
+
+	bool follows = prev && prev->block_num + prev->length == block_num;
+	int block_idx = fs_extent_alloc_block(fs, follows ? prev->start + prev->length : 0);
+	if (block_idx == -1)
+		return -1;
+
+	if (fs_extent_insert(fs, list, i, block_num, block_idx) == -1) {
+		fs_fat_set(fs, block_idx, 0);
+		return -1;
+	}
+
+	if (fresh)
+		*fresh = true;
+
+	return block_idx;
+}
+
+/** Release the blocks of a file described by extents from a logical block on
+ * @fs: pointer to filesystem
+ * @file_num: file number of the file
+ * @kept_blocks: number of logical blocks to keep
+*/
+void fs_extent_truncate(FS *fs, int file_num, uint64_t kept_blocks) {
+	extentList *list = &fs->extents[file_num];
+
+	while (list->count) {
+		extent *last = &list->extents[list->count - 1];
+		if (last->block_num + last->length <= kept_blocks)
 			break;
 
-		// read block
-		block_read(fs->superblock->data_block_start_idx + block_idx, block_p);
+		uint32_t kept = last->block_num >= kept_blocks ? 0 : kept_blocks - last->block_num;
+		for (uint32_t j = kept; j < last->length; j++)
+			fs_block_release(fs, last->start + j);
 
-		// find number of bytes after offset and before either EOF or end of block
-		size_t valid_bytes_in_block = min(BLOCK_SIZE - block_offset, target_file->file_size - open_file->file_offset);
+		list->dirty = true;
+		fs->extents_dirty = true;
+		if (kept) {
+			last->length = kept;
+			break;
+		}
+		list->count--;
+	}
+}
 
-		// copy the smaller of the 2:
-		// 1) number of valid bytes left in block
-		// 2) count - amount of bytes already read
-		size_t num_bytes_to_copy = min(count - bytes_read, valid_bytes_in_block);
+/** Next extent of a file's list as stored on disk, where holes are extents of their own
+ * @list: extents of the file
+ * @pos: walk state, zeroed before the first call (index in @list, and logical block reached)
+*/
+diskExtent fs_extent_disk_next(const extentList *list, size_t pos[2]) {
+	const extent *ext = &list->extents[pos[0]];
 
-		// fill string buffer
-		memcpy(buf + bytes_read, block_p + block_offset, num_bytes_to_copy);
+	if (ext->block_num > pos[1]) {
+		uint32_t length = min_size(ext->block_num - pos[1], UINT32_MAX);
 
-		// update count to contain how many bytes are left to be read
-		bytes_read += num_bytes_to_copy;
-		open_file->file_offset += num_bytes_to_copy;
+		pos[1] += length;
+		return (diskExtent){.start = 0, .length = length};
 	}
 
-	// end reading
-	return bytes_read;
+	pos[0]++;
+	pos[1] = ext->block_num + ext->length;
+	return (diskExtent){.start = ext->start, .length = ext->length};
+}
+
+/** Write the extents of a file to its record and its chain of overflow blocks
+ * @fs: pointer to filesystem
+ * @file_num: file number of the file
+ * 
+ * The overflow chain is reused, grown or cut to the number of blocks needed,
+ * it only grows here for extents that did not take their room, see fs_extent_room().
+ * 
+ * returns: 0 on success, -1 if the disk is full or cannot be written
+*/
+int fs_extent_save_file(FS *fs, int file_num) {
+	extentList *list = &fs->extents[file_num];
+	extentRecord *record = &fs->extent_table[file_num];
+	diskExtent block[EXTENTS_PER_BLOCK];
+	size_t num_extents = fs_extent_disk_count(list);
+	size_t pos[2] = {0, 0};
+
+	record->num_extents = num_extents;
+	for (size_t i = 0; i < EXTENT_INLINE; i++)
+		record->extents[i] = i < num_extents ? fs_extent_disk_next(list, pos) : (diskExtent){0};
+
+	if (fs_extent_room(fs, file_num, num_extents) == -1)
+		return -1;
+
+	uint32_t prev_block_idx = 0;
+	uint32_t block_idx = record->overflow_idx ? record->overflow_idx : FAT_EOC;
+	for (size_t n = EXTENT_INLINE; n < num_extents; n += EXTENTS_PER_BLOCK) {
+		memset(block, 0, sizeof(block));
+		for (size_t i = 0; i < EXTENTS_PER_BLOCK && n + i < num_extents; i++)
+			block[i] = fs_extent_disk_next(list, pos);
+		if (fs_block_write(fs, fs->geo.data_block_start_idx + block_idx, block) == -1)
+			return -1;
+
+		prev_block_idx = block_idx;
+		block_idx = fs_fat_get(fs, block_idx);
+	}
+
+	// cut the chain after the last block used, and release the rest
+	if (prev_block_idx)
+		fs_fat_set(fs, prev_block_idx, FAT_EOC);
+	else
+		record->overflow_idx = 0;
+
+	while (block_idx != FAT_EOC) {
+		uint32_t next_block_idx = fs_fat_get(fs, block_idx);
+		fs_fat_set(fs, block_idx, 0);
+		block_idx = next_block_idx;
+	}
+
+	return 0;
+}
+
+/** Write the extents of the files that changed, and the blocks of the table holding them
+ * 
+ * returns: 0 on success, -1 if the disk is full or cannot be written
+*/
+int fs_extent_save(FS *fs) {
+	char *table = (char *) fs->extent_table;
+	uint64_t dirty_blocks = 0;
+
+	if (!fs->extents_dirty)
+		return 0;
+
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (!fs->extents[i].dirty)
+			continue;
+
+		if (fs_extent_save_file(fs, i) == -1)
+			return -1;
+
+		fs->extents[i].dirty = false;
+		dirty_blocks |= 1ULL << (i * sizeof(extentRecord) / BLOCK_SIZE);
+	}
+
+	stats.meta_table_flushes++;
+	uint32_t block_idx = fs->geo.extent_table_idx;
+	for (size_t i = 0; block_idx != FAT_EOC; i++) {
+		if (dirty_blocks & (1ULL << i)
+			&& fs_block_write(fs, fs->geo.data_block_start_idx + block_idx, table + i * BLOCK_SIZE) == -1)
+			return -1;
+		block_idx = fs_fat_get(fs, block_idx);
+	}
+
+	fs->extents_dirty = false;
+	return 0;
+}
+
+/** Load the extent table and the extents of every file
+ * 
+ * returns: 0 on success, -1 if the table cannot be read or allocated
+*/
+int fs_extent_load(FS *fs) {
+	diskExtent block[EXTENTS_PER_BLOCK];
+
+	fs->extent_table = fs_arena_alloc(&fs->arena, EXTENT_TABLE_BLOCKS * BLOCK_SIZE);
+	if (!fs->extent_table || fs_meta_load(fs, fs->geo.extent_table_idx, fs->extent_table) == -1)
+		return -1;
+
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		extentRecord *record = &fs->extent_table[i];
+		extentList *list = &fs->extents[i];
+		uint32_t block_idx = record->overflow_idx ? record->overflow_idx : FAT_EOC;
+		uint64_t block_num = 0;
+
+		if (fs_extent_reserve(fs, list, record->num_extents) == -1)
+			return -1;
+
+		for (size_t n = 0; n < record->num_extents; n++) {
+			diskExtent *ext = &record->extents[n];
+
+			// the first overflow block is read when the inline extents run out
+			if (n >= EXTENT_INLINE) {
+				if ((n - EXTENT_INLINE) % EXTENTS_PER_BLOCK == 0) {
+					if (block_idx == FAT_EOC || fs_block_read(fs, fs->geo.data_block_start_idx + block_idx, block) == -1)
+						return -1;
+					block_idx = fs_fat_get(fs, block_idx);
+				}
+				ext = &block[(n - EXTENT_INLINE) % EXTENTS_PER_BLOCK];
+			}
+
+			if (ext->start && fs_extent_append(fs, list, block_num, ext->start, ext->length) == -1)
+				return -1;
+			block_num += ext->length;
+		}
+	}
+
+	return 0;
+}
+
+/** Count the runs of consecutive data blocks of a file
+ * @fs: pointer to filesystem
+ * @file_num: file number of the file
+ * @num_blocks: set to the number of data blocks of the file
+ * 
+ * returns: number of runs, 0 for a file without blocks
+*/
+size_t fs_extent_runs(FS *fs, int file_num, size_t *num_blocks) {
+	extentList *list = &fs->extents[file_num];
+	size_t runs = 0;
+
+	*num_blocks = 0;
+	for (size_t i = 0; i < list->count; i++) {
+		if (i == 0 || list->extents[i].start != list->extents[i - 1].start + list->extents[i - 1].length)
+			runs++;
+		*num_blocks += list->extents[i].length;
+	}
+
+	return runs;
 }
 
+/** Describe the files of a FAT disk by extents
+ * @fs: pointer to filesystem
+ * 
+ * Data blocks stay where they are: the chains and the hole map are read into
+ * extent lists, then the blocks of files are only marked used in the FAT and
+ * the hole map is released. Nothing is written until fs_save_FAT().
+ * 
+ * returns: 0 on success, -1 if there is no room for the extent table
+*/
+int fs_extent_convert(FS *fs) {
+	int table_idx = fs_meta_create(fs, EXTENT_TABLE_BLOCKS);
+	if (table_idx == -1)
+		return -1;
+
+	fs->extent_table = fs_arena_alloc(&fs->arena, EXTENT_TABLE_BLOCKS * BLOCK_SIZE);
+	if (!fs->extent_table)
+		return -1;
+	memset(fs->extent_table, 0, EXTENT_TABLE_BLOCKS * BLOCK_SIZE);
+
+	// read every chain before the first one is unlinked
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		file *target_file = &fs->rootDir->files[i];
+		uint64_t block_num = 0;
+
+		if (target_file->filename[0] == '\0' || (target_file->flags & FILE_TAIL))
+			continue;
+
+		for (uint32_t block_idx = fs_file_first(&fs->geo, target_file); block_idx != FAT_EOC;
+			 block_idx = fs_fat_get(fs, block_idx)) {
+			block_num += fs_hole_skip(fs, block_idx);
+			if (fs_extent_append(fs, &fs->extents[i], block_num++, block_idx, 1) == -1)
+				return -1;
+		}
+	}
+
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		extentList *list = &fs->extents[i];
+		file *target_file = &fs->rootDir->files[i];
+
+		for (size_t j = 0; j < list->count; j++) {
+			for (uint32_t k = 0; k < list->extents[j].length; k++)
+				fs_fat_set(fs, list->extents[j].start + k, FAT_EOC);
+		}
 
+		if (target_file->filename[0] != '\0' && !(target_file->flags & FILE_TAIL)) {
+			fs_file_set_first(&fs->geo, target_file, FAT_EOC);
+			fs_file_set_last(fs, target_file, FAT_EOC);
+			list->dirty = true;
+		}
+	}
+
+	// extents describe holes on their own
+	uint32_t block_idx = fs->geo.holemap_block_idx ? fs->geo.holemap_block_idx : FAT_EOC;
+	fs->holes = NULL;
+	fs->holes_dirty = false;
+	while (block_idx != FAT_EOC) {
+		uint32_t next_block_idx = fs_fat_get(fs, block_idx);
+		fs_fat_set(fs, block_idx, 0);
+		block_idx = next_block_idx;
+	}
+
+	fs->geo.holemap_block_idx = 0;
+	fs->superblock->holemap_block_idx = 0;
+	fs->superblock->holemap_block_idx32 = 0;
+	fs->superblock->features |= FS_FEATURE_EXTENTS;
+	fs->superblock->extent_table_idx = table_idx;
+	fs->geo.extents = true;
+	fs->geo.extent_table_idx = table_idx;
+	fs->extents_dirty = true;
+	return 0;
+}
+
+/* DEDUPLICATION HELPERS
+ *
+ * Full data blocks are fingerprinted with a 32-bit hash, kept in a table of
+ * one entry per data block created the first time deduplication is used. An
+ * index built in memory at mount time maps fingerprints to a block of a file
+ * holding that data. A block that matches an indexed one byte for byte is
+ * mapped to it instead of being written, and the two mappings share the block
+ * through its reference count (see SHARED BLOCK HELPERS). The index has one
+ * block per slot, the last one indexed, and a block drops out of it once it is
+ * freed.
+ */
+
+/** Fingerprint the data of a block
+ * 
+ * Four independent lanes of multiply-xorshift over the 64-bit words of the
+ * block, so that the multiplications overlap, folded together at the end.
+ * 
+ * returns: the fingerprint, never 0
+*/
+uint32_t fs_dedup_hash(const void *data) {
+	uint64_t a = 1, b = 2, c = 3, d = 4;
+	const char *bytes = data;
+
+	// one variable per lane rather than an array, which stays in registers even
+	// in an unoptimised build
+	for (size_t i = 0; i < BLOCK_SIZE; i += sizeof(uint64_t[4])) {
+		uint64_t words[4];
+
+		memcpy(words, bytes + i, sizeof(words));
+		a = (a ^ words[0]) * DEDUP_PRIME;
+		a ^= a >> 29;
+		b = (b ^ words[1]) * DEDUP_PRIME;
+		b ^= b >> 29;
+		c = (c ^ words[2]) * DEDUP_PRIME;
+		c ^= c >> 29;
+		d = (d ^ words[3]) * DEDUP_PRIME;
+		d ^= d >> 29;
+	}
+
+	uint64_t hash = a ^ (b * DEDUP_PRIME) ^ (c >> 17) ^ (d << 23);
+	hash ^= hash >> 33;
+	hash *= DEDUP_PRIME;
+	hash ^= hash >> 29;
+	return (uint32_t) (hash >> 32) | ((hash >> 32) == 0);
+}
+
+/** Remember that a data block holds the data with fingerprint @fingerprint
+ * 
+*/
+void fs_dedup_insert(FS *fs, uint32_t fingerprint, uint32_t block_idx) {
+	fs->dedup_index[fingerprint & fs->dedup_mask] = block_idx + 1;
+	if (fs->fingerprints[block_idx] != fingerprint) {
+		fs->fingerprints[block_idx] = fingerprint;
+		fs_bit_set(fs->fingerprints_dirty, block_idx / FINGERPRINTS_PER_BLOCK);
+	}
+}
+
+/** Load the fingerprint table and index the blocks of the files
+ * @fs: pointer to filesystem
+ * 
+ * Only the blocks files map are indexed, the fingerprints of other blocks are
+ * dropped.
+ * 
+ * returns: 0 on success, -1 if the table cannot be read
+*/
+int fs_dedup_load(FS *fs) {
+	if (fs_meta_load(fs, fs->geo.fingerprint_idx, fs->fingerprints) == -1)
+		return -1;
+
+	uint32_t *fingerprints = calloc(fs->geo.amt_data_blocks, sizeof(uint32_t));
+	if (!fingerprints)
+		return -1;
+
+	for (int file_num = 0; file_num < FS_FILE_MAX_COUNT; file_num++) {
+		extentList *list = &fs->extents[file_num];
+
+		for (size_t i = 0; i < list->count; i++) {
+			for (uint32_t j = 0; j < list->extents[i].length; j++) {
+				uint32_t block_idx = list->extents[i].start + j;
+				fingerprints[block_idx] = fs->fingerprints[block_idx];
+			}
+		}
+	}
+
+	for (uint32_t block_idx = 0; block_idx < fs->geo.amt_data_blocks; block_idx++) {
+		if (fingerprints[block_idx] != fs->fingerprints[block_idx])
+			fs_bit_set(fs->fingerprints_dirty, block_idx / FINGERPRINTS_PER_BLOCK);
+		if (fingerprints[block_idx])
+			fs->dedup_index[fingerprints[block_idx] & fs->dedup_mask] = block_idx + 1;
+	}
+
+	memcpy(fs->fingerprints, fingerprints, fs->geo.amt_data_blocks * sizeof(uint32_t));
+	free(fingerprints);
+	return 0;
+}
+
+/** Set up deduplication: the fingerprint table, its index, and the reference count table
+ * @fs: pointer to filesystem
+ * 
+ * The index gets a slot per data block, up to DEDUP_MAX_SLOTS. The tables are
+ * created the first time deduplication is used, and loaded afterwards.
+ * 
+ * returns: 0 on success, -1 if the index cannot be allocated, the table cannot
+ * 			be read, or there is no room for the tables
+*/
+int fs_dedup_setup(FS *fs) {
+	if (fs->dedup_index)
+		return 0;
+
+	int num_blocks = fs_meta_num_blocks(fs, sizeof(uint32_t));
+	size_t num_slots = 1;
+	while (num_slots < fs->geo.amt_data_blocks && num_slots < DEDUP_MAX_SLOTS)
+		num_slots *= 2;
+
+	uint32_t *fingerprints = fs_arena_alloc(&fs->arena, num_blocks * BLOCK_SIZE);
+	uint64_t *dirty = fs_arena_alloc(&fs->arena, (num_blocks + 63) / 64 * sizeof(uint64_t));
+	uint32_t *index = fs_arena_alloc(&fs->arena, num_slots * sizeof(uint32_t));
+	if (!fingerprints || !dirty || !index)
+		return -1;
+
+	fs->fingerprints = fingerprints;
+	fs->fingerprints_dirty = dirty;
+	fs->dedup_index = index;
+	fs->dedup_mask = num_slots - 1;
+
+	if (fs->geo.fingerprint_idx != 0) {
+		if (fs_dedup_load(fs) == -1)
+			goto fail;
+		return 0;
+	}
+
+	if (fs->FAT->num_blocks_taken + num_blocks > fs->geo.amt_data_blocks || fs_refs_create(fs) == -1)
+		goto fail;
+
+	int first_block_idx = fs_meta_create(fs, num_blocks);
+	if (first_block_idx == -1)
+		goto fail;
+
+	fs->geo.fingerprint_idx = first_block_idx;
+	fs->superblock->fingerprint_idx = first_block_idx;
+	fs->superblock->features |= FS_FEATURE_FINGERPRINTS;
+	return fs_save_superblock(fs);
+
+fail:
+	fs->fingerprints = NULL;
+	fs->dedup_index = NULL;
+	return -1;
+}
+
+/** Write the modified blocks of the fingerprint table
+ * 
+ * returns: 0 on success, -1 if a block cannot be written
+*/
+int fs_dedup_save(FS *fs) {
+	uint32_t block_idx = fs->geo.fingerprint_idx;
+	bool saved = false;
+
+	for (size_t i = 0; fs->fingerprints && block_idx != FAT_EOC; i++) {
+		if (fs_bit_test(fs->fingerprints_dirty, i)) {
+			if (fs_block_write(fs, fs->geo.data_block_start_idx + block_idx,
+							   fs->fingerprints + i * FINGERPRINTS_PER_BLOCK) == -1)
+				return -1;
+			fs_bit_clear(fs->fingerprints_dirty, i);
+			saved = true;
+		}
+		block_idx = fs_fat_get(fs, block_idx);
+	}
+
+	if (saved)
+		stats.meta_table_flushes++;
+	return 0;
+}
+
+/** Check whether full blocks are deduplicated as they are written
+ * 
+*/
+bool fs_dedup_enabled(FS *fs) {
+	return fs->dedup_index && (fs->superblock->features & FS_FEATURE_DEDUP);
+}
+
+/** Indexed block with fingerprint @fingerprint, without comparing the data
+ * 
+ * returns: index of the block, -1 if there is none or it can take no more references
+*/
+int fs_dedup_candidate(FS *fs, uint32_t fingerprint) {
+	uint32_t slot = fs->dedup_index[fingerprint & fs->dedup_mask];
+
+	if (slot == 0 || fs->fingerprints[slot - 1] != fingerprint || fs_block_refs(fs, slot - 1) == UINT16_MAX)
+		return -1;
+
+	return slot - 1;
+}
+
+/** Find an indexed block holding the same data as @data
+ * @fs: pointer to filesystem
+ * @fingerprint: fingerprint of @data
+ * @data: block of data
+ * 
+ * The candidate is read back, a fingerprint match alone is not trusted.
+ * 
+ * returns: index of the block, -1 if there is none
+*/
+int fs_dedup_find(FS *fs, uint32_t fingerprint, const void *data) {
+	int block_idx = fs_dedup_candidate(fs, fingerprint);
+	char *block;
+
+	if (block_idx == -1 || !(block = fs_buffer_get(fs)))
+		return -1;
+
+	if (fs_block_read(fs, fs->geo.data_block_start_idx + block_idx, block) == -1 || memcmp(block, data, BLOCK_SIZE)) {
+		stats.dedup_mismatches++;
+		block_idx = -1;
+	}
+
+	fs_buffer_put(fs, block);
+	return block_idx;
+}
+
+/** Map a logical block of a file to a block already holding its data
+ * @fs: pointer to filesystem
+ * @file_num: file number of the file
+ * @block_num: logical block number inside the file
+ * @block_idx: data block to share, the block @block_num was mapped to (if any) is released
+ * 
+ * returns: 0 on success, -1 if the arena could not grow or the disk is full
+*/
+int fs_dedup_map(FS *fs, int file_num, uint64_t block_num, uint32_t block_idx) {
+	extentList *list = &fs->extents[file_num];
+	int old_block_idx = fs_extent_block(fs, file_num, block_num, false, NULL);
+
+	if (old_block_idx == (int) block_idx)
+		return 0;
+
+	if (fs_extent_room(fs, file_num, fs_extent_disk_count(list) + 2) == -1)
+		return -1;
+
+	if (old_block_idx == -1 ? fs_extent_insert(fs, list, fs_extent_find(list, block_num), block_num, block_idx) == -1
+		: fs_extent_remap(fs, file_num, block_num, block_idx) == -1)
+		return -1;
+
+	if (old_block_idx != -1)
+		fs_block_release(fs, old_block_idx);
+
+	fs->refs[block_idx]++;
+	fs->refs_dirty = true;
+	stats.blocks_deduplicated++;
+	return 0;
+}
+
+/** Deduplicate a full block about to be written to a file
+ * @fs: pointer to filesystem
+ * @file_num: file number of the file
+ * @block_num: logical block number inside the file
+ * @data: data of the block
+ * @fingerprint: set to the fingerprint of @data
+ * 
+ * returns: 1 if the block was mapped to one already holding @data and must not
+ * 			be written, 0 if it must be written, -1 if the arena could not grow
+*/
+int fs_dedup_block(FS *fs, int file_num, uint64_t block_num, const void *data, uint32_t *fingerprint) {
+	*fingerprint = fs_dedup_hash(data);
+
+	int block_idx = fs_dedup_find(fs, *fingerprint, data);
+	if (block_idx == -1)
+		return 0;
+
+	return fs_dedup_map(fs, file_num, block_num, block_idx) == -1 ? -1 : 1;
+}
+
+/** Fingerprint the blocks following one that has no duplicate, up to the first that may have one
+ * @fs: pointer to filesystem
+ * @data: full blocks to write, the fingerprint of the first one is already in @fingerprints
+ * @max_blocks: number of blocks of @data, at most DEDUP_BATCH_BLOCKS
+ * @fingerprints: set to the fingerprint of each block of the batch
+ * 
+ * A block stops the batch when its fingerprint is indexed, or repeats one of
+ * the batch, so that it is looked up once the blocks before it are written.
+ * 
+ * returns: number of blocks that can be written in a single run
+*/
+size_t fs_dedup_batch(FS *fs, const char *data, size_t max_blocks, uint32_t *fingerprints) {
+	size_t n = 1;
+
+	for (; n < max_blocks; n++) {
+		uint32_t fingerprint = fs_dedup_hash(data + n * BLOCK_SIZE);
+		bool repeated = fs_dedup_candidate(fs, fingerprint) != -1;
+
+		for (size_t k = 0; k < n && !repeated; k++)
+			repeated = fingerprints[k] == fingerprint;
+		if (repeated)
+			break;
+
+		fingerprints[n] = fingerprint;
+	}
+
+	return n;
+}
+
+/** Write the modified blocks of the FAT
+ * 
+ * returns: 0 on success, -1 if a block cannot be written or an update was lost
+*/
+int fs_fat_flush(FS *fs) {
+	if (fs->FAT->dirty)
+		stats.fat_flushes++;
+
+	// write modified FAT32 pages back, they are not consecutive in memory
+	for (size_t i = 0; fs->geo.fat32 && i < fs->FAT->num_pages; i++) {
+		if (fs_fat_page_flush(fs, &fs->FAT->pages[i]) == -1)
+			return -1;
+	}
+
+	// write modified FAT16 blocks to disk, one run of consecutive blocks at a time
+	for (uint32_t i = 0; !fs->geo.fat32 && i < fs->geo.num_blocks_for_FAT; i++) {
+		if (!(fs->FAT->dirty_blocks[i / 64] & (1ULL << (i % 64))))
+			continue;
+
+		uint32_t run = 1;
+		while (i + run < fs->geo.num_blocks_for_FAT
+			   && (fs->FAT->dirty_blocks[(i + run) / 64] & (1ULL << ((i + run) % 64))))
+			run++;
+
+		stats.fat_blocks_flushed += run;
+		size_t FAT_ptr_offset = BLOCK_SIZE * i / sizeof(uint16_t);
+		if (fs_block_writev(fs, FAT_START_IDX + i, run, fs->FAT->blocks + FAT_ptr_offset) == -1)
+			return -1;
+		i += run - 1;
+	}
+
+	memset(fs->FAT->dirty_blocks, 0, sizeof(fs->FAT->dirty_blocks));
+	fs->FAT->dirty = false;
+
+	// updates to a FAT block that could not be read were lost
+	return fs->FAT->failed ? -1 : 0;
+}
+
+// Save FAT to disk
+int fs_save_FAT(FS *fs) {
+	// saving extents can take or release overflow blocks, the FAT is flushed even if it fails
+	// so that the blocks written so far stay allocated
+	int ret = fs_extent_save(fs);
+	if (fs_fat_flush(fs) == -1 || ret == -1)
+		return -1;
+
+	// the hole map describes gaps in the chains, keep both in sync
+	if (fs->holes_dirty && fs_meta_save(fs, fs->geo.holemap_block_idx, fs->holes) == -1)
+		return -1;
+
+	fs->holes_dirty = false;
+
+	// reference counts go with the extents of the files sharing the blocks
+	if (fs->refs_dirty && fs_meta_save(fs, fs->geo.refcount_idx, fs->refs) == -1)
+		return -1;
+
+	fs->refs_dirty = false;
+
+	// fingerprints of the blocks that were written or freed
+	if (fs_dedup_save(fs) == -1)
+		return -1;
+
+	// this is a checkpoint of a log disk: the blocks replaced since the last one are no longer referenced
+	if (fs->geo.log && fs->log_pending && fs_log_release(fs) && fs_fat_flush(fs) == -1)
+		return -1;
+
+	// checksums of the data blocks written since the last save
+	return fs_checksum_save(fs);
+}
+
+/** Give a block of a file a new place before it is overwritten
+ * @fs: pointer to filesystem
+ * @file_num: file number of the file
+ * @block_num: logical block number inside the file
+ * @block_idx: data block it is mapped to
+ * @goal: block to take if it is free (ignored on log disks, which take the head of the log)
+ * 
+ * Blocks shared with other files are copied on write, and so are the blocks of
+ * a log disk that were not taken since the last checkpoint. Other blocks are
+ * overwritten in place. When a log disk is full, a checkpoint releases the
+ * blocks replaced so far.
+ * 
+ * returns: data block to write the new contents to, -1 if the disk is full
+*/
+int fs_block_redirect(FS *fs, int file_num, uint64_t block_num, uint32_t block_idx, uint32_t goal) {
+	bool shared = fs_block_refs(fs, block_idx);
+
+	if (!fs_block_needs_copy(fs, block_idx))
+		return block_idx;
+
+	int new_block_idx = fs_extent_alloc_block(fs, goal);
+	if (new_block_idx == -1 && fs->log_pending && fs_save_FAT(fs) == 0)
+		new_block_idx = fs_extent_alloc_block(fs, goal);
+	if (new_block_idx == -1)
+		return -1;
+
+	if (fs_extent_remap(fs, file_num, block_num, new_block_idx) == -1) {
+		fs_fat_set(fs, new_block_idx, 0);
+		return -1;
+	}
+
+	fs_block_release(fs, block_idx);
+	if (shared)
+		stats.shared_blocks_copied++;
+	else
+		stats.log_blocks_redirected++;
+	return new_block_idx;
+}
+
+/** Give a run of consecutive blocks of a file new places, see fs_block_redirect()
+ * @run: length of the run, cut to the blocks that stay consecutive on disk
+ * 
+ * returns: data block to write the first block of the run to, -1 if the disk is full
+*/
+int fs_block_redirect_run(FS *fs, int file_num, uint64_t block_num, uint32_t block_idx, size_t *run) {
+	int first_block_idx = fs_block_redirect(fs, file_num, block_num, block_idx, 0);
+	bool in_place = (uint32_t) first_block_idx == block_idx;
+	size_t n = 1;
+
+	if ((!fs->geo.log && !fs->refs) || first_block_idx == -1)
+		return first_block_idx;
+
+	// the run goes on while its blocks stay in place, or while the blocks after the first copy are free
+	for (; n < *run; n++) {
+		bool copy = fs_block_needs_copy(fs, block_idx + n);
+		uint32_t next = first_block_idx + n;
+
+		if (in_place ? copy : !copy)
+			break;
+		if (in_place)
+			continue;
+		if (fs->geo.log ? fs->log_head != next || next >= fs->log_end || fs_fat_get(fs, next)
+			: next >= fs->geo.amt_data_blocks || fs_fat_get(fs, next))
+			break;
+		if (fs_block_redirect(fs, file_num, block_num + n, block_idx + n, next) == -1)
+			break;
+	}
+
+	*run = n;
+	return first_block_idx;
+}
+
+/** Check whether a file has data blocks of its own
+ * 
+*/
+bool fs_file_has_blocks(FS *fs, file *target_file) {
+	if (fs->geo.extents)
+		return fs->extents[target_file - fs->rootDir->files].count > 0;
+
+	return fs_file_first(&fs->geo, target_file) != FAT_EOC;
+}
+
+/** Check whether a file's last_block_idx can be trusted
+ * 
+ * A known last block always holds the final byte of the file.
+*/
+bool fs_file_last_block_known(FS *fs, file *target_file) {
+	uint32_t last_block_idx = fs_file_last(fs, target_file);
+
+	return fs_file_size(target_file) > 0
+		&& last_block_idx != LAST_BLOCK_UNKNOWN
+		&& last_block_idx != FAT_EOC;
+}
+
+/** Map a logical block of a file to its data block
+ * @fs: pointer to filesystem
+ * @target_file: file whose FAT chain is walked
+ * @block_num: logical block number inside the file
+ * @allocate: allocate a block if @block_num is a hole or past the chain
+ * @fresh: set to true if the returned block was just allocated (may be NULL)
+ * @cursor: where the previous lookup through the same descriptor ended (may be NULL)
+ * 
+ * The walk starts from @cursor when it is not past @block_num, so that
+ * streaming through a file only follows each link once, and @cursor is moved
+ * to the returned block.
+ * 
+ * returns: data block index of logical block @block_num,
+ * 			-1 if the block is not allocated, the disk is full, or the hole in
+ * 			front of the block is too long for the hole map
+*/
+int fs_file_block(FS *fs, file *target_file, size_t block_num, bool allocate, bool *fresh, chainCursor *cursor) {
+	// previous block of the chain, and logical number right after it
+	uint32_t prev_block_idx = FAT_EOC;
+	uint32_t block_idx = fs_file_first(&fs->geo, target_file);
+	size_t next_block_num = 0;
+	uint64_t size = fs_file_size(target_file);
+	size_t last_block_num = size ? (size - 1) / BLOCK_SIZE : 0;
+
+	if (fs->geo.extents)
+		return fs_extent_block(fs, target_file - fs->rootDir->files, block_num, allocate, fresh);
+
+	if (fresh)
+		*fresh = false;
+
+	// the block holding the end of the file and anything after it are reached without walking the chain
+	if (fs_file_last_block_known(fs, target_file) && block_num >= last_block_num) {
+		if (block_num == last_block_num)
+			return fs_file_last(fs, target_file);
+
+		prev_block_idx = fs_file_last(fs, target_file);
+		block_idx = FAT_EOC;
+		next_block_num = last_block_num + 1;
+	} else if (cursor && cursor->block_idx != FAT_EOC && cursor->gen == fs->chain_gen && cursor->block_num <= block_num) {
+		// the walk leaves the cursor's block before it can need the link in front of it
+		block_idx = cursor->block_idx;
+		next_block_num = cursor->block_num - fs_hole_skip(fs, block_idx);
+	}
+
+	while (block_idx != FAT_EOC) {
+		size_t curr_block_num = next_block_num + fs_hole_skip(fs, block_idx);
+
+		if (curr_block_num == block_num) {
+			if (cursor)
+				*cursor = (chainCursor){.block_idx = block_idx, .block_num = block_num, .gen = fs->chain_gen};
+			return block_idx;
+		}
+
+		// @block_num falls in the hole in front of the current block
+		if (curr_block_num > block_num)
+			break;
+
+		next_block_num = curr_block_num + 1;
+		prev_block_idx = block_idx;
+		block_idx = fs_fat_get(fs, block_idx);
+		stats.chain_walk_steps++;
+	}
+
+	// remember the final block once the chain has been walked to its end
+	if (block_idx == FAT_EOC && prev_block_idx != FAT_EOC && next_block_num - 1 == last_block_num)
+		fs_file_set_last(fs, target_file, prev_block_idx);
+
+	if (!allocate)
+		return -1;
+
+	// make sure the hole map exists (and can hold the hole) before taking a block for the data
+	uint32_t next_block_idx = block_idx;
+	if (block_num - next_block_num > fs_hole_max(fs))
+		return -1;
+	if (block_num > next_block_num && fs_hole_map_create(fs) == -1)
+		return -1;
+
+	// splice a new open block into the chain
+	int open_block = fs_find_open_data_block(fs);
+	if (open_block == -1)
+		return -1;
+
+	fs_fat_set(fs, open_block, next_block_idx);
+	fs_chain_link(fs, target_file, prev_block_idx, open_block);
+
+	// a block added at the end of the chain holds the new end of the file
+	if (next_block_idx == FAT_EOC && (size == 0 || block_num >= last_block_num))
+		fs_file_set_last(fs, target_file, open_block);
+
+	// split the hole around the new block
+	fs_hole_set(fs, open_block, block_num - next_block_num);
+	if (next_block_idx != FAT_EOC)
+		fs_hole_set(fs, next_block_idx, fs_hole_skip(fs, next_block_idx) - (block_num - next_block_num) - 1);
+
+	if (fresh)
+		*fresh = true;
+	if (cursor)
+		*cursor = (chainCursor){.block_idx = open_block, .block_num = block_num, .gen = fs->chain_gen};
+
+	return open_block;
+}
+
+/** Map a run of logical blocks of a file that are consecutive on disk
+ * @fs: pointer to filesystem
+ * @open_file: descriptor the file is accessed through
+ * @target_file: file the descriptor is open on
+ * @block_num: first logical block of the run
+ * @max_blocks: longest run wanted
+ * @allocate: allocate the blocks of the run that are holes or past the end
+ * @run: set to the length of the run (at least 1)
+ * 
+ * Extents give the run at once. Chains are followed for as long as they link
+ * consecutive blocks, and a chain that ends in the run is extended with the
+ * free blocks that follow its last one.
+ * 
+ * returns: data block index of logical block @block_num, -1 as for fs_file_block()
+*/
+int fs_file_run(FS *fs, openFile *open_file, file *target_file, size_t block_num, size_t max_blocks,
+				bool allocate, size_t *run) {
+	int block_idx = fs_file_block(fs, target_file, block_num, allocate, NULL, &open_file->cursor);
+
+	*run = 1;
+	if (block_idx == -1)
+		return -1;
+
+	if (fs->geo.extents && !allocate) {
+		extentList *list = &fs->extents[open_file->file_num];
+		extent *ext = &list->extents[fs_extent_find(list, block_num)];
+
+		*run = min_size(ext->block_num + ext->length - block_num, max_blocks);
+		return block_idx;
+	}
+
+	while (*run < max_blocks) {
+		uint32_t prev_block_idx = block_idx + *run - 1;
+		uint32_t next_block_idx;
+
+		if (fs->geo.extents) {
+			next_block_idx = fs_file_block(fs, target_file, block_num + *run, allocate, NULL, &open_file->cursor);
+		} else {
+			next_block_idx = fs_fat_get(fs, prev_block_idx);
+			stats.chain_walk_steps++;
+
+			// the end of the chain grows into the free block right after it,
+			// the file's size is only updated once the run is written
+			if (next_block_idx == FAT_EOC && allocate && prev_block_idx + 1 < fs->geo.amt_data_blocks) {
+				stats.alloc_searches++;
+				stats.alloc_scan_steps++;
+				if (fs_fat_get(fs, prev_block_idx + 1) == 0) {
+					next_block_idx = prev_block_idx + 1;
+					fs_fat_set(fs, next_block_idx, FAT_EOC);
+					fs_fat_set(fs, prev_block_idx, next_block_idx);
+					if (fs_file_size(target_file) <= (uint64_t) (block_num + *run + 1) * BLOCK_SIZE)
+						fs_file_set_last(fs, target_file, next_block_idx);
+				}
+			}
+			if (next_block_idx == FAT_EOC || fs_hole_skip(fs, next_block_idx))
+				break;
+		}
+
+		if (next_block_idx != block_idx + *run)
+			break;
+		(*run)++;
+	}
+
+	// later lookups through the descriptor start from the end of the run
+	if (!fs->geo.extents)
+		open_file->cursor = (chainCursor){.block_idx = block_idx + *run - 1, .block_num = block_num + *run - 1,
+			.gen = fs->chain_gen};
+
+	return block_idx;
+}
+
+/* TAIL PACKING HELPERS */
+
+/** Number of tail slots needed to hold @size bytes
+ * 
+*/
+int fs_tail_slots(size_t size) {
+	return max(1, ceil_but_better(size / (double) TAIL_SLOT_SIZE));
+}
+
+/** Bitmask covering @num_slots slots starting at @slot
+ * 
+*/
+uint64_t fs_tail_mask(int slot, int num_slots) {
+	uint64_t mask = num_slots == TAIL_SLOTS_PER_BLOCK ? ~0ULL : (1ULL << num_slots) - 1;
+	return mask << slot;
+}
+
+/** Find the in-memory slot map of a tail block
+ * @fs: pointer to filesystem
+ * @block_idx: data block index of the tail block
+ * 
+ * returns: pointer to the slot map, NULL if @block_idx is not a tail block
+*/
+tailBlock * fs_tail_find(FS *fs, uint32_t block_idx) {
+	for (size_t i = 0; i < fs->num_tails; i++) {
+		if (fs->tails[i].block_idx == block_idx)
+			return &fs->tails[i];
+	}
+
+	return NULL;
+}
+
+/** Mark slots of a tail block as used (rebuilds slot maps at mount time)
+ * @fs: pointer to filesystem
+ * @tail_loc: packed location of the first slot
+ * @num_slots: number of slots to mark
+*/
+void fs_tail_mark(FS *fs, uint32_t tail_loc, int num_slots) {
+	tailBlock *tail = fs_tail_find(fs, TAIL_LOC_BLOCK(tail_loc));
+
+	if (!tail) {
+		tail = &fs->tails[fs->num_tails++];
+		*tail = (tailBlock){.block_idx = TAIL_LOC_BLOCK(tail_loc), .used = 0};
+	}
+
+	tail->used |= fs_tail_mask(TAIL_LOC_SLOT(tail_loc), num_slots);
+}
+
+/** Allocate a run of contiguous slots in a shared tail block
+ * @fs: pointer to filesystem
+ * @num_slots: number of slots needed
+ * 
+ * returns: packed location of the run,
+ * 			-1 if the disk is full
+*/
+int64_t fs_tail_alloc(FS *fs, int num_slots) {
+	// first fit in the existing tail blocks
+	for (size_t i = 0; i < fs->num_tails; i++) {
+		for (int slot = 0; slot + num_slots <= TAIL_SLOTS_PER_BLOCK; slot++) {
+			uint64_t mask = fs_tail_mask(slot, num_slots);
+			if ((fs->tails[i].used & mask) == 0) {
+				fs->tails[i].used |= mask;
+				return TAIL_LOC(fs->tails[i].block_idx, slot);
+			}
+		}
+	}
+
+	// no room left, start a new tail block
+	if (fs->num_tails >= FS_FILE_MAX_COUNT)
+		return -1;
+
+	int open_block = fs_find_open_data_block(fs);
+	if (open_block == -1)
+		return -1;
+
+	fs_fat_set(fs, open_block, FAT_EOC);
+
+	fs->tails[fs->num_tails++] = (tailBlock){.block_idx = open_block, .used = fs_tail_mask(0, num_slots)};
+	return TAIL_LOC(open_block, 0);
+}
+
+/** Release a run of slots, and the tail block itself once it is empty
+ * @fs: pointer to filesystem
+ * @tail_loc: packed location of the first slot
+ * @num_slots: number of slots to release
+*/
+void fs_tail_free(FS *fs, uint32_t tail_loc, int num_slots) {
+	tailBlock *tail = fs_tail_find(fs, TAIL_LOC_BLOCK(tail_loc));
+	if (!tail)
+		return;
+
+	tail->used &= ~fs_tail_mask(TAIL_LOC_SLOT(tail_loc), num_slots);
+	if (tail->used)
+		return;
+
+	// give the block back to the FAT
+	fs_fat_set(fs, tail->block_idx, 0);
+	*tail = fs->tails[--fs->num_tails];
+}
+
+/** Try to grow a run of slots in place
+ * @fs: pointer to filesystem
+ * @tail_loc: packed location of the first slot
+ * @old_slots: current number of slots
+ * @new_slots: wanted number of slots
+ * 
+ * returns: true if the slots following the run were free and are now used
+*/
+bool fs_tail_grow(FS *fs, uint32_t tail_loc, int old_slots, int new_slots) {
+	tailBlock *tail = fs_tail_find(fs, TAIL_LOC_BLOCK(tail_loc));
+	int slot = TAIL_LOC_SLOT(tail_loc);
+
+	if (!tail || slot + new_slots > TAIL_SLOTS_PER_BLOCK)
+		return false;
+
+	uint64_t extra = fs_tail_mask(slot + old_slots, new_slots - old_slots);
+	if (tail->used & extra)
+		return false;
+
+	tail->used |= extra;
+	return true;
+}
+
+/** Check whether a write ending at @end_offset should go to a tail slot
+ * 
+*/
+bool fs_tail_eligible(FS *fs, file *target_file, size_t end_offset) {
+	if (end_offset > TAIL_MAX_SIZE)
+		return false;
+
+	if (target_file->flags & FILE_TAIL)
+		return true;
+
+	// only brand new files get packed, and never compressed ones
+	return (fs->superblock->features & FS_FEATURE_TAILPACK)
+		&& !(target_file->flags & FILE_COMPRESSED)
+		&& fs_file_size(target_file) == 0
+		&& !fs_file_has_blocks(fs, target_file);
+}
+
+/** Write into a packed file, moving it to a bigger run of slots if needed
+ * @fs: pointer to filesystem
+ * @target_file: file to write to
+ * @offset: file offset to start writing at
+ * @buf: data to write
+ * @count: number of bytes to write
+ * 
+ * returns: number of bytes written (0 if no slot could be allocated)
+*/
+int fs_tail_write(FS *fs, file *target_file, size_t offset, const void *buf, size_t count) {
+	char old_data[TAIL_MAX_SIZE];
+	char block[BLOCK_SIZE];
+	bool packed = target_file->flags & FILE_TAIL;
+	size_t new_size = max_size(target_file->file_size, offset + count);
+	int old_slots = packed ? fs_tail_slots(target_file->file_size) : 0;
+	int new_slots = fs_tail_slots(new_size);
+	uint32_t tail_loc = target_file->tail_loc;
+	bool moved = false;
+
+	if (!packed || (new_slots > old_slots && !fs_tail_grow(fs, tail_loc, old_slots, new_slots))) {
+		int64_t new_loc = fs_tail_alloc(fs, new_slots);
+		if (new_loc == -1)
+			return 0;
+
+		// keep a copy of the old contents before releasing their slots
+		if (packed) {
+			fs_block_read(fs, fs->geo.data_block_start_idx + TAIL_LOC_BLOCK(tail_loc), block);
+			memcpy(old_data, block + TAIL_LOC_SLOT(tail_loc) * TAIL_SLOT_SIZE, target_file->file_size);
+			fs_tail_free(fs, tail_loc, old_slots);
+		}
+
+		tail_loc = new_loc;
+		moved = packed;
+	}
+
+	size_t slot_start = TAIL_LOC_SLOT(tail_loc) * TAIL_SLOT_SIZE;
+	fs_block_read(fs, fs->geo.data_block_start_idx + TAIL_LOC_BLOCK(tail_loc), block);
+	if (moved)
+		memcpy(block + slot_start, old_data, target_file->file_size);
+	if (offset > target_file->file_size)
+		memset(block + slot_start + target_file->file_size, 0, offset - target_file->file_size);
+	memcpy(block + slot_start + offset, buf, count);
+	fs_block_write(fs, fs->geo.data_block_start_idx + TAIL_LOC_BLOCK(tail_loc), block);
+
+	target_file->flags |= FILE_TAIL;
+	target_file->tail_loc = tail_loc;
+	fs_file_set_size(fs, target_file, new_size);
+
+	return count;
+}
+
+/** Move a packed file into a regular data block of its own
+ * @fs: pointer to filesystem
+ * @target_file: packed file to promote
+ * 
+ * returns: 0 on success, -1 if the disk is full
+*/
+int fs_tail_promote(FS *fs, file *target_file) {
+	char block[BLOCK_SIZE];
+	char data[TAIL_MAX_SIZE];
+	uint32_t tail_loc = target_file->tail_loc;
+
+	// an extent is started for the block, a chain is only linked once the block holds the data
+	int open_block = fs->geo.extents ? fs_extent_block(fs, target_file - fs->rootDir->files, 0, true, NULL)
+		: fs_find_open_data_block(fs);
+	if (open_block == -1)
+		return -1;
+
+	fs_block_read(fs, fs->geo.data_block_start_idx + TAIL_LOC_BLOCK(tail_loc), block);
+	memcpy(data, block + TAIL_LOC_SLOT(tail_loc) * TAIL_SLOT_SIZE, target_file->file_size);
+
+	memset(block, 0, BLOCK_SIZE);
+	memcpy(block, data, target_file->file_size);
+	fs_block_write(fs, fs->geo.data_block_start_idx + open_block, block);
+
+	fs_tail_free(fs, tail_loc, fs_tail_slots(target_file->file_size));
+	target_file->flags &= ~FILE_TAIL;
+	target_file->tail_loc = 0;
+	if (!fs->geo.extents) {
+		fs_fat_set(fs, open_block, FAT_EOC);
+		fs_file_set_first(&fs->geo, target_file, open_block);
+		fs_file_set_last(fs, target_file, open_block);
+	}
+
+	return 0;
+}
+
+
+/** Shrink or extend a file, releasing the blocks past the new end in one pass
+ * @fs: pointer to filesystem
+ * @target_file: file to truncate
+ * @length: new file size in bytes
+ * 
+ * Extending a file only moves its end, the new range is a hole. A packed file
+ * is moved to a regular block first, as the slots after its own may belong to
+ * other files.
+ * 
+ * returns: 0 on success, -1 if the last kept block cannot be updated, or a
+ * 			packed file cannot be moved
+*/
+int fs_file_truncate(FS *fs, file *target_file, size_t length) {
+	char block[BLOCK_SIZE];
+	uint64_t size = fs_file_size(target_file);
+
+	// packed files only hold their data, the extension goes to a regular block
+	if (length > size && target_file->flags & FILE_TAIL && fs_tail_promote(fs, target_file) == -1)
+		return -1;
+
+	if (length >= size) {
+		// the old last block no longer holds the end of the file
+		if (length > 0 && (size == 0 || (length - 1) / BLOCK_SIZE != (size - 1) / BLOCK_SIZE))
+			fs_file_set_last(fs, target_file, LAST_BLOCK_UNKNOWN);
+
+		return fs_file_set_size(fs, target_file, length);
+	}
+
+	// packed files give back their trailing slots
+	if (target_file->flags & FILE_TAIL) {
+		int old_slots = fs_tail_slots(size);
+		int new_slots = length ? fs_tail_slots(length) : 0;
+
+		if (new_slots < old_slots)
+			fs_tail_free(fs, target_file->tail_loc + new_slots, old_slots - new_slots);
+
+		if (length == 0) {
+			target_file->flags &= ~FILE_TAIL;
+			target_file->tail_loc = 0;
+		}
+
+		return fs_file_set_size(fs, target_file, length);
+	}
+
+	// find the first block that lies entirely past the new end
+	size_t kept_blocks = (length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+	if (fs->geo.extents) {
+		int file_num = target_file - fs->rootDir->files;
+		int block_idx = length % BLOCK_SIZE ? fs_extent_block(fs, file_num, kept_blocks - 1, false, NULL) : -1;
+
+		// zero the part of the last kept block that is now past the end
+		if (block_idx != -1) {
+			if (fs_block_read(fs, fs->geo.data_block_start_idx + block_idx, block) == -1)
+				return -1;
+			memset(block + length % BLOCK_SIZE, 0, BLOCK_SIZE - length % BLOCK_SIZE);
+			if ((block_idx = fs_block_redirect(fs, file_num, kept_blocks - 1, block_idx, 0)) == -1
+				|| fs_block_write(fs, fs->geo.data_block_start_idx + block_idx, block) == -1)
+				return -1;
+		}
+
+		fs_extent_truncate(fs, file_num, kept_blocks);
+		return fs_file_set_size(fs, target_file, length);
+	}
+	uint32_t prev_block_idx = FAT_EOC;
+	uint32_t block_idx = fs_file_first(&fs->geo, target_file);
+	size_t next_block_num = 0;
+
+	while (block_idx != FAT_EOC) {
+		size_t block_num = next_block_num + fs_hole_skip(fs, block_idx);
+		if (block_num >= kept_blocks)
+			break;
+
+		// zero the part of the last kept block that is now past the end
+		if (block_num == kept_blocks - 1 && length % BLOCK_SIZE) {
+			if (fs_block_read(fs, fs->geo.data_block_start_idx + block_idx, block) == -1)
+				return -1;
+			memset(block + length % BLOCK_SIZE, 0, BLOCK_SIZE - length % BLOCK_SIZE);
+			if (fs_block_write(fs, fs->geo.data_block_start_idx + block_idx, block) == -1)
+				return -1;
+		}
+
+		next_block_num = block_num + 1;
+		prev_block_idx = block_idx;
+		block_idx = fs_fat_get(fs, block_idx);
+		stats.chain_walk_steps++;
+	}
+
+	// cut the chain and release the rest of it
+	fs_chain_link(fs, target_file, prev_block_idx, FAT_EOC);
+	if (length == 0)
+		fs_file_set_last(fs, target_file, FAT_EOC);
+	else if (prev_block_idx != FAT_EOC && next_block_num == kept_blocks)
+		fs_file_set_last(fs, target_file, prev_block_idx);
+	else
+		fs_file_set_last(fs, target_file, LAST_BLOCK_UNKNOWN);
+
+	while (block_idx != FAT_EOC) {
+		uint32_t next_block_idx = fs_fat_get(fs, block_idx);
+		fs_fat_set(fs, block_idx, 0);
+		block_idx = next_block_idx;
+		stats.chain_walk_steps++;
+	}
+
+	return fs_file_set_size(fs, target_file, length);
+}
+
+
+/* COMPRESSION HELPERS
+ *
+ * Files flagged with fs_compress() are stored in chunks of CHUNK_BLOCKS
+ * logical blocks. A chunk is compressed with a small LZ codec (literal runs
+ * and back-references into the chunk, as in LZ4) and stored in the first
+ * blocks it spans, behind a header, leaving the rest of them unmapped. A chunk
+ * that does not compress by at least a block is stored as is: behind a header
+ * as well if that still leaves a block unmapped, in all of its blocks
+ * otherwise, and a chunk of zeros takes no block at all. Whether the last
+ * block of a chunk is mapped is therefore enough to tell how it is stored.
+ *
+ * Chunks are read and written through a small cache of decompressed chunks.
+ * Writes modify the cached chunk, which is stored once it is complete, when it
+ * makes room for another chunk, or when the file's data is flushed (see
+ * fs_wbuf_flush_file()).
+ */
+
+/** Write the part of a length that does not fit in its token, see fs_lz_length()
+ * 
+ * returns: position in @dst after the length
+*/
+size_t fs_lz_put_length(unsigned char *dst, size_t pos, size_t length) {
+	for (length -= 15; length >= 255; length -= 255)
+		dst[pos++] = 255;
+	dst[pos++] = length;
+	return pos;
+}
+
+/** Append a sequence to a compressed stream: literals, then a match (none if @offset is 0)
+ * @dst: stream
+ * @cap: size of @dst
+ * @out: bytes of @dst already used, updated
+ * @literals: bytes copied as they are
+ * @num_literals: number of @literals
+ * @offset: distance back to the match
+ * @match: length of the match, LZ_MIN_MATCH at least
+ * 
+ * A token holds both lengths in 4 bits each, longer lengths go on in the
+ * bytes after it, 255 at a time.
+ * 
+ * returns: true on success, false if @dst is too small
+*/
+bool fs_lz_sequence(unsigned char *dst, size_t cap, size_t *out, const unsigned char *literals, size_t num_literals,
+					size_t offset, size_t match) {
+	size_t match_length = offset ? match - LZ_MIN_MATCH : 0;
+	size_t pos = *out;
+
+	if (pos + 1 + num_literals + num_literals / 255 + 1 + 2 + match_length / 255 + 1 > cap)
+		return false;
+
+	dst[pos++] = (min_size(num_literals, 15) << 4) | min_size(match_length, 15);
+	if (num_literals >= 15)
+		pos = fs_lz_put_length(dst, pos, num_literals);
+	memcpy(dst + pos, literals, num_literals);
+	pos += num_literals;
+
+	// the last sequence of a stream has no match
+	if (offset) {
+		dst[pos++] = offset & 0xFF;
+		dst[pos++] = offset >> 8;
+		if (match_length >= 15)
+			pos = fs_lz_put_length(dst, pos, match_length);
+	}
+
+	*out = pos;
+	return true;
+}
+
+/** Compress data, see fs_lz_decompress()
+ * @src: data to compress, at most 64 KiB
+ * @len: number of bytes of @src
+ * @dst: compressed stream
+ * @cap: size of @dst
+ * 
+ * Matches are found through a table of the last position of each hash of 4
+ * bytes, and the search skips ahead faster the longer it goes without one.
+ * 
+ * returns: size of the stream, 0 if it does not fit in @cap bytes
+*/
+size_t fs_lz_compress(const void *src, size_t len, void *dst, size_t cap) {
+	const unsigned char *in = src;
+	uint16_t table[1 << LZ_HASH_BITS] = {0};
+	size_t pos = 0, anchor = 0, out = 0;
+
+	while (pos + LZ_MIN_MATCH <= len) {
+		uint32_t word, candidate_word;
+
+		memcpy(&word, in + pos, sizeof(word));
+		uint32_t hash = (word * 2654435761U) >> (32 - LZ_HASH_BITS);
+		size_t candidate = table[hash];
+		table[hash] = pos;
+
+		memcpy(&candidate_word, in + candidate, sizeof(candidate_word));
+		if (candidate >= pos || pos - candidate > LZ_MAX_OFFSET || candidate_word != word) {
+			pos += 1 + ((pos - anchor) >> 6);
+			continue;
+		}
+
+		// extend the match a word at a time, then up to the first byte that differs
+		size_t match = LZ_MIN_MATCH;
+		while (pos + match + sizeof(uint64_t) <= len) {
+			uint64_t a, b;
+
+			memcpy(&a, in + candidate + match, sizeof(a));
+			memcpy(&b, in + pos + match, sizeof(b));
+			if (a != b)
+				break;
+			match += sizeof(uint64_t);
+		}
+		while (pos + match < len && in[candidate + match] == in[pos + match])
+			match++;
+
+		if (!fs_lz_sequence(dst, cap, &out, in + anchor, pos - anchor, pos - candidate, match))
+			return 0;
+		pos += match;
+		anchor = pos;
+	}
+
+	if (!fs_lz_sequence(dst, cap, &out, in + anchor, len - anchor, 0, 0))
+		return 0;
+	return out;
+}
+
+/** Read the continuation of a length from a compressed stream
+ * 
+ * returns: the length, SIZE_MAX if the stream ends first
+*/
+size_t fs_lz_length(const unsigned char *in, size_t size, size_t *pos, size_t length) {
+	unsigned char byte = 255;
+
+	while (length >= 15 && byte == 255) {
+		if (*pos >= size)
+			return SIZE_MAX;
+		byte = in[(*pos)++];
+		length += byte;
+	}
+
+	return length;
+}
+
+/** Decompress a stream made by fs_lz_compress()
+ * @src: compressed stream
+ * @size: size of the stream
+ * @dst: decompressed data
+ * @cap: size of @dst
+ * 
+ * Every length and offset is checked, so that a damaged stream cannot make
+ * it read or write out of bounds. Short copies may write up to 16 bytes
+ * of @dst past the ones decompressed, never past @cap.
+ * 
+ * returns: number of bytes decompressed, -1 if the stream is invalid or does
+ * 			not fit in @cap bytes
+*/
+ssize_t fs_lz_decompress(const void *src, size_t size, void *dst, size_t cap) {
+	const unsigned char *in = src;
+	unsigned char *out = dst;
+	size_t pos = 0, done = 0;
+
+	while (pos < size) {
+		unsigned char token = in[pos++];
+		size_t num_literals = fs_lz_length(in, size, &pos, token >> 4);
+
+		if (num_literals > size - pos || num_literals > cap - done)
+			return -1;
+
+		// short runs are copied a fixed 16 bytes at a time when both buffers have room for it
+		if (num_literals <= LZ_WILD_COPY && size - pos >= LZ_WILD_COPY && cap - done >= LZ_WILD_COPY)
+			memcpy(out + done, in + pos, LZ_WILD_COPY);
+		else
+			memcpy(out + done, in + pos, num_literals);
+		pos += num_literals;
+		done += num_literals;
+
+		// the last sequence has no match
+		if (pos == size)
+			break;
+		if (size - pos < 2)
+			return -1;
+
+		size_t offset = in[pos] | (in[pos + 1] << 8);
+		pos += 2;
+		size_t match = fs_lz_length(in, size, &pos, token & 0xF);
+		if (match == SIZE_MAX || offset == 0 || offset > done || (match += LZ_MIN_MATCH) > cap - done)
+			return -1;
+
+		// a match may overlap the bytes it produces
+		if (offset >= LZ_WILD_COPY && match <= LZ_WILD_COPY && cap - done >= LZ_WILD_COPY) {
+			memcpy(out + done, out + done - offset, LZ_WILD_COPY);
+		} else if (offset >= match) {
+			memcpy(out + done, out + done - offset, match);
+		} else {
+			// the bytes copied so far repeat the pattern, so each copy can take twice as many
+			for (size_t k = 0, span = offset, n; k < match; k += n, span *= 2) {
+				n = min_size(span, match - k);
+				memcpy(out + done + k, out + done + k - span, n);
+			}
+		}
+		done += match;
+	}
+
+	return done;
+}
+
+/** Allocate the chunk cache the first time a compressed file is used
+ * 
+ * returns: 0 on success, -1 if the arena could not grow
+*/
+int fs_chunk_setup(FS *fs) {
+	if (fs->chunk_stored)
+		return 0;
+
+	char *data = fs_arena_alloc(&fs->arena, (CHUNK_CACHE_SIZE + 1) * CHUNK_SIZE);
+	if (!data)
+		return -1;
+
+	for (int i = 0; i < CHUNK_CACHE_SIZE; i++)
+		fs->chunks[i] = (chunkCache){.data = data + i * CHUNK_SIZE, .file_num = -1};
+	fs->chunk_stored = data + CHUNK_CACHE_SIZE * CHUNK_SIZE;
+	return 0;
+}
+
+/** Read consecutive logical blocks of a file, unmapped ones read back as zeros
+ * 
+ * returns: 0 on success, -1 if a block cannot be read
+*/
+int fs_chunk_read_blocks(FS *fs, int file_num, uint64_t block_num, size_t num_blocks, char *data) {
+	extentList *list = &fs->extents[file_num];
+
+	for (size_t n = 0, run; n < num_blocks; n += run) {
+		ssize_t i = fs_extent_find(list, block_num + n);
+		extent *ext = i >= 0 ? &list->extents[i] : NULL;
+
+		if (!ext || block_num + n >= ext->block_num + ext->length) {
+			memset(data + n * BLOCK_SIZE, 0, BLOCK_SIZE);
+			run = 1;
+			continue;
+		}
+
+		run = min_size(ext->block_num + ext->length - (block_num + n), num_blocks - n);
+		if (fs_block_readv(fs, fs->geo.data_block_start_idx + ext->start + (block_num + n - ext->block_num), run,
+						   data + n * BLOCK_SIZE) == -1)
+			return -1;
+	}
+
+	return 0;
+}
+
+/** Unmap the logical blocks of a file in [@block_num, @end_block_num), releasing their data blocks
+ * 
+ * returns: 0 on success, -1 if the arena could not grow
+*/
+int fs_chunk_punch(FS *fs, int file_num, uint64_t block_num, uint64_t end_block_num) {
+	extentList *list = &fs->extents[file_num];
+
+	for (; block_num < end_block_num; block_num++) {
+		int block_idx = fs_extent_block(fs, file_num, block_num, false, NULL);
+		if (block_idx == -1)
+			continue;
+
+		if (fs_extent_reserve(fs, list, list->count + 1) == -1)
+			return -1;
+		fs_extent_punch(fs, list, fs_extent_find(list, block_num), block_num);
+		fs_block_release(fs, block_idx);
+	}
+
+	return 0;
+}
+
+/** Write consecutive logical blocks of a file, one access per run of consecutive data blocks
+ * 
+ * At most CHUNK_BLOCKS blocks are written. Every block is mapped before any is
+ * written, so that a full disk leaves the file as it was.
+ * 
+ * returns: 0 on success, -1 if the disk is full or cannot be written
+*/
+int fs_chunk_write_blocks(FS *fs, int file_num, uint64_t block_num, size_t num_blocks, const char *data) {
+	bool fresh[CHUNK_BLOCKS];
+
+	for (size_t n = 0; n < num_blocks; n++) {
+		if (fs_extent_block(fs, file_num, block_num + n, true, &fresh[n]) != -1)
+			continue;
+
+		// give back the blocks taken so far
+		while (n--) {
+			if (fresh[n])
+				fs_chunk_punch(fs, file_num, block_num + n, block_num + n + 1);
+		}
+		return -1;
+	}
+
+	for (size_t n = 0, run; n < num_blocks; n += run) {
+		int block_idx = fs_extent_block(fs, file_num, block_num + n, false, NULL);
+		extentList *list = &fs->extents[file_num];
+		extent *ext = &list->extents[fs_extent_find(list, block_num + n)];
+
+		run = min_size(ext->block_num + ext->length - (block_num + n), num_blocks - n);
+		block_idx = fs_block_redirect_run(fs, file_num, block_num + n, block_idx, &run);
+		if (block_idx == -1 || fs_block_writev(fs, fs->geo.data_block_start_idx + block_idx, run,
+											   data + n * BLOCK_SIZE) == -1)
+			return -1;
+	}
+
+	return 0;
+}
+
+/** Read and decompress a chunk of a compressed file
+ * @fs: pointer to filesystem
+ * @file_num: file number of the file
+ * @chunk_num: chunk number inside the file
+ * @data: CHUNK_SIZE bytes to fill
+ * 
+ * returns: 0 on success, -1 if a block cannot be read or the chunk is damaged
+*/
+int fs_chunk_load(FS *fs, int file_num, uint64_t chunk_num, char *data) {
+	uint64_t block_num = chunk_num * CHUNK_BLOCKS;
+	char *stored = fs->chunk_stored;
+	chunkHeader header;
+
+	// a chunk of zeros takes no block, and one that did not compress takes all of them
+	int block_idx = fs_extent_block(fs, file_num, block_num, false, NULL);
+	if (block_idx == -1) {
+		memset(data, 0, CHUNK_SIZE);
+		return 0;
+	}
+	if (fs_extent_block(fs, file_num, block_num + CHUNK_BLOCKS - 1, false, NULL) != -1)
+		return fs_chunk_read_blocks(fs, file_num, block_num, CHUNK_BLOCKS, data);
+
+	if (fs_block_read(fs, fs->geo.data_block_start_idx + block_idx, stored) == -1)
+		return -1;
+
+	memcpy(&header, stored, sizeof(header));
+	size_t num_blocks = (sizeof(header) + (size_t) header.stored + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	if (header.magic != CHUNK_MAGIC || header.length > CHUNK_SIZE || num_blocks >= CHUNK_BLOCKS
+		|| (header.method == CHUNK_RAW && header.stored != header.length)
+		|| (header.method != CHUNK_RAW && header.method != CHUNK_LZ))
+		return -1;
+
+	if (num_blocks > 1 && fs_chunk_read_blocks(fs, file_num, block_num + 1, num_blocks - 1, stored + BLOCK_SIZE) == -1)
+		return -1;
+
+	if (header.method == CHUNK_RAW)
+		memcpy(data, stored + sizeof(header), header.length);
+	else if (fs_lz_decompress(stored + sizeof(header), header.stored, data, CHUNK_SIZE) != header.length)
+		return -1;
+
+	memset(data + header.length, 0, CHUNK_SIZE - header.length);
+	return 0;
+}
+
+/** Compress a cached chunk and write it to disk
+ * @fs: pointer to filesystem
+ * @chunk: chunk to store
+ * 
+ * The bytes of the chunk past the end of the file must be zeros, and so are
+ * the bytes of the chunk that is read back past what is stored.
+ * 
+ * returns: 0 on success, -1 if the disk is full or cannot be written
+*/
+int fs_chunk_store(FS *fs, chunkCache *chunk) {
+	uint64_t block_num = chunk->chunk_num * CHUNK_BLOCKS;
+	uint64_t start = chunk->chunk_num * CHUNK_SIZE;
+	uint64_t size = fs_file_size(&fs->rootDir->files[chunk->file_num]);
+	size_t length = size > start ? min_size(size - start, CHUNK_SIZE) : 0;
+	chunkHeader header = {.magic = CHUNK_MAGIC, .method = CHUNK_RAW};
+	const char *stored = fs->chunk_stored;
+	size_t num_blocks = 0;
+
+	// trailing zeros come back from the end of the chunk
+	while (length && chunk->data[length - 1] == '\0')
+		length--;
+
+	if (length) {
+		// compressing must save a block over storing the chunk as is
+		size_t raw_blocks = min_size((sizeof(header) + length + BLOCK_SIZE - 1) / BLOCK_SIZE, CHUNK_BLOCKS);
+		size_t packed = raw_blocks > 1 ? fs_lz_compress(chunk->data, length, fs->chunk_stored + sizeof(header),
+														(raw_blocks - 1) * BLOCK_SIZE - sizeof(header)) : 0;
+
+		if (packed) {
+			header.method = CHUNK_LZ;
+			stats.chunks_compressed++;
+		} else {
+			stats.chunks_uncompressed++;
+		}
+		header.stored = packed ? packed : length;
+		header.length = length;
+		num_blocks = (sizeof(header) + header.stored + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+		// a chunk that does not fit behind a header in fewer blocks than it spans takes all of them
+		if (num_blocks < CHUNK_BLOCKS) {
+			if (!packed)
+				memcpy(fs->chunk_stored + sizeof(header), chunk->data, length);
+			memcpy(fs->chunk_stored, &header, sizeof(header));
+			memset(fs->chunk_stored + sizeof(header) + header.stored, 0,
+				   num_blocks * BLOCK_SIZE - sizeof(header) - header.stored);
+		} else {
+			num_blocks = CHUNK_BLOCKS;
+			stored = chunk->data;
+		}
+	}
+
+	// the blocks the chunk no longer takes are given back
+	if (fs_chunk_write_blocks(fs, chunk->file_num, block_num, num_blocks, stored) == -1
+		|| fs_chunk_punch(fs, chunk->file_num, block_num + num_blocks, block_num + CHUNK_BLOCKS) == -1)
+		return -1;
+
+	chunk->dirty = false;
+	return 0;
+}
+
+/** Find a chunk of a compressed file in the cache, or bring it in
+ * @fs: pointer to filesystem
+ * @file_num: file number of the file
+ * @chunk_num: chunk number inside the file
+ * @load: read the chunk from disk, false if the caller overwrites all of it
+ * 
+ * The least recently used chunk makes room, and is stored first if it was
+ * modified.
+ * 
+ * returns: the cached chunk, NULL if it cannot be read or room cannot be made
+*/
+chunkCache * fs_chunk_get(FS *fs, int file_num, uint64_t chunk_num, bool load) {
+	chunkCache *victim = NULL;
+
+	if (fs_chunk_setup(fs) == -1)
+		return NULL;
+
+	for (int i = 0; i < CHUNK_CACHE_SIZE; i++) {
+		chunkCache *chunk = &fs->chunks[i];
+
+		if (chunk->file_num == file_num && chunk->chunk_num == chunk_num) {
+			stats.chunk_cache_hits++;
+			chunk->last_used = ++fs->chunk_clock;
+			return chunk;
+		}
+		if (!victim || chunk->last_used < victim->last_used)
+			victim = chunk;
+	}
+
+	stats.chunk_cache_misses++;
+	if (victim->dirty && fs_chunk_store(fs, victim) == -1)
+		return NULL;
+
+	victim->file_num = -1;
+	if (load && fs_chunk_load(fs, file_num, chunk_num, victim->data) == -1)
+		return NULL;
+
+	*victim = (chunkCache){.data = victim->data, .file_num = file_num, .chunk_num = chunk_num,
+		.last_used = ++fs->chunk_clock};
+	return victim;
+}
+
+/** Store the modified chunks of a file
+ * @fs: pointer to filesystem
+ * @file_num: file number, -1 for all files
+ * 
+ * returns: 0 on success, -1 if a chunk could not be stored
+*/
+int fs_chunk_flush(FS *fs, int file_num) {
+	int ret = 0;
+
+	for (int i = 0; fs->chunk_stored && i < CHUNK_CACHE_SIZE; i++) {
+		chunkCache *chunk = &fs->chunks[i];
+
+		if (chunk->dirty && (file_num == -1 || chunk->file_num == file_num) && fs_chunk_store(fs, chunk) == -1)
+			ret = -1;
+	}
+
+	return ret;
+}
+
+/** Forget the cached chunks of a file from a chunk on, without storing them
+ * 
+*/
+void fs_chunk_drop(FS *fs, int file_num, uint64_t chunk_num) {
+	for (int i = 0; fs->chunk_stored && i < CHUNK_CACHE_SIZE; i++) {
+		chunkCache *chunk = &fs->chunks[i];
+
+		if (chunk->file_num == file_num && chunk->chunk_num >= chunk_num)
+			*chunk = (chunkCache){.data = chunk->data, .file_num = -1};
+	}
+}
+
+/** Write to a compressed file through the chunk cache, see fs_write()
+ * @fs: pointer to filesystem
+ * @open_file: descriptor to write through
+ * @target_file: file the descriptor is open on
+ * @buf: data to write
+ * @count: number of bytes to write
+ * 
+ * A chunk is stored as soon as it is complete. The write stops at a chunk that
+ * cannot be stored, which keeps the data it had.
+ * 
+ * returns: number of bytes written
+*/
+size_t fs_chunk_write(FS *fs, openFile *open_file, file *target_file, const void *buf, size_t count) {
+	size_t bytes_written = 0;
+
+	while (bytes_written < count) {
+		uint64_t chunk_num = open_file->file_offset / CHUNK_SIZE;
+		size_t chunk_offset = open_file->file_offset % CHUNK_SIZE;
+		size_t num_bytes_to_write = min_size(count - bytes_written, CHUNK_SIZE - chunk_offset);
+		uint64_t size = fs_file_size(target_file);
+
+		chunkCache *chunk = fs_chunk_get(fs, open_file->file_num, chunk_num, num_bytes_to_write < CHUNK_SIZE);
+		if (!chunk)
+			break;
+
+		memcpy(chunk->data + chunk_offset, (const char *) buf + bytes_written, num_bytes_to_write);
+		chunk->dirty = true;
+		if (open_file->file_offset + num_bytes_to_write > size)
+			fs_file_set_size(fs, target_file, open_file->file_offset + num_bytes_to_write);
+
+		// the chunk is forgotten if it cannot be stored, reading it again gives what is on disk
+		if (chunk_offset + num_bytes_to_write == CHUNK_SIZE && fs_chunk_store(fs, chunk) == -1) {
+			*chunk = (chunkCache){.data = chunk->data, .file_num = -1};
+			fs_file_set_size(fs, target_file, size);
+			break;
+		}
+
+		bytes_written += num_bytes_to_write;
+		open_file->file_offset += num_bytes_to_write;
+	}
+
+	return bytes_written;
+}
+
+/** Read from a compressed file through the chunk cache, see fs_read()
+ * 
+ * returns: number of bytes read, -1 if nothing could be read because a chunk
+ * 			is damaged or cannot be read
+*/
+ssize_t fs_chunk_read(FS *fs, openFile *open_file, file *target_file, void *buf, size_t count) {
+	uint64_t size = fs_file_size(target_file);
+	size_t bytes_read = 0;
+
+	while (bytes_read < count && open_file->file_offset < size) {
+		uint64_t chunk_num = open_file->file_offset / CHUNK_SIZE;
+		size_t chunk_offset = open_file->file_offset % CHUNK_SIZE;
+		size_t num_bytes_to_copy = min_size(min_size(count - bytes_read, CHUNK_SIZE - chunk_offset),
+											size - open_file->file_offset);
+
+		chunkCache *chunk = fs_chunk_get(fs, open_file->file_num, chunk_num, true);
+		if (!chunk)
+			return bytes_read ? (ssize_t) bytes_read : -1;
+
+		memcpy((char *) buf + bytes_read, chunk->data + chunk_offset, num_bytes_to_copy);
+		bytes_read += num_bytes_to_copy;
+		open_file->file_offset += num_bytes_to_copy;
+	}
+
+	return bytes_read;
+}
+
+/** Change the size of a compressed file, see fs_file_truncate()
+ * 
+ * The chunk the new end falls in is stored again without the bytes cut off.
+ * 
+ * returns: 0 on success, -1 if that chunk cannot be read or stored
+*/
+int fs_chunk_truncate(FS *fs, int file_num, size_t length) {
+	file *target_file = &fs->rootDir->files[file_num];
+	uint64_t size = fs_file_size(target_file);
+	uint64_t kept_chunks = (length + CHUNK_SIZE - 1) / CHUNK_SIZE;
+	size_t chunk_offset = length % CHUNK_SIZE;
+	chunkCache *chunk = NULL;
+
+	if (length < size && chunk_offset && !(chunk = fs_chunk_get(fs, file_num, kept_chunks - 1, true)))
+		return -1;
+
+	// the blocks of the last chunk stay until it is stored again
+	fs_chunk_drop(fs, file_num, kept_chunks);
+	if (fs_file_truncate(fs, target_file, min_size(size, kept_chunks * CHUNK_SIZE)) == -1
+		|| fs_file_set_size(fs, target_file, length) == -1)
+		return -1;
+
+	if (!chunk)
+		return 0;
+
+	memset(chunk->data + chunk_offset, 0, CHUNK_SIZE - chunk_offset);
+	return fs_chunk_store(fs, chunk);
+}
+
+
+/* WRITE BUFFER HELPERS */
+
+/** Write the block absorbed by a descriptor's write buffer to disk
+ * @fs: pointer to filesystem
+ * @open_file: descriptor whose buffer is flushed
+ * 
+ * The block is written as is when the buffer covers all of it (or the block
+ * was freshly allocated and the rest of the buffer is zeros), and merged
+ * with the block on disk otherwise. The buffer is kept when the block cannot
+ * be written, so that flushing it again retries.
+ * 
+ * returns: 0 on success, -1 if the block cannot be read or written
+*/
+int fs_wbuf_flush(FS *fs, openFile *open_file) {
+	writeBuffer *wbuf = &open_file->wbuf;
+	char block[BLOCK_SIZE];
+
+	if (wbuf->block_idx == -1)
+		return 0;
+
+	const char *data = wbuf->data;
+	int block_idx = wbuf->block_idx;
+	bool dedup = fs_dedup_enabled(fs) && wbuf->start == 0 && wbuf->end == BLOCK_SIZE;
+	uint32_t fingerprint;
+
+	// a full block already on disk is shared instead of written
+	if (dedup) {
+		int ret = fs_dedup_block(fs, open_file->file_num, wbuf->block_num, data, &fingerprint);
+		if (ret == -1)
+			return -1;
+		if (ret == 1) {
+			wbuf->block_idx = -1;
+			return 0;
+		}
+	}
+
+	// the buffer holds the whole block from then on, a retry does not read it again
+	if (!wbuf->fresh && (wbuf->start != 0 || wbuf->end != BLOCK_SIZE)) {
+		if (fs_block_read(fs, fs->geo.data_block_start_idx + block_idx, block) == -1)
+			return -1;
+		memcpy(block + wbuf->start, wbuf->data + wbuf->start, wbuf->end - wbuf->start);
+		memcpy(wbuf->data, block, BLOCK_SIZE);
+		wbuf->fresh = true;
+	}
+
+	// blocks that became shared, or old on a log disk, since they were buffered get their new contents written elsewhere
+	block_idx = fs_block_redirect(fs, open_file->file_num, wbuf->block_num, block_idx, 0);
+	if (block_idx == -1)
+		return -1;
+	wbuf->block_idx = block_idx;
+	if (fs_block_write(fs, fs->geo.data_block_start_idx + block_idx, data) == -1)
+		return -1;
+	if (dedup)
+		fs_dedup_insert(fs, fingerprint, block_idx);
+
+	wbuf->block_idx = -1;
+	return 0;
+}
+
+/** Flush the write buffers of every descriptor open on a file, and its modified chunks if it is compressed
+ * @fs: pointer to filesystem
+ * @file_num: file number, -1 for all files
+ * 
+ * returns: 0 on success, -1 if a block could not be written
+*/
+int fs_wbuf_flush_file(FS *fs, int file_num) {
+	int ret = fs_chunk_flush(fs, file_num);
+
+	for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+		openFile *open_file = &fs->open_files[i];
+		if (open_file->file_num == -1 || (file_num != -1 && open_file->file_num != file_num))
+			continue;
+
+		if (fs_wbuf_flush(fs, open_file) == -1)
+			ret = -1;
+	}
+
+	return ret;
+}
+
+/** Forget the data buffered by the descriptors open on a file, without writing it
+ * 
+*/
+void fs_wbuf_drop(FS *fs, int file_num) {
+	for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+		if (fs->open_files[i].file_num == file_num)
+			fs->open_files[i].wbuf.block_idx = -1;
+	}
+}
+
+/** Absorb a small write into a descriptor's write buffer
+ * @fs: pointer to filesystem
+ * @open_file: descriptor to write through
+ * @target_file: file the descriptor is open on
+ * @buf: data to write
+ * @count: number of bytes to write (less than a block)
+ * 
+ * Blocks are allocated as soon as they are written to, and shared blocks and
+ * blocks of log disks are moved to a copy, so running out of space is
+ * reported right away, but their data only reaches the disk once the buffer
+ * moves to another block or is flushed.
+ * 
+ * returns: number of bytes absorbed, which stops short at a block that cannot
+ * 			be read or flushed, -1 if that happens before any byte is
+*/
+int fs_wbuf_write(FS *fs, openFile *open_file, file *target_file, const void *buf, size_t count) {
+	writeBuffer *wbuf = &open_file->wbuf;
+	size_t bytes_written = 0;
+	bool io_error = false;
+
+	if (!wbuf->data) {
+		wbuf->data = fs_buffer_get(fs);
+		if (!wbuf->data)
+			return -1;
+	}
+
+	while (bytes_written < count) {
+		size_t block_num = open_file->file_offset / BLOCK_SIZE;
+		size_t block_offset = open_file->file_offset % BLOCK_SIZE;
+
+		// only sequential writes inside the buffered block are combined
+		if (wbuf->block_idx != -1 && (wbuf->block_num != block_num || wbuf->end != block_offset)) {
+			if (fs_wbuf_flush(fs, open_file) == -1) {
+				io_error = true;
+				break;
+			}
+		}
+
+		if (wbuf->block_idx == -1) {
+			bool fresh;
+			int block_idx = fs_file_block(fs, target_file, block_num, true, &fresh, &open_file->cursor);
+			if (block_idx == -1)
+				break;
+
+			if (fresh)
+				memset(wbuf->data, 0, BLOCK_SIZE);
+
+			// a block that needs a copy takes it now, with its current contents
+			if (!fresh && fs_block_needs_copy(fs, block_idx)) {
+				if (fs_block_read(fs, fs->geo.data_block_start_idx + block_idx, wbuf->data) == -1) {
+					io_error = true;
+					break;
+				}
+				block_idx = fs_block_redirect(fs, open_file->file_num, block_num, block_idx, 0);
+				if (block_idx == -1)
+					break;
+				fresh = true;
+			}
+
+			*wbuf = (writeBuffer){.data = wbuf->data, .block_idx = block_idx, .block_num = block_num,
+				.start = block_offset, .end = block_offset, .fresh = fresh};
+		}
+
+		size_t num_bytes_to_write = min(count - bytes_written, BLOCK_SIZE - block_offset);
+		memcpy(wbuf->data + block_offset, (const char *) buf + bytes_written, num_bytes_to_write);
+		wbuf->end += num_bytes_to_write;
+
+		bytes_written += num_bytes_to_write;
+		open_file->file_offset += num_bytes_to_write;
+		if (open_file->file_offset > fs_file_size(target_file))
+			fs_file_set_size(fs, target_file, open_file->file_offset);
+
+		// emit the block as soon as it is complete, the buffer keeps it if it cannot be
+		if (wbuf->end == BLOCK_SIZE && fs_wbuf_flush(fs, open_file) == -1) {
+			io_error = true;
+			break;
+		}
+	}
+
+	return io_error && bytes_written == 0 ? -1 : (int) bytes_written;
+}
+
+/** Flush all write buffers and the metadata they depend on
+ * @fs: pointer to filesystem
+ * 
+ * returns: 0 on success, -1 otherwise
+*/
+int fs_sync_all(FS *fs) {
+	if (fs_wbuf_flush_file(fs, -1) == -1)
+		return -1;
+
+	if ((fs->FAT->dirty || (fs->geo.log && fs->log_pending)) && fs_save_FAT(fs) == -1)
+		return -1;
+
+	if (fs_checksum_save(fs) == -1)
+		return -1;
+
+	return fs_save_rootDir(fs);
+}
+
+
+/* LOG CLEANER
+ *
+ * Segments of a log disk end up holding a mix of live blocks and blocks that
+ * were overwritten since. The cleaner picks the segments with the fewest live
+ * blocks (greedy), copies those to the head of the log, and checkpoints so
+ * that the segments can be written again. It runs in a background thread
+ * while empty segments are scarce, and on demand through fs_clean().
+ */
+
+/** Copy a live block of a file to the head of the log
+ * 
+ * returns: 0 on success, -1 if the disk is full or cannot be read or written
+*/
+int fs_log_move(FS *fs, int file_num, uint64_t block_num, uint32_t block_idx) {
+	char block[BLOCK_SIZE];
+	int new_block_idx = fs_log_alloc(fs);
+
+	if (new_block_idx == -1)
+		return -1;
+
+	if (fs_block_read(fs, fs->geo.data_block_start_idx + block_idx, block) == -1
+		|| fs_block_write(fs, fs->geo.data_block_start_idx + new_block_idx, block) == -1
+		|| fs_extent_remap(fs, file_num, block_num, new_block_idx) == -1) {
+		fs_fat_set(fs, new_block_idx, 0);
+		return -1;
+	}
+
+	fs_log_kill(fs, block_idx);
+	return 0;
+}
+
+/** Empty the segment with the fewest live blocks into the head of the log
+ * @fs: pointer to filesystem
+ * 
+ * The segment the log is written to is left alone, and so are segments
+ * holding blocks that are not part of files (metadata or the reserved block)
+ * or that are shared by clones, which are pinned until they are empty.
+ * 
+ * returns: 1 if a segment was emptied, 0 if none has dead blocks to reclaim,
+ * 			-1 if a block could not be moved
+*/
+int fs_log_clean_segment(FS *fs) {
+	logBlock live[LOG_SEGMENT_BLOCKS];
+	size_t head_segment = fs->log_end ? (fs->log_end - 1) / LOG_SEGMENT_BLOCKS : fs->num_segments;
+
+	while (true) {
+		size_t victim = fs->num_segments;
+		size_t victim_live = LOG_SEGMENT_BLOCKS;
+
+		for (size_t i = 0; i < fs->num_segments; i++) {
+			size_t num_live = fs->log_used[i] - fs->log_dead[i];
+
+			if (num_live && num_live < victim_live && i != head_segment && !fs->log_pinned[i]) {
+				victim = i;
+				victim_live = num_live;
+			}
+		}
+		if (victim == fs->num_segments)
+			return 0;
+
+		// find the blocks of files in the segment
+		uint64_t first_block_idx = victim * LOG_SEGMENT_BLOCKS;
+		uint64_t end_block_idx = min_size(first_block_idx + LOG_SEGMENT_BLOCKS, fs->geo.amt_data_blocks);
+		size_t count = 0;
+		bool shared = false;
+
+		for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+			extentList *list = &fs->extents[i];
+
+			for (size_t j = 0; j < list->count; j++) {
+				extent *ext = &list->extents[j];
+				uint64_t from = max_size(ext->start, first_block_idx);
+				uint64_t to = min_size((uint64_t) ext->start + ext->length, end_block_idx);
+
+				for (uint64_t block_idx = from; block_idx < to && count < LOG_SEGMENT_BLOCKS; block_idx++) {
+					live[count++] = (logBlock){.file_num = i,
+						.block_num = ext->block_num + (block_idx - ext->start), .block_idx = block_idx};
+					shared |= fs_block_refs(fs, block_idx) != 0;
+				}
+			}
+		}
+
+		// moving a shared block would give each of its files a copy of its own
+		if (count != victim_live || shared) {
+			fs->log_pinned[victim] = 1;
+			continue;
+		}
+
+		for (size_t i = 0; i < count; i++) {
+			if (fs_log_move(fs, live[i].file_num, live[i].block_num, live[i].block_idx) == -1)
+				return -1;
+		}
+
+		stats.log_segments_cleaned++;
+		stats.log_blocks_moved += count;
+		return 1;
+	}
+}
+
+/** Empty segments of a log disk, then checkpoint so that they can be written again
+ * @fs: pointer to filesystem
+ * @max_segments: segments to empty, 0 for no limit
+ * 
+ * returns: number of segments emptied, -1 if a block or the metadata could not be written
+*/
+int fs_log_clean(FS *fs, size_t max_segments) {
+	int cleaned = 0;
+	int ret = 0;
+
+	// blocks held in write buffers would be left behind
+	if (fs_wbuf_flush_file(fs, -1) == -1)
+		return -1;
+
+	for (size_t n = 0; n < fs->num_segments && (!max_segments || n < max_segments); n++) {
+		ret = fs_log_clean_segment(fs);
+		if (ret != 1)
+			break;
+		cleaned++;
+	}
+
+	// the emptied segments are released once the extents pointing to the copies are saved
+	if (fs_save_FAT(fs) == -1 || fs_save_rootDir(fs) == -1 || ret == -1)
+		return -1;
+
+	return cleaned;
+}
+
+/* SNAPSHOT HELPERS
+ *
+ * A snapshot is a chain of metadata blocks holding a copy of the root
+ * directory and the extents of every file, with one reference to each of
+ * their data blocks (see SHARED BLOCK HELPERS). The live file system then
+ * copies the blocks it modifies, so those of the snapshot never change. The
+ * snapshot table lists the chains, and is created with the first snapshot.
+ */
+
+/** Create the snapshot table the first time a snapshot is taken
+ * 
+ * returns: 0 on success, -1 if there is no room for the table
+*/
+int fs_snapshot_table_create(FS *fs) {
+	if (fs->snapshots)
+		return 0;
+
+	snapshotEntry *snapshots = fs_arena_alloc(&fs->arena, BLOCK_SIZE);
+	if (!snapshots)
+		return -1;
+
+	int block_idx = fs_meta_create(fs, 1);
+	if (block_idx == -1)
+		return -1;
+
+	fs->snapshots = snapshots;
+	fs->geo.snapshot_idx = block_idx;
+	fs->superblock->snapshot_idx = block_idx;
+	fs->superblock->features |= FS_FEATURE_SNAPSHOTS;
+	return fs_save_superblock(fs);
+}
+
+/** Find a snapshot in the snapshot table
+ * 
+ * returns: index of the snapshot, -1 if there is none named @name
+*/
+int fs_snapshot_find(FS *fs, const char *name) {
+	for (int i = 0; fs->snapshots && i < FS_SNAPSHOT_MAX_COUNT; i++) {
+		if (fs->snapshots[i].name[0] != '\0' && !strcmp(fs->snapshots[i].name, name))
+			return i;
+	}
+
+	return -1;
+}
+
+/** Read the chain of a snapshot
+ * 
+ * returns: the blocks of the chain (to be freed by the caller), NULL if they
+ * 			cannot be read or allocated
+*/
+char * fs_snapshot_load(FS *fs, int snapshot) {
+	char *table = malloc(fs->snapshots[snapshot].num_blocks * BLOCK_SIZE);
+
+	if (table && fs_meta_load(fs, fs->snapshots[snapshot].meta_idx, table) == -1) {
+		free(table);
+		return NULL;
+	}
+
+	return table;
+}
+
+/** Extents of a file in the chain of a snapshot, holes included
+ * @table: blocks of the chain
+ * @file_num: root directory entry of the file in the snapshot
+ * @num_extents: set to the number of extents of the file
+*/
+diskExtent * fs_snapshot_extents(char *table, int file_num, size_t *num_extents) {
+	uint32_t *counts = (uint32_t *) (table + BLOCK_SIZE);
+	size_t first = 0;
+
+	for (int i = 0; i < file_num; i++)
+		first += counts[i];
+
+	*num_extents = counts[file_num];
+	return (diskExtent *) (table + SNAPSHOT_HEADER_BLOCKS * BLOCK_SIZE) + first;
+}
+
+// Save the snapshot table to disk
+int fs_snapshot_save_table(FS *fs) {
+	stats.meta_table_flushes++;
+	return fs_block_write(fs, fs->geo.data_block_start_idx + fs->geo.snapshot_idx, fs->snapshots);
+}
+
+/* DEFRAGMENTATION HELPERS */
+
+// blocks copied per vectored write while relocating a chain
+#define DEFRAG_COPY_BLOCKS 8
+
+/** Count the blocks of a chain and the runs of consecutive blocks they form
+ * @fs: pointer to filesystem
+ * @block_idx: first data block of the chain
+ * @num_blocks: set to the length of the chain
+ * 
+ * returns: number of runs (extents), 0 for an empty chain
+*/
+size_t fs_chain_extents(FS *fs, uint32_t block_idx, size_t *num_blocks) {
+	uint32_t prev_block_idx = FAT_EOC;
+	size_t extents = 0;
+
+	*num_blocks = 0;
+	while (block_idx != FAT_EOC) {
+		if (prev_block_idx == FAT_EOC || block_idx != prev_block_idx + 1)
+			extents++;
+
+		(*num_blocks)++;
+		prev_block_idx = block_idx;
+		block_idx = fs_fat_get(fs, block_idx);
+	}
+
+	return extents;
+}
+
+/** Measure the fragmentation of the files and of the free space
+ * 
+*/
+void fs_frag_scan(FS *fs, struct fs_frag *frag) {
+	size_t run = 0;
+
+	memset(frag, 0, sizeof(*frag));
+
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		file *target_file = &fs->rootDir->files[i];
+		size_t num_blocks;
+
+		// packed files share their block, there is nothing to gather
+		if (target_file->filename[0] == '\0' || (target_file->flags & FILE_TAIL))
+			continue;
+
+		size_t extents = fs->geo.extents ? fs_extent_runs(fs, i, &num_blocks)
+			: fs_chain_extents(fs, fs_file_first(&fs->geo, target_file), &num_blocks);
+		if (!num_blocks)
+			continue;
+
+		frag->files++;
+		frag->blocks += num_blocks;
+		frag->extents += extents;
+		if (extents > 1)
+			frag->fragmented_files++;
+	}
+
+	for (uint32_t i = 0; i <= fs->geo.amt_data_blocks; i++) {
+		if (i < fs->geo.amt_data_blocks && fs_fat_get(fs, i) == 0) {
+			run++;
+			continue;
+		}
+
+		if (run) {
+			frag->free_blocks += run;
+			frag->free_extents++;
+			if (run > frag->largest_free_extent)
+				frag->largest_free_extent = run;
+		}
+		run = 0;
+	}
+}
+
+/** Find the first run of free data blocks of a given length
+ * 
+ * returns: first block of the run, -1 if there is none
+*/
+int fs_find_free_run(FS *fs, size_t length) {
+	size_t run = 0;
+
+	stats.alloc_searches++;
+	for (uint32_t i = 0; i < fs->geo.amt_data_blocks; i++) {
+		stats.alloc_scan_steps++;
+		run = fs_fat_get(fs, i) == 0 ? run + 1 : 0;
+		if (run == length)
+			return i - length + 1;
+	}
+
+	return -1;
+}
+
+/** Move the extents of a file to a contiguous run of free blocks, see fs_file_relocate()
+ * 
+ * Files sharing blocks with clones are left where they are, moving them would
+ * take a copy of the shared blocks.
+*/
+int fs_extent_relocate(FS *fs, int file_num, size_t num_blocks) {
+	char blocks[DEFRAG_COPY_BLOCKS][BLOCK_SIZE];
+	extentList *list = &fs->extents[file_num];
+	size_t data_start = fs->geo.data_block_start_idx;
+
+	// buffered data and cached chunks must be on disk before the extents are
+	// looked at, storing them may move blocks (log disks, compressed files) or share them (dedup)
+	if (fs_wbuf_flush_file(fs, file_num) == -1)
+		return -1;
+
+	extentList old_list = *list;
+	if (fs_extent_shared(fs, file_num))
+		return 0;
+
+	int new_first = fs_find_free_run(fs, num_blocks);
+	if (new_first == -1)
+		return 0;
+
+	// copy, each extent is read in as few accesses as its length allows
+	uint32_t new_block_idx = new_first;
+	for (size_t i = 0; i < old_list.count; i++) {
+		extent *ext = &old_list.extents[i];
+
+		for (uint32_t j = 0; j < ext->length; j += DEFRAG_COPY_BLOCKS) {
+			size_t count = min_size(ext->length - j, DEFRAG_COPY_BLOCKS);
+
+			if (fs_block_readv(fs, data_start + ext->start + j, count, blocks) == -1
+				|| fs_block_writev(fs, data_start + new_block_idx, count, blocks) == -1)
+				return -1;
+			new_block_idx += count;
+		}
+	}
+
+	// describe the file by the new run, keeping its holes
+	*list = (extentList){0};
+	new_block_idx = new_first;
+	for (size_t i = 0; i < old_list.count; i++) {
+		if (fs_extent_append(fs, list, old_list.extents[i].block_num, new_block_idx, old_list.extents[i].length) == -1) {
+			*list = old_list;
+			return -1;
+		}
+		new_block_idx += old_list.extents[i].length;
+	}
+	for (size_t i = 0; i < num_blocks; i++)
+		fs_fat_set(fs, new_first + i, FAT_EOC);
+	list->dirty = true;
+	fs->extents_dirty = true;
+
+	// switch the file over, durably, before giving the old blocks back
+	if (fs_save_FAT(fs) == -1 || fs_save_rootDir(fs) == -1)
+		return -1;
+
+	for (size_t i = 0; i < old_list.count; i++) {
+		for (uint32_t j = 0; j < old_list.extents[i].length; j++)
+			fs_fat_set(fs, old_list.extents[i].start + j, 0);
+	}
+
+	stats.defrag_files_moved++;
+	stats.defrag_blocks_moved += num_blocks;
+	return 1;
+}
+
+/** Move a file's chain to a contiguous run of free blocks
+ * @fs: pointer to filesystem
+ * @file_num: file number of the file to move
+ * @num_blocks: length of its chain, once its buffered data is stored
+ * 
+ * The blocks are copied to the new run before the FAT links it, and the FAT
+ * and root directory are saved before the old chain is freed, so that the
+ * disk always holds one complete copy of the file.
+ * 
+ * returns: 1 if the file was moved,
+ * 			0 if there is no free run long enough,
+ * 			-1 if the disk cannot be read or written
+*/
+int fs_file_relocate(FS *fs, int file_num, size_t num_blocks) {
+	char blocks[DEFRAG_COPY_BLOCKS][BLOCK_SIZE];
+	file *target_file = &fs->rootDir->files[file_num];
+	size_t data_start = fs->geo.data_block_start_idx;
+
+	if (fs->geo.extents)
+		return fs_extent_relocate(fs, file_num, num_blocks);
+
+	// buffered data must be on disk before the blocks are copied
+	if (fs_wbuf_flush_file(fs, file_num) == -1)
+		return -1;
+
+	int new_first = fs_find_free_run(fs, num_blocks);
+	if (new_first == -1)
+		return 0;
+
+	// copy, the new blocks are still free in the FAT if this fails
+	uint32_t block_idx = fs_file_first(&fs->geo, target_file);
+	for (size_t i = 0; i < num_blocks; i += DEFRAG_COPY_BLOCKS) {
+		size_t count = min(num_blocks - i, DEFRAG_COPY_BLOCKS);
+
+		for (size_t j = 0; j < count; j++) {
+			if (fs_block_read(fs, data_start + block_idx, blocks[j]) == -1)
+				return -1;
+			block_idx = fs_fat_get(fs, block_idx);
+		}
+		if (fs_block_writev(fs, data_start + new_first + i, count, blocks) == -1)
+			return -1;
+	}
+
+	// link the new chain, carrying the holes of sparse files over
+	block_idx = fs_file_first(&fs->geo, target_file);
+	for (size_t i = 0; i < num_blocks; i++) {
+		uint32_t new_block_idx = new_first + i;
+
+		fs_fat_set(fs, new_block_idx, i + 1 < num_blocks ? new_block_idx + 1 : FAT_EOC);
+		if (fs_hole_set(fs, new_block_idx, fs_hole_skip(fs, block_idx)) == -1)
+			return -1;
+		block_idx = fs_fat_get(fs, block_idx);
+	}
+
+	// switch the file over, durably, before giving the old chain back
+	uint32_t old_first = fs_file_first(&fs->geo, target_file);
+	fs_file_set_first(&fs->geo, target_file, new_first);
+	if (fs_file_last_block_known(fs, target_file))
+		fs_file_set_last(fs, target_file, new_first + num_blocks - 1);
+
+	if (fs_save_FAT(fs) == -1 || fs_save_rootDir(fs) == -1)
+		return -1;
+
+	for (block_idx = old_first; block_idx != FAT_EOC; ) {
+		uint32_t next_block_idx = fs_fat_get(fs, block_idx);
+		fs_fat_set(fs, block_idx, 0);
+		block_idx = next_block_idx;
+	}
+
+	stats.defrag_files_moved++;
+	stats.defrag_blocks_moved += num_blocks;
+	return 1;
+}
+
+/** Microseconds elapsed since @start
+ * 
+*/
+uint64_t fs_elapsed_us(const struct timespec *start) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000000ULL + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+
+/* CHECKSUM REGION HELPERS
+ *
+ * The checksum region is a run of consecutive data blocks holding a CRC32C per
+ * disk block, indexed by disk block number. It is contiguous so that it can be
+ * read before the FAT, whose blocks it covers.
+ */
+
+// wakes the background scrubber up when its rate changes or the disk is unmounted
+static pthread_cond_t scrub_cond = PTHREAD_COND_INITIALIZER;
+
+/** Buffer of SCRUB_BATCH_BLOCKS blocks for checksumming and scrubbing, allocated on first use
+ * 
+*/
+char * fs_scrub_buffer(FS *fs) {
+	if (!fs->scrub_buf)
+		fs->scrub_buf = fs_arena_alloc(&fs->arena, SCRUB_BATCH_BLOCKS * BLOCK_SIZE);
+	return fs->scrub_buf;
+}
+
+/** Number of blocks of the checksum region of the mounted disk
+ * 
+*/
+uint32_t fs_checksum_num_blocks(FS *fs) {
+	return ((uint64_t) fs->geo.block_count * sizeof(uint32_t) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+/** Start verifying blocks against the checksums of a loaded or computed table
+ * 
+*/
+void fs_checksum_activate(FS *fs, uint32_t *table, uint64_t *dirty, uint32_t first_block_idx) {
+	fs->checksums = (checksumState){.table = table, .dirty = dirty,
+		.first = fs->geo.data_block_start_idx + first_block_idx, .num_blocks = fs_checksum_num_blocks(fs),
+		.num_entries = fs->geo.block_count, .data_start = fs->geo.data_block_start_idx};
+}
+
+/** Load the checksum region of a disk that has one, before anything else is read
+ * @fs: pointer to filesystem
+ * 
+ * returns: 0 on success, -1 if the region is out of range or cannot be read
+*/
+int fs_checksum_load(FS *fs) {
+	uint32_t num_blocks = fs_checksum_num_blocks(fs);
+
+	if (fs->geo.checksum_idx == 0)
+		return 0;
+	if ((uint64_t) fs->geo.checksum_idx + num_blocks > fs->geo.amt_data_blocks)
+		return -1;
+
+	uint32_t *table = fs_arena_alloc(&fs->arena, (size_t) num_blocks * BLOCK_SIZE);
+	uint64_t *dirty = fs_arena_alloc(&fs->arena, (num_blocks + 63) / 64 * sizeof(uint64_t));
+	if (!table || !dirty)
+		return -1;
+
+	stats.blocks_read += num_blocks;
+	if (block_readv(fs->geo.data_block_start_idx + fs->geo.checksum_idx, num_blocks, table) == -1)
+		return -1;
+
+	fs_checksum_activate(fs, table, dirty, fs->geo.checksum_idx);
+	return 0;
+}
+
+/** Checksum every block of the disk into a new checksum region, see fs_checksums()
+ * @fs: pointer to filesystem
+ * 
+ * Blocks are checksummed as they are on disk: the ones still to be written
+ * update their checksum when they are. The superblock only records the region
+ * once it is written, along with the FAT chaining it.
+ * 
+ * returns: 0 on success, -1 if there is no run of free blocks for the region,
+ * 			or if the disk cannot be read or written
+*/
+int fs_checksum_setup(FS *fs) {
+	uint32_t num_blocks = fs_checksum_num_blocks(fs);
+	char *buf = fs_scrub_buffer(fs);
+
+	if (fs->checksums.table)
+		return 0;
+
+	int first_block_idx = fs_find_free_run(fs, num_blocks);
+	if (!buf || first_block_idx == -1)
+		return -1;
+
+	uint32_t *table = fs_arena_alloc(&fs->arena, (size_t) num_blocks * BLOCK_SIZE);
+	uint64_t *dirty = fs_arena_alloc(&fs->arena, (num_blocks + 63) / 64 * sizeof(uint64_t));
+	if (!table || !dirty)
+		return -1;
+
+	for (size_t block = 0, count; block < fs->geo.block_count; block += count) {
+		count = min_size(SCRUB_BATCH_BLOCKS, fs->geo.block_count - block);
+		stats.blocks_read += count;
+		if (block_readv(block, count, buf) == -1)
+			return -1;
+		for (size_t i = 0; i < count; i++)
+			table[block + i] = fs_crc32c(buf + i * BLOCK_SIZE, BLOCK_SIZE);
+	}
+
+	// the region is in place before anything that is written from now on updates it
+	for (uint32_t i = 0; i < num_blocks; i++)
+		fs_fat_set(fs, first_block_idx + i, i + 1 < num_blocks ? first_block_idx + i + 1 : FAT_EOC);
+	fs_checksum_activate(fs, table, dirty, first_block_idx);
+
+	stats.blocks_written += num_blocks;
+	stats.meta_table_flushes++;
+	if (block_writev(fs->checksums.first, num_blocks, table) == -1 || fs_save_FAT(fs) == -1)
+		return -1;
+
+	fs->geo.checksum_idx = first_block_idx;
+	fs->superblock->checksum_idx = first_block_idx;
+	fs->superblock->features |= FS_FEATURE_CHECKSUMS;
+	return fs_save_superblock(fs);
+}
+
+/** Stop checksumming, and release the checksum region
+ * @fs: pointer to filesystem
+ * 
+ * returns: 0 on success, -1 if the superblock or the FAT cannot be written
+*/
+int fs_checksum_release(FS *fs) {
+	uint32_t first_block_idx = fs->geo.checksum_idx;
+	uint32_t num_blocks = fs->checksums.num_blocks;
+
+	if (!fs->checksums.table)
+		return 0;
+
+	// the superblock forgets the region before its blocks can be reused
+	fs->geo.checksum_idx = 0;
+	fs->superblock->checksum_idx = 0;
+	fs->superblock->features &= ~FS_FEATURE_CHECKSUMS;
+	if (fs_save_superblock(fs) == -1)
+		return -1;
+
+	fs->checksums = (checksumState){0};
+	for (uint32_t i = 0; i < num_blocks; i++)
+		fs_fat_set(fs, first_block_idx + i, 0);
+
+	return fs_save_FAT(fs);
+}
+
+/** Check whether the scrubber verifies a block: the FAT, the root directory, and data blocks in use
+ * 
+*/
+bool fs_scrub_wanted(FS *fs, size_t block) {
+	if (!fs_checksum_covered(fs, block))
+		return false;
+	if (block < fs->checksums.data_start)
+		return true;
+
+	return block - fs->checksums.data_start < fs->geo.amt_data_blocks
+		&& fs_fat_get(fs, block - fs->checksums.data_start) != 0;
+}
+
+/** Verify blocks against their checksums, see fs_scrub()
+ * @fs: pointer to filesystem
+ * @max_blocks: blocks to verify, 0 for a whole pass
+ * @report: structure to fill, or NULL
+ * 
+ * Runs of blocks in use are read SCRUB_BATCH_BLOCKS at a time, starting at the
+ * block the previous call stopped at.
+ * 
+ * returns: number of bad blocks found, -1 if the disk cannot be read
+*/
+int fs_scrub_blocks(FS *fs, size_t max_blocks, struct fs_scrub_report *report) {
+	struct fs_scrub_report found = {0};
+	char *buf = fs_scrub_buffer(fs);
+	size_t total = fs->checksums.num_entries;
+
+	if (!buf)
+		return -1;
+
+	// block 0 is the superblock, which has no checksum
+	for (size_t steps = 0; steps + 1 < total && (max_blocks == 0 || found.blocks_scrubbed < max_blocks);) {
+		size_t block = fs->scrub_cursor >= 1 && fs->scrub_cursor < total ? fs->scrub_cursor : 1;
+		size_t limit = min_size(min_size(SCRUB_BATCH_BLOCKS, total - block), total - 1 - steps);
+		size_t run = 0;
+
+		if (max_blocks)
+			limit = min_size(limit, max_blocks - found.blocks_scrubbed);
+		while (run < limit && fs_scrub_wanted(fs, block + run))
+			run++;
+
+		// skip a block that is not in use
+		if (run == 0) {
+			fs->scrub_cursor = block + 1;
+			steps++;
+			continue;
+		}
+
+		stats.blocks_read += run;
+		if (block_readv(block, run, buf) == -1)
+			return -1;
+
+		for (size_t i = 0; i < run; i++) {
+			if (fs_crc32c(buf + i * BLOCK_SIZE, BLOCK_SIZE) == fs->checksums.table[block + i])
+				continue;
+			if (found.bad_blocks++ == 0)
+				found.first_bad_block = block + i;
+		}
+
+		found.blocks_scrubbed += run;
+		fs->scrub_cursor = block + run;
+		steps += run;
+	}
+
+	stats.blocks_scrubbed += found.blocks_scrubbed;
+	stats.checksum_failures += found.bad_blocks;
+	if (report)
+		*report = found;
+	return found.bad_blocks;
+}
+
+// global filesystem var
+FS *fs;
+
+// mounts so far, so that a log cleaner thread can tell its mount from later ones
+static uint64_t mount_count;
+
+/** Undo a partially completed mount
+ * 
+ * returns: -1, for use as fs_mount()'s return value
+*/
+int fs_mount_abort(FS *mounting_fs) {
+	block_disk_close();
+	fs_arena_release(mounting_fs->arena);
+	fs = NULL;
+	return -1;
+}
+
+static int fs_mount_locked(const char *diskname)
+{
+	// refuse to mount twice
+	if (is_mounted(fs))
+		return -1;
+
+	// init global filesystem var
+	fs = fs_init();
+	if (!fs)
+		return -1;
+
+	// open virtual disk
+	if (block_disk_open(diskname) == -1) {
+		fs_arena_release(fs->arena);
+		fs = NULL;
+		return -1;
+	}
+
+	// assign superblock values
+	fs_block_read(fs, 0, fs->superblock);
+	memcpy(fs->disk_superblock, fs->superblock, BLOCK_SIZE);
+	fs_geometry_read(fs->superblock, &fs->geo);
+
+	// everything read from now on is verified, if the disk has checksums
+	if (fs_checksum_load(fs) == -1)
+		return fs_mount_abort(fs);
+
+	// let the disk layer tell metadata accesses from data accesses
+	block_disk_set_layout(fs->geo.root_block_idx, fs->geo.data_block_start_idx);
+
+	// init FAT array
+	fs->FAT->curr_pos = 0;
+	fs->FAT->dirty = false;
+	memset(fs->FAT->dirty_blocks, 0, sizeof(fs->FAT->dirty_blocks));
+
+	if (fs->geo.fat32) {
+		// FAT32 blocks are loaded as they are used
+		fs->FAT->page_of = fs_arena_alloc(&fs->arena, fs->geo.num_blocks_for_FAT);
+		if (!fs->FAT->page_of || fs_fat32_count_taken(fs) == -1)
+			return fs_mount_abort(fs);
+	} else {
+		fs->FAT->blocks = fs_arena_alloc(&fs->arena, fs->geo.num_blocks_for_FAT * BLOCK_SIZE);
+
+		// malloc error handling
+		if (!fs->FAT->blocks)
+			return fs_mount_abort(fs);
+
+		// read and assign values to array
+		if (fs_block_readv(fs, FAT_START_IDX, fs->geo.num_blocks_for_FAT, fs->FAT->blocks) == -1)
+			return fs_mount_abort(fs);
+
+		// count blocks taken straight from the FAT (entry 0 is always reserved)
+		fs->FAT->num_blocks_taken = 0;
+		for (uint32_t i = 0; i < fs->geo.amt_data_blocks; i++) {
+			if (fs->FAT->blocks[i] != 0)
+				fs->FAT->num_blocks_taken++;
+		}
+	}
+
+	// read into block buffer
+	if (fs_block_read(fs, fs->geo.root_block_idx, fs->rootDir->files) == -1)
+		return fs_mount_abort(fs);
+	memcpy(fs->disk_rootDir, fs->rootDir->files, BLOCK_SIZE);
+
+	// load the hole map of sparse files if this disk has one
+	fs->holes = NULL;
+	fs->holes_dirty = false;
+	if (fs->geo.holemap_block_idx != 0) {
+		fs->holes = fs_arena_alloc(&fs->arena, fs_meta_num_blocks(fs, fs_hole_entry_size(fs)) * BLOCK_SIZE);
+		if (!fs->holes || fs_meta_load(fs, fs->geo.holemap_block_idx, fs->holes) == -1)
+			return fs_mount_abort(fs);
+	}
+
+	// files of an extent disk are mapped from the extent table
+	if (fs->geo.extents && fs_extent_load(fs) == -1)
+		return fs_mount_abort(fs);
+
+	// load the reference counts of blocks shared by clones if this disk has any
+	fs->refs = NULL;
+	fs->refs_dirty = false;
+	if (fs->geo.refcount_idx != 0) {
+		fs->refs = fs_arena_alloc(&fs->arena, fs_meta_num_blocks(fs, sizeof(uint16_t)) * BLOCK_SIZE);
+		if (!fs->refs || fs_meta_load(fs, fs->geo.refcount_idx, fs->refs) == -1)
+			return fs_mount_abort(fs);
+	}
+
+	// and the list of snapshots, whose chains are only read when they are used
+	fs->snapshots = NULL;
+	if (fs->geo.snapshot_idx != 0) {
+		fs->snapshots = fs_arena_alloc(&fs->arena, BLOCK_SIZE);
+		if (!fs->snapshots || fs_meta_load(fs, fs->geo.snapshot_idx, fs->snapshots) == -1)
+			return fs_mount_abort(fs);
+	}
+
+	// the log is written to the empty segments
+	if (fs->geo.log && fs_log_setup(fs) == -1)
+		return fs_mount_abort(fs);
+
+	// index the fingerprints of the blocks of files if deduplication was used
+	if (fs->geo.fingerprint_idx != 0 && fs_dedup_setup(fs) == -1)
+		return fs_mount_abort(fs);
+
+	fs->rootDir->num_files = 0;
+	fs->num_tails = 0;
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++){
+		file *target_file = &fs->rootDir->files[i];
+
+		// the entry only has room for the last block while it fits in 16 bits
+		fs->last_block[i] = target_file->last_block_idx == FAT16_EOC ? FAT_EOC : target_file->last_block_idx;
+
+		// increment number of files counter if filename is not null
+		if (target_file->filename[0] == '\0')
+			continue;
+		fs->rootDir->num_files++;
+
+		// rebuild slot maps of shared tail blocks
+		if (target_file->flags & FILE_TAIL)
+			fs_tail_mark(fs, target_file->tail_loc, fs_tail_slots(target_file->file_size));
+	}
+
+	fs->mount_id = ++mount_count;
+	fs->is_mounted = true;
+	return 0;
+}
+
+static int fs_umount_locked(void)
+{
+	// make sure fs is properly mounted
+	if (!is_mounted(fs))
+		return -1;
+
+	// write out data still sitting in write buffers, the mount goes away even if some of it cannot be saved
+	int ret = fs_wbuf_flush_file(fs, -1);
+
+	// save superblock
+	if (fs_save_superblock(fs) == -1)
+		ret = -1;
+
+	// save rootDir
+	if (fs_save_rootDir(fs) == -1)
+		ret = -1;
+
+	// save FAT
+	if (fs_save_FAT(fs) == -1)
+		ret = -1;
+
+	// free all mount state at once, and let the log cleaner and the scrubber see it is gone
+	fs->is_mounted = false;
+	fs_arena_release(fs->arena);
+	fs = NULL;
+	pthread_cond_broadcast(&log_cond);
+	pthread_cond_broadcast(&scrub_cond);
+
+	// close block disk
+	if (block_disk_close() == -1)
+		return -1;
+
+	return ret;
+}
+
+static int fs_info_locked(void)
+{
+	// make sure fs is properly mounted
+	if (!is_mounted(fs))
+		return -1;
+
+	printf("FS Info:\n");
+	printf("total_blk_count=%u\n", fs->geo.block_count);
+	printf("fat_blk_count=%u\n", fs->geo.num_blocks_for_FAT);
+	printf("rdir_blk=%u\n", fs->geo.root_block_idx);
+	printf("data_blk=%u\n", fs->geo.data_block_start_idx);
+	printf("data_blk_count=%u\n", fs->geo.amt_data_blocks);
+	printf("fat_free_ratio=%ld/%u\n", fs->geo.amt_data_blocks - fs->FAT->num_blocks_taken, fs->geo.amt_data_blocks);
+	printf("rdir_free_ratio=%ld/%d\n", FS_FILE_MAX_COUNT - fs->rootDir->num_files, FS_FILE_MAX_COUNT);
+
+	return 0;
+}
+
+static int fs_create_locked(const char *filename)
+{
+	// make sure fs is properly mounted
+	if (!is_mounted(fs))
+		return -1;
+
+	// validate filename
+	if (!fs_validate_filename(filename))
+		return -1;
+
+	// makesure filename does not exist already
+	if (fs_file_num_from_filename(fs, filename) != -2)
+		return -1;
+	
+	// make sure there is space for another file
+	if (fs->rootDir->num_files >= FS_FILE_MAX_COUNT)
+		return -1;
+
+	// get file list pointer
+	file *files_list = fs->rootDir->files;
+
+	// initalize new file instance
+	file new_file = {.file_size = 0};
+	strcpy(new_file.filename, filename);
+
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		// if cell is empty in directory...
+		if (files_list[i].filename[0] == '\0') {
+			// fill cell with new file and return successful
+			files_list[i] = new_file;
+			fs_file_set_first(&fs->geo, &files_list[i], FAT_EOC);
+			fs_file_set_last(fs, &files_list[i], FAT_EOC);
+			fs->rootDir->num_files++;
+			
+			// save updated rootDir
+			if (fs_save_rootDir(fs) == -1)
+				return -1;
+
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+static int fs_delete_locked(const char *filename)
+{
+	// make sure fs is properly mounted
+	if (!is_mounted(fs))
+		return -1;
+
+	file *files_list = fs->rootDir->files;
+	file EMPTY_FILE_CELL = {.filename = "", .file_size = 0, .first_block_idx = FAT16_EOC};
+
+	// get file_num
+	int file_num = fs_file_num_from_filename(fs, filename);
+
+	// invalid filename or couldnt find
+	if (file_num < 0) 
+		return -1;
+
+	// first, free blocks associated with file, the data it did not store yet is dropped
+	fs_chunk_drop(fs, file_num, 0);
+	fs_wbuf_drop(fs, file_num);
+	fs_file_truncate(fs, &files_list[file_num], 0);
+
+	// delete entry in 
+	files_list[file_num] = EMPTY_FILE_CELL;
+	fs->rootDir->num_files--;
+
+	// save updated rootDir
+	if (fs_save_rootDir(fs) == -1)
+		return -1;
+	
+	// save updated FAT
+	if (fs_save_FAT(fs) == -1)
+		return -1;
+
+	return 0;
+}
+
+static int fs_clone_locked(const char *src_filename, const char *dst_filename)
+{
+	char block[BLOCK_SIZE];
+
+	// make sure fs is properly mounted, and describes files by extents
+	if (!is_mounted(fs) || !fs->geo.extents)
+		return -1;
+
+	// the source must exist, and the clone must not
+	int src_num = fs_file_num_from_filename(fs, src_filename);
+	if (src_num < 0 || !fs_validate_filename(dst_filename) || fs_file_num_from_filename(fs, dst_filename) != -2)
+		return -1;
+
+	// make sure there is space for another file
+	if (fs->rootDir->num_files >= FS_FILE_MAX_COUNT)
+		return -1;
+
+	int dst_num = 0;
+	while (fs->rootDir->files[dst_num].filename[0] != '\0')
+		dst_num++;
+
+	// the clone sees what was written through open descriptors
+	if (fs_wbuf_flush_file(fs, src_num) == -1)
+		return -1;
+
+	file *src_file = &fs->rootDir->files[src_num];
+	file *dst_file = &fs->rootDir->files[dst_num];
+	extentList *src_list = &fs->extents[src_num];
+	extentList *dst_list = &fs->extents[dst_num];
+
+	*dst_file = *src_file;
+	memset(dst_file->filename, 0, FS_FILENAME_LEN);
+	strcpy(dst_file->filename, dst_filename);
+	fs->last_block[dst_num] = fs->last_block[src_num];
+
+	if (src_file->flags & FILE_TAIL) {
+		// packed files are small, their slots are copied
+		size_t size = src_file->file_size;
+
+		if (fs_block_read(fs, fs->geo.data_block_start_idx + TAIL_LOC_BLOCK(src_file->tail_loc), block) == -1) {
+			memset(dst_file, 0, sizeof(*dst_file));
+			return -1;
+		}
+		dst_file->flags &= ~FILE_TAIL;
+		dst_file->tail_loc = 0;
+		dst_file->file_size = 0;
+		if (fs_tail_write(fs, dst_file, 0, block + TAIL_LOC_SLOT(src_file->tail_loc) * TAIL_SLOT_SIZE, size)
+			!= (int) size) {
+			memset(dst_file, 0, sizeof(*dst_file));
+			return -1;
+		}
+	} else if (src_list->count) {
+		// every block of the source gains a reference, none may overflow
+		if (fs_refs_create(fs) == -1 || fs_extent_reserve(fs, dst_list, src_list->count) == -1
+			|| fs_extent_room(fs, dst_num, fs_extent_disk_count(src_list)) == -1) {
+			memset(dst_file, 0, sizeof(*dst_file));
+			return -1;
+		}
+		for (size_t i = 0; i < src_list->count; i++) {
+			for (uint32_t j = 0; j < src_list->extents[i].length; j++) {
+				if (fs->refs[src_list->extents[i].start + j] == UINT16_MAX) {
+					memset(dst_file, 0, sizeof(*dst_file));
+					return -1;
+				}
+			}
+		}
+
+		for (size_t i = 0; i < src_list->count; i++) {
+			for (uint32_t j = 0; j < src_list->extents[i].length; j++)
+				fs->refs[src_list->extents[i].start + j]++;
+		}
+		memcpy(dst_list->extents, src_list->extents, src_list->count * sizeof(extent));
+		dst_list->count = src_list->count;
+		dst_list->dirty = true;
+		fs->extents_dirty = true;
+		fs->refs_dirty = true;
+	}
+
+	fs->rootDir->num_files++;
+
+	// the extents and reference counts are saved before the entry that uses them
+	if (fs_save_FAT(fs) == -1 || fs_save_rootDir(fs) == -1)
+		return -1;
+
+	return 0;
+}
+
+static int fs_snapshot_create_locked(const char *name)
+{
+	char block[BLOCK_SIZE];
+	size_t num_extents = 0;
+	size_t num_packed = 0;
+	int snapshot = 0;
+	int meta_idx = -1;
+
+	// make sure fs is properly mounted, and describes files by extents
+	if (!is_mounted(fs) || !fs->geo.extents)
+		return -1;
+
+	if (!fs_validate_filename(name) || fs_snapshot_find(fs, name) != -1)
+		return -1;
+
+	// the snapshot holds what was written through open descriptors
+	if (fs_wbuf_flush_file(fs, -1) == -1)
+		return -1;
+
+	if (fs_refs_create(fs) == -1 || fs_snapshot_table_create(fs) == -1)
+		return -1;
+
+	while (snapshot < FS_SNAPSHOT_MAX_COUNT && fs->snapshots[snapshot].name[0] != '\0')
+		snapshot++;
+	if (snapshot == FS_SNAPSHOT_MAX_COUNT)
+		return -1;
+
+	// size the chain, every block of a file gains a reference and none may overflow
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		extentList *list = &fs->extents[i];
+
+		if (fs->rootDir->files[i].filename[0] == '\0')
+			continue;
+
+		if (fs->rootDir->files[i].flags & FILE_TAIL) {
+			num_extents++;
+			num_packed++;
+			continue;
+		}
+
+		num_extents += fs_extent_disk_count(list);
+		for (size_t j = 0; j < list->count; j++) {
+			for (uint32_t k = 0; k < list->extents[j].length; k++) {
+				if (fs->refs[list->extents[j].start + k] == UINT16_MAX)
+					return -1;
+			}
+		}
+	}
+
+	size_t num_blocks = SNAPSHOT_HEADER_BLOCKS + (num_extents + EXTENTS_PER_BLOCK - 1) / EXTENTS_PER_BLOCK;
+	if (fs->FAT->num_blocks_taken + num_blocks + num_packed > fs->geo.amt_data_blocks)
+		return -1;
+
+	char *table = calloc(num_blocks, BLOCK_SIZE);
+	if (!table)
+		return -1;
+
+	file *files = (file *) table;
+	uint32_t *counts = (uint32_t *) (table + BLOCK_SIZE);
+	diskExtent *ext = (diskExtent *) (table + SNAPSHOT_HEADER_BLOCKS * BLOCK_SIZE);
+
+	memcpy(files, fs->rootDir->files, BLOCK_SIZE);
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		extentList *list = &fs->extents[i];
+		size_t pos[2] = {0, 0};
+
+		if (files[i].filename[0] == '\0')
+			continue;
+
+		// packed files are rewritten in place, the snapshot gets a block of their data
+		if (files[i].flags & FILE_TAIL) {
+			uint32_t tail_loc = files[i].tail_loc;
+			int block_idx = fs_extent_alloc_block(fs, 0);
+			if (block_idx == -1)
+				goto undo;
+
+			if (fs_block_read(fs, fs->geo.data_block_start_idx + TAIL_LOC_BLOCK(tail_loc), block) == -1) {
+				fs_block_release(fs, block_idx);
+				goto undo;
+			}
+			memmove(block, block + TAIL_LOC_SLOT(tail_loc) * TAIL_SLOT_SIZE, files[i].file_size);
+			memset(block + files[i].file_size, 0, BLOCK_SIZE - files[i].file_size);
+			if (fs_block_write(fs, fs->geo.data_block_start_idx + block_idx, block) == -1) {
+				fs_block_release(fs, block_idx);
+				goto undo;
+			}
+
+			files[i].flags &= ~FILE_TAIL;
+			files[i].tail_loc = 0;
+			*ext++ = (diskExtent){.start = block_idx, .length = 1};
+			counts[i] = 1;
+			continue;
+		}
+
+		counts[i] = fs_extent_disk_count(list);
+		for (size_t j = 0; j < counts[i]; j++)
+			*ext++ = fs_extent_disk_next(list, pos);
+	}
+
+	meta_idx = fs_meta_create(fs, num_blocks);
+	if (meta_idx == -1 || fs_meta_save(fs, meta_idx, table) == -1)
+		goto undo;
+	free(table);
+
+	// references are taken last, a failure above has none to give back
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		extentList *list = &fs->extents[i];
+
+		if (fs->rootDir->files[i].filename[0] == '\0' || (fs->rootDir->files[i].flags & FILE_TAIL))
+			continue;
+
+		for (size_t j = 0; j < list->count; j++) {
+			for (uint32_t k = 0; k < list->extents[j].length; k++)
+				fs->refs[list->extents[j].start + k]++;
+		}
+	}
+	fs->refs_dirty = true;
+
+	// the chain and the reference counts are saved before the table points to them
+	fs->snapshots[snapshot] = (snapshotEntry){.meta_idx = meta_idx, .num_blocks = num_blocks, .created = time(NULL)};
+	strcpy(fs->snapshots[snapshot].name, name);
+	if (fs_save_FAT(fs) == -1 || fs_snapshot_save_table(fs) == -1)
+		return -1;
+
+	return 0;
+
+undo:
+	// release the chain and the copies of the packed files made so far
+	if (meta_idx != -1) {
+		uint32_t block_idx = meta_idx;
+
+		while (block_idx != FAT_EOC) {
+			uint32_t next_block_idx = fs_fat_get(fs, block_idx);
+			fs_fat_set(fs, block_idx, 0);
+			block_idx = next_block_idx;
+		}
+	}
+	ext = (diskExtent *) (table + SNAPSHOT_HEADER_BLOCKS * BLOCK_SIZE);
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if ((fs->rootDir->files[i].flags & FILE_TAIL) && counts[i] == 1)
+			fs_block_release(fs, ext->start);
+		ext += counts[i];
+	}
+	free(table);
+	return -1;
+}
+
+static int fs_snapshot_delete_locked(const char *name)
+{
+	// make sure fs is properly mounted
+	if (!is_mounted(fs))
+		return -1;
+
+	int snapshot = fs_snapshot_find(fs, name);
+	if (snapshot == -1)
+		return -1;
+
+	// files of the snapshot must not be open
+	for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+		if (fs->open_files[i].file_num >= FS_FILE_MAX_COUNT && fs->snapshot_of[i] == snapshot)
+			return -1;
+	}
+
+	char *table = fs_snapshot_load(fs, snapshot);
+	if (!table)
+		return -1;
+
+	// the table no longer points to the snapshot before its blocks are given back
+	uint32_t block_idx = fs->snapshots[snapshot].meta_idx;
+	memset(&fs->snapshots[snapshot], 0, sizeof(snapshotEntry));
+	if (fs_snapshot_save_table(fs) == -1) {
+		free(table);
+		return -1;
+	}
+
+	file *files = (file *) table;
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		size_t num_extents;
+		diskExtent *ext = fs_snapshot_extents(table, i, &num_extents);
+
+		for (size_t j = 0; files[i].filename[0] != '\0' && j < num_extents; j++) {
+			for (uint32_t k = 0; ext[j].start && k < ext[j].length; k++)
+				fs_block_release(fs, ext[j].start + k);
+		}
+	}
+	free(table);
+
+	while (block_idx != FAT_EOC) {
+		uint32_t next_block_idx = fs_fat_get(fs, block_idx);
+		fs_fat_set(fs, block_idx, 0);
+		block_idx = next_block_idx;
+	}
+
+	return fs_save_FAT(fs);
+}
+
+static int fs_snapshot_list_locked(struct fs_snapshot_info *snapshots, size_t count)
+{
+	int num_snapshots = 0;
+
+	// make sure fs is properly mounted
+	if (!is_mounted(fs) || (!snapshots && count))
+		return -1;
+
+	for (int i = 0; fs->snapshots && i < FS_SNAPSHOT_MAX_COUNT; i++) {
+		snapshotEntry *entry = &fs->snapshots[i];
+
+		if (entry->name[0] == '\0')
+			continue;
+
+		if ((size_t) num_snapshots < count) {
+			file files[FS_FILE_MAX_COUNT];
+			uint32_t num_files = 0;
+
+			// the directory of the snapshot is the first block of its chain
+			if (fs_block_read(fs, fs->geo.data_block_start_idx + entry->meta_idx, files) == -1)
+				return -1;
+			for (int j = 0; j < FS_FILE_MAX_COUNT; j++)
+				num_files += files[j].filename[0] != '\0';
+
+			snapshots[num_snapshots] = (struct fs_snapshot_info){.created = entry->created, .files = num_files};
+			strcpy(snapshots[num_snapshots].name, entry->name);
+		}
+		num_snapshots++;
+	}
+
+	return num_snapshots;
+}
+
+static int fs_snapshot_open_locked(const char *name, const char *filename)
+{
+	// make sure fs is properly mounted
+	if (!is_mounted(fs) || !fs_validate_filename(filename))
+		return -1;
+
+	// check if max amount of open files has been reached
+	if (fs->num_open_files >= FS_OPEN_MAX_COUNT)
+		return -1;
+
+	int snapshot = fs_snapshot_find(fs, name);
+	if (snapshot == -1)
+		return -1;
+
+	int fd = 0;
+	while (fs->open_files[fd].file_num != -1)
+		fd++;
+
+	char *table = fs_snapshot_load(fs, snapshot);
+	if (!table)
+		return -1;
+
+	file *files = (file *) table;
+	int snapshot_file_num = 0;
+	while (snapshot_file_num < FS_FILE_MAX_COUNT && strcmp(files[snapshot_file_num].filename, filename))
+		snapshot_file_num++;
+	if (snapshot_file_num == FS_FILE_MAX_COUNT) {
+		free(table);
+		return -1;
+	}
+
+	// the file takes the entry and the extent list reserved for the descriptor
+	int file_num = SNAPSHOT_FILE(fd);
+	extentList *list = &fs->extents[file_num];
+	size_t num_extents;
+	diskExtent *ext = fs_snapshot_extents(table, snapshot_file_num, &num_extents);
+	uint64_t block_num = 0;
+
+	list->count = 0;
+	for (size_t i = 0; i < num_extents; i++) {
+		if (ext[i].start && fs_extent_append(fs, list, block_num, ext[i].start, ext[i].length) == -1) {
+			free(table);
+			return -1;
+		}
+		block_num += ext[i].length;
+	}
+	fs->rootDir->files[file_num] = files[snapshot_file_num];
+	free(table);
+
+	fs->snapshot_of[fd] = snapshot;
+	fs->open_files[fd] = (openFile){.fd = fd, .file_num = file_num, .flags = 0, .file_offset = 0,
+		.wbuf = {.block_idx = -1}, .cursor = {.block_idx = FAT_EOC}};
+	fs->num_open_files++;
+
+	return fd;
+}
+
+/** Truncate a file and flush the metadata it touched
+ * @fs: pointer to filesystem
+ * @file_num: file number of the file to truncate
+ * @length: new file size in bytes
+ * 
+ * returns: 0 on success, -1 otherwise
+*/
+int fs_truncate_file_num(FS *fs, int file_num, size_t length) {
+	file *target_file = &fs->rootDir->files[file_num];
+
+	if (fs_wbuf_flush_file(fs, file_num) == -1)
+		return -1;
+
+	if ((target_file->flags & FILE_COMPRESSED ? fs_chunk_truncate(fs, file_num, length)
+		 : fs_file_truncate(fs, target_file, length)) == -1)
+		return -1;
+
+	// only the FAT blocks holding released entries are written
+	if (fs->FAT->dirty && fs_save_FAT(fs) == -1)
+		return -1;
+
+	return fs_save_rootDir(fs);
+}
+
+static int fs_truncate_locked(const char *filename, size_t length)
+{
+	// make sure fs is properly mounted
+	if (!is_mounted(fs))
+		return -1;
+
+	// get file_num
+	int file_num = fs_file_num_from_filename(fs, filename);
+	if (file_num < 0)
+		return -1;
+
+	return fs_truncate_file_num(fs, file_num, length);
+}
+
+static int fs_ftruncate_locked(int fd, size_t length)
+{
+	// make sure fs is properly mounted
+	if (!is_mounted(fs))
+		return -1;
+
+	// get file number from fd, files of snapshots are read-only
+	int file_num = fs_file_num_from_fd(fs, fd);
+	if (file_num == -1 || file_num >= FS_FILE_MAX_COUNT)
+		return -1;
+
+	return fs_truncate_file_num(fs, file_num, length);
+}
+
+static int fs_ls_locked(void)
+{
+	// make sure fs is properly mounted
+	if (!is_mounted(fs))
+		return -1;
+
+	file *files_list = fs->rootDir->files;
+
+	// print header
+	printf("FS Ls:\n");
+
+	// print each file information
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		uint32_t first_block_idx = fs_file_first(&fs->geo, &files_list[i]);
+
+		if (fs->geo.extents)
+			first_block_idx = fs->extents[i].count ? fs->extents[i].extents[0].start : FAT_EOC;
+
+		// file is not empty...
+		if (files_list[i].filename[0] != '\0')
+			printf("file: %s, size: %" PRIu64 ", data_blk: %d\n", files_list[i].filename, fs_file_size(&files_list[i]),
+				   (int) first_block_idx);
+	}
+
+	return 0;
+}
+
+static int fs_open_flags_locked(const char *filename, int flags)
+{
+	// make sure fs is properly mounted
+	if (!is_mounted(fs))
+		return -1;
+
+	// check if max amount of open files has been reached
+	if (fs->num_open_files >= FS_OPEN_MAX_COUNT)
+		return -1;
+	
+	// find open file descriptor
+	int fd = -1;
+	for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+		// file_num of -1 means fd is available to use
+		if (fs->open_files[i].file_num == -1) {
+			fd = i;
+			break;
+		}
+	}
+
+	// ERROR: no file descriptor available
+	if (fd == -1)
+		return -1;
+
+	// get file number
+	int file_num = fs_file_num_from_filename(fs, filename);
+	if (file_num < 0)
+		return -1;
+
+	// set open file
+	fs->open_files[fd] = (openFile){.fd = fd, .file_num = file_num, .flags = flags, .file_offset = 0, .wbuf = {.block_idx = -1},
+		.cursor = {.block_idx = FAT_EOC}};
+	fs->num_open_files++;
+
+	return fd;
+}
+
+static int fs_close_locked(int fd)
+{
+	// make sure fs is properly mounted
+	if (!is_mounted(fs))
+		return -1;
+
+	// make sure file descriptor is valid
+	if (!fs_validate_fd(fs, fd))
+		return -1;
+
+	// write out buffered data and the metadata it depends on
+	openFile *open_file = &fs->open_files[fd];
+	int ret = fs_wbuf_flush(fs, open_file);
+	if (ret == 0)
+		ret = fs_chunk_flush(fs, open_file->file_num);
+	if (ret == 0 && fs->FAT->dirty)
+		ret = fs_save_FAT(fs);
+	if (ret == 0)
+		ret = fs_save_rootDir(fs);
+
+	// files of snapshots only live as long as their descriptor
+	if (open_file->file_num >= FS_FILE_MAX_COUNT) {
+		memset(&fs->rootDir->files[open_file->file_num], 0, sizeof(file));
+		fs->extents[open_file->file_num].count = 0;
+		fs_chunk_drop(fs, open_file->file_num, 0);
+	}
+
+	// close file descriptor
+	fs_buffer_put(fs, open_file->wbuf.data);
+	*open_file = (openFile){.file_num = -1, .wbuf = {.block_idx = -1}};
+	fs->num_open_files--;
+
+	if (ret == -1)
+		return -1;
+
+	return 0;
+}
+
+static int64_t fs_stat64_locked(int fd)
+{
+	// make sure fs is properly mounted
+	if (!is_mounted(fs))
+		return -1;
+
+	// get file number from fd
+	int file_num = fs_file_num_from_fd(fs, fd);
+	if (file_num == -1)
+		return -1;
+
+	// return file size
+	return fs_file_size(&fs->rootDir->files[file_num]);
+}
+
+static int fs_stat_locked(int fd)
+{
+	int64_t size = fs_stat64_locked(fd);
+
+	// the size would not survive the conversion
+	if (size > INT_MAX)
+		return -1;
+
+	return size;
+}
+
+static int fs_lseek_locked(int fd, size_t offset)
+{
+	// make sure fs is properly mounted
+	if (!is_mounted(fs))
+		return -1;
+
+	// invalid fd
+	if (!fs_validate_fd(fs, fd))
+		return -1;
+
+	// buffered writes belong to the old offset
+	if (fs_wbuf_flush(fs, &fs->open_files[fd]) == -1)
+		return -1;
+
+	// set offset, seeking past the end of the file is allowed
+	fs->open_files[fd].file_offset = offset;
+
+	return 0;
+}
+
+/** Find the next data or hole region of a file
+ * @fs: pointer to filesystem
+ * @fd: file descriptor of open file in question
+ * @offset: file offset to start looking from
+ * @want_data: look for data if true, for a hole otherwise
+ * 
+ * returns: offset of the region, -1 if @fd is invalid, if @offset is past the
+ * 			end of the file, or if there is no data after @offset
+*/
+int64_t fs_seek_region(FS *fs, int fd, size_t offset, bool want_data) {
+	int file_num = fs_file_num_from_fd(fs, fd);
+	if (file_num == -1)
+		return -1;
+
+	file *target_file = &fs->rootDir->files[file_num];
+	uint64_t size = fs_file_size(target_file);
+	if (offset >= size)
+		return -1;
+
+	// buffered blocks are already allocated, only their data is pending
+	if (fs_wbuf_flush_file(fs, file_num) == -1)
+		return -1;
+
+	// packed files are never sparse
+	if (target_file->flags & FILE_TAIL)
+		return want_data ? offset : size;
+
+	// walk the allocated blocks (or extents) in logical order
+	extentList *list = fs->geo.extents ? &fs->extents[file_num] : NULL;
+	uint32_t block_idx = fs_file_first(&fs->geo, target_file);
+	size_t next_block_num = 0;
+	for (size_t i = 0; list ? i < list->count : block_idx != FAT_EOC; i++) {
+		size_t block_num, num_blocks;
+
+		if (list) {
+			block_num = list->extents[i].block_num;
+			num_blocks = list->extents[i].length;
+		} else {
+			block_num = next_block_num + fs_hole_skip(fs, block_idx);
+			num_blocks = 1;
+			block_idx = fs_fat_get(fs, block_idx);
+			stats.chain_walk_steps++;
+		}
+
+		// the blocks a compressed chunk takes hold all of its data
+		if (target_file->flags & FILE_COMPRESSED)
+			num_blocks = (block_num + num_blocks + CHUNK_BLOCKS - 1) / CHUNK_BLOCKS * CHUNK_BLOCKS - block_num;
+
+		size_t block_start = block_num * BLOCK_SIZE;
+		size_t block_end = block_start + num_blocks * BLOCK_SIZE;
+		next_block_num = block_num + num_blocks;
+
+		if (want_data && offset < block_end)
+			return max_size(offset, block_start);
+
+		if (!want_data && offset < block_start)
+			return offset;
+
+		if (!want_data && offset < block_end)
+			offset = block_end;
+	}
+
+	// the end of the file counts as a hole
+	if (want_data)
+		return -1;
+
+	return min_size(offset, size);
+}
+
+static int64_t fs_seek_data_locked(int fd, size_t offset)
+{
+	// make sure fs is properly mounted
+	if (!is_mounted(fs))
+		return -1;
+
+	int64_t data_offset = fs_seek_region(fs, fd, offset, true);
+	if (data_offset == -1)
+		return -1;
+
+	fs->open_files[fd].file_offset = data_offset;
+	return data_offset;
+}
+
+static int64_t fs_seek_hole_locked(int fd, size_t offset)
+{
+	// make sure fs is properly mounted
+	if (!is_mounted(fs))
+		return -1;
+
+	int64_t hole_offset = fs_seek_region(fs, fd, offset, false);
+	if (hole_offset == -1)
+		return -1;
+
+	fs->open_files[fd].file_offset = hole_offset;
+	return hole_offset;
+}
+
+static ssize_t fs_write_locked(int fd, void *buf, size_t count)
+{
+	// make sure fs is properly mounted
+	if (!is_mounted(fs))
+		return -1;
+
+	// number of bytes already written from @buf
+	size_t bytes_written = 0;
+
+	// set when the disk fails a write, as opposed to running out of space
+	bool io_error = false;
+
+	// block sized buffer
+	char block[BLOCK_SIZE];
+
+	// get target file, files of snapshots are read-only
+	int file_num = fs_file_num_from_fd(fs, fd);
+	if (file_num == -1 || file_num >= FS_FILE_MAX_COUNT || !buf)
+		return -1;
+	
+	// get open file descriptor
+	openFile *open_file = &fs->open_files[fd];
+	// get target file
+	file *target_file = &fs->rootDir->files[file_num];
+
+	// keep writes through other descriptors ordered with this one
+	for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+		if (i != fd && fs->open_files[i].file_num == file_num && fs_wbuf_flush(fs, &fs->open_files[i]) == -1)
+			return -1;
+	}
+
+	// appenders reserve their range at the current end of the file
+	if (open_file->flags & FS_O_APPEND)
+		open_file->file_offset = fs_file_size(target_file);
+
+	// small writes to regular files are combined into whole blocks,
+	// metadata is saved when the buffer is flushed
+	if (!(open_file->flags & FS_O_NOBUF) && count < BLOCK_SIZE && !(target_file->flags & (FILE_TAIL | FILE_COMPRESSED))
+		&& !fs_tail_eligible(fs, target_file, open_file->file_offset + count))
+		return fs_wbuf_write(fs, open_file, target_file, buf, count);
+
+	// larger writes go straight to disk after what is already buffered
+	if (fs_wbuf_flush(fs, open_file) == -1)
+		return -1;
+
+	// small files live in slots of shared tail blocks
+	if (fs_tail_eligible(fs, target_file, open_file->file_offset + count)) {
+		bytes_written = fs_tail_write(fs, target_file, open_file->file_offset, buf, count);
+		open_file->file_offset += bytes_written;
+	} else if (target_file->flags & FILE_COMPRESSED) {
+		// compressed files are written through the chunk cache
+		bytes_written = fs_chunk_write(fs, open_file, target_file, buf, count);
+	} else if (target_file->flags & FILE_TAIL && fs_tail_promote(fs, target_file) == -1) {
+		// outgrew its slots but there is no block to move it to
+		return 0;
+	}
+
+	// loop until bytes are written
+	while (bytes_written < count) {
+		size_t block_num = open_file->file_offset / BLOCK_SIZE;
+		size_t block_offset = open_file->file_offset % BLOCK_SIZE;
+		bool fresh;
+
+		// packed file that could not get bigger slots, or compressed file short of room
+		if (target_file->flags & (FILE_TAIL | FILE_COMPRESSED))
+			break;
+
+		// whole blocks go straight from @buf to disk, one access per run of consecutive blocks
+		if (block_offset == 0 && count - bytes_written >= BLOCK_SIZE) {
+			size_t run, max_blocks = (count - bytes_written) / BLOCK_SIZE;
+			uint32_t fingerprints[DEDUP_BATCH_BLOCKS];
+			bool dedup = fs_dedup_enabled(fs);
+
+			// a block that is already on disk is mapped instead of written, the others are written in runs
+			if (dedup) {
+				int ret = fs_dedup_block(fs, file_num, block_num, (char *) buf + bytes_written, &fingerprints[0]);
+				if (ret == -1)
+					break;
+				if (ret == 1) {
+					bytes_written += BLOCK_SIZE;
+					open_file->file_offset += BLOCK_SIZE;
+					if (open_file->file_offset > fs_file_size(target_file))
+						fs_file_set_size(fs, target_file, open_file->file_offset);
+					continue;
+				}
+				max_blocks = fs_dedup_batch(fs, (char *) buf + bytes_written, min_size(max_blocks, DEDUP_BATCH_BLOCKS),
+											fingerprints);
+			}
+
+			int block_idx = fs_file_run(fs, open_file, target_file, block_num, max_blocks, true, &run);
+			if (block_idx != -1)
+				block_idx = fs_block_redirect_run(fs, file_num, block_num, block_idx, &run);
+			if (block_idx == -1)
+				break;
+
+			if (fs_block_writev(fs, fs->geo.data_block_start_idx + block_idx, run, (char *) buf + bytes_written) == -1) {
+				io_error = true;
+				break;
+			}
+			for (size_t k = 0; dedup && k < run; k++)
+				fs_dedup_insert(fs, fingerprints[k], block_idx + k);
+			bytes_written += run * BLOCK_SIZE;
+			open_file->file_offset += run * BLOCK_SIZE;
+			if (open_file->file_offset > fs_file_size(target_file))
+				fs_file_set_size(fs, target_file, open_file->file_offset);
+			continue;
+		}
+
+		// find (or allocate) the block holding the current offset
+		int block_idx = fs_file_block(fs, target_file, block_num, true, &fresh, &open_file->cursor);
+		if (block_idx == -1)
+			break;
+
+		// calculate number of bytes to be written in this block
+		size_t num_bytes_to_write = min_size(count - bytes_written, BLOCK_SIZE - block_offset);
+
+		// first read block we are about to partially overwrite
+		if (num_bytes_to_write < BLOCK_SIZE) {
+			if (fresh)
+				memset(block, 0, BLOCK_SIZE);
+			else if (fs_block_read(fs, fs->geo.data_block_start_idx + block_idx, block) == -1)
+				break;
+		}
+
+		// the new contents go elsewhere if the block is shared, or to the head of the log on log disks
+		block_idx = fs_block_redirect(fs, file_num, block_num, block_idx, 0);
+		if (block_idx == -1)
+			break;
+
+		// bytes to block sized buffer
+		memcpy(block + block_offset, (char *) buf + bytes_written, num_bytes_to_write);
+
+		// write to block
+		if (fs_block_write(fs, fs->geo.data_block_start_idx + block_idx, block) == -1) {
+			io_error = true;
+			break;
+		}
+
+		// update bytes written and file offset
+		bytes_written += num_bytes_to_write;
+		open_file->file_offset += num_bytes_to_write;
+
+		// update file size if necessary
+		if (open_file->file_offset > fs_file_size(target_file))
+			fs_file_set_size(fs, target_file, open_file->file_offset);
+	}
+
+	// a write that failed before any byte reached the disk is an error, a later one shortens the count
+	ssize_t ret = io_error && bytes_written == 0 ? -1 : (ssize_t) bytes_written;
+
+	// log disks save their metadata at checkpoints, once enough blocks have been written
+	if (fs->geo.log && fs->log_pending < LOG_CHECKPOINT_BLOCKS)
+		return ret;
+
+	// save updated FAT if blocks were allocated or released
+	if (fs->FAT->dirty && fs_save_FAT(fs) == -1)
+		return -1;
+
+	// save updated rootDir to disk
+	if (bytes_written > 0 && fs_save_rootDir(fs) == -1)
+		return -1;
+
+	return ret;
+}
+
+static ssize_t fs_read_locked(int fd, void *buf, size_t count)
+{
+	// make sure fs is properly mounted
+	if (!is_mounted(fs))
+		return -1;
+
+	// number of bytes already read into @buf
+	size_t bytes_read = 0;
+
+	// block sized buffer
+	char block[BLOCK_SIZE];
+
+	// get target file
+	int file_num = fs_file_num_from_fd(fs, fd);
+	if (file_num == -1 || !buf)
+		return -1;
+
+	// get open file descriptor
+	openFile *open_file = &fs->open_files[fd];
+
+	// get target file
+	file *target_file = &fs->rootDir->files[file_num];
+
+	// compressed files are read through the chunk cache, which holds the data written last
+	if (target_file->flags & FILE_COMPRESSED)
+		return fs_chunk_read(fs, open_file, target_file, buf, count);
+
+	// see data buffered by any descriptor open on this file
+	if (fs_wbuf_flush_file(fs, file_num) == -1)
+		return -1;
+
+	uint64_t size = fs_file_size(target_file);
+
+	// packed files are a single run of slots in a tail block
+	if (target_file->flags & FILE_TAIL) {
+		if (open_file->file_offset >= size)
+			return 0;
+
+		uint32_t tail_loc = target_file->tail_loc;
+		size_t num_bytes_to_copy = min_size(count, size - open_file->file_offset);
+
+		if (fs_block_read(fs, fs->geo.data_block_start_idx + TAIL_LOC_BLOCK(tail_loc), block) == -1)
+			return -1;
+		memcpy(buf, block + TAIL_LOC_SLOT(tail_loc) * TAIL_SLOT_SIZE + open_file->file_offset, num_bytes_to_copy);
+
+		open_file->file_offset += num_bytes_to_copy;
+		return num_bytes_to_copy;
+	}
+
+	// once a run cannot be read, blocks are read one at a time to find the first bad one
+	bool run_failed = false;
+
+	while (bytes_read < count && open_file->file_offset < size) {
+		size_t block_num = open_file->file_offset / BLOCK_SIZE;
+		size_t block_offset = open_file->file_offset % BLOCK_SIZE;
+		size_t whole_blocks = min_size(count - bytes_read, size - open_file->file_offset) / BLOCK_SIZE;
+
+		// whole blocks are read straight into @buf, one access per run of consecutive blocks
+		if (block_offset == 0 && whole_blocks && !run_failed) {
+			size_t run;
+			int block_idx = fs_file_run(fs, open_file, target_file, block_num, whole_blocks, false, &run);
+
+			if (block_idx != -1) {
+				run_failed = fs_block_readv(fs, fs->geo.data_block_start_idx + block_idx, run, (char *) buf + bytes_read) == -1;
+				if (run_failed)
+					continue;
+				bytes_read += run * BLOCK_SIZE;
+				open_file->file_offset += run * BLOCK_SIZE;
+				continue;
+			}
+		}
+
+		// get block holding the current offset
+		int block_idx = fs_file_block(fs, target_file, block_num, false, NULL, &open_file->cursor);
+
+		// read block, holes read back as zeros, and a bad block ends the read before it
+		if (block_idx == -1)
+			memset(block, 0, BLOCK_SIZE);
+		else if (fs_block_read(fs, fs->geo.data_block_start_idx + block_idx, block) == -1)
+			return bytes_read ? (ssize_t) bytes_read : -1;
+
+		// find number of bytes after offset and before either EOF or end of block
+		size_t valid_bytes_in_block = min_size(BLOCK_SIZE - block_offset, size - open_file->file_offset);
+
+		// copy the smaller of the 2:
+		// 1) number of valid bytes left in block
+		// 2) count - amount of bytes already read
+		size_t num_bytes_to_copy = min_size(count - bytes_read, valid_bytes_in_block);
+
+		// fill string buffer
+		memcpy((char *) buf + bytes_read, block + block_offset, num_bytes_to_copy);
+
+		// update count to contain how many bytes are left to be read
+		bytes_read += num_bytes_to_copy;
+		open_file->file_offset += num_bytes_to_copy;
+	}
+
+	// end reading
+	return bytes_read;
+}
+
+static int fs_sync_locked(void)
+{
+	// make sure fs is properly mounted
+	if (!is_mounted(fs))
+		return -1;
+
+	if (fs_sync_all(fs) == -1)
+		return -1;
+
+	// let the backend make it durable
+	return block_disk_sync();
+}
+
+static int fs_tailpack_locked(int enable)
+{
+	// make sure fs is properly mounted
+	if (!is_mounted(fs))
+		return -1;
+
+	if (enable)
+		fs->superblock->features |= FS_FEATURE_TAILPACK;
+	else
+		fs->superblock->features &= ~FS_FEATURE_TAILPACK;
+
+	return fs_save_superblock(fs);
+}
+
+static int fs_dedup_locked(int enable)
+{
+	// make sure fs is properly mounted, and describes files by extents
+	if (!is_mounted(fs) || !fs->geo.extents)
+		return -1;
+
+	if (enable) {
+		// blocks shared by deduplication are counted in the reference count table
+		if (fs_dedup_setup(fs) == -1)
+			return -1;
+		fs->superblock->features |= FS_FEATURE_DEDUP;
+	} else {
+		fs->superblock->features &= ~FS_FEATURE_DEDUP;
+	}
+
+	return fs_save_superblock(fs);
+}
+
+static int fs_dedup_scan_locked(struct fs_dedup_report *report)
+{
+	// make sure fs is properly mounted, and describes files by extents
+	if (!report || !is_mounted(fs) || !fs->geo.extents)
+		return -1;
+
+	// the scan sees what was written through open descriptors
+	if (fs_wbuf_flush_file(fs, -1) == -1 || fs_dedup_setup(fs) == -1)
+		return -1;
+
+	char *blocks = malloc(DEDUP_BATCH_BLOCKS * BLOCK_SIZE);
+	uint64_t *used = calloc((fs->geo.amt_data_blocks + 63) / 64, sizeof(uint64_t));
+	uint64_t mismatches = stats.dedup_mismatches;
+	int ret = blocks && used ? 0 : -1;
+
+	memset(report, 0, sizeof(*report));
+	for (int file_num = 0; file_num < FS_FILE_MAX_COUNT && ret == 0; file_num++) {
+		extentList *list = &fs->extents[file_num];
+		uint64_t block_num = 0;
+
+		// the extents change as blocks are remapped, so the scan goes by logical block
+		while (ret == 0) {
+			ssize_t i = fs_extent_find(list, block_num);
+
+			if (i < 0 || block_num >= list->extents[i].block_num + list->extents[i].length) {
+				if ((size_t) (i + 1) >= list->count)
+					break;
+				block_num = list->extents[i + 1].block_num;
+				continue;
+			}
+
+			// read the extent in batches of consecutive blocks
+			uint32_t block_idx = list->extents[i].start + (block_num - list->extents[i].block_num);
+			size_t run = min_size(list->extents[i].block_num + list->extents[i].length - block_num,
+								  DEDUP_BATCH_BLOCKS);
+			if (fs_block_readv(fs, fs->geo.data_block_start_idx + block_idx, run, blocks) == -1) {
+				ret = -1;
+				break;
+			}
+
+			for (size_t k = 0; k < run && ret == 0; k++) {
+				char *data = blocks + k * BLOCK_SIZE;
+				uint32_t fingerprint = fs_dedup_hash(data);
+				int match = fs_dedup_find(fs, fingerprint, data);
+
+				report->blocks_scanned++;
+				if (match == -1 || (uint32_t) match == block_idx + k) {
+					fs_dedup_insert(fs, fingerprint, block_idx + k);
+				} else if (fs_dedup_map(fs, file_num, block_num + k, match) == -1) {
+					ret = -1;
+				} else {
+					report->blocks_deduplicated++;
+				}
+			}
+			block_num += run;
+		}
+	}
+
+	// count the blocks the files map, and the distinct ones among them
+	for (int file_num = 0; file_num < FS_FILE_MAX_COUNT && ret == 0; file_num++) {
+		extentList *list = &fs->extents[file_num];
+
+		for (size_t i = 0; i < list->count; i++) {
+			for (uint32_t j = 0; j < list->extents[i].length; j++) {
+				uint32_t block_idx = list->extents[i].start + j;
+
+				report->logical_blocks++;
+				if (!fs_bit_test(used, block_idx)) {
+					fs_bit_set(used, block_idx);
+					report->physical_blocks++;
+				}
+			}
+		}
+	}
+	report->mismatches = stats.dedup_mismatches - mismatches;
+
+	free(blocks);
+	free(used);
+
+	// the released duplicates and the new references are saved together
+	if (ret == 0 && fs_save_FAT(fs) == -1)
+		return -1;
+
+	return ret;
+}
+
+static int fs_compress_locked(const char *filename, int enable)
+{
+	// make sure fs is properly mounted, and describes files by extents
+	if (!is_mounted(fs) || !fs->geo.extents)
+		return -1;
+
+	// get file_num
+	int file_num = fs_file_num_from_filename(fs, filename);
+	if (file_num < 0)
+		return -1;
+
+	// only an empty file changes how its data is stored
+	file *target_file = &fs->rootDir->files[file_num];
+	if (!(target_file->flags & FILE_COMPRESSED) != !enable && fs_file_size(target_file) != 0)
+		return -1;
+
+	if (enable)
+		target_file->flags |= FILE_COMPRESSED;
+	else
+		target_file->flags &= ~FILE_COMPRESSED;
+
+	return fs_save_rootDir(fs);
+}
+
+static int fs_checksums_locked(int enable)
+{
+	// make sure fs is properly mounted
+	if (!is_mounted(fs))
+		return -1;
+
+	return enable ? fs_checksum_setup(fs) : fs_checksum_release(fs);
+}
+
+static int fs_scrub_locked(size_t max_blocks, struct fs_scrub_report *report)
+{
+	// make sure fs is properly mounted, and has checksums to verify blocks against
+	if (!is_mounted(fs) || !fs->checksums.table)
+		return -1;
+
+	return fs_scrub_blocks(fs, max_blocks, report);
+}
+
+static int fs_scrub_rate_locked(size_t blocks_per_sec)
+{
+	// make sure fs is properly mounted, and has checksums to verify blocks against
+	if (!is_mounted(fs) || !fs->checksums.table)
+		return -1;
+
+	// a running scrubber picks the new rate up, see fs_scrubber_start() for a new one
+	fs->scrub_rate = blocks_per_sec;
+	pthread_cond_broadcast(&scrub_cond);
+	return 0;
+}
+
+static int fs_defrag_locked(size_t max_blocks, unsigned int max_us)
+{
+	struct timespec start;
+	size_t moved = 0;
+
+	// make sure fs is properly mounted
+	if (!is_mounted(fs))
+		return -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	// pick up where the previous call stopped
+	for (; fs->defrag_cursor < FS_FILE_MAX_COUNT; fs->defrag_cursor++) {
+		file *target_file = &fs->rootDir->files[fs->defrag_cursor];
+		size_t num_blocks;
+
+		if (target_file->filename[0] == '\0' || (target_file->flags & FILE_TAIL))
+			continue;
+
+		// the blocks are counted once buffered data has been stored, as that may move them
+		if (fs_wbuf_flush_file(fs, fs->defrag_cursor) == -1)
+			return -1;
+
+		size_t runs = fs->geo.extents ? fs_extent_runs(fs, fs->defrag_cursor, &num_blocks)
+			: fs_chain_extents(fs, fs_file_first(&fs->geo, target_file), &num_blocks);
+		if (runs <= 1)
+			continue;
+
+		// a file is moved as a whole, the first one even if it exceeds the budget
+		if (max_blocks && moved && moved + num_blocks > max_blocks)
+			break;
+		if (max_us && moved && fs_elapsed_us(&start) >= max_us)
+			break;
+
+		int ret = fs_file_relocate(fs, fs->defrag_cursor, num_blocks);
+		if (ret == -1)
+			return -1;
+		if (ret == 1)
+			moved += num_blocks;
+	}
+
+	if (fs_save_FAT(fs) == -1)
+		return -1;
+
+	if (fs->defrag_cursor < FS_FILE_MAX_COUNT)
+		return 1;
+
+	// the pass is over, the next call starts a new one
+	fs->defrag_cursor = 0;
+	return 0;
+}
+
+static int fs_clean_locked(size_t max_segments)
+{
+	// make sure fs is properly mounted
+	if (!is_mounted(fs) || !fs->geo.log)
+		return -1;
+
+	return fs_log_clean(fs, max_segments);
+}
+
+static int fs_format_locked(const char *diskname, size_t amt_data_blocks, unsigned int flags)
+{
+	bool fat32 = flags & FS_FORMAT_FAT32;
+	bool log = flags & FS_FORMAT_LOG;
+	bool extents = log || (flags & FS_FORMAT_EXTENTS);
+	size_t entry_size = fat32 ? sizeof(uint32_t) : sizeof(uint16_t);
+	size_t num_blocks_for_FAT = ceil_but_better(amt_data_blocks * entry_size / (double) BLOCK_SIZE);
+	size_t block_count = FAT_START_IDX + num_blocks_for_FAT + 1 + amt_data_blocks;
+	superblock_t sb = NULL;
+	char *FAT_block = NULL;
+	int ret = -1;
+
+	// the disk layer holds one disk at a time
+	if (is_mounted(fs) || amt_data_blocks == 0)
+		return -1;
+
+	// the extent table follows the reserved block
+	if (extents && amt_data_blocks < 1 + EXTENT_TABLE_BLOCKS)
+		return -1;
+
+	// tail locations bound FAT32 disks, 16-bit block numbers bound FAT16 ones
+	if (fat32 ? amt_data_blocks > FAT32_MAX_DATA_BLOCKS : block_count > UINT16_MAX)
+		return -1;
+
+	sb = calloc(1, BLOCK_SIZE);
+	FAT_block = calloc(1, BLOCK_SIZE);
+	if (!sb || !FAT_block)
+		goto out;
+
+	// data block 0 is reserved, like on the disks made by fs_make.x
+	memcpy(sb->signature, "ECS150FS", SIGNATURE_LENGTH);
+	if (fat32) {
+		sb->features = FS_FEATURE_FAT32;
+		sb->block_count32 = block_count;
+		sb->num_blocks_for_FAT32 = num_blocks_for_FAT;
+		sb->root_block_idx32 = FAT_START_IDX + num_blocks_for_FAT;
+		sb->data_block_start_idx32 = sb->root_block_idx32 + 1;
+		sb->amt_data_blocks32 = amt_data_blocks;
+		((uint32_t *) FAT_block)[0] = FAT_EOC;
+	} else {
+		sb->block_count = block_count;
+		sb->num_blocks_for_FAT = num_blocks_for_FAT;
+		sb->root_block_idx = FAT_START_IDX + num_blocks_for_FAT;
+		sb->data_block_start_idx = sb->root_block_idx + 1;
+		sb->amt_data_blocks = amt_data_blocks;
+		((uint16_t *) FAT_block)[0] = FAT16_EOC;
+	}
+
+	// the blank extent table is chained right after the reserved block
+	if (extents) {
+		sb->features |= FS_FEATURE_EXTENTS | (log ? FS_FEATURE_LOG : 0);
+		sb->extent_table_idx = 1;
+		for (uint32_t i = 1; i <= EXTENT_TABLE_BLOCKS; i++) {
+			if (fat32)
+				((uint32_t *) FAT_block)[i] = i < EXTENT_TABLE_BLOCKS ? i + 1 : FAT_EOC;
+			else
+				((uint16_t *) FAT_block)[i] = i < EXTENT_TABLE_BLOCKS ? i + 1 : FAT16_EOC;
+		}
+	}
+
+	// the rest of the FAT and the root directory start out as blank blocks
+	if (block_disk_create(diskname, block_count) == -1
+		|| block_disk_open_backend(diskname, &block_backend_file) == -1)
+		goto out;
+
+	ret = 0;
+	if (block_write(0, sb) == -1 || block_write(FAT_START_IDX, FAT_block) == -1)
+		ret = -1;
+	if (block_disk_close() == -1)
+		ret = -1;
+
+out:
+	free(sb);
+	free(FAT_block);
+	return ret;
+}
+
+static int fs_convert_locked(const char *diskname)
+{
+	if (fs_mount_locked(diskname) == -1)
+		return -1;
+
+	// chains are unlinked once every list is built, a failed conversion leaves them intact
+	if (!fs->geo.extents && fs_extent_convert(fs) == -1)
+		return fs_mount_abort(fs);
+
+	// the extents are on disk before the superblock points to them
+	int ret = 0;
+	if (fs_save_FAT(fs) == -1 || fs_save_rootDir(fs) == -1 || fs_save_superblock(fs) == -1)
+		ret = -1;
+	if (fs_umount_locked() == -1)
+		ret = -1;
+
+	return ret;
+}
+
+
+/* CHECKER
+ *
+ * fs_check() reads an unmounted image straight from its blocks, so that it
+ * never relies on the state fs_mount() would build from them. File chains are
+ * walked by worker threads that claim each block they reach in a shared map of
+ * owners: a block claimed twice is either a loop (same owner) or a cross-link.
+ */
+
+// owners of the blocks that are not part of a regular file
+#define OWNER_FREE 0
+#define OWNER_TAIL 0xFFFD
+#define OWNER_META 0xFFFE
+#define OWNER_RESERVED 0xFFFF
+
+#define CHECK_MAX_THREADS 64
+
+typedef struct checkState {
+	superblock_t superblock;
+	geometry geo;
+	uint32_t *FAT;
+	file *files;
+	uint32_t *holes;
+	// extent disks: the table, and the extents of each file, holes included
+	extentRecord *extent_table;
+	diskExtent *extents[FS_FILE_MAX_COUNT];
+	// shared disks: the reference count table, and the claims of each block beyond the first
+	uint16_t *refs;
+	uint16_t *claims;
+	uint16_t *owners;
+	// disks with checksums: the checksum of each disk block
+	uint32_t *checksums;
+	unsigned int flags;
+	int num_threads;
+} checkState;
+
+typedef struct checkWorker {
+	pthread_t thread;
+	checkState *state;
+	int id;
+	struct fs_check_report report;
+} checkWorker;
+
+// Count a problem, and describe it if the caller asked for it
+#define check_problem(state, report, field, fmt, ...)						\
+do {																		\
+	(report)->field++;														\
+	(report)->errors++;														\
+	if ((state)->flags & FS_CHECK_VERBOSE)									\
+		fprintf(stderr, "fs_check: " fmt "\n", ##__VA_ARGS__);				\
+} while (0)
+
+/** Claim a block for an owner
+ * 
+ * returns: OWNER_FREE if the block was unclaimed, its previous owner otherwise
+*/
+uint16_t fs_check_claim(checkState *state, uint32_t block_idx, uint16_t owner) {
+	uint16_t expected = OWNER_FREE;
+
+	if (__atomic_compare_exchange_n(&state->owners[block_idx], &expected, owner,
+									false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		return OWNER_FREE;
+
+	return expected;
+}
+
+/** Describe the owner of a block for a message
+ * 
+*/
+const char * fs_check_owner_name(checkState *state, uint16_t owner) {
+	if (owner == OWNER_TAIL)
+		return "a tail block";
+	if (owner == OWNER_META)
+		return "a metadata table";
+	if (owner == OWNER_RESERVED)
+		return "the reserved block";
+	if (owner > FS_FILE_MAX_COUNT)
+		return "a file of a snapshot";
+
+	return state->files[owner - 1].filename;
+}
+
+/** Walk the extents of a regular file on an extent disk
+ * @state: check in progress
+ * @target_file: root directory entry of the file (live or in a snapshot)
+ * @owner: owner to claim the blocks for
+ * @extents: extents of the file, holes included
+ * @num_extents: number of @extents
+ * @report: counters of the calling worker
+*/
+void fs_check_file_extents(checkState *state, file *target_file, uint16_t owner, diskExtent *extents,
+						   size_t num_extents, struct fs_check_report *report) {
+	uint64_t size = fs_file_size(target_file);
+	uint64_t size_blocks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	uint64_t next_block_num = 0;
+	bool past_end = false;
+
+	// the header of a compressed chunk may sit in any block of the chunk holding the last byte
+	if (target_file->flags & FILE_COMPRESSED)
+		size_blocks = (size_blocks + CHUNK_BLOCKS - 1) / CHUNK_BLOCKS * CHUNK_BLOCKS;
+
+	for (size_t i = 0; i < num_extents; i++) {
+		diskExtent *ext = &extents[i];
+
+		// holes take logical blocks but no data blocks
+		next_block_num += ext->length;
+		if (ext->start == 0)
+			continue;
+
+		if (ext->length == 0 || ext->start >= state->geo.amt_data_blocks
+			|| ext->length > state->geo.amt_data_blocks - ext->start) {
+			check_problem(state, report, bad_links, "'%s': extent %zu covers invalid blocks %u+%u",
+						  target_file->filename, i, ext->start, ext->length);
+			break;
+		}
+		if (next_block_num > size_blocks && !past_end) {
+			check_problem(state, report, size_mismatches, "'%s': extent %zu lies past the end of the file (%" PRIu64 " bytes)",
+						  target_file->filename, i, size);
+			past_end = true;
+		}
+
+		for (uint32_t j = 0; j < ext->length; j++) {
+			uint32_t block_idx = ext->start + j;
+			uint16_t prev_owner = fs_check_claim(state, block_idx, owner);
+			bool shared = state->refs && state->refs[block_idx];
+
+			// deduplication may map a shared block more than once in the same file
+			if (prev_owner == owner && !shared) {
+				check_problem(state, report, cycles, "'%s': block %u is listed twice",
+							  target_file->filename, block_idx);
+				return;
+			}
+			// a block shared by clones is counted against its reference count
+			if (prev_owner != OWNER_FREE && prev_owner < OWNER_TAIL && shared) {
+				__atomic_fetch_add(&state->claims[block_idx], 1, __ATOMIC_RELAXED);
+				continue;
+			}
+			if (prev_owner != OWNER_FREE) {
+				check_problem(state, report, cross_linked, "'%s': block %u also belongs to %s",
+							  target_file->filename, block_idx, fs_check_owner_name(state, prev_owner));
+				return;
+			}
+
+			report->blocks_used++;
+			if (state->FAT[block_idx] == 0)
+				check_problem(state, report, bad_links, "'%s': block %u is marked free",
+							  target_file->filename, block_idx);
+		}
+	}
+}
+
+/** Walk the chain of a regular file
+ * @state: check in progress
+ * @file_num: root directory entry of the file
+ * @report: counters of the calling worker
+*/
+void fs_check_file(checkState *state, int file_num, struct fs_check_report *report) {
+	file *target_file = &state->files[file_num];
+	uint16_t owner = file_num + 1;
+	uint32_t block_idx = fs_file_first(&state->geo, target_file);
+	uint32_t last_block_idx = FAT_EOC;
+	uint64_t size = fs_file_size(target_file);
+	size_t size_blocks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	size_t next_block_num = 0;
+	bool past_end = false;
+
+	report->files++;
+	if (size > UINT32_MAX && !(state->superblock->features & FS_FEATURE_LARGE_FILES))
+		check_problem(state, report, bad_entries, "'%s': %" PRIu64 " bytes on a disk without large files",
+					  target_file->filename, size);
+
+	if (state->geo.extents) {
+		fs_check_file_extents(state, target_file, owner, state->extents[file_num],
+							  state->extent_table[file_num].num_extents, report);
+		return;
+	}
+
+	while (block_idx != FAT_EOC) {
+		if (block_idx == 0 || block_idx >= state->geo.amt_data_blocks) {
+			check_problem(state, report, bad_links, "'%s': link to invalid block %u",
+						  target_file->filename, block_idx);
+			break;
+		}
+
+		uint16_t prev_owner = fs_check_claim(state, block_idx, owner);
+		if (prev_owner == owner) {
+			check_problem(state, report, cycles, "'%s': chain loops back to block %u",
+						  target_file->filename, block_idx);
+			break;
+		}
+		if (prev_owner != OWNER_FREE) {
+			check_problem(state, report, cross_linked, "'%s': block %u also belongs to %s",
+						  target_file->filename, block_idx, fs_check_owner_name(state, prev_owner));
+			break;
+		}
+
+		report->blocks_used++;
+		next_block_num += (state->holes ? state->holes[block_idx] : 0) + 1;
+		if (next_block_num > size_blocks && !past_end) {
+			check_problem(state, report, size_mismatches, "'%s': block %u lies past the end of the file (%" PRIu64 " bytes)",
+						  target_file->filename, block_idx, size);
+			past_end = true;
+		}
+
+		last_block_idx = block_idx;
+		block_idx = state->FAT[block_idx];
+		if (block_idx == 0) {
+			check_problem(state, report, bad_links, "'%s': block %u is marked free",
+						  target_file->filename, last_block_idx);
+			break;
+		}
+	}
+
+	// a known last block must hold the final byte of the file
+	if (size > 0 && target_file->last_block_idx != LAST_BLOCK_UNKNOWN
+		&& target_file->last_block_idx != FAT16_EOC
+		&& (target_file->last_block_idx != last_block_idx || next_block_num != size_blocks))
+		check_problem(state, report, bad_entries, "'%s': stale last block %u",
+					  target_file->filename, target_file->last_block_idx);
+}
+
+/** Worker: walk the chains of a share of the files
+ * 
+*/
+void * fs_check_walk_worker(void *arg) {
+	checkWorker *worker = arg;
+	checkState *state = worker->state;
+
+	for (int i = worker->id; i < FS_FILE_MAX_COUNT; i += state->num_threads) {
+		file *target_file = &state->files[i];
+
+		if (target_file->filename[0] != '\0' && !(target_file->flags & FILE_TAIL))
+			fs_check_file(state, i, &worker->report);
+	}
+
+	return NULL;
+}
+
+/** Worker: find the allocated blocks no chain claimed, in a share of the FAT
+ * 
+ * Reference counts of shared blocks are checked against their claims on the way.
+*/
+void * fs_check_leak_worker(void *arg) {
+	checkWorker *worker = arg;
+	checkState *state = worker->state;
+	struct fs_check_report *report = &worker->report;
+	size_t amt_data_blocks = state->geo.amt_data_blocks;
+	size_t first = amt_data_blocks * worker->id / state->num_threads;
+	size_t last = amt_data_blocks * (worker->id + 1) / state->num_threads;
+
+	for (size_t i = first; i < last; i++) {
+		if (state->refs && state->refs[i] != state->claims[i])
+			check_problem(state, report, bad_refcounts, "block %zu has %u extra references, but %u files share it",
+						  i, state->refs[i], state->claims[i] + 1);
+
+		if (state->FAT[i] == 0 || state->owners[i] != OWNER_FREE)
+			continue;
+
+		check_problem(state, report, leaked, "block %zu is allocated but unused", i);
+		if (state->flags & FS_CHECK_REPAIR) {
+			state->FAT[i] = 0;
+			report->repaired++;
+		}
+	}
+
+	return NULL;
+}
+
+/** Run a worker function on every worker, in parallel
+ * 
+ * Shares whose thread cannot be started are run by the calling thread.
+*/
+void fs_check_run(checkState *state, checkWorker *workers, void *(*func)(void *)) {
+	bool started[CHECK_MAX_THREADS] = {false};
+
+	for (int i = 1; i < state->num_threads; i++)
+		started[i] = pthread_create(&workers[i].thread, NULL, func, &workers[i]) == 0;
+
+	func(&workers[0]);
+	for (int i = 1; i < state->num_threads; i++) {
+		if (started[i])
+			pthread_join(workers[i].thread, NULL);
+		else
+			func(&workers[i]);
+	}
+}
+
+/** Walk the chains of every file, see fs_check_walk_worker()
+ * @state: check in progress
+ * @workers: workers, whose counters are still zero
+ * 
+ * Workers claim blocks in whatever order they get to them. When two files
+ * claim the same block, which one reports the cross-link (and what follows
+ * from it) depends on that order, so an image with cross-links is walked
+ * again by a single worker in file order, as is a damaged image whose
+ * problems are to be described.
+ * 
+ * returns: 0 on success, -1 if memory runs out
+*/
+int fs_check_walk(checkState *state, checkWorker *workers) {
+	size_t size = state->geo.amt_data_blocks * sizeof(uint16_t);
+	uint16_t *owners = malloc(size);
+	uint16_t *claims = state->claims ? malloc(size) : NULL;
+	unsigned int flags = state->flags;
+	int num_threads = state->num_threads;
+	uint32_t cross_linked = 0, errors = 0;
+
+	if (!owners || (state->claims && !claims)) {
+		free(owners);
+		free(claims);
+		return -1;
+	}
+
+	// the claims made before the walk (metadata, tail blocks) are kept for a second one
+	memcpy(owners, state->owners, size);
+	if (claims)
+		memcpy(claims, state->claims, size);
+
+	if (num_threads > 1)
+		state->flags &= ~FS_CHECK_VERBOSE;
+	fs_check_run(state, workers, fs_check_walk_worker);
+	state->flags = flags;
+
+	for (int i = 0; i < num_threads; i++) {
+		cross_linked += workers[i].report.cross_linked;
+		errors += workers[i].report.errors;
+	}
+
+	if (num_threads > 1 && (cross_linked || (errors && (flags & FS_CHECK_VERBOSE)))) {
+		memcpy(state->owners, owners, size);
+		if (claims)
+			memcpy(state->claims, claims, size);
+		for (int i = 0; i < num_threads; i++)
+			workers[i].report = (struct fs_check_report){0};
+
+		state->num_threads = 1;
+		fs_check_walk_worker(&workers[0]);
+		state->num_threads = num_threads;
+	}
+
+	free(owners);
+	free(claims);
+	return 0;
+}
+
+/** Check the geometry of the superblock against the disk
+ * 
+ * returns: true if the rest of the image can be located from it
+*/
+bool fs_check_superblock(checkState *state, struct fs_check_report *report) {
+	superblock_t sb = state->superblock;
+	geometry *geo = &state->geo;
+	size_t entry_size = geo->fat32 ? sizeof(uint32_t) : sizeof(uint16_t);
+	uint32_t num_blocks_for_FAT = ceil_but_better(geo->amt_data_blocks * entry_size / (double) BLOCK_SIZE);
+	uint32_t max_data_blocks = geo->fat32 ? FAT32_MAX_DATA_BLOCKS : FAT16_EOC;
+
+	if (memcmp(sb->signature, "ECS150FS", SIGNATURE_LENGTH))
+		check_problem(state, report, bad_superblock, "bad signature");
+	if (geo->block_count != (uint32_t) block_disk_count())
+		check_problem(state, report, bad_superblock, "%u blocks, but the disk has %d",
+					  geo->block_count, block_disk_count());
+	if (geo->amt_data_blocks == 0 || geo->amt_data_blocks > max_data_blocks
+		|| geo->num_blocks_for_FAT != num_blocks_for_FAT)
+		check_problem(state, report, bad_superblock, "%u FAT blocks for %u data blocks",
+					  geo->num_blocks_for_FAT, geo->amt_data_blocks);
+	if (geo->root_block_idx != FAT_START_IDX + geo->num_blocks_for_FAT
+		|| geo->data_block_start_idx != geo->root_block_idx + 1
+		|| geo->data_block_start_idx + geo->amt_data_blocks != geo->block_count)
+		check_problem(state, report, bad_superblock, "inconsistent layout (root %u, data %u+%u, total %u)",
+					  geo->root_block_idx, geo->data_block_start_idx, geo->amt_data_blocks, geo->block_count);
+	if (sb->features & ~(FS_FEATURE_TAILPACK | FS_FEATURE_FAT32 | FS_FEATURE_LARGE_FILES | FS_FEATURE_EXTENTS
+						 | FS_FEATURE_LOG | FS_FEATURE_SHARED | FS_FEATURE_SNAPSHOTS | FS_FEATURE_DEDUP
+						 | FS_FEATURE_FINGERPRINTS | FS_FEATURE_CHECKSUMS))
+		check_problem(state, report, bad_superblock, "unknown features 0x%x", sb->features);
+	if ((sb->features & FS_FEATURE_LOG) && !geo->extents)
+		check_problem(state, report, bad_superblock, "log without extents");
+	if ((sb->features & FS_FEATURE_SHARED) && !geo->extents)
+		check_problem(state, report, bad_superblock, "shared blocks without extents");
+	if (geo->extents && (sb->features & FS_FEATURE_SHARED)
+		&& (geo->refcount_idx == 0 || geo->refcount_idx >= geo->amt_data_blocks))
+		check_problem(state, report, bad_superblock, "reference count table at invalid block %u", geo->refcount_idx);
+	if ((sb->features & (FS_FEATURE_DEDUP | FS_FEATURE_FINGERPRINTS)) && !geo->extents)
+		check_problem(state, report, bad_superblock, "deduplication without extents");
+	if (geo->extents && (sb->features & FS_FEATURE_FINGERPRINTS)
+		&& (geo->fingerprint_idx == 0 || geo->fingerprint_idx >= geo->amt_data_blocks))
+		check_problem(state, report, bad_superblock, "fingerprint table at invalid block %u", geo->fingerprint_idx);
+	if ((sb->features & FS_FEATURE_SNAPSHOTS) && !geo->extents)
+		check_problem(state, report, bad_superblock, "snapshots without extents");
+	if (geo->extents && (sb->features & FS_FEATURE_SNAPSHOTS)
+		&& (geo->snapshot_idx == 0 || geo->snapshot_idx >= geo->amt_data_blocks))
+		check_problem(state, report, bad_superblock, "snapshot table at invalid block %u", geo->snapshot_idx);
+	if ((sb->features & FS_FEATURE_CHECKSUMS) && (geo->checksum_idx == 0
+		|| geo->checksum_idx + (geo->block_count * sizeof(uint32_t) + BLOCK_SIZE - 1) / BLOCK_SIZE > geo->amt_data_blocks))
+		check_problem(state, report, bad_superblock, "checksum region at invalid block %u", geo->checksum_idx);
+	if (geo->holemap_block_idx >= geo->amt_data_blocks)
+		check_problem(state, report, bad_superblock, "hole map at invalid block %u", geo->holemap_block_idx);
+	if (geo->extents && (geo->extent_table_idx == 0 || geo->extent_table_idx >= geo->amt_data_blocks))
+		check_problem(state, report, bad_superblock, "extent table at invalid block %u", geo->extent_table_idx);
+
+	return report->bad_superblock == 0;
+}
+
+/** Read the whole FAT, with FAT16 entries widened to 32 bits
+ * 
+ * returns: the entries, NULL if the FAT cannot be read
+*/
+uint32_t * fs_check_read_FAT(const geometry *geo) {
+	size_t num_entries = geo->num_blocks_for_FAT * (geo->fat32 ? FAT32_ENTRIES_PER_BLOCK : FAT16_ENTRIES_PER_BLOCK);
+	uint32_t *FAT = malloc(num_entries * sizeof(uint32_t));
+	uint16_t *FAT16 = geo->fat32 ? NULL : malloc(geo->num_blocks_for_FAT * BLOCK_SIZE);
+
+	if (!FAT || (!geo->fat32 && !FAT16)
+		|| block_readv(FAT_START_IDX, geo->num_blocks_for_FAT, geo->fat32 ? (void *) FAT : (void *) FAT16) == -1) {
+		free(FAT);
+		free(FAT16);
+		return NULL;
+	}
+
+	for (size_t i = 0; FAT16 && i < num_entries; i++)
+		FAT[i] = FAT16[i] == FAT16_EOC ? FAT_EOC : FAT16[i];
+
+	free(FAT16);
+	return FAT;
+}
+
+/** Write back a FAT read by fs_check_read_FAT()
+ * 
+ * returns: 0 on success, -1 if the FAT cannot be written
+*/
+int fs_check_write_FAT(const geometry *geo, const uint32_t *FAT) {
+	if (geo->fat32)
+		return block_writev(FAT_START_IDX, geo->num_blocks_for_FAT, FAT);
+
+	size_t num_entries = geo->num_blocks_for_FAT * FAT16_ENTRIES_PER_BLOCK;
+	uint16_t *FAT16 = malloc(geo->num_blocks_for_FAT * BLOCK_SIZE);
+	if (!FAT16)
+		return -1;
+
+	for (size_t i = 0; i < num_entries; i++)
+		FAT16[i] = FAT[i] == FAT_EOC ? FAT16_EOC : FAT[i];
+
+	int ret = block_writev(FAT_START_IDX, geo->num_blocks_for_FAT, FAT16);
+	free(FAT16);
+	return ret;
+}
+
+/** Walk the hole map chain and load it
+ * 
+ * returns: 0 on success, -1 if the disk cannot be read or the map is unusable
+*/
+int fs_check_holemap(checkState *state, struct fs_check_report *report) {
+	size_t amt_data_blocks = state->geo.amt_data_blocks;
+	size_t entry_size = state->geo.fat32 ? sizeof(uint32_t) : sizeof(uint16_t);
+	size_t num_blocks = ceil_but_better(amt_data_blocks * entry_size / (double) BLOCK_SIZE);
+	uint32_t block_idx = state->geo.holemap_block_idx;
+	bool broken = false;
+
+	if (block_idx == 0)
+		return 0;
+
+	char *table = calloc(num_blocks, BLOCK_SIZE);
+	state->holes = calloc(amt_data_blocks, sizeof(uint32_t));
+	if (!table || !state->holes) {
+		free(table);
+		return -1;
+	}
+
+	for (size_t i = 0; i < num_blocks; i++) {
+		if (block_idx == FAT_EOC || block_idx == 0 || block_idx >= amt_data_blocks
+			|| fs_check_claim(state, block_idx, OWNER_META) != OWNER_FREE) {
+			check_problem(state, report, bad_links, "hole map chain broken at link %zu", i);
+			broken = true;
+			break;
+		}
+		if (block_read(state->geo.data_block_start_idx + block_idx, table + i * BLOCK_SIZE) == -1) {
+			free(table);
+			return -1;
+		}
+		report->blocks_used++;
+		block_idx = state->FAT[block_idx];
+	}
+
+	// without a trustworthy map, sizes cannot be checked against chains
+	if (broken) {
+		free(state->holes);
+		state->holes = NULL;
+	} else if (block_idx != FAT_EOC) {
+		check_problem(state, report, bad_links, "hole map chain is longer than %zu blocks", num_blocks);
+	}
+
+	// FAT16 entries are widened like the FAT
+	for (size_t i = 0; state->holes && i < amt_data_blocks; i++)
+		state->holes[i] = state->geo.fat32 ? ((uint32_t *) table)[i] : ((uint16_t *) table)[i];
+
+	free(table);
+	return 0;
+}
+
+/** Read a chain of metadata blocks, and claim them
+ * @state: check in progress
+ * @report: counters of the calling thread
+ * @block_idx: first block of the chain
+ * @num_blocks: number of blocks the chain should have
+ * @buf: buffer of @num_blocks blocks to fill
+ * @name: what the chain holds, for messages
+ * 
+ * returns: 0 on success, 1 if the chain is broken, -1 if the disk cannot be read
+*/
+int fs_check_meta_chain(checkState *state, struct fs_check_report *report, uint32_t block_idx,
+						size_t num_blocks, void *buf, const char *name) {
+	for (size_t i = 0; i < num_blocks; i++) {
+		if (block_idx == FAT_EOC || block_idx == 0 || block_idx >= state->geo.amt_data_blocks
+			|| fs_check_claim(state, block_idx, OWNER_META) != OWNER_FREE) {
+			check_problem(state, report, bad_links, "%s chain broken at link %zu", name, i);
+			return 1;
+		}
+		if (block_read(state->geo.data_block_start_idx + block_idx, (char *) buf + i * BLOCK_SIZE) == -1)
+			return -1;
+		report->blocks_used++;
+		block_idx = state->FAT[block_idx];
+	}
+
+	if (block_idx != FAT_EOC)
+		check_problem(state, report, bad_links, "%s chain is longer than %zu blocks", name, num_blocks);
+
+	return 0;
+}
+
+/** Load the extent table and the overflow blocks of every file
+ * 
+ * Blocks of a file whose extents cannot be read would look leaked, so leaks
+ * are then reported but not repaired.
+ * 
+ * returns: 0 on success, -1 if the disk cannot be read
+*/
+int fs_check_extents(checkState *state, struct fs_check_report *report) {
+	bool lost = false;
+
+	if (!state->geo.extents)
+		return 0;
+
+	state->extent_table = calloc(EXTENT_TABLE_BLOCKS, BLOCK_SIZE);
+	if (!state->extent_table)
+		return -1;
+
+	int ret = fs_check_meta_chain(state, report, state->geo.extent_table_idx, EXTENT_TABLE_BLOCKS,
+								  state->extent_table, "extent table");
+	if (ret == -1)
+		return -1;
+	if (ret == 1) {
+		memset(state->extent_table, 0, EXTENT_TABLE_BLOCKS * BLOCK_SIZE);
+		lost = true;
+	}
+
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		extentRecord *record = &state->extent_table[i];
+		file *target_file = &state->files[i];
+		uint64_t size_blocks = (fs_file_size(target_file) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		size_t num_extents = record->num_extents;
+
+		if (num_extents == 0)
+			continue;
+
+		if (target_file->filename[0] == '\0' || (target_file->flags & FILE_TAIL)) {
+			check_problem(state, report, bad_entries, "entry %d: extents recorded for a file without blocks", i);
+			record->num_extents = 0;
+			continue;
+		}
+
+		// each block at most starts an extent and ends a hole
+		if (num_extents > 2 * (uint64_t) state->geo.amt_data_blocks + 1 + size_blocks / UINT32_MAX) {
+			check_problem(state, report, bad_entries, "'%s': %zu extents", target_file->filename, num_extents);
+			record->num_extents = 0;
+			lost = true;
+			continue;
+		}
+
+		size_t num_blocks = num_extents > EXTENT_INLINE
+			? (num_extents - EXTENT_INLINE + EXTENTS_PER_BLOCK - 1) / EXTENTS_PER_BLOCK : 0;
+		state->extents[i] = malloc(EXTENT_INLINE * sizeof(diskExtent) + num_blocks * BLOCK_SIZE);
+		if (!state->extents[i])
+			return -1;
+
+		memcpy(state->extents[i], record->extents, sizeof(record->extents));
+		if (num_blocks == 0)
+			continue;
+
+		ret = fs_check_meta_chain(state, report, record->overflow_idx ? record->overflow_idx : FAT_EOC,
+								  num_blocks, state->extents[i] + EXTENT_INLINE, target_file->filename);
+		if (ret == -1)
+			return -1;
+		if (ret == 1) {
+			record->num_extents = 0;
+			lost = true;
+		}
+	}
+
+	if (lost)
+		state->flags &= ~FS_CHECK_REPAIR;
+
+	return 0;
+}
+
+/** Load the reference count table of a disk with clones
+ * 
+ * Without the table, blocks shared by clones are reported as cross-linked.
+ * 
+ * returns: 0 on success, -1 if the disk cannot be read
+*/
+int fs_check_refs(checkState *state, struct fs_check_report *report) {
+	size_t num_blocks = ceil_but_better(state->geo.amt_data_blocks * sizeof(uint16_t) / (double) BLOCK_SIZE);
+
+	if (state->geo.refcount_idx == 0)
+		return 0;
+
+	state->refs = calloc(num_blocks, BLOCK_SIZE);
+	state->claims = calloc(state->geo.amt_data_blocks, sizeof(uint16_t));
+	if (!state->refs || !state->claims)
+		return -1;
+
+	int ret = fs_check_meta_chain(state, report, state->geo.refcount_idx, num_blocks, state->refs,
+								  "reference count table");
+	if (ret == 1) {
+		free(state->refs);
+		state->refs = NULL;
+	}
+
+	return ret == -1 ? -1 : 0;
+}
+
+/** Claim the blocks of the fingerprint table
+ * 
+ * The fingerprints themselves are not checked, those of blocks no file maps
+ * are dropped when the disk is mounted.
+ * 
+ * returns: 0 on success, -1 if the disk cannot be read
+*/
+int fs_check_fingerprints(checkState *state, struct fs_check_report *report) {
+	size_t num_blocks = ceil_but_better(state->geo.amt_data_blocks * sizeof(uint32_t) / (double) BLOCK_SIZE);
+
+	if (state->geo.fingerprint_idx == 0)
+		return 0;
+
+	void *table = malloc(num_blocks * BLOCK_SIZE);
+	if (!table)
+		return -1;
+
+	int ret = fs_check_meta_chain(state, report, state->geo.fingerprint_idx, num_blocks, table, "fingerprint table");
+	free(table);
+	return ret == -1 ? -1 : 0;
+}
+
+/** Number of blocks of the checksum region of the disk being checked
+ * 
+*/
+uint32_t fs_check_checksum_blocks(checkState *state) {
+	return ((uint64_t) state->geo.block_count * sizeof(uint32_t) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+/** Load the checksum region, which must be a run of consecutive blocks
+ * 
+ * Blocks are only verified against a region that is intact.
+ * 
+ * returns: 0 on success, -1 if the disk cannot be read
+*/
+int fs_check_checksums(checkState *state, struct fs_check_report *report) {
+	uint32_t first_block_idx = state->geo.checksum_idx;
+	uint32_t num_blocks = fs_check_checksum_blocks(state);
+
+	if (first_block_idx == 0)
+		return 0;
+
+	state->checksums = malloc((size_t) num_blocks * BLOCK_SIZE);
+	if (!state->checksums)
+		return -1;
+
+	int ret = fs_check_meta_chain(state, report, first_block_idx, num_blocks, state->checksums, "checksum region");
+	for (uint32_t i = 0; ret == 0 && i + 1 < num_blocks; i++) {
+		if (state->FAT[first_block_idx + i] != first_block_idx + i + 1) {
+			check_problem(state, report, bad_links, "checksum region is not contiguous at link %u", i);
+			ret = 1;
+		}
+	}
+
+	if (ret != 0) {
+		free(state->checksums);
+		state->checksums = NULL;
+	}
+	return ret == -1 ? -1 : 0;
+}
+
+/** Check whether a disk block is in use and has a checksum: the FAT, the root directory, and claimed data blocks
+ * 
+*/
+bool fs_check_checksummed(checkState *state, size_t block) {
+	size_t data_start = state->geo.data_block_start_idx;
+
+	if (block == 0 || block < data_start)
+		return block != 0;
+
+	size_t block_idx = block - data_start;
+	if (block_idx >= state->geo.amt_data_blocks || block_idx - state->geo.checksum_idx < fs_check_checksum_blocks(state))
+		return false;
+
+	return state->owners[block_idx] != OWNER_FREE && state->owners[block_idx] != OWNER_RESERVED;
+}
+
+/** Verify a share of the blocks in use against their checksums
+ * 
+ * Runs of blocks in use are read SCRUB_BATCH_BLOCKS at a time.
+*/
+void * fs_check_checksum_worker(void *arg) {
+	checkWorker *worker = arg;
+	checkState *state = worker->state;
+	struct fs_check_report *report = &worker->report;
+	size_t block_count = state->geo.block_count;
+	size_t first = block_count * worker->id / state->num_threads;
+	size_t last = block_count * (worker->id + 1) / state->num_threads;
+	char one_block[BLOCK_SIZE];
+	char *buf = malloc(SCRUB_BATCH_BLOCKS * BLOCK_SIZE);
+	size_t batch = buf ? SCRUB_BATCH_BLOCKS : 1;
+
+	if (!buf)
+		buf = one_block;
+
+	for (size_t block = first, run; block < last; block += run ? run : 1) {
+		for (run = 0; run < batch && block + run < last && fs_check_checksummed(state, block + run); run++)
+			;
+
+		if (run && block_readv(block, run, buf) == -1) {
+			check_problem(state, report, bad_checksums, "blocks %zu to %zu cannot be read", block, block + run - 1);
+			continue;
+		}
+
+		for (size_t i = 0; i < run; i++) {
+			if (fs_crc32c(buf + i * BLOCK_SIZE, BLOCK_SIZE) != state->checksums[block + i])
+				check_problem(state, report, bad_checksums, "block %zu does not match its checksum", block + i);
+		}
+	}
+
+	if (buf != one_block)
+		free(buf);
+	return NULL;
+}
+
+/** Update the checksums of the FAT blocks, after a repair rewrote them
+ * 
+ * returns: 0 on success, -1 if the disk cannot be read or written
+*/
+int fs_check_write_checksums(checkState *state) {
+	uint32_t num_FAT_blocks = state->geo.num_blocks_for_FAT;
+	char *buf = malloc((size_t) num_FAT_blocks * BLOCK_SIZE);
+	int ret = -1;
+
+	if (!buf || block_readv(FAT_START_IDX, num_FAT_blocks, buf) == -1)
+		goto out;
+
+	for (uint32_t i = 0; i < num_FAT_blocks; i++)
+		state->checksums[FAT_START_IDX + i] = fs_crc32c(buf + i * BLOCK_SIZE, BLOCK_SIZE);
+
+	// the region blocks holding those checksums
+	size_t first = FAT_START_IDX / CHECKSUMS_PER_BLOCK;
+	size_t last = (FAT_START_IDX + num_FAT_blocks - 1) / CHECKSUMS_PER_BLOCK;
+	ret = block_writev(state->geo.data_block_start_idx + state->geo.checksum_idx + first, last - first + 1,
+					   state->checksums + first * CHECKSUMS_PER_BLOCK);
+
+out:
+	free(buf);
+	return ret;
+}
+
+/** Walk the files of every snapshot, after those of the live file system
+ * 
+ * The blocks of the file numbered i in snapshot s are claimed for owner
+ * (s + 1) * FS_FILE_MAX_COUNT + i + 1, so that the files of a snapshot cannot
+ * be told from clones.
+ * 
+ * returns: 0 on success, -1 if the disk cannot be read
+*/
+int fs_check_snapshots(checkState *state, struct fs_check_report *report) {
+	snapshotEntry snapshots[BLOCK_SIZE / sizeof(snapshotEntry)];
+
+	if (state->geo.snapshot_idx == 0)
+		return 0;
+
+	int ret = fs_check_meta_chain(state, report, state->geo.snapshot_idx, 1, snapshots, "snapshot table");
+	if (ret != 0)
+		return ret == -1 ? -1 : 0;
+
+	for (int s = 0; s < FS_SNAPSHOT_MAX_COUNT; s++) {
+		snapshotEntry *entry = &snapshots[s];
+		size_t max_extents = (size_t) 2 * state->geo.amt_data_blocks + FS_FILE_MAX_COUNT;
+
+		if (entry->name[0] == '\0')
+			continue;
+
+		// a snapshot's chain holds at most two extents per data block, and a hole per file
+		if (entry->num_blocks < SNAPSHOT_HEADER_BLOCKS
+			|| entry->num_blocks > SNAPSHOT_HEADER_BLOCKS + max_extents / EXTENTS_PER_BLOCK + 1) {
+			check_problem(state, report, bad_entries, "snapshot '%.15s': %u blocks", entry->name, entry->num_blocks);
+			state->flags &= ~FS_CHECK_REPAIR;
+			continue;
+		}
+
+		char *table = calloc(entry->num_blocks, BLOCK_SIZE);
+		if (!table)
+			return -1;
+
+		ret = fs_check_meta_chain(state, report, entry->meta_idx, entry->num_blocks, table, entry->name);
+		if (ret != 0) {
+			free(table);
+			if (ret == -1)
+				return -1;
+			state->flags &= ~FS_CHECK_REPAIR;
+			continue;
+		}
+
+		file *files = (file *) table;
+		uint32_t *counts = (uint32_t *) (table + BLOCK_SIZE);
+		size_t capacity = (entry->num_blocks - SNAPSHOT_HEADER_BLOCKS) * EXTENTS_PER_BLOCK;
+		size_t first = 0;
+
+		for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+			if (counts[i] > capacity - first) {
+				check_problem(state, report, bad_entries, "snapshot '%.15s': extents of entry %d past its chain",
+							  entry->name, i);
+				state->flags &= ~FS_CHECK_REPAIR;
+				break;
+			}
+			if (files[i].filename[0] != '\0')
+				fs_check_file_extents(state, &files[i], (s + 1) * FS_FILE_MAX_COUNT + i + 1,
+									  (diskExtent *) (table + SNAPSHOT_HEADER_BLOCKS * BLOCK_SIZE) + first,
+									  counts[i], report);
+			first += counts[i];
+		}
+		free(table);
+	}
+
+	return 0;
+}
+
+/** Check the root directory entries, and claim the shared tail blocks
+ * 
+*/
+void fs_check_entries(checkState *state, struct fs_check_report *report) {
+	tailBlock tails[FS_FILE_MAX_COUNT];
+	size_t num_tails = 0;
+
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		file *target_file = &state->files[i];
+
+		if (target_file->filename[0] == '\0')
+			continue;
+
+		if (!memchr(target_file->filename, '\0', FS_FILENAME_LEN)) {
+			check_problem(state, report, bad_entries, "entry %d: unterminated filename", i);
+			target_file->filename[FS_FILENAME_LEN - 1] = '\0';
+		}
+		for (int j = 0; j < i; j++) {
+			if (!strcmp(state->files[j].filename, target_file->filename))
+				check_problem(state, report, bad_entries, "'%s': duplicate entry", target_file->filename);
+		}
+		if (target_file->flags & ~(FILE_TAIL | FILE_COMPRESSED))
+			check_problem(state, report, bad_entries, "'%s': unknown flags 0x%x",
+						  target_file->filename, target_file->flags);
+		else if (target_file->flags & FILE_COMPRESSED
+				 && (!state->geo.extents || target_file->flags & FILE_TAIL))
+			check_problem(state, report, bad_entries, "'%s': compressed file is %s",
+						  target_file->filename, state->geo.extents ? "packed" : "chained");
+
+		if (!(target_file->flags & FILE_TAIL))
+			continue;
+
+		// packed files live in slots of a shared block
+		report->files++;
+		uint32_t block_idx = TAIL_LOC_BLOCK(target_file->tail_loc);
+		int slot = TAIL_LOC_SLOT(target_file->tail_loc);
+		int num_slots = fs_tail_slots(target_file->file_size);
+
+		if (target_file->file_size > TAIL_MAX_SIZE || slot + num_slots > TAIL_SLOTS_PER_BLOCK
+			|| block_idx == 0 || block_idx >= state->geo.amt_data_blocks
+			|| fs_file_first(&state->geo, target_file) != FAT_EOC) {
+			check_problem(state, report, bad_entries, "'%s': invalid tail location", target_file->filename);
+			continue;
+		}
+		if (state->FAT[block_idx] != FAT_EOC)
+			check_problem(state, report, bad_links, "'%s': tail block %u is not a single block",
+						  target_file->filename, block_idx);
+
+		uint16_t prev_owner = fs_check_claim(state, block_idx, OWNER_TAIL);
+		if (prev_owner != OWNER_FREE && prev_owner != OWNER_TAIL) {
+			check_problem(state, report, cross_linked, "'%s': tail block %u also belongs to %s",
+						  target_file->filename, block_idx, fs_check_owner_name(state, prev_owner));
+			continue;
+		}
+		if (prev_owner == OWNER_FREE)
+			report->blocks_used++;
+
+		// slots of different files must not overlap
+		tailBlock *tail = NULL;
+		for (size_t t = 0; t < num_tails && !tail; t++) {
+			if (tails[t].block_idx == block_idx)
+				tail = &tails[t];
+		}
+		if (!tail) {
+			tail = &tails[num_tails++];
+			*tail = (tailBlock){.block_idx = block_idx, .used = 0};
+		}
+
+		uint64_t mask = fs_tail_mask(slot, num_slots);
+		if (tail->used & mask)
+			check_problem(state, report, cross_linked, "'%s': tail slots overlap another file", target_file->filename);
+		tail->used |= mask;
+	}
+}
+
+/** Add the counters of a worker to the report
+ * 
+*/
+void fs_check_merge(struct fs_check_report *report, const struct fs_check_report *worker) {
+	report->errors += worker->errors;
+	report->files += worker->files;
+	report->blocks_used += worker->blocks_used;
+	report->bad_superblock += worker->bad_superblock;
+	report->bad_entries += worker->bad_entries;
+	report->bad_links += worker->bad_links;
+	report->cycles += worker->cycles;
+	report->cross_linked += worker->cross_linked;
+	report->leaked += worker->leaked;
+	report->size_mismatches += worker->size_mismatches;
+	report->repaired += worker->repaired;
+	report->bad_refcounts += worker->bad_refcounts;
+	report->bad_checksums += worker->bad_checksums;
+}
+
+static int fs_check_locked(const char *diskname, unsigned int flags, int num_threads,
+						   struct fs_check_report *report)
+{
+	checkState state = {.flags = flags};
+	checkWorker workers[CHECK_MAX_THREADS];
+	char *root_block = NULL;
+	int ret = -1;
+
+	// the disk layer holds one disk at a time
+	if (is_mounted(fs) || block_disk_open(diskname) == -1)
+		return -1;
+
+	memset(report, 0, sizeof(*report));
+
+	state.superblock = malloc(BLOCK_SIZE);
+	if (!state.superblock || block_read(0, state.superblock) == -1)
+		goto out;
+
+	// nothing else can be located without a sane layout
+	fs_geometry_read(state.superblock, &state.geo);
+	if (!fs_check_superblock(&state, report)) {
+		ret = report->errors;
+		goto out;
+	}
+	block_disk_set_layout(state.geo.root_block_idx, state.geo.data_block_start_idx);
+
+	state.FAT = fs_check_read_FAT(&state.geo);
+	root_block = malloc(BLOCK_SIZE);
+	state.owners = calloc(state.geo.amt_data_blocks, sizeof(uint16_t));
+	if (!state.FAT || !root_block || !state.owners
+		|| block_read(state.geo.root_block_idx, root_block) == -1)
+		goto out;
+	state.files = (file *) root_block;
+
+	// data block 0 is never handed out
+	state.owners[0] = OWNER_RESERVED;
+	if (state.FAT[0] != FAT_EOC)
+		check_problem(&state, report, bad_links, "reserved block 0 is not marked used");
+
+	// metadata and tail blocks are claimed before any chain is walked
+	if (fs_check_holemap(&state, report) == -1)
+		goto out;
+	fs_check_entries(&state, report);
+	if (fs_check_extents(&state, report) == -1 || fs_check_refs(&state, report) == -1
+		|| fs_check_fingerprints(&state, report) == -1 || fs_check_checksums(&state, report) == -1)
+		goto out;
+
+	if (num_threads <= 0)
+		num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	state.num_threads = max(1, min(num_threads, CHECK_MAX_THREADS));
+
+	for (int i = 0; i < state.num_threads; i++)
+		workers[i] = (checkWorker){.state = &state, .id = i};
+
+	// leaks can only be told apart once every chain has been walked
+	if (fs_check_walk(&state, workers) == -1 || fs_check_snapshots(&state, &workers[0].report) == -1)
+		goto out;
+	fs_check_run(&state, workers, fs_check_leak_worker);
+	if (state.checksums)
+		fs_check_run(&state, workers, fs_check_checksum_worker);
+
+	for (int i = 0; i < state.num_threads; i++)
+		fs_check_merge(report, &workers[i].report);
+
+	// give leaked blocks back by writing the repaired FAT
+	if (report->repaired && fs_check_write_FAT(&state.geo, state.FAT) == -1)
+		goto out;
+	if (report->repaired && state.checksums && fs_check_write_checksums(&state) == -1)
+		goto out;
+
+	ret = report->errors - report->repaired;
+
+out:
+	block_disk_close();
+	free(state.superblock);
+	free(state.FAT);
+	free(state.holes);
+	free(state.extent_table);
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+		free(state.extents[i]);
+	free(state.refs);
+	free(state.claims);
+	free(state.owners);
+	free(state.checksums);
+	free(root_block);
+	return ret;
+}
+
+/* TRACING
+ *
+ * The locked wrappers below record each call into a ring of fixed-size
+ * records, which is appended to the trace file in one write when it fills up.
+ * Tracing is global rather than per mount, so a trace can cover remounts.
+ */
+
+#define TRACE_RING_SIZE 4096
+
+_Static_assert(sizeof(struct fs_trace_record) == 56, "trace records must stay 56 bytes");
+
+static struct {
+	bool active;
+	bool env_checked;
+	FILE *file;
+	uint64_t start_ns;
+	size_t count;
+	struct fs_trace_record *ring;
+} trace;
+
+static const char *trace_op_names[FS_TRACE_OP_COUNT] = {
+	[FS_TRACE_MOUNT]		= "mount",
+	[FS_TRACE_UMOUNT]		= "umount",
+	[FS_TRACE_INFO]			= "info",
+	[FS_TRACE_CREATE]		= "create",
+	[FS_TRACE_DELETE]		= "delete",
+	[FS_TRACE_TRUNCATE]		= "truncate",
+	[FS_TRACE_FTRUNCATE]	= "ftruncate",
+	[FS_TRACE_LS]			= "ls",
+	[FS_TRACE_OPEN]			= "open",
+	[FS_TRACE_CLOSE]		= "close",
+	[FS_TRACE_STAT]			= "stat",
+	[FS_TRACE_LSEEK]		= "lseek",
+	[FS_TRACE_SEEK_DATA]	= "seek_data",
+	[FS_TRACE_SEEK_HOLE]	= "seek_hole",
+	[FS_TRACE_WRITE]		= "write",
+	[FS_TRACE_READ]			= "read",
+	[FS_TRACE_SYNC]			= "sync",
+	[FS_TRACE_TAILPACK]		= "tailpack",
+	[FS_TRACE_DEFRAG]		= "defrag",
+	[FS_TRACE_CLEAN]		= "clean",
+	[FS_TRACE_CLONE]		= "clone",
+	[FS_TRACE_SNAPSHOT_CREATE]	= "snapshot_create",
+	[FS_TRACE_SNAPSHOT_DELETE]	= "snapshot_delete",
+	[FS_TRACE_SNAPSHOT_OPEN]	= "snapshot_open",
+	[FS_TRACE_DEDUP]		= "dedup",
+	[FS_TRACE_DEDUP_SCAN]		= "dedup_scan",
+	[FS_TRACE_COMPRESS]		= "compress",
+	[FS_TRACE_CHECKSUMS]		= "checksums",
+	[FS_TRACE_SCRUB]		= "scrub",
+	[FS_TRACE_SCRUB_RATE]		= "scrub_rate",
+};
+
+static uint64_t fs_trace_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Current offset of a descriptor, without complaining about invalid ones
+static uint64_t fs_trace_offset(int fd) {
+	if (!fs || !fs->is_mounted || !fs_validate_fd(fs, fd))
+		return 0;
+
+	return fs->open_files[fd].file_offset;
+}
+
+// Append the records of the ring to the trace file
+static int fs_trace_flush(void) {
+	size_t count = trace.count;
+
+	trace.count = 0;
+	if (fwrite(trace.ring, sizeof(*trace.ring), count, trace.file) != count)
+		return -1;
+
+	return fflush(trace.file) ? -1 : 0;
+}
+
+/** Record a call that just returned
+ * @op: operation, one of enum fs_trace_op
+ * @fd: file descriptor argument, or -1
+ * @filename: filename argument, or NULL
+ * @arg: size or offset argument
+ * @offset: offset of @fd before the call
+ * @start_ns: time the call started
+ * @latency: time spent in the call
+ * @result: value returned by the call
+*/
+static void fs_trace_record(int op, int fd, const char *filename, uint64_t arg, uint64_t offset,
+							uint64_t start_ns, uint64_t latency, int64_t result) {
+	struct fs_trace_record *rec = &trace.ring[trace.count++];
+
+	*rec = (struct fs_trace_record) {
+		.timestamp_ns = start_ns - trace.start_ns,
+		.offset = offset,
+		.arg = arg,
+		.latency_ns = latency > UINT32_MAX ? UINT32_MAX : latency,
+		.result = result > INT32_MAX ? INT32_MAX : result,
+		.fd = fd,
+		.op = op,
+	};
+	if (filename)
+		strncpy(rec->filename, filename, FS_FILENAME_LEN - 1);
+
+	// let a replay format a disk of the same size
+	if (op == FS_TRACE_MOUNT && result == 0)
+		rec->arg = fs->geo.amt_data_blocks;
+
+	// keep the trace complete on disk whenever the FS is unmounted
+	if (trace.count == TRACE_RING_SIZE || op == FS_TRACE_UMOUNT)
+		fs_trace_flush();
+}
+
+static int fs_trace_start_locked(const char *filename) {
+	struct fs_trace_header header = { .record_size = sizeof(struct fs_trace_record) };
+
+	if (trace.active || !filename)
+		return -1;
+
+	trace.ring = malloc(TRACE_RING_SIZE * sizeof(*trace.ring));
+	if (!trace.ring)
+		return -1;
+
+	trace.file = fopen(filename, "wb");
+	if (!trace.file) {
+		free(trace.ring);
+		return -1;
+	}
+
+	memcpy(header.magic, FS_TRACE_MAGIC, sizeof(header.magic));
+	fwrite(&header, sizeof(header), 1, trace.file);
+
+	trace.count = 0;
+	trace.start_ns = fs_trace_now();
+	trace.active = true;
+	return 0;
+}
+
+static int fs_trace_stop_locked(void) {
+	if (!trace.active)
+		return -1;
+
+	int ret = fs_trace_flush();
+	if (fclose(trace.file))
+		ret = -1;
+
+	free(trace.ring);
+	trace.ring = NULL;
+	trace.file = NULL;
+	trace.active = false;
+	return ret;
+}
+
+/** Account for a call in the runtime statistics
+ * @op: operation, one of enum fs_trace_op
+ * @arg: size or offset argument
+ * @latency: time spent in the call
+ * @result: value returned by the call
+*/
+static void fs_stats_record(int op, uint64_t arg, uint64_t latency, int64_t result) {
+	struct fs_op_stats *op_stats = &stats.ops[op];
+
+	op_stats->calls++;
+	op_stats->total_ns += latency;
+	if (latency > op_stats->max_ns)
+		op_stats->max_ns = latency;
+	if (result == -1)
+		op_stats->errors++;
+
+	if (op == FS_TRACE_READ) {
+		stats.bytes_read_requested += arg;
+		stats.bytes_read += result > 0 ? result : 0;
+	} else if (op == FS_TRACE_WRITE) {
+		stats.bytes_write_requested += arg;
+		stats.bytes_written += result > 0 ? result : 0;
+	}
+}
+
+// Run a _locked call under the API lock, accounting for it in the statistics and the trace
+#define FS_CALL(op, fd, filename, arg, call)											\
+({																						\
+	pthread_mutex_lock(&fs_lock);														\
+	uint64_t __offset = trace.active ? fs_trace_offset(fd) : 0;						\
+	uint64_t __start = fs_trace_now();													\
+	__typeof__(call) __ret = (call);													\
+	uint64_t __latency = fs_trace_now() - __start;										\
+	fs_stats_record(op, arg, __latency, __ret);											\
+	if (trace.active)																	\
+		fs_trace_record(op, fd, filename, arg, __offset, __start, __latency, __ret);	\
+	pthread_mutex_unlock(&fs_lock);														\
+	__ret;																				\
+})
+
+/* LOCKED API
+ *
+ * Every call on the mounted file system runs under a single mutex, so that
+ * descriptors can be shared between threads (e.g. concurrent appenders).
+ */
+
+// serializes all API calls
+pthread_mutex_t fs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Stop a trace started from the environment when the program exits
+static void fs_trace_atexit(void)
+{
+	fs_trace_stop();
+}
+
+// Start tracing if FS_TRACE names a trace file, the first time a FS is mounted
+static void fs_trace_from_env(void)
+{
+	pthread_mutex_lock(&fs_lock);
+	if (!trace.env_checked) {
+		const char *filename = getenv("FS_TRACE");
+
+		trace.env_checked = true;
+		if (filename && fs_trace_start_locked(filename) == 0)
+			atexit(fs_trace_atexit);
+	}
+	pthread_mutex_unlock(&fs_lock);
+}
+
+/** Clean a log disk in the background for as long as it stays mounted
+ * @arg: mount id of the disk
+ * 
+ * Cleaning starts when the log takes a segment while fewer than
+ * LOG_CLEAN_LOW() are empty, and goes on one segment at a time, letting API
+ * calls in between, until LOG_CLEAN_HIGH() are.
+*/
+static void *fs_cleaner_thread(void *arg)
+{
+	uint64_t mount_id = (uintptr_t) arg;
+
+	pthread_mutex_lock(&fs_lock);
+	while (is_mounted(fs) && fs->mount_id == mount_id) {
+		if (fs->log_free_segments < LOG_CLEAN_LOW(fs->num_segments))
+			fs->log_cleaning = true;
+		else if (fs->log_free_segments >= LOG_CLEAN_HIGH(fs->num_segments))
+			fs->log_cleaning = false;
+
+		if (!fs->log_cleaning) {
+			pthread_cond_wait(&log_cond, &fs_lock);
+			continue;
+		}
+
+		// nothing left to reclaim until more blocks are overwritten
+		if (fs_log_clean(fs, 1) != 1)
+			fs->log_cleaning = false;
+
+		pthread_mutex_unlock(&fs_lock);
+		sched_yield();
+		pthread_mutex_lock(&fs_lock);
+	}
+	pthread_mutex_unlock(&fs_lock);
+
+	return NULL;
+}
+
+// Start the background cleaner of a log disk that was just mounted
+static void fs_cleaner_start(void)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+
+	pthread_mutex_lock(&fs_lock);
+	if (is_mounted(fs) && fs->geo.log && pthread_attr_init(&attr) == 0) {
+		// without a cleaner the log still fills the free blocks left between segments
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		pthread_create(&thread, &attr, fs_cleaner_thread, (void *) (uintptr_t) fs->mount_id);
+		pthread_attr_destroy(&attr);
+	}
+	pthread_mutex_unlock(&fs_lock);
+}
+
+/** Scrub a disk in the background at the rate set by fs_scrub_rate()
+ * @arg: mount id of the disk
+ * 
+ * Each batch is scrubbed with the lock held, and the thread sleeps until the
+ * batch is due, letting API calls in between. It stops once the rate is set to
+ * 0, the checksums are disabled, or the disk is unmounted.
+*/
+static void *fs_scrubber_thread(void *arg)
+{
+	uint64_t mount_id = (uintptr_t) arg;
+
+	pthread_mutex_lock(&fs_lock);
+	while (is_mounted(fs) && fs->mount_id == mount_id && fs->scrub_rate && fs->checksums.table) {
+		size_t batch = min_size(SCRUB_BATCH_BLOCKS, fs->scrub_rate);
+		uint64_t due_ns = batch * 1000000000ULL / fs->scrub_rate;
+		struct timespec deadline;
+
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		due_ns += deadline.tv_nsec;
+		deadline.tv_sec += due_ns / 1000000000ULL;
+		deadline.tv_nsec = due_ns % 1000000000ULL;
+
+		// bad blocks are counted in the statistics, a failed read is retried at the next pass
+		fs_scrub_blocks(fs, batch, NULL);
+		pthread_cond_timedwait(&scrub_cond, &fs_lock, &deadline);
+	}
+	if (is_mounted(fs) && fs->mount_id == mount_id)
+		fs->scrub_running = false;
+	pthread_mutex_unlock(&fs_lock);
+
+	return NULL;
+}
+
+// Start the background scrubber once a rate is set, unless it is already running
+static int fs_scrubber_start(void)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+	int ret = 0;
+
+	pthread_mutex_lock(&fs_lock);
+	if (is_mounted(fs) && fs->scrub_rate && !fs->scrub_running) {
+		ret = -1;
+		if (pthread_attr_init(&attr) == 0) {
+			pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+			ret = pthread_create(&thread, &attr, fs_scrubber_thread, (void *) (uintptr_t) fs->mount_id) ? -1 : 0;
+			pthread_attr_destroy(&attr);
+		}
+		fs->scrub_running = ret == 0;
+	}
+	pthread_mutex_unlock(&fs_lock);
+
+	return ret;
+}
+
+int fs_mount(const char *diskname)
+{
+	fs_trace_from_env();
+	int ret = FS_CALL(FS_TRACE_MOUNT, -1, diskname, 0, fs_mount_locked(diskname));
+
+	if (ret == 0)
+		fs_cleaner_start();
+	return ret;
+}
+
+int fs_umount(void)
+{
+	return FS_CALL(FS_TRACE_UMOUNT, -1, NULL, 0, fs_umount_locked());
+}
+
+int fs_info(void)
+{
+	return FS_CALL(FS_TRACE_INFO, -1, NULL, 0, fs_info_locked());
+}
+
+int fs_create(const char *filename)
+{
+	return FS_CALL(FS_TRACE_CREATE, -1, filename, 0, fs_create_locked(filename));
+}
+
+int fs_delete(const char *filename)
+{
+	return FS_CALL(FS_TRACE_DELETE, -1, filename, 0, fs_delete_locked(filename));
+}
+
+int fs_truncate(const char *filename, size_t length)
+{
+	return FS_CALL(FS_TRACE_TRUNCATE, -1, filename, length, fs_truncate_locked(filename, length));
+}
+
+int fs_ftruncate(int fd, size_t length)
+{
+	return FS_CALL(FS_TRACE_FTRUNCATE, fd, NULL, length, fs_ftruncate_locked(fd, length));
+}
+
+int fs_ls(void)
+{
+	return FS_CALL(FS_TRACE_LS, -1, NULL, 0, fs_ls_locked());
+}
+
+int fs_open_flags(const char *filename, int flags)
+{
+	return FS_CALL(FS_TRACE_OPEN, -1, filename, flags, fs_open_flags_locked(filename, flags));
+}
+
+int fs_open(const char *filename)
+{
+	return fs_open_flags(filename, 0);
+}
+
+int fs_close(int fd)
+{
+	return FS_CALL(FS_TRACE_CLOSE, fd, NULL, 0, fs_close_locked(fd));
+}
+
+int fs_stat(int fd)
+{
+	return FS_CALL(FS_TRACE_STAT, fd, NULL, 0, fs_stat_locked(fd));
+}
+
+int64_t fs_stat64(int fd)
+{
+	return FS_CALL(FS_TRACE_STAT, fd, NULL, 0, fs_stat64_locked(fd));
+}
+
+int fs_lseek(int fd, size_t offset)
+{
+	return FS_CALL(FS_TRACE_LSEEK, fd, NULL, offset, fs_lseek_locked(fd, offset));
+}
+
+int64_t fs_seek_data(int fd, size_t offset)
+{
+	return FS_CALL(FS_TRACE_SEEK_DATA, fd, NULL, offset, fs_seek_data_locked(fd, offset));
+}
+
+int64_t fs_seek_hole(int fd, size_t offset)
+{
+	return FS_CALL(FS_TRACE_SEEK_HOLE, fd, NULL, offset, fs_seek_hole_locked(fd, offset));
+}
+
+ssize_t fs_write(int fd, void *buf, size_t count)
+{
+	return FS_CALL(FS_TRACE_WRITE, fd, NULL, count, fs_write_locked(fd, buf, count));
+}
+
+ssize_t fs_read(int fd, void *buf, size_t count)
+{
+	return FS_CALL(FS_TRACE_READ, fd, NULL, count, fs_read_locked(fd, buf, count));
+}
+
+int fs_tailpack(int enable)
+{
+	return FS_CALL(FS_TRACE_TAILPACK, -1, NULL, enable, fs_tailpack_locked(enable));
+}
+
+int fs_sync(void)
+{
+	return FS_CALL(FS_TRACE_SYNC, -1, NULL, 0, fs_sync_locked());
+}
+
+int fs_dedup(int enable)
+{
+	return FS_CALL(FS_TRACE_DEDUP, -1, NULL, enable, fs_dedup_locked(enable));
+}
+
+int fs_dedup_scan(struct fs_dedup_report *report)
+{
+	return FS_CALL(FS_TRACE_DEDUP_SCAN, -1, NULL, 0, fs_dedup_scan_locked(report));
+}
+
+int fs_compress(const char *filename, int enable)
+{
+	return FS_CALL(FS_TRACE_COMPRESS, -1, filename, enable, fs_compress_locked(filename, enable));
+}
+
+int fs_checksums(int enable)
+{
+	return FS_CALL(FS_TRACE_CHECKSUMS, -1, NULL, enable, fs_checksums_locked(enable));
+}
+
+int fs_scrub(size_t max_blocks, struct fs_scrub_report *report)
+{
+	return FS_CALL(FS_TRACE_SCRUB, -1, NULL, max_blocks, fs_scrub_locked(max_blocks, report));
+}
+
+int fs_scrub_rate(size_t blocks_per_sec)
+{
+	int ret = FS_CALL(FS_TRACE_SCRUB_RATE, -1, NULL, blocks_per_sec, fs_scrub_rate_locked(blocks_per_sec));
+
+	if (ret == 0)
+		ret = fs_scrubber_start();
+	return ret;
+}
+
+int fs_defrag(size_t max_blocks, unsigned int max_us)
+{
+	return FS_CALL(FS_TRACE_DEFRAG, -1, NULL, max_blocks, fs_defrag_locked(max_blocks, max_us));
+}
+
+int fs_clean(size_t max_segments)
+{
+	return FS_CALL(FS_TRACE_CLEAN, -1, NULL, max_segments, fs_clean_locked(max_segments));
+}
+
+int fs_clone(const char *src_filename, const char *dst_filename)
+{
+	return FS_CALL(FS_TRACE_CLONE, -1, dst_filename, 0, fs_clone_locked(src_filename, dst_filename));
+}
+
+int fs_snapshot_create(const char *name)
+{
+	return FS_CALL(FS_TRACE_SNAPSHOT_CREATE, -1, name, 0, fs_snapshot_create_locked(name));
+}
+
+int fs_snapshot_delete(const char *name)
+{
+	return FS_CALL(FS_TRACE_SNAPSHOT_DELETE, -1, name, 0, fs_snapshot_delete_locked(name));
+}
+
+int fs_snapshot_open(const char *name, const char *filename)
+{
+	return FS_CALL(FS_TRACE_SNAPSHOT_OPEN, -1, filename, 0, fs_snapshot_open_locked(name, filename));
+}
+
+int fs_snapshot_list(struct fs_snapshot_info *snapshots, size_t count)
+{
+	pthread_mutex_lock(&fs_lock);
+	int ret = fs_snapshot_list_locked(snapshots, count);
+	pthread_mutex_unlock(&fs_lock);
+	return ret;
+}
+
+int fs_fragmentation(struct fs_frag *frag)
+{
+	int ret = -1;
+
+	if (!frag)
+		return -1;
+
+	pthread_mutex_lock(&fs_lock);
+	if (is_mounted(fs)) {
+		fs_frag_scan(fs, frag);
+		ret = 0;
+	}
+	pthread_mutex_unlock(&fs_lock);
+	return ret;
+}
+
+int fs_format(const char *diskname, size_t data_blocks, unsigned int flags)
+{
+	if (!diskname)
+		return -1;
+
+	pthread_mutex_lock(&fs_lock);
+	int ret = fs_format_locked(diskname, data_blocks, flags);
+	pthread_mutex_unlock(&fs_lock);
+	return ret;
+}
+
+int fs_convert(const char *diskname)
+{
+	if (!diskname)
+		return -1;
+
+	pthread_mutex_lock(&fs_lock);
+	int ret = fs_convert_locked(diskname);
+	pthread_mutex_unlock(&fs_lock);
+	return ret;
+}
+
+int fs_check(const char *diskname, unsigned int flags, int num_threads, struct fs_check_report *report)
+{
+	if (!diskname || !report)
+		return -1;
+
+	pthread_mutex_lock(&fs_lock);
+	int ret = fs_check_locked(diskname, flags, num_threads, report);
+	pthread_mutex_unlock(&fs_lock);
+	return ret;
+}
+
+int fs_trace_start(const char *filename)
+{
+	pthread_mutex_lock(&fs_lock);
+	int ret = fs_trace_start_locked(filename);
+	pthread_mutex_unlock(&fs_lock);
+	return ret;
+}
+
+int fs_trace_stop(void)
+{
+	pthread_mutex_lock(&fs_lock);
+	int ret = fs_trace_stop_locked();
+	pthread_mutex_unlock(&fs_lock);
+	return ret;
+}
+
+const char *fs_trace_op_name(int op)
+{
+	if (op < 0 || op >= FS_TRACE_OP_COUNT)
+		return NULL;
+
+	return trace_op_names[op];
+}
+
+int fs_get_stats(struct fs_stats *out)
+{
+	if (!out)
+		return -1;
+
+	pthread_mutex_lock(&fs_lock);
+	*out = stats;
+	pthread_mutex_unlock(&fs_lock);
+	return 0;
+}
+
+int fs_reset_stats(void)
+{
+	pthread_mutex_lock(&fs_lock);
+	memset(&stats, 0, sizeof(stats));
+	pthread_mutex_unlock(&fs_lock);
+	return 0;
+}
@@ -2,6 +2,8 @@
 #define _FS_H
 
 #include <stddef.h> /* for size_t definition */
+#include <stdint.h>
+#include <sys/types.h> /* for ssize_t definition */
 
 /** Maximum filename length (including the NULL character) */
 #define FS_FILENAME_LEN 16
@@ -12,6 +14,305 @@
 /** Maximum number of open files */
 #define FS_OPEN_MAX_COUNT 32
 
+/** Maximum number of snapshots of a file system */
+#define FS_SNAPSHOT_MAX_COUNT 32
+
+/** fs_open_flags() flag: every write goes to the end of the file */
+#define FS_O_APPEND 0x01
+
+/** fs_open_flags() flag: do not combine small writes in a write buffer */
+#define FS_O_NOBUF 0x02
+
+/** Operations recorded by the tracer, in &struct fs_trace_record.op */
+enum fs_trace_op {
+	FS_TRACE_MOUNT,
+	FS_TRACE_UMOUNT,
+	FS_TRACE_INFO,
+	FS_TRACE_CREATE,
+	FS_TRACE_DELETE,
+	FS_TRACE_TRUNCATE,
+	FS_TRACE_FTRUNCATE,
+	FS_TRACE_LS,
+	FS_TRACE_OPEN,
+	FS_TRACE_CLOSE,
+	FS_TRACE_STAT,
+	FS_TRACE_LSEEK,
+	FS_TRACE_SEEK_DATA,
+	FS_TRACE_SEEK_HOLE,
+	FS_TRACE_WRITE,
+	FS_TRACE_READ,
+	FS_TRACE_SYNC,
+	FS_TRACE_TAILPACK,
+	FS_TRACE_DEFRAG,
+	FS_TRACE_CLEAN,
+	FS_TRACE_CLONE,
+	FS_TRACE_SNAPSHOT_CREATE,
+	FS_TRACE_SNAPSHOT_DELETE,
+	FS_TRACE_SNAPSHOT_OPEN,
+	FS_TRACE_DEDUP,
+	FS_TRACE_DEDUP_SCAN,
+	FS_TRACE_COMPRESS,
+	FS_TRACE_CHECKSUMS,
+	FS_TRACE_SCRUB,
+	FS_TRACE_SCRUB_RATE,
+	FS_TRACE_OP_COUNT,
+};
+
+/** Magic string at the start of a trace file */
+#define FS_TRACE_MAGIC "FSTRACE1"
+
+/**
+ * struct fs_trace_record - One traced API call
+ * @timestamp_ns: Start of the call, in nanoseconds since the trace started
+ * @offset: Offset of descriptor @fd when the call started
+ * @arg: Size or offset argument of the call (count of fs_read()/fs_write(),
+ *       offset of fs_lseek(), length of fs_truncate(), flags of
+ *       fs_open_flags(), ...). For a successful fs_mount(), the number of data
+ *       blocks of the disk.
+ * @latency_ns: Time spent in the call, excluding waiting for the API lock
+ * @result: Value returned by the call, capped at %INT32_MAX
+ * @fd: File descriptor argument, or -1
+ * @op: Operation, one of &enum fs_trace_op
+ * @filename: Filename argument, if any (the new file for fs_clone(), whose
+ *            source is not recorded, and the file for fs_snapshot_open(), whose
+ *            snapshot is not recorded)
+ */
+struct fs_trace_record {
+	uint64_t timestamp_ns;
+	uint64_t offset;
+	uint64_t arg;
+	uint32_t latency_ns;
+	int32_t result;
+	int16_t fd;
+	uint8_t op;
+	uint8_t reserved[5];
+	char filename[FS_FILENAME_LEN];
+};
+
+/**
+ * struct fs_trace_header - Header of a trace file
+ * @magic: %FS_TRACE_MAGIC, not NULL-terminated
+ * @record_size: Size of each record following the header
+ */
+struct fs_trace_header {
+	char magic[8];
+	uint32_t record_size;
+	uint32_t reserved;
+};
+
+/**
+ * struct fs_op_stats - Counters of one API operation
+ * @calls: Number of calls
+ * @errors: Calls that returned -1
+ * @total_ns: Cumulative time spent in the calls
+ * @max_ns: Longest call
+ */
+struct fs_op_stats {
+	uint64_t calls;
+	uint64_t errors;
+	uint64_t total_ns;
+	uint64_t max_ns;
+};
+
+/**
+ * struct fs_stats - Runtime statistics of the library
+ * @ops: Counters of each operation, indexed by &enum fs_trace_op
+ * @bytes_read_requested: Bytes asked for by fs_read()
+ * @bytes_read: Bytes returned by fs_read()
+ * @bytes_write_requested: Bytes passed to fs_write()
+ * @bytes_written: Bytes accepted by fs_write()
+ * @blocks_read: Blocks read from the disk, data and metadata
+ * @blocks_written: Blocks written to the disk, data and metadata
+ * @superblock_flushes: Superblock writes
+ * @rootdir_flushes: Root directory writes
+ * @fat_flushes: Saves of a modified FAT
+ * @fat_blocks_flushed: FAT blocks written by those saves
+ * @meta_table_flushes: Saves of metadata tables kept in data blocks (hole map,
+ *                      extent table)
+ * @alloc_searches: Searches for a free data block
+ * @alloc_scan_steps: FAT entries examined by those searches
+ * @chain_walk_steps: FAT links followed to find blocks of files
+ * @extent_search_steps: Extents compared to find blocks of files (extent disks
+ *                       only)
+ * @defrag_files_moved: Files relocated by fs_defrag()
+ * @defrag_blocks_moved: Blocks copied by fs_defrag()
+ * @log_blocks_redirected: Overwritten blocks written to the log instead of in
+ *                         place (log-structured disks only)
+ * @log_checkpoints: Saves of the metadata that released the blocks overwritten
+ *                   since the previous one
+ * @log_segments_cleaned: Segments emptied by the cleaner
+ * @log_blocks_moved: Live blocks copied out of those segments
+ * @shared_blocks_copied: Blocks shared by clones that were copied before being
+ *                        overwritten
+ * @blocks_deduplicated: Full blocks mapped to a block already holding the
+ *                       same data instead of being written (see fs_dedup())
+ * @dedup_mismatches: Blocks whose fingerprint matched a block holding other
+ *                    data
+ * @chunks_compressed: Chunks of compressed files stored compressed (see
+ *                     fs_compress())
+ * @chunks_uncompressed: Chunks of compressed files stored as they are, because
+ *                       compressing them saved no block
+ * @chunk_cache_hits: Reads and writes of compressed files that found their
+ *                    chunk decompressed in memory
+ * @chunk_cache_misses: Reads and writes of compressed files that had to read
+ *                      their chunk from disk, or make room for it
+ * @fat_pages_loaded: FAT blocks read on demand (32-bit FAT only)
+ * @fat_pages_evicted: FAT blocks dropped from memory to make room for others
+ * @checksum_failures: Blocks read that did not match their checksum (see
+ *                     fs_checksums())
+ * @blocks_scrubbed: Blocks verified by fs_scrub() and the background scrubber
+ *
+ * Write amplification is @blocks_written * %BLOCK_SIZE / @bytes_written.
+ */
+struct fs_stats {
+	struct fs_op_stats ops[FS_TRACE_OP_COUNT];
+	uint64_t bytes_read_requested;
+	uint64_t bytes_read;
+	uint64_t bytes_write_requested;
+	uint64_t bytes_written;
+	uint64_t blocks_read;
+	uint64_t blocks_written;
+	uint64_t superblock_flushes;
+	uint64_t rootdir_flushes;
+	uint64_t fat_flushes;
+	uint64_t fat_blocks_flushed;
+	uint64_t meta_table_flushes;
+	uint64_t alloc_searches;
+	uint64_t alloc_scan_steps;
+	uint64_t chain_walk_steps;
+	uint64_t extent_search_steps;
+	uint64_t defrag_files_moved;
+	uint64_t defrag_blocks_moved;
+	uint64_t log_blocks_redirected;
+	uint64_t log_checkpoints;
+	uint64_t log_segments_cleaned;
+	uint64_t log_blocks_moved;
+	uint64_t shared_blocks_copied;
+	uint64_t blocks_deduplicated;
+	uint64_t dedup_mismatches;
+	uint64_t chunks_compressed;
+	uint64_t chunks_uncompressed;
+	uint64_t chunk_cache_hits;
+	uint64_t chunk_cache_misses;
+	uint64_t fat_pages_loaded;
+	uint64_t fat_pages_evicted;
+	uint64_t checksum_failures;
+	uint64_t blocks_scrubbed;
+};
+
+/**
+ * struct fs_frag - Fragmentation of a file system
+ * @files: Files stored in data blocks of their own (packed files excluded)
+ * @fragmented_files: Files whose blocks are not one contiguous run
+ * @blocks: Data blocks of those files
+ * @extents: Runs of consecutive blocks making up those files, equal to @files
+ *           when nothing is fragmented
+ * @free_blocks: Free data blocks
+ * @free_extents: Runs of consecutive free blocks
+ * @largest_free_extent: Longest run of free blocks, the largest file that can
+ *                       still be stored contiguously
+ */
+struct fs_frag {
+	uint32_t files;
+	uint32_t fragmented_files;
+	uint32_t blocks;
+	uint32_t extents;
+	uint32_t free_blocks;
+	uint32_t free_extents;
+	uint32_t largest_free_extent;
+};
+
+/**
+ * struct fs_snapshot_info - Description of a snapshot
+ * @name: Name of the snapshot
+ * @created: Time the snapshot was taken, in seconds since the Epoch
+ * @files: Files the snapshot holds
+ */
+struct fs_snapshot_info {
+	char name[FS_FILENAME_LEN];
+	uint64_t created;
+	uint32_t files;
+};
+
+/**
+ * struct fs_dedup_report - Outcome of fs_dedup_scan()
+ * @blocks_scanned: Data blocks of files read and fingerprinted
+ * @blocks_deduplicated: Blocks of files mapped to another block holding the
+ *                       same data, and released
+ * @mismatches: Blocks whose fingerprint matched a block holding other data
+ * @logical_blocks: Data blocks mapped by the files once the scan is over,
+ *                  counting a shared block once per mapping
+ * @physical_blocks: Distinct data blocks behind those mappings
+ *
+ * The deduplication ratio is @logical_blocks / @physical_blocks.
+ */
+struct fs_dedup_report {
+	uint64_t blocks_scanned;
+	uint64_t blocks_deduplicated;
+	uint64_t mismatches;
+	uint64_t logical_blocks;
+	uint64_t physical_blocks;
+};
+
+/**
+ * struct fs_scrub_report - Outcome of fs_scrub()
+ * @blocks_scrubbed: Blocks read and verified against their checksum
+ * @bad_blocks: Blocks that did not match their checksum
+ * @first_bad_block: Disk block number of the first of them, 0 if there is none
+ */
+struct fs_scrub_report {
+	uint64_t blocks_scrubbed;
+	uint64_t bad_blocks;
+	uint32_t first_bad_block;
+};
+
+/** fs_format() flag: use 32-bit FAT entries and block numbers */
+#define FS_FORMAT_FAT32 0x1
+/** fs_format() flag: describe files by extents instead of FAT chains */
+#define FS_FORMAT_EXTENTS 0x2
+/** fs_format() flag: write data out of place to a log (implies extents) */
+#define FS_FORMAT_LOG 0x4
+
+/** fs_check() flag: free the blocks that are allocated but used by nothing */
+#define FS_CHECK_REPAIR 0x1
+/** fs_check() flag: describe each problem on stderr */
+#define FS_CHECK_VERBOSE 0x2
+
+/**
+ * struct fs_check_report - Problems found by fs_check()
+ * @errors: Total number of problems
+ * @files: Files checked
+ * @blocks_used: Data blocks reachable from files and metadata
+ * @bad_superblock: Superblock fields that do not match the disk
+ * @bad_entries: Invalid root directory entries (names, flags, tail locations,
+ *               last block hints)
+ * @bad_links: FAT links to blocks that are out of range or marked free
+ * @cycles: Chains that loop back onto themselves
+ * @cross_linked: Blocks reached from more than one file (or metadata), and not
+ *                shared by clones
+ * @leaked: Blocks allocated in the FAT but reachable from nothing
+ * @size_mismatches: Files whose chain extends past their size
+ * @repaired: Problems fixed (leaked blocks freed with %FS_CHECK_REPAIR)
+ * @bad_refcounts: Blocks whose reference count does not match the number of
+ *                 files sharing them
+ * @bad_checksums: Blocks that do not match their checksum (see fs_checksums())
+ */
+struct fs_check_report {
+	uint32_t errors;
+	uint32_t files;
+	uint32_t blocks_used;
+	uint32_t bad_superblock;
+	uint32_t bad_entries;
+	uint32_t bad_links;
+	uint32_t cycles;
+	uint32_t cross_linked;
+	uint32_t leaked;
+	uint32_t size_mismatches;
+	uint32_t repaired;
+	uint32_t bad_refcounts;
+	uint32_t bad_checksums;
+};
+
 /**
  * fs_mount - Mount a file system
  * @diskname: Name of the virtual disk file
@@ -20,6 +321,15 @@
  * contains. A file system needs to be mounted before files can be read from it
  * with fs_read() or written to it with fs_write().
  *
+ * Prefixing @diskname with "ram:" mounts an in-memory copy of the image, which
+ * is discarded at fs_umount(); with "ram+save:" the copy is written back to the
+ * image by fs_sync() and fs_umount() (see block_disk_open()).
+ *
+ * Disks with a 16-bit FAT (made by fs_make.x) and with a 32-bit FAT (see
+ * fs_format()) are both supported. A 16-bit FAT is read whole, while the blocks
+ * of a 32-bit FAT are read as they are used and only a bounded number of them
+ * stay in memory.
+ *
  * Return: -1 if virtual disk file @diskname cannot be opened, or if no valid
  * file system can be located. 0 otherwise.
  */
@@ -73,6 +383,124 @@ int fs_create(const char *filename);
  */
 int fs_delete(const char *filename);
 
+/**
+ * fs_clone - Create a copy of a file that shares its blocks
+ * @src_filename: Name of the file to copy
+ * @dst_filename: Name of the new file
+ *
+ * Create the file named @dst_filename with the contents of @src_filename,
+ * without copying any data: both files point to the same data blocks, and a
+ * reference count is kept for each of them. The first write to a shared block,
+ * through either file, goes to a new block of that file's own (copy-on-write),
+ * and deleting or truncating one of the files leaves the blocks the other
+ * still uses in place. Cloning only writes metadata, whatever the size of the
+ * file. Files small enough to be packed in tail blocks are copied.
+ *
+ * Only disks describing files by extents support clones (see
+ * %FS_FORMAT_EXTENTS and fs_convert()). fs_defrag() leaves files sharing blocks
+ * where they are, and so does the cleaner of a log-structured disk.
+ *
+ * Return: -1 if no FS is currently mounted, if it does not use extents, if
+ * there is no file named @src_filename, if @dst_filename is invalid or already
+ * exists, if the root directory is full, if a block of @src_filename is already
+ * shared 65,535 times, or if there is no room for the reference count table. 0
+ * otherwise.
+ */
+int fs_clone(const char *src_filename, const char *dst_filename);
+
+/**
+ * fs_snapshot_create - Take a read-only snapshot of the file system
+ * @name: Name of the snapshot
+ *
+ * Save the root directory and the extents of every file as they are now, in
+ * a chain of metadata blocks listed in a snapshot table. Like a clone (see
+ * fs_clone()), the snapshot shares the data blocks of the files instead of
+ * copying them, and the live file system keeps taking writes, which copy the
+ * shared blocks they modify. Only files packed in tail blocks, whose slots are
+ * rewritten in place, get a data block of the snapshot's own. Taking a
+ * snapshot only writes metadata, whatever the amount of data.
+ *
+ * Files of a snapshot are read with fs_snapshot_open(). Blocks the live file
+ * system no longer uses stay allocated as long as a snapshot holds them.
+ *
+ * Return: -1 if no FS is currently mounted, if it does not use extents, if
+ * @name is invalid or already names a snapshot, if there are already
+ * %FS_SNAPSHOT_MAX_COUNT snapshots, if a block is already shared 65,535 times,
+ * or if the disk has no room for the snapshot's metadata. 0 otherwise.
+ */
+int fs_snapshot_create(const char *name);
+
+/**
+ * fs_snapshot_delete - Delete a snapshot
+ * @name: Name of the snapshot
+ *
+ * Release the blocks of the snapshot that no live file or other snapshot
+ * uses, and its metadata.
+ *
+ * Return: -1 if no FS is currently mounted, if there is no snapshot named
+ * @name, or if one of its files is currently open. 0 otherwise.
+ */
+int fs_snapshot_delete(const char *name);
+
+/**
+ * fs_snapshot_list - List the snapshots of the mounted file system
+ * @snapshots: Array to fill, in the order the snapshots are stored
+ * @count: Number of entries of @snapshots
+ *
+ * Call it with a NULL @snapshots and a zero @count to size the array.
+ *
+ * Return: -1 if no FS is currently mounted, or if @snapshots is NULL while
+ * @count is not zero. Otherwise the number of snapshots (which may exceed
+ * @count).
+ */
+int fs_snapshot_list(struct fs_snapshot_info *snapshots, size_t count);
+
+/**
+ * fs_snapshot_open - Open a file of a snapshot
+ * @name: Name of the snapshot
+ * @filename: Name of the file in the snapshot
+ *
+ * Open the file named @filename as it was when snapshot @name was taken. The
+ * descriptor is read-only: fs_read(), fs_lseek(), fs_stat(), fs_seek_data()
+ * and fs_seek_hole() work as for any file, fs_write() and fs_ftruncate()
+ * fail. It counts towards the %FS_OPEN_MAX_COUNT open files, and is closed
+ * with fs_close().
+ *
+ * Return: -1 if no FS is currently mounted, if there is no snapshot named
+ * @name or no file named @filename in it, or if there are already
+ * %FS_OPEN_MAX_COUNT files currently open. Otherwise, return the file
+ * descriptor.
+ */
+int fs_snapshot_open(const char *name, const char *filename);
+
+/**
+ * fs_truncate - Change the size of a file
+ * @filename: File name
+ * @length: New size of the file in bytes
+ *
+ * Set the size of the file named @filename to @length bytes. If the file
+ * shrinks, the blocks that lie entirely past the new end of the file are
+ * released and only the FAT blocks that referenced them are written back to
+ * disk. If the file grows, the added range is a hole that reads back as zeros.
+ * The file offsets of open file descriptors are left unchanged.
+ *
+ * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if
+ * there is no file named @filename. 0 otherwise.
+ */
+int fs_truncate(const char *filename, size_t length);
+
+/**
+ * fs_ftruncate - Change the size of an open file
+ * @fd: File descriptor
+ * @length: New size of the file in bytes
+ *
+ * Same as fs_truncate(), for the file referenced by file descriptor @fd.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open). 0 otherwise.
+ */
+int fs_ftruncate(int fd, size_t length);
+
 /**
  * fs_ls - List files on file system
  *
@@ -101,11 +529,32 @@ int fs_ls(void);
  */
 int fs_open(const char *filename);
 
+/**
+ * fs_open_flags - Open a file with flags
+ * @filename: File name
+ * @flags: Bitwise OR of FS_O_* flags
+ *
+ * Same as fs_open(), with behavior modifiers for the returned file descriptor.
+ * With %FS_O_APPEND, each fs_write() first moves the file offset to the current
+ * end of the file. Since all calls on the file system are serialized, the range
+ * written by one appender can never overlap another appender's, even when they
+ * run in different threads. Appends reach the last block of the file directly
+ * from its directory entry instead of walking the FAT chain.
+ *
+ * By default, writes smaller than a block are combined in a per-descriptor
+ * write buffer and reach the disk as whole blocks (see fs_write()). With
+ * %FS_O_NOBUF, every fs_write() goes to disk immediately.
+ *
+ * Return: Same as fs_open().
+ */
+int fs_open_flags(const char *filename, int flags);
+
 /**
  * fs_close - Close a file
  * @fd: File descriptor
  *
- * Close file descriptor @fd.
+ * Close file descriptor @fd. Data still held in the write buffer of @fd is
+ * written to disk, along with the file's updated size.
  *
  * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
  * invalid (out of bounds or not currently open). 0 otherwise.
@@ -119,10 +568,26 @@ int fs_close(int fd);
  * Get the current size of the file pointed by file descriptor @fd.
  *
  * Return: -1 if no FS is currently mounted, of if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if the size of the file
+ * does not fit in an int (see fs_stat64()). Otherwise return the current size
+ * of file.
+ */
+int fs_stat(int fd);
+
+/**
+ * fs_stat64 - Get file status of a large file
+ * @fd: File descriptor
+ *
+ * Same as fs_stat(), for files of any size. Files can grow past 4 GiB on any
+ * disk; the first one that does marks the disk as holding large files, so
+ * that fs_check() tells the images apart from those older versions of the
+ * library could read.
+ *
+ * Return: -1 if no FS is currently mounted, of if file descriptor @fd is
  * invalid (out of bounds or not currently open). Otherwise return the current
  * size of file.
  */
-int fs_stat(int fd);
+int64_t fs_stat64(int fd);
 
 /**
  * fs_lseek - Set file offset
@@ -131,14 +596,47 @@ int fs_stat(int fd);
  *
  * Set the file offset (used for read and write operations) associated with file
  * descriptor @fd to the argument @offset. To append to a file, one can call
- * fs_lseek(fd, fs_stat(fd));
+ * fs_lseek(fd, fs_stat64(fd));
+ *
+ * The offset can be set past the end of the file. A subsequent fs_write()
+ * extends the file and leaves a hole between the old end of the file and the
+ * written data: no block is allocated for the hole and it reads back as zeros.
  *
  * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
- * invalid (i.e., out of bounds, or not currently open), or if @offset is larger
- * than the current file size. 0 otherwise.
+ * invalid (i.e., out of bounds, or not currently open). 0 otherwise.
  */
 int fs_lseek(int fd, size_t offset);
 
+/**
+ * fs_seek_data - Move file offset to the next data region
+ * @fd: File descriptor
+ * @offset: File offset to start looking from
+ *
+ * Set the file offset of file descriptor @fd to the first offset greater than
+ * or equal to @offset that is backed by an allocated block, like lseek() with
+ * SEEK_DATA.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid, or if @offset is at or past the end of the file, or if there is only
+ * a hole after @offset. Otherwise return the new file offset.
+ */
+int64_t fs_seek_data(int fd, size_t offset);
+
+/**
+ * fs_seek_hole - Move file offset to the next hole
+ * @fd: File descriptor
+ * @offset: File offset to start looking from
+ *
+ * Set the file offset of file descriptor @fd to the first offset greater than
+ * or equal to @offset that falls in a hole, like lseek() with SEEK_HOLE. The end
+ * of the file is considered to be a hole.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid, or if @offset is at or past the end of the file. Otherwise return the
+ * new file offset.
+ */
+int64_t fs_seek_hole(int fd, size_t offset);
+
 /**
  * fs_write - Write to a file
  * @fd: File descriptor
@@ -154,12 +652,22 @@ int fs_lseek(int fd, size_t offset);
  * runs out of space while performing a write operation, fs_write() should write
  * as many bytes as possible. The number of written bytes can therefore be
  * smaller than @count (it can even be 0 if there is no more space on disk).
+ * A 16-bit FAT disk also stops a write whose hole in front of it would be
+ * longer than 65,535 blocks.
+ *
+ * Writes smaller than a block are absorbed by a write buffer attached to @fd
+ * as long as they are sequential, and the block is written once it is full,
+ * or when @fd is closed, seeked with fs_lseek(), or when fs_sync() is called.
+ * Blocks are still allocated immediately, so running out of space is reported
+ * by the call that caused it. Reads, truncation and writes through other file
+ * descriptors of the same file flush the buffer first, so buffered data is
+ * always visible through the API.
  *
  * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
  * invalid (out of bounds or not currently open), or if @buf is NULL. Otherwise
  * return the number of bytes actually written.
  */
-int fs_write(int fd, void *buf, size_t count);
+ssize_t fs_write(int fd, void *buf, size_t count);
 
 /**
  * fs_read - Read from a file
@@ -176,10 +684,335 @@ int fs_write(int fd, void *buf, size_t count);
  * is at the end of the file). The file offset of the file descriptor is
  * implicitly incremented by the number of bytes that were actually read.
  *
+ * Each file descriptor remembers where its last read or write ended in the
+ * file, so a file read (or overwritten) in order costs the same for each
+ * block, however large the file is.
+ *
  * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
  * invalid (out of bounds or not currently open), or if @buf is NULL. Otherwise
  * return the number of bytes actually read.
  */
-int fs_read(int fd, void *buf, size_t count);
+ssize_t fs_read(int fd, void *buf, size_t count);
+
+/**
+ * fs_sync - Flush buffered writes
+ *
+ * Write the content of all write buffers to disk, along with the metadata
+ * (file sizes and FAT) that describes it, and ask the disk backend to make it
+ * durable (see block_disk_sync()).
+ *
+ * Return: -1 if no FS is currently mounted, or if writing to the disk fails. 0
+ * otherwise.
+ */
+int fs_sync(void);
+
+/**
+ * fs_tailpack - Enable or disable small-file tail packing
+ * @enable: Non-zero to pack new small files, zero to stop packing them
+ *
+ * When tail packing is enabled, files that are written while empty and stay
+ * under half a block are stored in 64-byte slots of data blocks shared with
+ * other small files instead of consuming a whole block each. A packed file is
+ * transparently moved to regular blocks by fs_write() once it outgrows that
+ * limit. The setting is saved in the superblock; files that are already packed
+ * remain readable and writable after tail packing is disabled.
+ *
+ * Return: -1 if no FS is currently mounted, or if the superblock cannot be
+ * written. 0 otherwise.
+ */
+int fs_tailpack(int enable);
+
+/**
+ * fs_dedup - Enable or disable inline deduplication
+ * @enable: Non-zero to deduplicate full blocks as they are written, zero to
+ *          stop
+ *
+ * When inline deduplication is enabled, every full block that fs_write()
+ * writes is fingerprinted, and looked up in an index of the blocks written or
+ * scanned (see fs_dedup_scan()) while deduplication was in use. A block whose
+ * data matches an indexed block byte for byte is not written: the file is
+ * mapped to the indexed block, which is then shared as with fs_clone().
+ * Partial blocks and files packed in tail blocks are written as usual. The
+ * setting is saved in the superblock, and the fingerprints in a table on disk
+ * from which the index is rebuilt at mount time.
+ *
+ * Only disks describing files by extents support deduplication (see
+ * %FS_FORMAT_EXTENTS and fs_convert()).
+ *
+ * Return: -1 if no FS is currently mounted, if it does not use extents, if
+ * there is no room for the reference count and fingerprint tables, or if the
+ * superblock cannot be written. 0 otherwise.
+ */
+int fs_dedup(int enable);
+
+/**
+ * fs_dedup_scan - Deduplicate the data blocks of every file
+ * @report: Structure to fill with the outcome of the scan
+ *
+ * Read the data blocks of every file, and map each block whose data matches a
+ * block read before to that block, releasing the duplicate. The scan fills the
+ * index used by inline deduplication (see fs_dedup()), whether it is enabled
+ * or not.
+ *
+ * Return: -1 if @report is NULL, if no FS is currently mounted, if it does not
+ * use extents, if there is no room for the reference count and fingerprint
+ * tables, or if the disk cannot be read or written. 0 otherwise.
+ */
+int fs_dedup_scan(struct fs_dedup_report *report);
+
+/**
+ * fs_compress - Enable or disable compression of a file
+ * @filename: File name
+ * @enable: Non-zero to compress the data of the file, zero to store it as is
+ *
+ * The data of a compressed file is stored in chunks of 64 KiB, each compressed
+ * with a built-in LZ codec into as few blocks as it needs. A chunk that does
+ * not compress by at least a block is stored as is, and a chunk of zeros takes
+ * no block. The setting is saved in the file's entry, and can only change while
+ * the file is empty (see fs_truncate()).
+ *
+ * Reads and writes go through a cache of a few decompressed chunks. fs_write()
+ * modifies the cached chunk, which is compressed and stored once it is
+ * complete, when it makes room for another chunk, or when the file is closed,
+ * synced (see fs_sync()), truncated, cloned or deduplicated. Running out of
+ * space may therefore only be reported by those calls. Compressed files are
+ * not deduplicated as they are written (see fs_dedup()).
+ *
+ * Only disks describing files by extents support compression (see
+ * %FS_FORMAT_EXTENTS and fs_convert()).
+ *
+ * Return: -1 if no FS is currently mounted, if it does not use extents, if
+ * there is no file named @filename, if the file is not empty and the setting
+ * would change, or if the root directory cannot be written. 0 otherwise.
+ */
+int fs_compress(const char *filename, int enable);
+
+/**
+ * fs_checksums - Enable or disable block checksums
+ * @enable: Non-zero to checksum every block, zero to stop
+ *
+ * Enabling computes a CRC32C of every block of the disk but the superblock and
+ * stores them in a checksum region, a run of data blocks recorded in the
+ * superblock. From then on, every block read is verified against its checksum,
+ * and a read that does not match fails instead of returning corrupted data.
+ * Every block written updates its checksum. The checksums of the FAT and the
+ * root directory are written along with them, those of data blocks are saved
+ * with the FAT (see fs_sync()), so data written since the last sync may not
+ * match its checksum after a crash. The CRC uses the crc32 instruction of
+ * SSE4.2 when the CPU has it, and tables otherwise.
+ *
+ * The setting is saved in the superblock, so the checksums are verified from
+ * the next fs_mount() on. Disabling releases the region.
+ *
+ * Return: -1 if no FS is currently mounted, if there is no contiguous room for
+ * the region, or if the disk cannot be read or written. 0 otherwise.
+ */
+int fs_checksums(int enable);
+
+/**
+ * fs_scrub - Verify blocks against their checksums
+ * @max_blocks: Blocks to verify in this call, 0 for a whole pass
+ * @report: Structure to fill with the blocks verified and the bad ones found,
+ *          or NULL
+ *
+ * Read the blocks in use, the FAT and the root directory in large sequential
+ * batches, and compare them with their checksums. Work is incremental: the next
+ * call resumes where the previous one stopped, and wraps around to the start of
+ * the disk. A call never verifies a block twice. Nothing is repaired, the bad
+ * blocks are only reported.
+ *
+ * Return: -1 if no FS is currently mounted, if it has no checksums (see
+ * fs_checksums()), or if the disk cannot be read. Otherwise the number of bad
+ * blocks found.
+ */
+int fs_scrub(size_t max_blocks, struct fs_scrub_report *report);
+
+/**
+ * fs_scrub_rate - Scrub the file system in the background
+ * @blocks_per_sec: Blocks to verify per second, 0 to stop
+ *
+ * Start a thread that calls fs_scrub() in batches of up to 256 blocks, paced
+ * to verify @blocks_per_sec blocks per second, over and over until the rate is
+ * set to 0 or the file system is unmounted. Bad blocks are counted in
+ * &struct fs_stats @checksum_failures. Changing the rate of a running
+ * scrubber takes effect at its next batch.
+ *
+ * Return: -1 if no FS is currently mounted, if it has no checksums, or if the
+ * thread cannot be started. 0 otherwise.
+ */
+int fs_scrub_rate(size_t blocks_per_sec);
+
+/**
+ * fs_defrag - Gather fragmented files into contiguous runs of blocks
+ * @max_blocks: Blocks to move in this call, 0 for no limit
+ * @max_us: Time to spend in this call in microseconds, 0 for no limit
+ *
+ * Move each file whose blocks are scattered across the data region to the
+ * first run of free blocks that can hold it whole. Blocks are copied before
+ * the file is switched over to them, and the file is switched over before its
+ * old blocks are released, so the file system stays consistent at every step
+ * and can be used (including the files being moved) between calls.
+ *
+ * Work is incremental: a call stops once its budget is used up, and the next
+ * call resumes where it stopped. A file is always moved as a whole, so the
+ * first file moved by a call may exceed @max_blocks. Files that do not fit in
+ * any free run are left as they are.
+ *
+ * Return: -1 if no FS is currently mounted, or if the disk cannot be read or
+ * written. 1 if the budget ran out before every file was examined, 0 once a
+ * whole pass is complete.
+ */
+int fs_defrag(size_t max_blocks, unsigned int max_us);
+
+/**
+ * fs_fragmentation - Measure the fragmentation of the mounted file system
+ * @frag: Structure to fill
+ *
+ * Return: -1 if @frag is NULL or if no FS is currently mounted. 0 otherwise.
+ */
+int fs_fragmentation(struct fs_frag *frag);
+
+/**
+ * fs_clean - Reclaim segments of a log-structured file system
+ * @max_segments: Segments to empty in this call, 0 for no limit
+ *
+ * Pick the segments with the fewest live blocks, copy those blocks to the head
+ * of the log, and save the metadata so that the emptied segments can be
+ * written again. Segments holding metadata blocks are left as they are.
+ *
+ * The same work is done in the background, from the time a disk formatted with
+ * %FS_FORMAT_LOG is mounted, whenever fewer than an eighth of its segments are
+ * empty; this call lets an application clean at a time of its choosing.
+ *
+ * Return: -1 if no FS is currently mounted, if it is not log-structured, or if
+ * the disk cannot be read or written. Otherwise the number of segments
+ * emptied.
+ */
+int fs_clean(size_t max_segments);
+
+/**
+ * fs_format - Create a disk with an empty file system
+ * @diskname: Name of the virtual disk file to create (or overwrite)
+ * @data_blocks: Number of data blocks of the file system
+ * @flags: 0, or %FS_FORMAT_FAT32, %FS_FORMAT_EXTENTS and/or %FS_FORMAT_LOG
+ *
+ * Create a virtual disk file holding a superblock, a FAT, an empty root
+ * directory and @data_blocks data blocks. By default, the disk has the same
+ * 16-bit FAT layout as the ones made by fs_make.x, which limits it to 65,535
+ * blocks (256 MiB). With %FS_FORMAT_FAT32, FAT entries and block numbers are
+ * 32-bit, and a disk can hold up to 2^26 - 1 data blocks (256 GiB). The image
+ * file is sparse, blocks take room on the host once they are written.
+ *
+ * With %FS_FORMAT_EXTENTS, each file is described by the runs of consecutive
+ * blocks it is made of, kept in an extent table of 4 data blocks, instead of a
+ * FAT chain. Offsets are then mapped by a binary search, and each run is read
+ * or written in a single disk access. Such disks cannot be mounted by older
+ * versions of the library.
+ *
+ * With %FS_FORMAT_LOG, the disk also uses extents, and its data region is
+ * divided into segments of 64 blocks. Blocks are written sequentially at the
+ * head of a log that moves from one empty segment to the next: an overwrite
+ * goes to a new block instead of the one it replaces, which is only released
+ * once the extents no longer pointing to it are saved (a checkpoint). A
+ * cleaner copies the live blocks out of the emptiest segments when few empty
+ * ones are left (see fs_clean()).
+ *
+ * Return: -1 if @diskname is NULL, if a FS is currently mounted, if
+ * @data_blocks is 0, too large for the FAT width or too small for the extent
+ * table, or if the disk cannot be created. 0 otherwise.
+ */
+int fs_format(const char *diskname, size_t data_blocks, unsigned int flags);
+
+/**
+ * fs_convert - Convert a file system to the extent format
+ * @diskname: Name of the virtual disk file, which must not be mounted
+ *
+ * Describe every file of a disk made with FAT chains by extents, as if it had
+ * been formatted with %FS_FORMAT_EXTENTS. Data blocks are not moved: a
+ * fragmented file gets one extent per run, and fs_defrag() can merge them
+ * later. Disks that already use extents are left as they are.
+ *
+ * Return: -1 if @diskname is NULL, if a FS is currently mounted, if the disk
+ * cannot be mounted or written, or if it has no room for the extent table. 0
+ * otherwise.
+ */
+int fs_convert(const char *diskname);
+
+/**
+ * fs_check - Verify the consistency of a file system image
+ * @diskname: Name of the virtual disk file, which must not be mounted
+ * @flags: %FS_CHECK_REPAIR and/or %FS_CHECK_VERBOSE
+ * @num_threads: Worker threads walking the FAT chains, 0 for one per CPU
+ * @report: Structure to fill with the problems found
+ *
+ * Check the superblock geometry against the disk, then every root directory
+ * entry and FAT chain: links out of range or to free blocks, chains that loop,
+ * blocks shared by several files (unless they are clones, whose reference
+ * counts are checked instead), allocated blocks that nothing uses, and chains
+ * that extend past the size of their file. On disks with checksums (see
+ * fs_checksums()), every block in use is also verified against its checksum.
+ * Nothing but leaked blocks (and the checksums of the FAT freeing them) is ever
+ * modified, and only with %FS_CHECK_REPAIR.
+ *
+ * Return: -1 if @diskname or @report is NULL, if a FS is currently mounted or
+ * if the disk cannot be read or written. Otherwise the number of problems left
+ * unrepaired, 0 for a consistent image.
+ */
+int fs_check(const char *diskname, unsigned int flags, int num_threads, struct fs_check_report *report);
+
+/**
+ * fs_trace_start - Record every API call into a trace file
+ * @filename: Name of the trace file on the host computer
+ *
+ * Start recording every fs_*() call, along with its arguments, result and
+ * latency. Records are kept in an in-memory ring buffer, and appended to
+ * @filename (after a &struct fs_trace_header) whenever the ring fills up, at
+ * each fs_umount() and by fs_trace_stop(). Tracing outlives mounts, and is also
+ * started by the first fs_mount() if the FS_TRACE environment variable names a
+ * trace file. To be replayable, a trace must start before the file system is
+ * mounted.
+ *
+ * Return: -1 if a trace is already being recorded, or if @filename cannot be
+ * created. 0 otherwise.
+ */
+int fs_trace_start(const char *filename);
+
+/**
+ * fs_trace_stop - Stop recording API calls
+ *
+ * Write the records still in the ring buffer and close the trace file.
+ *
+ * Return: -1 if no trace is being recorded, or if the trace file cannot be
+ * written. 0 otherwise.
+ */
+int fs_trace_stop(void);
+
+/**
+ * fs_trace_op_name - Name of an operation
+ * @op: Operation, one of &enum fs_trace_op
+ *
+ * Return: the name of the API call without its fs_ prefix (e.g. "write"), or
+ * NULL if @op is invalid.
+ */
+const char *fs_trace_op_name(int op);
+
+/**
+ * fs_get_stats - Get the runtime statistics of the library
+ * @stats: Structure to fill
+ *
+ * Copy the counters accumulated since the program started, or since the last
+ * call to fs_reset_stats(). Statistics cover every mount and can be read
+ * whether or not a FS is currently mounted.
+ *
+ * Return: -1 if @stats is NULL. 0 otherwise.
+ */
+int fs_get_stats(struct fs_stats *stats);
+
+/**
+ * fs_reset_stats - Reset the runtime statistics
+ *
+ * Return: 0.
+ */
+int fs_reset_stats(void);
 
 #endif /* _FS_H */